@@ -23,7 +23,6 @@
 #define _ARCH_AVR_H
 
 // Defines and includes.  {{{
-// Note: When changing this, also change max in cdriver/space.cpp
 #define STEPS_DELAY 60
 #ifdef FAST_ISR
 #define TIME_PER_ISR 180
@@ -40,8 +39,10 @@
 		"\t"	"brne 1b"	"\n"
 #endif
 #endif // }}}
+#define STEP_TIME ((34 + 6 * STEPS_DELAY) * 1000L / 16)	// Time for one step pulse in the isr at 16 MHz [ns].
 #else
 #define TIME_PER_ISR 500
+#define STEP_TIME 4000	// Estimate for the C step loop [ns].
 #endif
 
 //#define pindebug debug
@@ -107,6 +108,9 @@
 #define ARCH_MOTOR \
 	volatile uint16_t step_port, dir_port; \
 	volatile uint8_t step_bitmask, dir_bitmask;
+
+#define ARCH_SETTINGS \
+	uint16_t avr_top;
 // }}}
 
 static inline void arch_disable_isr() { // {{{
@@ -118,6 +122,7 @@ static inline void arch_enable_isr() { // {{{
 } // }}}
 
 static inline void arch_set_speed(uint16_t count);
+static inline void arch_change_speed(uint8_t fragment);
 
 // Everything before this line is used at the start of firmware.h; everything after it at the end.
 #else
@@ -573,6 +578,21 @@ static inline void arch_set_speed(uint16_t count) { // {{{
 	}
 } // }}}
 
+static inline bool arch_prepare_speed(uint8_t fragment) { // {{{
+	// Compute the timer value for the sample time of a fragment, for use by the interrupt.
+	uint32_t c = settings[fragment].time;
+	c *= 16;
+	c /= full_phase;
+	if (c > 0xffff)
+		return false;
+	settings[fragment].avr_top = c;
+	return true;
+} // }}}
+
+static inline void arch_change_speed(uint8_t fragment) { // {{{
+	OCR1A = settings[fragment].avr_top;
+} // }}}
+
 static inline void arch_spi_start() { // {{{
 	SET_OUTPUT(MOSI);
 	RESET(SCK);
@@ -870,7 +890,7 @@ ISR(TIMER1_COMPA_vect, ISR_NAKED) { // {{{
 	"1:\t"						"\n"
 		// Go to next fragment.
 		"\t"	"sts current_sample, 27"	"\n"
-#define next_fragment(activation, underrun) \
+#define next_fragment(activation, underrun, speed) \
 		"\t"	"lds 16, current_fragment"	"\n" \
 		"\t"	"inc 16"			"\n" \
 		"\t"	"cpi 16, %[num_fragments]"	"\n" \
@@ -901,7 +921,8 @@ ISR(TIMER1_COMPA_vect, ISR_NAKED) { // {{{
 		"\t"	"dec 16"			"\n" \
 		"\t"	"brne 1b"			"\n" \
 	"2:\t"		"ldd 16, y + %[len]"		"\n" \
-		"\t"	"sts current_len, 16"		"\n"
+		"\t"	"sts current_len, 16"		"\n" \
+		speed
 
 		next_fragment(
 		/* Activation of all motors. */
@@ -921,7 +942,12 @@ ISR(TIMER1_COMPA_vect, ISR_NAKED) { // {{{
 		"\t"	"adiw 28, %[motor_size]"	"\n"
 		"\t"	"adiw 30, %[fragment_size]"	"\n"
 		"\t"	"dec 17"			"\n"
-		"\t"	"brne 2b"			"\n", "isr_underrun")
+		"\t"	"brne 2b"			"\n", "isr_underrun",
+		/* Set the timer for the sample time of the new fragment. */
+		"\t"	"ldd 16, y + %[top_high]"	"\n"
+		"\t"	"sts %[ocr1ah], 16"		"\n"
+		"\t"	"ldd 16, y + %[top]"		"\n"
+		"\t"	"sts %[ocr1al], 16"		"\n")
 
 		"\t"	"rjmp isr_end"			"\n"
 		// Underrun.
@@ -1060,7 +1086,7 @@ ISR(TIMER1_COMPA_vect, ISR_NAKED) { // {{{
 		// Fragment is done.
 		"\t"	"ldi 17, 0"			"\n"
 		"\t"	"sts move_phase, 17"		"\n"
-		next_fragment("", "isr_audio_underrun")
+		next_fragment("", "isr_audio_underrun", "")
 	"8:\t"						"\n"
 		"\t"	"ldi 16, 0"			"\n"
 	"3:\t"						"\n"
@@ -1099,6 +1125,10 @@ ISR(TIMER1_COMPA_vect, ISR_NAKED) { // {{{
 			[motor_size] "" (sizeof(Motor)),
 			[settings_size] "I" (sizeof(Settings)),
 			[len] "I" (offsetof(Settings, len)),
+			[top] "I" (offsetof(Settings, avr_top)),
+			[top_high] "I" (offsetof(Settings, avr_top) + 1),
+			[ocr1ah] "M" (_SFR_MEM_ADDR(OCR1AH)),
+			[ocr1al] "M" (_SFR_MEM_ADDR(OCR1AL)),
 			[timsk] "M" (_SFR_MEM_ADDR(TIMSK1)),
 			[timskval] "M" (1 << OCIE1A),
 			[state_probe] "M" (STEP_STATE_PROBE),
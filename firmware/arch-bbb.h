@@ -46,12 +46,16 @@
 
 #define ARCH_PIN_DATA
 #define ARCH_MOTOR
+#define ARCH_SETTINGS
+
+static inline void arch_change_speed(uint8_t fragment);
 
 // Everything before this line is used at the start of firmware.h; everything after it at the end.
 #else
 // }}}
 
 #define TIME_PER_ISR 20
+#define STEP_TIME 1000
 
 #ifndef NODEBUG
 static inline void debug_add(int i) { (void)&i; }
@@ -135,6 +139,15 @@ static inline void arch_set_speed(uint16_t count) {
 		step_state = STEP_STATE_STOP;
 }
 
+static inline bool arch_prepare_speed(uint8_t fragment) {
+	(void)&fragment;
+	return true;
+}
+
+static inline void arch_change_speed(uint8_t fragment) {
+	(void)&fragment;
+}
+
 static inline void arch_tick() {
 	while (true) {
 		int c = fgetc(stdin);
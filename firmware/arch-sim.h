@@ -46,12 +46,23 @@
 
 #define ARCH_PIN_DATA
 #define ARCH_MOTOR
+#define ARCH_SETTINGS
 
 #define TIME_PER_ISR 20
+#define STEP_TIME 1000
 #ifdef FAST_ISR
 #undef FAST_ISR
 #endif
 
+static inline void arch_disable_isr() {
+}
+
+static inline void arch_enable_isr() {
+}
+
+static inline void arch_set_speed(uint16_t count);
+static inline void arch_change_speed(uint8_t fragment);
+
 // Everything before this line is used at the start of firmware.h; everything after it at the end.
 #else
 // }}}
@@ -78,6 +89,9 @@ inline static void arch_serial_write(uint8_t c) {
 inline static void arch_serial_flush() {
 	std::fflush(stdout);
 }
+
+inline static void arch_claim_serial() {
+}
 // }}}
 
 // ADC. {{{
@@ -138,6 +152,15 @@ static inline void arch_set_speed(uint16_t count) {
 		step_state = STEP_STATE_STOP;
 }
 
+static inline bool arch_prepare_speed(uint8_t fragment) {
+	(void)&fragment;
+	return true;
+}
+
+static inline void arch_change_speed(uint8_t fragment) {
+	(void)&fragment;
+}
+
 static inline void arch_tick() {
 	while (true) {
 		int c = fgetc(stdin);
@@ -150,13 +173,12 @@ static inline void arch_tick() {
 		if (serial_overflow)
 			break;
 		//debug("%%  %02x", c & 0xff);
-		int n = (serial_buffer_head + 1) & SERIAL_MASK;
+		volatile uint8_t *n = (volatile uint8_t *)(((uintptr_t(serial_buffer_head) + 1) & SERIAL_MASK) | uintptr_t(serial_buffer));
 		if (n == serial_buffer_tail) {
 			serial_overflow = true;
 			break;
 		}
-		BUFFER_CHECK(serial_buffer, serial_buffer_head);
-		serial_buffer[serial_buffer_head] = c;
+		*serial_buffer_head = c;
 		serial_buffer_head = n;
 	}
 	// Do moves.
@@ -164,6 +186,35 @@ static inline void arch_tick() {
 }
 // }}}
 
+// SPI. {{{
+static inline void arch_spi_start() {
+}
+
+static inline void arch_spi_send(uint8_t data, uint8_t bits) {
+	(void)&data;
+	(void)&bits;
+}
+
+static inline void arch_spi_stop() {
+}
+// }}}
+
+// Pins and uuid. {{{
+static inline int8_t arch_pin_name(char *buffer_, bool digital, uint8_t pin_) {
+	return sprintf(buffer_, "%c%d", digital ? 'D' : 'A', pin_);
+}
+
+static inline void arch_outputs() {
+}
+
+struct SimEEPROM {
+	uint8_t data[UUID_SIZE];
+	uint8_t read(int i) { return data[i]; }
+	void write(int i, uint8_t value) { data[i] = value; }
+};
+EXTERN SimEEPROM EEPROM;
+// }}}
+
 // Timekeeping. {{{
 EXTERN long long sim_t;
 static inline uint16_t millis() {
@@ -28,7 +28,14 @@
 
 #define ID_SIZE 8	// Number of bytes in printerid; 8.
 #define UUID_SIZE 16	// Number of bytes in uuid; 16.
-#define PROTOCOL_VERSION 3
+#define PROTOCOL_VERSION 4	// Newest supported version; it is only used if the host asks for it in BEGIN.
+
+// Most steps per motor in one isr: the asm counts them in 8 bits, SLOW_ISR in a signed 8 bit target.
+#ifdef FAST_ISR
+#define MAX_ISR_STEPS 255
+#else
+#define MAX_ISR_STEPS 127
+#endif
 
 #define ADC_INTERVAL 1000	// Delay 1 ms between ADC measurements.
 
@@ -67,6 +74,11 @@
 
 #define SERIAL_BUFFER_SIZE (1 << SERIAL_SIZE_BITS)
 #define SERIAL_MASK (SERIAL_BUFFER_SIZE - 1)
+// Number of packets the host may send without waiting for an ack, with
+// protocol version 4.  They must fit in the serial buffer.
+#ifndef SERIAL_WINDOW
+#define SERIAL_WINDOW (SERIAL_BUFFER_SIZE / 64 < 32 ? SERIAL_BUFFER_SIZE / 64 : 32)
+#endif
 #define FRAGMENTS_PER_MOTOR_MASK ((1 << FRAGMENTS_PER_MOTOR_BITS) - 1)
 
 #ifndef NO_DEBUG
@@ -99,6 +111,9 @@ EXTERN uint8_t ff_in;
 EXTERN uint8_t ff_out;
 EXTERN uint8_t pending_packet[4][REPLY_BUFFER_SIZE];
 EXTERN int16_t pending_len[4];
+EXTERN uint8_t serial_protocol;	// Protocol version 3 or 4.
+EXTERN uint8_t pending_seq[4];	// Version 4 sequence numbers of pending packets.
+EXTERN uint8_t out_seq;		// Next version 4 sequence number to send.
 EXTERN volatile uint8_t move_phase, full_phase, full_phase_bits;
 EXTERN uint8_t filling;
 EXTERN uint8_t led_fast;
@@ -133,6 +148,19 @@ enum SingleByteCommands {	// See serial.cpp for computation of command values.
 	CMD_STALLACK = 0x8f	// Clear stall.
 };
 
+// Protocol version 4 frames; see serial.cpp.
+enum SerialFrame {
+	FRAME_END = 0xc0,
+	FRAME_ESC = 0xdb,
+	FRAME_ESC_END = 0xdc,
+	FRAME_ESC_ESC = 0xdd,
+	FRAME_DATA = 0x00,
+	FRAME_ACK = 0x40,
+	FRAME_NACK = 0x80,
+	FRAME_STALL = 0xc0,
+	FRAME_SEQ_MASK = 0x3f
+};
+
 enum Control {
 	// Control is 0x0000rrcc, with R=read request, r=reset value, c=current value.
 	CTRL_RESET,
@@ -212,7 +240,7 @@ EXTERN Pin_t pin[NUM_DIGITAL_PINS];
 
 enum Command {
 	// from host
-	CMD_BEGIN = 0x00,	// 0
+	CMD_BEGIN = 0x00,	// 1:packetlen, 8:run id[, 1:requested version, 1:window]
 	CMD_PING,	// 1:code
 	CMD_SET_UUID,	// 16: UUID
 	CMD_SETUP,	// 1:active_motors, 4:us/sample, 1:led_pin, 1:stop_pin 1:probe_pin 1:pin_flags 2:timeout
@@ -221,10 +249,10 @@ enum Command {
 	CMD_ASETUP,	// 1:adc, 2:linked_pins, 4:limits, 4:values	(including flags)
 	CMD_HOME,	// 4:us/step, {1:dir}*
 
-	CMD_START_MOVE,	// 1:num_samples, 1:num_moving_motors
-	CMD_START_PROBE,// 1:num_samples, 1:num_moving_motors
-	CMD_MOVE,	// 1:which, *:samples
-	CMD_MOVE_SINGLE,// 1:which, *:samples
+	CMD_START_MOVE,	// 1:num_samples, 1:num_moving_motors[, 2:us/sample]
+	CMD_START_PROBE,// 1:num_samples, 1:num_moving_motors[, 2:us/sample]
+	CMD_MOVE,	// 1:which, *:samples; version 4: 1:which, 1:len, len:packed samples
+	CMD_MOVE_SINGLE,// Same as CMD_MOVE.
 	CMD_START,	// 0 start moving.
 	CMD_STOP,	// 0 stop moving.
 	CMD_ABORT,	// 0 stop moving and set all pins to their reset state.
@@ -237,7 +265,7 @@ enum Command {
 enum RCommand {
 	// to host
 		// responses to host requests; only one active at a time.
-	CMD_READY = 0x10,	// 1:packetlen, 4:version, 1:num_dpins, 1:num_adc, 1:num_motors, 1:fragments/motor, 1:bytes/fragment
+	CMD_READY = 0x10,	// 1:packetlen, 4:version, 1:num_dpins, 1:num_adc, 1:num_motors, 1:fragments/motor, 1:bytes/fragment[, 1:window, 2:μs/isr, 2:ns/step, 1:steps/isr]
 	CMD_PONG,	// 1:code
 	CMD_HOMED,	// {4:motor_pos}*
 	CMD_PIN,	// 1:state
@@ -255,7 +283,11 @@ enum RCommand {
 
 static inline uint8_t command(int16_t pos) {
 	//debug("cmd %x = %x (%x + %x & %x)", (serial_buffer_tail + pos) & SERIAL_MASK, serial_buffer[(serial_buffer_tail + pos) & SERIAL_MASK], serial_buffer_tail, pos, SERIAL_MASK);
-	return *(volatile uint8_t *)(((uint16_t(serial_buffer_tail) + pos) & SERIAL_MASK) | uint16_t(serial_buffer));
+	return *(volatile uint8_t *)(((uintptr_t(serial_buffer_tail) + pos) & SERIAL_MASK) | uintptr_t(serial_buffer));
+}
+
+static inline void set_command(int16_t pos, uint8_t value) {
+	*(volatile uint8_t *)(((uintptr_t(serial_buffer_tail) + pos) & SERIAL_MASK) | uintptr_t(serial_buffer)) = value;
 }
 
 static inline int16_t minpacketlen() {
@@ -377,6 +409,8 @@ EXTERN uint8_t homers;
 struct Settings {
 	uint8_t flags;
 	uint8_t len;
+	uint16_t time;	// Sample time in μs.
+	ARCH_SETTINGS
 	enum {
 		PROBING = 1
 	};
@@ -479,7 +513,7 @@ static inline void SLOW_ISR() {
 		int16_t sample = *reinterpret_cast <volatile int16_t *> (&(*current_buffer)[m][current_sample]);
 		if (sample == 0)
 			continue;
-		int8_t target = ((abs(sample) * move_phase) >> full_phase_bits) - motor[m].steps_current;
+		int8_t target = ((int32_t(abs(sample)) * move_phase) >> full_phase_bits) - motor[m].steps_current;
 		//debug("sample %d %d %d %d %d %d %d", m, sample, abs(sample), move_phase, full_phase, target, motor[m].steps_current);
 		if (target == 0)
 			continue;
@@ -529,6 +563,7 @@ static inline void SLOW_ISR() {
 				}
 				BUFFER_CHECK(settings, current_fragment);
 				current_len = settings[current_fragment].len;
+				arch_change_speed(current_fragment);
 			}
 			else {
 				// Underrun.
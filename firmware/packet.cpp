@@ -31,10 +31,12 @@ static uint16_t read_16(int pos) {
 static uint32_t read_32(int pos) {
 	uint32_t ret = 0;
 	for (uint8_t b = 0; b < 4; ++b)
-		ret |= command(pos + b) << (8 * b);
+		ret |= uint32_t(command(pos + b)) << (8 * b);
 	return ret;
 }
 
+#include "unpack.h"
+
 void packet()
 {
 	last_active = seconds();
@@ -55,16 +57,35 @@ void packet()
 		arch_set_speed(0);
 		homers = 0;
 		home_step_time = 0;
+		// Hosts that support version 4 add the requested version and window size.
+		uint8_t version = command(1) >= 12 ? command(10) : 3;
 		reply[0] = CMD_READY;
 		reply[1] = 11;
-		*reinterpret_cast <uint32_t *>(&reply[2]) = PROTOCOL_VERSION;
+		*reinterpret_cast <uint32_t *>(&reply[2]) = 3;
 		reply[6] = NUM_DIGITAL_PINS;
 		reply[7] = NUM_ANALOG_INPUTS;
 		reply[8] = NUM_MOTORS;
 		reply[9] = 1 << FRAGMENTS_PER_MOTOR_BITS;
 		reply[10] = BYTES_PER_FRAGMENT;
-		reply_ready = reply[1];	// Update the length there if it needs to change.
 		write_ack();
+		if (version >= 4) {
+			// The ack was sent with version 3; everything after it uses version 4.
+			serial_protocol = 4;
+			ff_in = 0;
+			ff_out = 0;
+			out_busy = 0;
+			out_seq = 0;
+			reply[1] = 17;
+			*reinterpret_cast <uint32_t *>(&reply[2]) = PROTOCOL_VERSION;
+			reply[11] = command(11) < SERIAL_WINDOW ? command(11) : SERIAL_WINDOW;
+			// Timing, for the host to compute how many steps fit in a sample.
+			reply[12] = TIME_PER_ISR & 0xff;
+			reply[13] = (TIME_PER_ISR >> 8) & 0xff;
+			reply[14] = STEP_TIME & 0xff;
+			reply[15] = (STEP_TIME >> 8) & 0xff;
+			reply[16] = MAX_ISR_STEPS;
+		}
+		reply_ready = reply[1];	// Update the length there if it needs to change.
 		return;
 	}
 	case CMD_PING:
@@ -401,6 +422,13 @@ void packet()
 			write_stall();
 			return;
 		}
+		// With protocol version 4, each fragment has its own sample time.
+		settings[last_fragment].time = serial_protocol >= 4 ? read_16(3) : time_per_sample;
+		if (settings[last_fragment].time == 0 || !arch_prepare_speed(last_fragment)) {
+			debug("Invalid sample time (%d)", settings[last_fragment].time);
+			write_stall();
+			return;
+		}
 		settings[last_fragment].len = command(1);
 		filling = command(2);
 		for (uint8_t m = 0; m < active_motors; ++m) {
@@ -446,8 +474,19 @@ void packet()
 			write_stall();
 			return;
 		}
-		for (uint8_t b = 0; b < last_len; ++b)
-			buffer[last_fragment][m][b] = static_cast <uint8_t>(command(2 + b));
+		if (serial_protocol >= 4) {
+			if (!unpack_samples(reinterpret_cast <volatile int16_t *>(&buffer[last_fragment][m][0]), last_len >> 1)) {
+				debug("invalid packed samples for buffer %d", m);
+				buffer[last_fragment][m][0] = 0x00;
+				buffer[last_fragment][m][1] = 0x80;
+				write_stall();
+				return;
+			}
+		}
+		else {
+			for (uint8_t b = 0; b < last_len; ++b)
+				buffer[last_fragment][m][b] = static_cast <uint8_t>(command(2 + b));
+		}
 		if (command(0) != CMD_MOVE_SINGLE) {
 			for (uint8_t f = 0; f < active_motors; ++f) {
 				if ((motor[f].follow & 0x7f) == m) {
@@ -501,7 +540,7 @@ void packet()
 		current_len = settings[current_fragment].len;
 		//debug("step_state start 0");
 		step_state = STEP_STATE_PROBE;
-		arch_set_speed(time_per_sample);
+		arch_set_speed(settings[current_fragment].time);
 		write_ack();
 		return;
 	}
@@ -41,6 +41,19 @@
 // static const uint8_t MASK1[3] = {0x4b, 0x2d, 0x1e}
 // Codes (low nybble is data): f0 91 a2 c3 c4 a5 96 f7 88 e9 da bb bc dd ee (8f)
 // These are defined in firmware.h.
+
+// Protocol version 4 is used when the host asks for it in CMD_BEGIN.  It
+// sends packets in frames: FRAME_END, data, header, crc16 (low byte first),
+// FRAME_END.  FRAME_END and FRAME_ESC in the data, header and crc are sent
+// as FRAME_ESC, FRAME_ESC_END or FRAME_ESC_ESC.  The crc is CRC-CCITT
+// (polynomial 0x8408 reflected, start value 0xffff) over data and header.
+// The header is the frame type and a 6 bit sequence number.  Data frames
+// hold a packet without flipflop or checksums.  Acks acknowledge all
+// packets up to the sequence number, nacks request all packets from the
+// sequence number to be resent, stalls are the same as in version 3.  The
+// host may have up to SERIAL_WINDOW packets waiting for an ack.  Single
+// byte commands are still used between frames for ID, STALLACK and debug
+// messages.  CMD_ID from the host switches back to version 3.
 // }}}
 
 // Static variables. {{{
@@ -61,6 +74,14 @@ static const uint8_t cmd_nack[4] = { CMD_NACK0, CMD_NACK1, CMD_NACK2, CMD_NACK3
 static const uint8_t cmd_stall[4] = { CMD_STALL0, CMD_STALL1, CMD_STALL2, CMD_STALL3 };
 // }}}
 
+// Version 4 frame that is being received.  Its data is unstuffed in place, so
+// it starts at serial_buffer_tail; frame_raw is the number of received bytes
+// that were used for it, or 0 between frames.
+static int16_t frame_raw;
+static int16_t frame_len;
+static bool frame_escape;
+static bool frame_nack_sent;
+
 static inline int16_t fullpacketlen() { // {{{
 	if ((command(0) & 0x1f) == CMD_BEGIN) {
 		return command(1);
@@ -69,7 +90,12 @@ static inline int16_t fullpacketlen() { // {{{
 		return 5 + active_motors;
 	}
 	else if ((command(0) & 0x1f) == CMD_MOVE || (command(0) & 0x1f) == CMD_MOVE_SINGLE) {
-		return 2 + last_len;
+		// With protocol version 4, the samples are packed and their length is sent.
+		return serial_protocol >= 4 ? 3 + command(2) : 2 + last_len;
+	}
+	else if ((command(0) & 0x1f) == CMD_START_MOVE || (command(0) & 0x1f) == CMD_START_PROBE) {
+		// With protocol version 4, the sample time is sent.
+		return serial_protocol >= 4 ? 5 : 3;
 	}
 	else if ((command(0) & 0x1f) == CMD_SPI) {
 		return 2 + ((command(1) + 7) >> 3);
@@ -79,14 +105,55 @@ static inline int16_t fullpacketlen() { // {{{
 }
 // }}}
 
+static uint16_t crc_update(uint16_t crc, uint8_t data) { // {{{
+	crc ^= data;
+	for (uint8_t bit = 0; bit < 8; ++bit)
+		crc = crc & 1 ? (crc >> 1) ^ 0x8408 : crc >> 1;
+	return crc;
+}
+// }}}
+
+static void frame_write(uint8_t data) { // {{{
+	if (data == FRAME_END || data == FRAME_ESC) {
+		arch_serial_write(FRAME_ESC);
+		data = data == FRAME_END ? FRAME_ESC_END : FRAME_ESC_ESC;
+	}
+	arch_serial_write(data);
+}
+// }}}
+
+static void write_frame(uint8_t header, uint8_t const *data = 0, int16_t len = 0) { // {{{
+	uint16_t crc = 0xffff;
+	arch_serial_write(FRAME_END);
+	for (int16_t i = 0; i < len; ++i) {
+		frame_write(data[i]);
+		crc = crc_update(crc, data[i]);
+	}
+	frame_write(header);
+	crc = crc_update(crc, header);
+	frame_write(crc & 0xff);
+	frame_write(crc >> 8);
+	arch_serial_write(FRAME_END);
+}
+// }}}
+
+static void write_nack() { // {{{
+	if (serial_protocol >= 4)
+		write_frame(FRAME_NACK | ff_in);
+	else
+		arch_serial_write(cmd_nack[ff_in]);
+}
+// }}}
+
 static void clear_overflow() { // {{{
 	debug("serial flushed after overflow");
 	command_end = 0;
+	frame_raw = 0;
 	serial_buffer_head = serial_buffer;
 	serial_buffer_tail = serial_buffer;
 	serial_overflow = false;
 	debug_dump();
-	arch_serial_write(cmd_nack[ff_in]);
+	write_nack();
 }
 // }}}
 
@@ -102,15 +169,226 @@ static inline void inc_tail(int16_t amount) { // {{{
 	if (amount <= 0)
 		amount = 1;
 	cli();
-	serial_buffer_tail = (volatile uint8_t *)(((uint16_t(serial_buffer_tail) + amount) & SERIAL_MASK) | uint16_t(serial_buffer));
+	serial_buffer_tail = (volatile uint8_t *)(((uintptr_t(serial_buffer_tail) + amount) & SERIAL_MASK) | uintptr_t(serial_buffer));
 	if (serial_overflow && serial_buffer_head == serial_buffer_tail)
 		clear_overflow();
 	sei();
 }
 // }}}
 
+static void packet_acked() { // {{{
+	// The oldest pending packet was acked.
+	uint8_t which = (ff_out - out_busy) & 3;
+	out_busy -= 1;
+	if ((pending_packet[which][0] & 0x1f) == CMD_LIMIT) {
+		current_fragment = (current_fragment + 1) & FRAGMENTS_PER_MOTOR_MASK;
+		last_fragment = current_fragment;
+		notified_current_fragment = current_fragment;
+		filling = 0;
+		stopping = -1;
+		for (uint8_t m = 0; m < active_motors; ++m) {
+			if (motor[m].flags & Motor::LIMIT) {
+				stopping = m;
+				break;
+			}
+		}
+	}
+}
+// }}}
+
+static void resend(uint8_t amount) { // {{{
+	// Resend the last amount packets.
+	if (amount > out_busy) {
+		//debug("no resend at request");
+		return;
+	}
+	//debug("resend at request %x", pending_packet[ff_out][0] & 0xff);
+	ff_out = (ff_out - amount) & 3;
+	out_busy -= amount;
+	while (amount--) {
+		ff_out = (ff_out + 1) & 3;
+		send_packet();
+	}
+}
+// }}}
+
+static void serial_protocol3() { // {{{
+	// The host has switched (back) to version 3.
+	debug("using protocol version 3");
+	serial_protocol = 3;
+	frame_raw = 0;
+	ff_in = 0;
+	ff_out = 0;
+	out_busy = 0;
+}
+// }}}
+
+static void handle_frame(int16_t len) { // {{{
+	// A complete frame of len bytes is at the start of the buffer.
+	uint16_t crc = 0xffff;
+	for (int16_t i = 0; i < len - 2; ++i)
+		crc = crc_update(crc, command(i));
+	if (len < 3 || command(len - 2) != (crc & 0xff) || command(len - 1) != (crc >> 8)) {
+		debug("invalid frame");
+		if (!frame_nack_sent) {
+			write_nack();
+			frame_nack_sent = true;
+		}
+		return;
+	}
+	uint8_t header = command(len - 3);
+	uint8_t seq = header & FRAME_SEQ_MASK;
+	switch (header & ~FRAME_SEQ_MASK) {
+	case FRAME_ACK:
+		// Acks are cumulative.
+		while (out_busy > 0 && ((seq - pending_seq[(ff_out - out_busy) & 3]) & FRAME_SEQ_MASK) <= FRAME_SEQ_MASK / 2)
+			packet_acked();
+		return;
+	case FRAME_NACK:
+		arch_claim_serial();
+		for (uint8_t amount = out_busy; amount > 0; --amount) {
+			if (pending_seq[(ff_out - amount) & 3] == seq) {
+				resend(amount);
+				break;
+			}
+		}
+		return;
+	case FRAME_DATA:
+		break;
+	default:
+		debug("invalid frame type %x", header);
+		return;
+	}
+	if (had_stall) {
+		debug("repeating stall");
+		write_stall();
+		return;
+	}
+	uint8_t diff = (seq - ff_in) & FRAME_SEQ_MASK;
+	if (diff != 0) {
+		if (diff > FRAME_SEQ_MASK / 2) {
+			// This is a retry of a packet that was already handled, so our ack was lost.
+			debug("duplicate %d %d", ff_in, seq);
+			write_frame(FRAME_ACK | ((ff_in - 1) & FRAME_SEQ_MASK));
+		}
+		else if (!frame_nack_sent) {
+			// A packet was lost; request it and everything after it again.
+			write_nack();
+			frame_nack_sent = true;
+		}
+		return;
+	}
+	frame_nack_sent = false;
+	if (len - 3 < minpacketlen() || len - 3 != fullpacketlen()) {
+		debug("invalid packet length %d for %x", len - 3, command(0));
+		write_ack();
+		return;
+	}
+	packet();
+}
+// }}}
+
+static void serial_frame() { // {{{
+	// Handle serial data with protocol version 4.
+	uint16_t milliseconds = millis();
+	if (milliseconds - last_millis >= 500) {
+		if (serial_overflow)
+			clear_overflow();
+		if (!had_data && frame_raw > 0) {
+			// Frame not finished; ignore it and wait for next.
+			arch_watchdog_reset();
+			debug("fail frame %d", frame_raw);
+			inc_tail(frame_raw);
+			frame_raw = 0;
+			return;
+		}
+	}
+	had_data = false;
+	while (true) {
+		int16_t sa = serial_available();
+		if (frame_raw == 0) {
+			if (!sa) {
+				arch_watchdog_reset();
+				return;
+			}
+			had_data = true;
+			uint8_t firstbyte = *serial_buffer_tail;
+			switch (firstbyte) {
+			case FRAME_END:
+				frame_raw = 1;
+				frame_len = 0;
+				frame_escape = false;
+				last_millis = millis();
+				continue;
+			case CMD_NACK0:
+			case CMD_NACK1:
+			case CMD_NACK2:
+			case CMD_NACK3:
+				// Version 3 nack, sent by the host when it reconnects: resend everything.
+				arch_claim_serial();
+				resend(out_busy);
+				inc_tail(1);
+				continue;
+			case CMD_ID:
+				// The host has (re)connected; it uses version 3 until it asks for more.
+				serial_protocol3();
+				arch_claim_serial();
+				send_id(CMD_ID);
+				inc_tail(1);
+				return;
+			case CMD_STALLACK:
+				had_stall = false;
+				inc_tail(1);
+				continue;
+			default:
+				// Garbage from a lost frame start, or version 3 acks from a connecting host.
+				inc_tail(1);
+				continue;
+			}
+		}
+		if (frame_raw >= sa) {
+			if (serial_overflow)
+				clear_overflow();
+			arch_watchdog_reset();
+			return;
+		}
+		had_data = true;
+		uint8_t c = command(frame_raw++);
+		last_millis = millis();
+		if (c == FRAME_END) {
+			if (frame_len == 0) {
+				// The previous flag was the end of a lost frame; this one starts the next.
+				inc_tail(frame_raw - 1);
+				frame_raw = 1;
+				frame_escape = false;
+				continue;
+			}
+			int16_t raw = frame_raw;
+			frame_raw = 0;
+			arch_watchdog_reset();
+			handle_frame(frame_len);
+			inc_tail(raw);
+			return;
+		}
+		if (c == FRAME_ESC) {
+			frame_escape = true;
+			continue;
+		}
+		if (frame_escape) {
+			c = c == FRAME_ESC_END ? FRAME_END : FRAME_ESC;
+			frame_escape = false;
+		}
+		set_command(frame_len++, c);
+	}
+}
+// }}}
+
 // Check if there is serial data available.  This is not running from an interrupt, because it must 
 void serial() { // {{{
+	if (serial_protocol >= 4) {
+		serial_frame();
+		return;
+	}
 	uint16_t milliseconds = millis();
 	sdebug("command end %d", command_end);
 	if (milliseconds - last_millis >= 500) {
@@ -151,22 +429,8 @@ void serial() { // {{{
 			// Ack: everything was ok; flip the flipflop.
 			//debug("a%d out %d busy %d", which, ff_out, out_busy);
 			//debug("a%d", ff_out);
-			if (out_busy > 0 && ((ff_out - out_busy) & 3) == which) {	// Only if we expected it and it is the right type.
-				out_busy -= 1;
-				if ((pending_packet[which][0] & 0x1f) == CMD_LIMIT) {
-					current_fragment = (current_fragment + 1) & FRAGMENTS_PER_MOTOR_MASK;
-					last_fragment = current_fragment;
-					notified_current_fragment = current_fragment;
-					filling = 0;
-					stopping = -1;
-					for (uint8_t m = 0; m < active_motors; ++m) {
-						if (motor[m].flags & Motor::LIMIT) {
-							stopping = m;
-							break;
-						}
-					}
-				}
-			}
+			if (out_busy > 0 && ((ff_out - out_busy) & 3) == which)	// Only if we expected it and it is the right type.
+				packet_acked();
 			inc_tail(1);
 			continue;
 		}
@@ -183,18 +447,7 @@ void serial() { // {{{
 			//debug("n%d out %d busy %d", which, ff_out, out_busy);
 			//debug_dump();
 			// Unless the last packet was already received; in that case ignore the NACK.
-			uint8_t amount = (ff_out - which) & 3;
-			if (amount <= out_busy) {
-				//debug("resend at request %x", pending_packet[ff_out][0] & 0xff);
-				ff_out = (ff_out - amount) & 3;
-				out_busy -= amount;
-				while (amount--) {
-					ff_out = (ff_out + 1) & 3;
-					send_packet();
-				}
-			}
-			//else
-				//debug("no resend at request");
+			resend((ff_out - which) & 3);
 			inc_tail(1);
 			continue;
 		}
@@ -345,6 +598,14 @@ static int16_t prepare_packet(int16_t len, uint8_t *packet = 0)
 		return 0;
 	}
 	int16_t *packetlen;
+	if (!packet && serial_protocol >= 4) {
+		// The frame is created while sending.
+		pending_len[ff_out] = len;
+		pending_seq[ff_out] = out_seq;
+		out_seq = (out_seq + 1) & FRAME_SEQ_MASK;
+		ff_out = (ff_out + 1) & 3;
+		return len;
+	}
 	if (!packet) {
 		packet = pending_packet[ff_out];
 		packetlen = &pending_len[ff_out];
@@ -401,6 +662,10 @@ void send_packet()
 	sdebug2("send");
 	out_busy += 1;
 	uint8_t which = (ff_out - 1) & 3;
+	if (serial_protocol >= 4) {
+		write_frame(FRAME_DATA | pending_seq[which], pending_packet[which], pending_len[which]);
+		return;
+	}
 	for (int16_t t = 0; t < pending_len[which]; ++t) {
 		BUFFER_CHECK(pending_packet[which], t);
 		arch_serial_write(pending_packet[which][t]);
@@ -567,6 +832,11 @@ void write_ack()
 	//debug("acking %d", out_busy);
 	//debug_dump();
 	had_stall = false;
+	if (serial_protocol >= 4) {
+		write_frame(FRAME_ACK | ff_in);
+		ff_in = (ff_in + 1) & FRAME_SEQ_MASK;
+		return;
+	}
 	arch_serial_write(cmd_ack[ff_in]);
 	ff_in = (ff_in + 1) & 3;
 }
@@ -575,6 +845,9 @@ void write_stall()
 {
 	//debug("stalling");
 	had_stall = true;
-	arch_serial_write(cmd_stall[ff_in]);
+	if (serial_protocol >= 4)
+		write_frame(FRAME_STALL | ff_in);
+	else
+		arch_serial_write(cmd_stall[ff_in]);
 }
 // }}}
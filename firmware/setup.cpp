@@ -58,6 +58,8 @@ void setup()
 	out_busy = 0;
 	ff_in = 0;
 	ff_out = 0;
+	serial_protocol = 3;
+	out_seq = 0;
 	reply_ready = 0;
 	adcreply_ready = 0;
 	timeout = false;
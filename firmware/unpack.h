@@ -0,0 +1,100 @@
+/* unpack.h - packed sample decoding for Franklin
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// This is included by packet.cpp, and by the round-trip test of the host
+// (server/cdriver/pack-test.cpp).  The includer defines command(),
+// read_16() and read_32() for the current packet.
+
+#ifndef _UNPACK_H
+#define _UNPACK_H
+
+static bool unpack_samples(volatile int16_t *target, uint8_t num) {
+	// Expand the packed samples of a version 4 CMD_MOVE into target.
+	// The data is a list of runs, each starting with a byte that holds the type and length-1:
+	// 00nnnnnn: zeros; 01nnnnnn: copies of the previous sample;
+	// 10nnnnnn: 4 bit signed differences with the previous sample, two per byte, low nybble first;
+	// 110nnnnn: 8 bit signed differences; 111nnnnn: 16 bit little endian samples.
+	// A single zero is never sent that way; 0x00 starts a quadratic run instead.  It is followed
+	// by a byte with length-1, a 16 bit start fraction, 32 bit speed and 32 bit acceleration, all
+	// in steps per sample with 16 fractional bits.  The arithmetic wraps; the host checks that it
+	// produces the intended samples.
+	uint8_t len = command(2);	// The host keeps the packet shorter than the serial buffer.
+	int16_t end = 3 + len;
+	int16_t pos = 3;
+	uint8_t s = 0;
+	int16_t value = 0;
+	while (pos < end) {
+		uint8_t run = command(pos++);
+		if (run == 0) {
+			// Integrate the segment into samples here; the step interrupt only handles samples.
+			if (pos + 11 > end)
+				return false;
+			uint8_t count = command(pos) + 1;
+			if (s + count > num)
+				return false;
+			uint32_t x = read_16(pos + 1);
+			uint32_t v = read_32(pos + 3);
+			uint32_t a = read_32(pos + 7);
+			pos += 11;
+			for (uint8_t i = 0; i < count; ++i) {
+				uint16_t old = x >> 16;
+				x += v;
+				v += a;
+				value = int16_t(uint16_t(x >> 16) - old);
+				target[s++] = value;
+			}
+			continue;
+		}
+		uint8_t type = run >> 5;
+		uint8_t count = (type < 6 ? run & 0x3f : run & 0x1f) + 1;
+		if (s + count > num)
+			return false;
+		for (uint8_t i = 0; i < count; ++i) {
+			switch (type) {
+			case 0:
+			case 1:
+				value = 0;
+				break;
+			case 2:
+			case 3:
+				break;
+			case 4:
+			case 5:
+			{
+				uint8_t nybble = command(pos + (i >> 1));
+				nybble = i & 1 ? nybble >> 4 : nybble & 0xf;
+				value += nybble & 0x8 ? int8_t(nybble | 0xf0) : int8_t(nybble);
+				break;
+			}
+			case 6:
+				value += int8_t(command(pos + i));
+				break;
+			default:
+				value = read_16(pos + 2 * i);
+				break;
+			}
+			target[s++] = value;
+		}
+		pos += type < 4 ? 0 : type < 6 ? (count + 1) >> 1 : type == 6 ? count : 2 * count;
+	}
+	return s == num && pos == end;
+}
+
+#endif
@@ -38,6 +38,8 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <signal.h>
+#include <string>
 
 // Enable all the parts for a serial connection (which can fail) to the printer.
 #define SERIAL
@@ -49,7 +51,11 @@
 #define DATA_DELETE(s, m) delete[] (spaces[s].motor[m]->avr_data)
 #define DATA_CLEAR(s, m) memset((spaces[s].motor[m]->avr_data), 0, BYTES_PER_FRAGMENT)
 #define DATA_SET(s, m, v) spaces[s].motor[m]->avr_data[current_fragment_pos] = v;
-#define SAMPLES_PER_FRAGMENT (BYTES_PER_FRAGMENT / sizeof(DATA_TYPE))
+// With protocol version 4, the packed samples of a motor follow a 3 byte header with their 8 bit length, and the packet
+// must be shorter than COMMAND_SIZE.  Full samples take 2 bytes each plus a byte per 32, so no more than this many are
+// sent in a fragment.
+#define AVR_PACKED_SAMPLES 124
+#define SAMPLES_PER_FRAGMENT (serial_protocol >= 4 && BYTES_PER_FRAGMENT / sizeof(DATA_TYPE) > AVR_PACKED_SAMPLES ? AVR_PACKED_SAMPLES : BYTES_PER_FRAGMENT / sizeof(DATA_TYPE))
 #define ARCH_MAX_FDS 1	// Maximum number of fds for arch-specific purposes.
 
 #else
@@ -110,6 +116,10 @@ int hwpacketsize(int len, int *available);
 void try_send_control();
 void arch_had_ack();
 void avr_send();
+void avr_queue_send(int len);
+void avr_flush_queue();
+void avr_continue_fragment();
+int avr_pack_samples(char *target, int const *value, int start, int num, bool raw, bool quadratic);
 void avr_call1(uint8_t cmd, uint8_t arg);
 void avr_get_current_pos(int offset, bool check);
 bool hwpacket(int len);
@@ -161,9 +171,14 @@ void END_DEBUG();
 struct AVRSerial : public Serial_t { // {{{
 	char buffer[256];
 	int start, end_, fd;
+	char outbuffer[256];
+	int outlen;
+	std::string pending;	// Data that the port did not accept yet; it is written when poll reports room.
 	void begin(char const *port);
-	void end() { close(fd); }
+	void end() { outlen = 0; pending.clear(); close(fd); }
+	void send(char const *data, int len);
 	void write(char c);
+	void write(char const *data, int len);
 	void refill();
 	int read();
 	int readBytes (char *target, int len) {
@@ -171,13 +186,19 @@ struct AVRSerial : public Serial_t { // {{{
 			*target++ = read();
 		return len;
 	}
-	void flush() {}
+	void flush();
 	int available() {
 		if (start == end_)
 			refill();
 		return end_ - start;
 	}
 }; // }}}
+struct AvrQueuerecord { // {{{
+	AvrQueuerecord *next;
+	void (*cb)();
+	int len;
+	char data[COMMAND_SIZE];
+}; // }}}
 struct Avr_pin_t { // {{{
 	char state;
 	char reset;
@@ -194,6 +215,7 @@ EXTERN bool avr_running;
 EXTERN Avr_pin_t *avr_pins;
 EXTERN double *avr_pos_offset;
 EXTERN int avr_active_motors;
+EXTERN int avr_isr_time, avr_step_time, avr_isr_steps;	// Firmware timing: μs per isr, ns per step, steps per isr; 0 if not reported.
 EXTERN int *avr_adc_id;
 EXTERN uint8_t *avr_control_queue;
 EXTERN bool *avr_in_control_queue;
@@ -201,10 +223,17 @@ EXTERN int avr_control_queue_length;
 EXTERN bool avr_connected;
 EXTERN bool avr_homing;
 EXTERN bool avr_filling;
+// Fragment upload.  All packets are prepared by arch_send_fragment and sent by avr_continue_fragment when there is room in the window.
+EXTERN char *avr_fragment_buffer;	// Packet contents, avr_fragment_stride bytes per packet.
+EXTERN int *avr_fragment_len;
+EXTERN int avr_fragment_size, avr_fragment_stride;
+EXTERN int avr_fragment_packets;	// Number of packets in the fragment that is being uploaded.
+EXTERN int avr_fragment_sent;		// Packets that have been sent; sending_fragment counts the ones that have not been acknowledged yet.
 EXTERN void (*avr_get_cb)(bool);
 EXTERN bool avr_get_pin_invert;
 EXTERN bool avr_stop_fake;
 EXTERN void (*avr_cb)();
+EXTERN AvrQueuerecord *avr_queue_head, *avr_queue_tail;	// Packets that are waiting for room in the window, oldest first.
 EXTERN int *avr_pin_name_len;
 EXTERN char **avr_pin_name;
 EXTERN bool avr_uuid_dirty;
@@ -246,20 +275,27 @@ int hwpacketsize(int len, int *available) { // {{{
 	}
 } // }}}
 
-void try_send_control() { // {{{
-	if (!avr_connected || preparing || out_busy >= 3 || avr_control_queue_length == 0)
-		return;
+static void avr_pop_control() { // {{{
+	// Fill avr_buffer with the last control in the queue.
 	avr_control_queue_length -= 1;
 	avr_buffer[0] = HWC_CONTROL;
 	avr_buffer[1] = avr_control_queue[avr_control_queue_length * 3];
 	avr_buffer[2] = avr_control_queue[avr_control_queue_length * 3 + 1];
 	avr_buffer[3] = avr_control_queue[avr_control_queue_length * 3 + 2];
 	avr_in_control_queue[avr_control_queue[avr_control_queue_length * 3]] = false;
+} // }}}
+
+void try_send_control() { // {{{
+	if (!avr_connected || avr_queue_head || out_busy >= serial_window || avr_control_queue_length == 0)
+		return;
+	avr_pop_control();
 	prepare_packet(avr_buffer, 4);
 	avr_send();
 } // }}}
 
 void arch_had_ack() { // {{{
+	avr_flush_queue();
+	avr_continue_fragment();
 	if (out_busy == 0)
 		try_send_control();
 } // }}}
@@ -270,23 +306,68 @@ void avr_send() { // {{{
 		debug("send called while not connected");
 		abort();
 	}
-	while (out_busy >= 3) {
-		//debug("avr send");
-		poll(&pollfds[BASE_FDS], 1, -1);
-		serial(1);
+	if (out_busy >= serial_window) {
+		debug("BUG: avr_send called with a full window");
+		abort();
 	}
 	serial_cb[out_busy] = avr_cb;
 	avr_cb = NULL;
 	send_packet();
-	if (out_busy < 3)
+	if (out_busy < serial_window)
 		try_send_control();
 } // }}}
 
+void avr_queue_send(int len) { // {{{
+	// Send the packet in avr_buffer with avr_cb as its callback; if the window is full, it is sent from arch_had_ack.
+	if (!avr_connected) {
+		debug("send called while not connected");
+		abort();
+	}
+	if (!avr_queue_head && out_busy < serial_window) {
+		if (prepare_packet(avr_buffer, len))
+			avr_send();
+		avr_cb = NULL;
+		return;
+	}
+	AvrQueuerecord *record = new AvrQueuerecord;
+	record->next = NULL;
+	record->cb = avr_cb;
+	record->len = len;
+	memcpy(record->data, avr_buffer, len);
+	avr_cb = NULL;
+	if (avr_queue_head)
+		avr_queue_tail->next = record;
+	else
+		avr_queue_head = record;
+	avr_queue_tail = record;
+} // }}}
+
+void avr_flush_queue() { // {{{
+	// Send queued packets while there is room.  Packets that cannot be prepared because of a stop are dropped, like direct sends.
+	while (avr_connected && avr_queue_head && out_busy < serial_window) {
+		AvrQueuerecord *record = avr_queue_head;
+		avr_queue_head = record->next;
+		memcpy(avr_buffer, record->data, record->len);
+		avr_cb = record->cb;
+		if (prepare_packet(avr_buffer, record->len))
+			avr_send();
+		avr_cb = NULL;
+		delete record;
+	}
+} // }}}
+
+static void avr_clear_queue() { // {{{
+	while (avr_queue_head) {
+		AvrQueuerecord *record = avr_queue_head;
+		avr_queue_head = record->next;
+		delete record;
+	}
+} // }}}
+
 void avr_call1(uint8_t cmd, uint8_t arg) { // {{{
 	avr_buffer[0] = cmd;
 	avr_buffer[1] = arg;
-	prepare_packet(avr_buffer, 2);
-	avr_send();
+	avr_queue_send(2);
 } // }}}
 
 double arch_round_pos(int s, int m, double pos) { // {{{
@@ -299,6 +380,36 @@ double arch_round_pos(int s, int m, double pos) { // {{{
 	return round(pos + avr_pos_offset[mi + m]) - avr_pos_offset[mi + m];
 } // }}}
 
+int arch_sample_factor(double rate) { // {{{
+	// Longest sample period (as a multiple of hwtime_step) for a peak step rate [steps/s].
+	// Only protocol version 4 sends the period with each fragment; the firmware stores it in 16 bits.
+	if (serial_protocol < 4)
+		return 1;
+	int max = min(MAX_SAMPLE_FACTOR, 0xffff / hwtime_step);
+	double factor = SLOW_SAMPLE_STEPS / (rate * hwtime_step / 1e6);
+	if (!(factor < max))
+		return max;
+	return factor < 1 ? 1 : int(factor);
+} // }}}
+
+int arch_max_sample_steps(int period) { // {{{
+	// Most steps a motor can do in a sample of period μs.
+	// Without reported timing, assume 0x1e steps per isr and 128 isrs per sample.
+	if (avr_isr_time <= 0 || avr_step_time <= 0 || avr_isr_steps <= 0)
+		return 0x1e << 7;
+	// The firmware spreads a sample over the largest power of 2 isrs that are at least avr_isr_time apart for hwtime_step; that number doesn't change with the period.
+	int phases = 1;
+	while (hwtime_step / avr_isr_time >= phases * 2)
+		phases *= 2;
+	int per_isr = int64_t(period) * 1000 / phases / avr_step_time;
+	if (per_isr > avr_isr_steps)
+		per_isr = avr_isr_steps;
+	if (per_isr < 1)
+		per_isr = 1;
+	// Samples are sent as 16 bit values.
+	return min(per_isr * phases, 0x7fff);
+} // }}}
+
 void avr_get_current_pos(int offset, bool check) { // {{{
 	int mi = 0;
 	for (int ts = 0; ts < NUM_SPACES; mi += spaces[ts++].num_motors) {
@@ -368,14 +479,9 @@ bool hwpacket(int len) { // {{{
 		avr_get_current_pos(4, false);
 		if (spaces[0].num_axes > 0)
 			cpdebug(0, 0, "ending hwpos %f", spaces[0].motor[0]->settings.current_pos + avr_pos_offset[0]);
-		double pos;
-		int s, m;
-		if (which >= avr_active_motors) {
-			s = -1;
-			m = -1;
-			pos = NAN;
-		}
-		else {
+		double pos = NAN;
+		int s = -1, m = -1;
+		if (which < avr_active_motors) {
 			for (s = 0; s < NUM_SPACES; ++s) {
 				if (which < spaces[s].num_motors) {
 					m = which;
@@ -440,10 +546,8 @@ bool hwpacket(int len) { // {{{
 			if (!sending_fragment && !transmitting_fragment) {
 				if (command[1][3] == 0) {
 					avr_get_current_pos(4, true);
-					if (run_file_finishing) {
-						send_host(CMD_FILE_DONE);
-						abort_run_file();
-					}
+					if (run_file_finishing)
+						run_file_done();
 				}
 			}
 			//debug("underrun check %d %d %d", sending_fragment, current_fragment, running_fragment);
@@ -467,12 +571,13 @@ bool hwpacket(int len) { // {{{
 		}
 		first_fragment = -1;
 		int cbs = 0;
-		//debug("done: %d pending %d sending %d preparing %d current %d running %d", command[1][offset + 1], command[1][offset + 2], sending_fragment, preparing, current_fragment, running_fragment);
+		//debug("done: %d pending %d sending %d current %d running %d", command[1][offset + 1], command[1][offset + 2], sending_fragment, current_fragment, running_fragment);
 		for (int i = 0; i < command[1][offset + 1]; ++i) {
 			int f = (running_fragment + i) % FRAGMENTS_PER_BUFFER;
-			//debug("fragment %d: cbs=%d current=%d", f, history[f].cbs, current_fragment);
-			cbs += history[f].cbs;
-			history[f].cbs = 0;
+			//debug("fragment %d: cbs=%d current=%d", f, history(f).cbs, current_fragment);
+			cbs += history(f).cbs;
+			history(f).cbs = 0;
+			run_file_fire_events(f);
 		}
 		if (!avr_running) {
 			cbs += cbs_after_current_move;
@@ -494,7 +599,7 @@ bool hwpacket(int len) { // {{{
 			debug("Done received, but should be underrun");
 			//abort();
 		}
-		if (out_busy < 3)
+		if (out_busy < serial_window)
 			buffer_refill();
 		//else
 		//	debug("no refill");
@@ -724,6 +829,17 @@ void arch_reset() { // {{{
 	}
 	// Wait for reset to complete.
 	sleep(2);
+	if (serial_protocol >= 4) {
+		// The firmware switches back to version 3 when it receives the pings.
+		serial_protocol = 3;
+		serial_window = 3;
+		ff_in = 0;
+		ff_out = 0;
+		out_busy = 0;
+	}
+	// Packets for the previous connection are not sent anymore.
+	avr_clear_queue();
+	serial_upgrade = false;
 	avr_serial.write(CMD_ACK1);
 	avr_serial.write(CMD_ACK2);
 	avr_serial.write(CMD_ACK3);
@@ -734,11 +850,13 @@ void arch_reset() { // {{{
 	avr_serial.write(CMD_STALLACK);
 	// Just in case the controller was reset: reclaim port by requesting ID.
 	avr_serial.write(CMD_ID);
+	avr_serial.flush();
 	avr_call1(HWC_PING, 0);
 	avr_call1(HWC_PING, 1);
 	avr_call1(HWC_PING, 2);
 	avr_call1(HWC_PING, 3);
 	avr_serial.write(CMD_ID);
+	avr_serial.flush();
 	avr_call1(HWC_PING, 4);
 	avr_call1(HWC_PING, 5);
 	avr_call1(HWC_PING, 6);
@@ -746,6 +864,7 @@ void arch_reset() { // {{{
 	int32_t before = millis();
 	while (avr_pong != 7 && millis() - before < 2000) {
 		//debug("avr pongwait %d", avr_pong);
+		avr_serial.flush();
 		pollfds[BASE_FDS].revents = 0;
 		poll(&pollfds[BASE_FDS], 1, 1);
 		serial(1);
@@ -806,8 +925,7 @@ void arch_motor_change(uint8_t s, uint8_t sm) { // {{{
 	else
 		avr_buffer[6] = 0xff;
 	avr_buffer[7] = (mtr.step_pin.inverted() ? INVERT_STEP : 0) | (mininvert ? INVERT_LIMIT_MIN : 0) | (maxinvert ? INVERT_LIMIT_MAX : 0);
-	prepare_packet(avr_buffer, 8);
-	avr_send();
+	avr_queue_send(8);
 } // }}}
 
 void arch_change(bool motors) { // {{{
@@ -839,8 +957,7 @@ void arch_change(bool motors) { // {{{
 		avr_buffer[10] = timeout & 0xff;
 		avr_buffer[11] = (timeout >> 8) & 0xff;
 		avr_buffer[12] = spiss_pin.valid() ? spiss_pin.pin : ~0;
-		prepare_packet(avr_buffer, 14);
-		avr_send();
+		avr_queue_send(14);
 	}
 	if (motors) {
 		for (uint8_t s = 0; s < NUM_SPACES; ++s) {
@@ -859,15 +976,14 @@ void arch_change(bool motors) { // {{{
 				avr_buffer[5] = ~0;
 				avr_buffer[6] = ~0;
 				avr_buffer[7] = 0;
-				prepare_packet(avr_buffer, 8);
-				avr_send();
+				avr_queue_send(8);
 			}
 		}
 	}
 } // }}}
 
 void arch_motors_change() { // {{{
-	if (preparing || out_busy >= 3) {
+	if (out_busy >= serial_window) {
 		change_pending = true;
 		return;
 	}
@@ -909,8 +1025,7 @@ void arch_set_uuid() { // {{{
 	avr_buffer[0] = HWC_SET_UUID;
 	for (uint8_t i = 0; i < UUID_SIZE; ++i)
 		avr_buffer[1 + i] = uuid[i];
-	prepare_packet(avr_buffer, 1 + UUID_SIZE);
-	avr_send();
+	avr_queue_send(1 + UUID_SIZE);
 } // }}}
 
 static void avr_connect3();
@@ -951,8 +1066,7 @@ static void avr_connect3() { // {{{
 	avr_buffer[0] = HWC_PINNAME;
 	avr_buffer[1] = avr_next_pin_name < NUM_DIGITAL_PINS ? avr_next_pin_name : (avr_next_pin_name - NUM_DIGITAL_PINS) | 0x80;
 	wait_for_reply[expected_replies++] = avr_connect4;
-	prepare_packet(avr_buffer, 2);
-	avr_send();
+	avr_queue_send(2);
 } // }}}
 
 void avr_connect2() { // {{{
@@ -965,6 +1079,23 @@ void avr_connect2() { // {{{
 	NUM_MOTORS = command[1][8];
 	FRAGMENTS_PER_BUFFER = command[1][9];
 	BYTES_PER_FRAGMENT = command[1][10];
+	if (protocol_version >= 4) {
+		serial_window = command[1][11];
+		if (serial_window < 1 || serial_window > SERIAL_WINDOW)
+			serial_window = SERIAL_WINDOW;
+	}
+	else
+		serial_window = 3;
+	if (protocol_version >= 4 && command[1][1] >= 17) {
+		avr_isr_time = uint8_t(command[1][12]) | uint8_t(command[1][13]) << 8;
+		avr_step_time = uint8_t(command[1][14]) | uint8_t(command[1][15]) << 8;
+		avr_isr_steps = uint8_t(command[1][16]);
+	}
+	else {
+		avr_isr_time = 0;
+		avr_step_time = 0;
+		avr_isr_steps = 0;
+	}
 	//id[0][:8] + '-' + id[0][8:12] + '-' + id[0][12:16] + '-' + id[0][16:20] + '-' + id[0][20:32]
 	for (int i = 0; i < UUID_SIZE; ++i)
 		uuid[i] = command[1][11 + i];
@@ -1000,12 +1131,15 @@ void arch_connect(char const *run_id, char const *port) { // {{{
 	arch_reset();
 	// Get constants.
 	avr_buffer[0] = HWC_BEGIN;
-	avr_buffer[1] = 10;
+	avr_buffer[1] = 12;
 	for (int i = 0; i < ID_SIZE; ++i)
 		avr_buffer[2 + i] = run_id[i];
+	// Request protocol version 4; older firmware ignores the last bytes.
+	avr_buffer[2 + ID_SIZE] = PROTOCOL_VERSION;
+	avr_buffer[3 + ID_SIZE] = SERIAL_WINDOW;
 	wait_for_reply[expected_replies++] = avr_connect2;
-	prepare_packet(avr_buffer, 10);
-	avr_send();
+	serial_upgrade = true;
+	avr_queue_send(12);
 } // }}}
 
 void arch_request_temp(int which) { // {{{
@@ -1024,13 +1158,10 @@ void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin, bo
 		debug("setup for invalid adc %d requested", thermistor_pin);
 		return;
 	}
-	// Make sure the controls for the heater and fan have been sent, otherwise they override this.
-	try_send_control();
-	while (out_busy >= 3) {
-		//debug("avr send");
-		poll(&pollfds[BASE_FDS], 1, -1);
-		serial(1);
-		try_send_control();
+	// Make sure the controls for the heater and fan are sent first, otherwise they override this.
+	while (avr_control_queue_length > 0) {
+		avr_pop_control();
+		avr_queue_send(4);
 	}
 	thermistor_pin -= NUM_DIGITAL_PINS;
 	avr_adc_id[thermistor_pin] = id;
@@ -1077,12 +1208,14 @@ void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin, bo
 	uint16_t hold_time_ms = hold_time * 1000;
 	avr_buffer[16] = hold_time_ms & 0xff;
 	avr_buffer[17] = (hold_time_ms >> 8) & 0xff;
-	prepare_packet(avr_buffer, 18);
-	avr_send();
+	avr_queue_send(18);
 } // }}}
 
+static void avr_end_fragment();
+
 void arch_disconnect() { // {{{
 	avr_connected = false;
+	avr_end_fragment();
 	avr_serial.end();
 } // }}}
 
@@ -1097,6 +1230,7 @@ void arch_reconnect(char *port) { // {{{
 		return;
 	for (int i = 0; i < 4; ++i)
 		avr_serial.write(cmd_nack[i]);	// Just to be sure.
+	avr_serial.flush();
 } // }}}
 // }}}
 
@@ -1125,6 +1259,20 @@ void arch_addpos(int s, int m, double diff) { // {{{
 	cpdebug(s, m, "arch addpos diff %f offset %f raw %f pos %f", diff, avr_pos_offset[mi], spaces[s].motor[m]->settings.current_pos + avr_pos_offset[mi], spaces[s].motor[m]->settings.current_pos);
 } // }}}
 
+static void avr_end_fragment() { // {{{
+	// Stop uploading the current fragment; packets that were not sent yet are dropped.
+	// They will never be acknowledged, so they must not keep sending_fragment busy; after a disconnect no stop OK will clear it.
+	if (transmitting_fragment) {
+		sending_fragment -= avr_fragment_packets - avr_fragment_sent;
+		if (sending_fragment < 0)
+			sending_fragment = 0;
+	}
+	avr_fragment_packets = 0;
+	avr_fragment_sent = 0;
+	transmitting_fragment = false;
+	avr_filling = false;
+} // }}}
+
 void arch_stop(bool fake) { // {{{
 	if (!avr_connected) {
 		stop_pending = true;
@@ -1132,12 +1280,13 @@ void arch_stop(bool fake) { // {{{
 	}
 	//debug("blocking host");
 	host_block = true;
-	if (preparing || out_busy >= 3) {
+	if (out_busy >= serial_window) {
 		//debug("not yet stopping");
 		stop_pending = true;
 		return;
 	}
 	stop_pending = false;
+	avr_end_fragment();
 	if (!avr_running && !avr_homing) {
 		//debug("not running, so not stopping");
 		current_fragment_pos = 0;
@@ -1151,8 +1300,7 @@ void arch_stop(bool fake) { // {{{
 	avr_buffer[0] = HWC_STOP;
 	wait_for_reply[expected_replies++] = avr_stop2;
 	avr_stop_fake = fake;
-	prepare_packet(avr_buffer, 1);
-	avr_send();
+	avr_queue_send(1);
 } // }}}
 
 void avr_stop2() { // {{{
@@ -1181,66 +1329,108 @@ static void avr_sent_fragment() { // {{{
 	}
 } // }}}
 
+void avr_continue_fragment() { // {{{
+	// Send as many packets of the current fragment as the window allows.  This never blocks; it is called again from arch_had_ack.
+	if (!transmitting_fragment)
+		return;
+	while (avr_fragment_sent < avr_fragment_packets) {
+		if (!avr_connected || host_block || stopping || stop_pending) {
+			// The rest of the fragment is not needed anymore.
+			//debug("abandoning fragment after %d of %d packets", avr_fragment_sent, avr_fragment_packets);
+			break;
+		}
+		if (avr_queue_head || out_busy >= serial_window)
+			return;
+		int len = avr_fragment_len[avr_fragment_sent];
+		memcpy(avr_buffer, &avr_fragment_buffer[avr_fragment_sent * avr_fragment_stride], len);
+		if (!prepare_packet(avr_buffer, len))
+			break;
+		avr_fragment_sent += 1;
+		avr_cb = &avr_sent_fragment;
+		avr_send();
+	}
+	avr_end_fragment();
+	// A discard is not done while a fragment is being uploaded.
+	if (discard_pending)
+		arch_do_discard();
+} // }}}
+
+#include "avr-pack.h"
+
 bool arch_send_fragment() { // {{{
-	if (!avr_connected || host_block || stopping || discard_pending || stop_pending) {
+	if (!avr_connected || host_block || stopping || discard_pending || stop_pending || transmitting_fragment) {
 		//debug("not sending arch frag %d %d %d %d", host_block, stopping, discard_pending, stop_pending);
 		return false;
 	}
-	while (out_busy >= 3) {
-		poll(&pollfds[BASE_FDS], 1, -1);
-		serial(1);
-	}
-	if (stop_pending || discard_pending)
-		return false;
-	avr_buffer[0] = settings.probing ? HWC_START_PROBE : HWC_START_MOVE;
 	//debug("send fragment current-fragment-pos=%d current-fragment=%d active-moters=%d running=%d num-running=0x%x", current_fragment_pos, current_fragment, num_active_motors, running_fragment, (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER);
-	avr_buffer[1] = current_fragment_pos * 2;
-	avr_buffer[2] = num_active_motors;
-	sending_fragment = num_active_motors + 1;
-	if (prepare_packet(avr_buffer, 3)) {
-		transmitting_fragment = true;
-		avr_cb = &avr_sent_fragment;
-		avr_send();
-		int mi = 0;
-		avr_filling = true;
-		int cfp = current_fragment_pos;
-		for (int s = 0; !host_block && !stopping && !discard_pending && !stop_pending && s < NUM_SPACES; mi += spaces[s++].num_motors) {
-			for (uint8_t m = 0; !host_block && !stopping && !discard_pending && !stop_pending && m < spaces[s].num_motors; ++m) {
-				if (!spaces[s].motor[m]->active)
-					continue;
-				cpdebug(s, m, "sending %d %d", current_fragment, current_fragment_pos);
-				//debug("sending %d %d cf %d cp 0x%x", s, m, current_fragment, current_fragment_pos);
-				while (out_busy >= 3) {
-					poll(&pollfds[BASE_FDS], 1, -1);
-					serial(1);
-				}
-				if (stop_pending || discard_pending)
-					break;
-				avr_buffer[0] = settings.single ? HWC_MOVE_SINGLE : HWC_MOVE;
-				avr_buffer[1] = mi + m;
-				for (int i = 0; i < cfp; ++i) {
-					int value = (spaces[s].motor[m]->dir_pin.inverted() ? -1 : 1) * spaces[s].motor[m]->avr_data[i];
-					avr_buffer[2 + 2 * i] = value & 0xff;
-					avr_buffer[2 + 2 * i + 1] = (value >> 8) & 0xff;
-				}
-				if (prepare_packet(avr_buffer, 2 + 2 * cfp)) {
-					avr_cb = &avr_sent_fragment;
-					avr_send();
+	int cfp = current_fragment_pos;
+	// With protocol version 4, the samples are packed; the worst case is 1 byte per sample more than raw.
+	int stride = serial_protocol >= 4 ? 3 + 3 * cfp : 2 + 2 * cfp;
+	if ((num_active_motors + 1) * stride > avr_fragment_size) {
+		delete[] avr_fragment_buffer;
+		delete[] avr_fragment_len;
+		avr_fragment_size = (num_active_motors + 1) * stride;
+		avr_fragment_buffer = new char[avr_fragment_size];
+		avr_fragment_len = new int[num_active_motors + 1];
+	}
+	avr_fragment_stride = stride;
+	char *packet = avr_fragment_buffer;
+	packet[0] = settings.probing ? HWC_START_PROBE : HWC_START_MOVE;
+	packet[1] = cfp * 2;
+	packet[2] = num_active_motors;
+	avr_fragment_len[0] = 3;
+	if (serial_protocol >= 4) {
+		// Sample period of this fragment.
+		packet[3] = settings.sample_step & 0xff;
+		packet[4] = (settings.sample_step >> 8) & 0xff;
+		avr_fragment_len[0] = 5;
+	}
+	avr_fragment_packets = 1;
+	int mi = 0;
+	for (int s = 0; s < NUM_SPACES; mi += spaces[s++].num_motors) {
+		for (uint8_t m = 0; m < spaces[s].num_motors; ++m) {
+			if (!spaces[s].motor[m]->active)
+				continue;
+			cpdebug(s, m, "sending %d %d", current_fragment, current_fragment_pos);
+			//debug("sending %d %d cf %d cp 0x%x", s, m, current_fragment, current_fragment_pos);
+			packet = &avr_fragment_buffer[avr_fragment_packets * stride];
+			packet[0] = settings.single ? HWC_MOVE_SINGLE : HWC_MOVE;
+			packet[1] = mi + m;
+			if (serial_protocol >= 4) {
+				int value[256 / sizeof(DATA_TYPE)];	// BYTES_PER_FRAGMENT is a uint8_t.
+				for (int i = 0; i < cfp; ++i)
+					value[i] = (spaces[s].motor[m]->dir_pin.inverted() ? -1 : 1) * spaces[s].motor[m]->avr_data[i];
+				int len = avr_pack_samples(&packet[3], value, 0, cfp, false, true);
+				if (len > 2 * cfp + (cfp + 31) / 32)
+					len = avr_pack_samples(&packet[3], value, 0, cfp, true, false);
+				if (3 + len >= COMMAND_SIZE) {
+					debug("BUG: packed samples do not fit in a packet: %d bytes for %d samples", len, cfp);
+					abort();
 				}
-				else
-					break;
+				packet[2] = uint8_t(len);
+				avr_fragment_len[avr_fragment_packets++] = 3 + len;
+				continue;
 			}
+			for (int i = 0; i < cfp; ++i) {
+				int value = (spaces[s].motor[m]->dir_pin.inverted() ? -1 : 1) * spaces[s].motor[m]->avr_data[i];
+				packet[2 + 2 * i] = value & 0xff;
+				packet[2 + 2 * i + 1] = (value >> 8) & 0xff;
+			}
+			avr_fragment_len[avr_fragment_packets++] = stride;
 		}
-		transmitting_fragment = false;
 	}
-	avr_filling = false;
-	return !host_block && !stopping && !discard_pending && !stop_pending;
+	avr_fragment_sent = 0;
+	sending_fragment = avr_fragment_packets;
+	transmitting_fragment = true;
+	avr_filling = true;
+	avr_continue_fragment();
+	return true;
 } // }}}
 
 void arch_start_move(int extra) { // {{{
 	if (host_block)
 		return;
-	if (!avr_connected || preparing || sending_fragment || out_busy >= 3) {
+	if (!avr_connected || sending_fragment || out_busy >= serial_window) {
 		//debug("no start yet");
 		start_pending = true;
 		return;
@@ -1254,15 +1444,10 @@ void arch_start_move(int extra) { // {{{
 		return;
 	}
 	//debug("start move %d %d %d %d", current_fragment, running_fragment, sending_fragment, extra);
-	while (out_busy >= 3) {
-		poll(&pollfds[BASE_FDS], 1, -1);
-		serial(1);
-	}
 	start_pending = false;
 	avr_running = true;
 	avr_buffer[0] = HWC_START;
-	if (prepare_packet(avr_buffer, 1))
-		avr_send();
+	avr_queue_send(1);
 } // }}}
 
 bool arch_running() { // {{{
@@ -1273,10 +1458,6 @@ void arch_home() { // {{{
 	if (!avr_connected)
 		return;
 	avr_homing = true;
-	while (out_busy >= 3) {
-		poll(&pollfds[BASE_FDS], 1, -1);
-		serial(1);
-	}
 	avr_buffer[0] = HWC_HOME;
 	int speed = 10000;	// μs/step.
 	for (int i = 0; i < 4; ++i)
@@ -1294,8 +1475,7 @@ void arch_home() { // {{{
 			}
 		}
 	}
-	if (prepare_packet(avr_buffer, 5 + avr_active_motors))
-		avr_send();
+	avr_queue_send(5 + avr_active_motors);
 } // }}}
 
 void arch_stop_audio() { // {{{
@@ -1316,38 +1496,44 @@ off_t arch_send_audio(uint8_t *map, off_t pos, off_t max, int motor) { // {{{
 		arch_globals_change();
 	}
 	int len = max - pos >= NUM_MOTORS * BYTES_PER_FRAGMENT ? BYTES_PER_FRAGMENT : (max - pos) / NUM_MOTORS;
+	if (serial_protocol >= 4 && len > 2 * AVR_PACKED_SAMPLES)
+		len = 2 * AVR_PACKED_SAMPLES;
 	if (len <= 0)
 		return max;
-	while (out_busy >= 3) {
-		poll(&pollfds[BASE_FDS], 1, -1);
-		serial(1);
-	}
+	// The packets are queued; sending_fragment keeps the next upload back until they have all been acknowledged.
 	avr_buffer[0] = HWC_START_MOVE;
 	avr_buffer[1] = len;
 	avr_buffer[2] = NUM_MOTORS;
+	avr_buffer[3] = audio_hwtime_step & 0xff;
+	avr_buffer[4] = (audio_hwtime_step >> 8) & 0xff;
 	sending_fragment = NUM_MOTORS + 1;
-	if (!prepare_packet(avr_buffer, 3)) {
-		debug("audio upload failed");
-		return pos + NUM_MOTORS * len;
-	}
 	avr_cb = &avr_sent_fragment;
-	avr_send();
+	avr_queue_send(serial_protocol >= 4 ? 5 : 3);
 	avr_filling = true;
 	for (int m = 0; m < NUM_MOTORS; ++m) {
-		while (out_busy >= 3) {
-			poll(&pollfds[BASE_FDS], 1, -1);
-			serial(1);
-		}
 		avr_buffer[0] = HWC_MOVE_SINGLE;
 		avr_buffer[1] = m;
-		for (int i = 0; i < len; ++i)
-			avr_buffer[2 + i] = map[pos + m * len + i];
-		if (!prepare_packet(avr_buffer, 2 + len)) {
-			debug("audio data upload failed");
-			break;
+		int packet_len;
+		if (serial_protocol >= 4) {
+			// Send the bits as full samples, which the firmware stores unchanged.
+			int value[256 / sizeof(DATA_TYPE)];
+			for (int i = 0; i < len / 2; ++i)
+				value[i] = int16_t(map[pos + m * len + 2 * i] | (map[pos + m * len + 2 * i + 1] << 8));
+			int packed = avr_pack_samples(&avr_buffer[3], value, 0, len / 2, true, false);
+			if (3 + packed >= COMMAND_SIZE) {
+				debug("BUG: packed audio does not fit in a packet: %d bytes for %d samples", packed, len / 2);
+				abort();
+			}
+			avr_buffer[2] = uint8_t(packed);
+			packet_len = 3 + packed;
+		}
+		else {
+			for (int i = 0; i < len; ++i)
+				avr_buffer[2 + i] = map[pos + m * len + i];
+			packet_len = 2 + len;
 		}
 		avr_cb = &avr_sent_fragment;
-		avr_send();
+		avr_queue_send(packet_len);
 	}
 	avr_filling = false;
 	return pos + NUM_MOTORS * len;
@@ -1355,11 +1541,10 @@ off_t arch_send_audio(uint8_t *map, off_t pos, off_t max, int motor) { // {{{
 
 void arch_do_discard() { // {{{
 	int cbs = 0;
-	while (out_busy >= 3) {
-		poll(&pollfds[BASE_FDS], 1, -1);
-		serial(1);
-	}
-	if (!discard_pending)
+	if (transmitting_fragment || !discard_pending)
+		return;
+	// The discard must reach the firmware before it runs the fragments it removes, so it is not queued; serial_acked retries it.
+	if (out_busy >= serial_window || avr_queue_head)
 		return;
 	discard_pending = false;
 	int fragments = (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
@@ -1368,19 +1553,18 @@ void arch_do_discard() { // {{{
 	for (int i = 0; i < fragments - 2; ++i) {
 		current_fragment = (current_fragment - 1 + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
 		//debug("current_fragment = (current_fragment - 1 + FRAGMENTS_PER_BUFFER) %% FRAGMENTS_PER_BUFFER; %d", current_fragment);
-		//debug("restoring %d %d", current_fragment, history[current_fragment].cbs);
-		cbs += history[current_fragment].cbs;
+		//debug("restoring %d %d", current_fragment, history(current_fragment).cbs);
+		cbs += history(current_fragment).cbs;
 	}
 	restore_settings();
-	history[(current_fragment - 1 + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER].cbs += cbs + cbs_after_current_move;
+	history((current_fragment - 1 + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER).cbs += cbs + cbs_after_current_move;
 	//debug("cbs after current cleared after setting %d+%d in history", cbs, cbs_after_current_move);
 	cbs_after_current_move = 0;
 	avr_buffer[0] = HWC_DISCARD;
 	avr_buffer[1] = fragments - 2;
 	// We're in the middle of a move again, so make sure the computation is restarted.
 	computing_move = true;
-	if (prepare_packet(avr_buffer, 2))
-		avr_send();
+	avr_queue_send(2);
 } // }}}
 
 void arch_discard() { // {{{
@@ -1395,16 +1579,11 @@ void arch_discard() { // {{{
 void arch_send_spi(int bits, uint8_t *data) { // {{{
 	if (!avr_connected)
 		return;
-	while (out_busy >= 3) {
-		poll(&pollfds[BASE_FDS], 1, -1);
-		serial(1);
-	}
 	avr_buffer[0] = HWC_SPI;
 	avr_buffer[1] = bits;
 	for (int i = 0; i * 8 < bits; ++i)
 		avr_buffer[2 + i] = data[i];
-	if (prepare_packet(avr_buffer, 2 + (bits + 7) / 8))
-		avr_send();
+	avr_queue_send(2 + (bits + 7) / 8);
 } // }}}
 // }}}
 
@@ -1436,6 +1615,9 @@ void AVRSerial::begin(char const *port) { // {{{
 		pid_t pid = fork();
 		if (!pid) {
 			// Child.
+			sigset_t mask;
+			sigemptyset(&mask);
+			sigprocmask(SIG_SETMASK, &mask, NULL);
 			close(pipes[0]);
 			dup2(pipes[1], 0);
 			dup2(pipes[1], 1);
@@ -1460,6 +1642,8 @@ void AVRSerial::begin(char const *port) { // {{{
 	pollfds[BASE_FDS].revents = 0;
 	start = 0;
 	end_ = 0;
+	outlen = 0;
+	pending.clear();
 	fcntl(fd, F_SETFL, O_NONBLOCK);
 } // }}}
 
@@ -1471,17 +1655,71 @@ void AVRSerial::write(char c) { // {{{
 		debug("writing to serial while not connected");
 		abort();
 	}
-	while (true) {
-		errno = 0;
-		int ret = ::write(fd, &c, 1);
-		if (ret == 1)
-			break;
-		if (errno != EAGAIN && errno != EWOULDBLOCK) {
-			debug("write to avr failed: %d %s", ret, strerror(errno));
-			disconnect(true);
-			return;	// This causes protocol errors during reconnect, but they will be handled.
+	if (outlen >= int(sizeof(outbuffer)))
+		flush();
+	outbuffer[outlen++] = c;
+} // }}}
+
+void AVRSerial::write(char const *data, int len) { // {{{
+#ifdef DEBUG_AVRCOMM
+	for (int i = 0; i < len; ++i)
+		debug("w\t%02x", data[i] & 0xff);
+#endif
+	if (!avr_connected) {
+		debug("writing to serial while not connected");
+		abort();
+	}
+	if (outlen + len <= int(sizeof(outbuffer))) {
+		memcpy(&outbuffer[outlen], data, len);
+		outlen += len;
+		return;
+	}
+	send(data, len);
+} // }}}
+
+void AVRSerial::flush() { // {{{
+	if ((outlen == 0 && pending.empty()) || !avr_connected)
+		return;
+	send(NULL, 0);
+} // }}}
+
+void AVRSerial::send(char const *data, int len) { // {{{
+	// Send pending, buffered and new data in one call.  What the port does not accept now is kept until poll reports room; the main loop flushes it.
+	struct iovec iov[3];
+	int n = 0;
+	if (!pending.empty()) {
+		iov[n].iov_base = const_cast <char *>(pending.data());
+		iov[n++].iov_len = pending.size();
+	}
+	if (outlen > 0) {
+		iov[n].iov_base = outbuffer;
+		iov[n++].iov_len = outlen;
+	}
+	if (len > 0) {
+		iov[n].iov_base = const_cast <char *>(data);
+		iov[n++].iov_len = len;
+	}
+	outlen = 0;
+	struct iovec w[3];	// write_some changes the iovecs.
+	memcpy(w, iov, sizeof(w));
+	ssize_t ret = write_some(fd, w, n);
+	if (ret < 0) {
+		debug("write to avr failed: %s", strerror(errno));
+		pending.clear();
+		disconnect(true);	// This causes protocol errors during reconnect, but they will be handled.
+		return;
+	}
+	std::string rest;
+	for (int i = 0; i < n; ++i) {
+		if (size_t(ret) >= iov[i].iov_len) {
+			ret -= iov[i].iov_len;
+			continue;
 		}
+		rest.append(reinterpret_cast <char *>(iov[i].iov_base) + ret, iov[i].iov_len - ret);
+		ret = 0;
 	}
+	pending.swap(rest);
+	pollfds[BASE_FDS].events = pending.empty() ? POLLIN | POLLPRI : POLLIN | POLLPRI | POLLOUT;
 } // }}}
 
 void AVRSerial::refill() { // {{{
@@ -1494,7 +1732,7 @@ void AVRSerial::refill() { // {{{
 			debug("read returned error: %s", strerror(errno));
 		end_ = 0;
 	}
-	if (end_ == 0 && pollfds[BASE_FDS].revents) {
+	if (end_ == 0 && (pollfds[BASE_FDS].revents & ~POLLOUT)) {
 		debug("EOF detected on serial port; waiting for reconnect.");
 		disconnect(true);
 	}
@@ -121,6 +121,7 @@ struct bbb_Pru { // {{{
 	volatile uint16_t base, dirs;
 	// These must be bytes, because read and write must be atomic.
 	volatile uint8_t current_sample, current_fragment, next_fragment, state;
+	volatile uint16_t period[FRAGMENTS_PER_BUFFER];	// Sample period, in the units of TICK_US - 5 in bbb_pru.asm.
 	volatile uint16_t buffer[FRAGMENTS_PER_BUFFER][SAMPLES_PER_FRAGMENT][2];
 } __attribute__ ((packed)); // }}}
 
@@ -421,6 +422,8 @@ void arch_setup_start() { // {{{
 #endif
 	// Override hwtime_step.
 	hwtime_step = 40;
+	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f)
+		bbb_pru->period[f] = hwtime_step - 5;
 	// Claim that firmware has correct version.
 	protocol_version = PROTOCOL_VERSION;
 	for (int i = 0; i < NUM_DIGITAL_PINS + NUM_ANALOG_INPUTS; ++i) {
@@ -547,18 +550,17 @@ int arch_tick() { // {{{
 		debug("cf=%d, runn=%d", cf, running_fragment);
 		int cbs = 0;
 		while (cf != running_fragment) {
-			cbs += history[running_fragment].cbs;
-			history[running_fragment].cbs = 0;
+			cbs += history(running_fragment).cbs;
+			history(running_fragment).cbs = 0;
+			run_file_fire_events(running_fragment);
 			running_fragment = (running_fragment + 1) % FRAGMENTS_PER_BUFFER;
 		}
 		if (cbs)
 			send_host(CMD_MOVECB, cbs);
 		buffer_refill();
 		run_file_fill_queue();
-		if (!computing_move && run_file_finishing) {
-			send_host(CMD_FILE_DONE);
-			abort_run_file();
-		}
+		if (!computing_move && run_file_finishing)
+			run_file_done();
 	}
 	// Handle temps and check temp limits.
 	if (bbb_active_temp >= 0) {
@@ -748,6 +750,7 @@ void arch_start_move(int extra) { // {{{
 bool arch_send_fragment() { // {{{
 	if (stopping)
 		return false;
+	bbb_pru->period[current_fragment] = settings.sample_step - 5;
 	bbb_pru->next_fragment = (bbb_pru->next_fragment + 1) & BBB_PRU_FRAGMENT_MASK;
 	return true;
 } // }}}
@@ -826,6 +829,20 @@ double arch_round_pos(int space, int motor, double src) { // {{{
 	(void)&motor;
 	return src;
 } // }}}
+
+int arch_sample_factor(double rate) { // {{{
+	// Longest sample period (as a multiple of hwtime_step) for a peak step rate [steps/s].
+	// The pru does at most one step per sample.
+	double factor = 1 / (rate * hwtime_step / 1e6);
+	if (!(factor < MAX_SAMPLE_FACTOR))
+		return MAX_SAMPLE_FACTOR;
+	return factor < 1 ? 1 : int(factor);
+} // }}}
+
+int arch_max_sample_steps(int period) { // {{{
+	(void)&period;
+	return 1;
+} // }}}
 // }}}
 #endif
 
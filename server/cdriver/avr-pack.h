@@ -0,0 +1,194 @@
+/* avr-pack.h - Sample packing for the avr firmware in Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _AVR_PACK_H
+#define _AVR_PACK_H
+
+// The encoder for firmware/unpack.h.  This is included by arch-avr.h and by
+// the round-trip test (pack-test.cpp).
+
+#include <stdint.h>
+#include <math.h>
+
+static int avr_run_length(int const *value, int pos, int num) { // {{{
+	// Number of samples from pos that can be sent as a run of zeros or repeats.
+	int zeros = 0;
+	while (pos + zeros < num && value[pos + zeros] == 0)
+		zeros += 1;
+	int repeats = 0;
+	while (pos > 0 && pos + repeats < num && value[pos + repeats] == value[pos - 1])
+		repeats += 1;
+	return zeros > repeats ? zeros : repeats;
+} // }}}
+
+static int avr_fit_quadratic(int const *value, int start, int num, uint32_t *coef) { // {{{
+	// Find a start fraction, speed and acceleration from which the firmware computes these samples.
+	// Return the number of samples from start that it computes correctly.
+	// The position after k samples is c + v * k + a * k * (k - 1) / 2; fit it to the middle of each step.
+	double m[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+	double r[3] = {0, 0, 0};
+	double y = .5;
+	for (int k = 0; k <= num; ++k) {
+		if (k > 0)
+			y += value[start + k - 1];
+		double b[3] = {1, double(k), k * (k - 1) / 2.};
+		for (int i = 0; i < 3; ++i) {
+			r[i] += b[i] * y;
+			for (int j = 0; j < 3; ++j)
+				m[i][j] += b[i] * b[j];
+		}
+	}
+	double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	if (det == 0)
+		return 0;
+	double fit[3];
+	for (int c = 0; c < 3; ++c) {
+		// Cramer's rule.
+		double t[3][3];
+		for (int i = 0; i < 3; ++i) {
+			for (int j = 0; j < 3; ++j)
+				t[i][j] = j == c ? r[i] : m[i][j];
+		}
+		fit[c] = (t[0][0] * (t[1][1] * t[2][2] - t[1][2] * t[2][1]) - t[0][1] * (t[1][0] * t[2][2] - t[1][2] * t[2][0]) + t[0][2] * (t[1][0] * t[2][1] - t[1][1] * t[2][0])) / det;
+	}
+	if (fabs(fit[1]) >= 0x7fff || fabs(fit[2]) >= 0x7fff)
+		return 0;
+	// Try the fitted start position, and the middle of the step.
+	int best = 0;
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		double frac = attempt == 0 ? fit[0] - floor(fit[0]) : .5;
+		uint32_t c[3] = {uint32_t(frac * 0x10000) & 0xffff, uint32_t(int32_t(round(fit[1] * 0x10000))), uint32_t(int32_t(round(fit[2] * 0x10000)))};
+		// Compute the samples like the firmware does; unsigned, so it wraps the same way.
+		uint32_t x = c[0];
+		uint32_t v = c[1];
+		int k;
+		for (k = 0; k < num; ++k) {
+			uint16_t old = x >> 16;
+			x += v;
+			v += c[2];
+			if (int16_t(uint16_t(x >> 16) - old) != value[start + k])
+				break;
+		}
+		if (k > best) {
+			best = k;
+			for (int i = 0; i < 3; ++i)
+				coef[i] = c[i];
+			if (k == num)
+				break;
+		}
+	}
+	return best;
+} // }}}
+
+int avr_pack_samples(char *target, int const *value, int start, int num, bool raw, bool quadratic) { // {{{
+	// Encode samples start to num for HWC_MOVE with protocol version 4.  Return the number of bytes.
+	// The data is a list of runs, each starting with a byte that holds the type and length-1:
+	// 00nnnnnn: zeros; 01nnnnnn: copies of the previous sample;
+	// 10nnnnnn: 4 bit signed differences with the previous sample, two per byte, low nybble first;
+	// 110nnnnn: 8 bit signed differences; 111nnnnn: 16 bit little endian samples.
+	// A single zero is never sent as a run; 0x00 starts a quadratic run instead.  It is followed by
+	// a byte with length-1, a 16 bit start fraction, 32 bit speed and 32 bit acceleration, all in
+	// steps per sample with 16 fractional bits; the firmware integrates them into samples.
+	// If raw is true, only full samples are used.
+	int pos = 0;
+	int i = start;
+	while (i < num) {
+		int run = raw ? 0 : avr_run_length(value, i, num);
+		if (run >= 2) {
+			if (run > 64)
+				run = 64;
+			target[pos++] = (value[i] == 0 ? 0 : 0x40) | (run - 1);
+			i += run;
+			continue;
+		}
+		if (quadratic && !raw) {
+			// A quadratic run takes 12 bytes, so it is only useful for at least 6 samples.
+			// Try at most a few lengths, so the cost stays linear in the number of samples.
+			int n = num - i < 64 ? num - i : 64;
+			int done = 0;
+			for (int attempt = 0; attempt < 4 && n >= 6; ++attempt) {
+				uint32_t coef[3];
+				int k = avr_fit_quadratic(value, i, n, coef);
+				if (k < n) {
+					n = k >= 6 ? k : n / 2;
+					continue;
+				}
+				char other[3 * 64];
+				if (avr_pack_samples(other, value, i, i + n, false, false) <= 12)
+					break;
+				target[pos++] = 0;
+				target[pos++] = n - 1;
+				for (int c = 0; c < 3; ++c) {
+					for (int b = 0; b < (c == 0 ? 2 : 4); ++b)
+						target[pos++] = (coef[c] >> (8 * b)) & 0xff;
+				}
+				done = n;
+				break;
+			}
+			if (done > 0) {
+				i += done;
+				continue;
+			}
+		}
+		// Count how many samples fit in small differences, until a run starts.
+		int n4 = 0, n8 = 0;
+		for (int j = i; !raw && j < num && n8 < 32; ++j) {
+			int diff = value[j] - (j > 0 ? value[j - 1] : 0);
+			if (diff < -128 || diff > 127 || (j > i && avr_run_length(value, j, num) >= 3))
+				break;
+			if (n4 == n8 && diff >= -8 && diff < 8)
+				n4 += 1;
+			n8 += 1;
+		}
+		if (n4 >= 2 || (n4 == 1 && n8 == 1)) {
+			if (n4 > 64)
+				n4 = 64;
+			target[pos++] = 0x80 | (n4 - 1);
+			for (int k = 0; k < n4; ++k) {
+				int diff = (value[i + k] - (i + k > 0 ? value[i + k - 1] : 0)) & 0xf;
+				if (k & 1)
+					target[pos - 1] |= diff << 4;
+				else
+					target[pos++] = diff;
+			}
+			i += n4;
+			continue;
+		}
+		if (n8 > 0) {
+			target[pos++] = 0xc0 | (n8 - 1);
+			for (int k = 0; k < n8; ++k)
+				target[pos++] = value[i + k] - (i + k > 0 ? value[i + k - 1] : 0);
+			i += n8;
+			continue;
+		}
+		// Send full samples until a difference is small enough.
+		int n = 0;
+		while (i + n < num && n < 32 && (n == 0 || raw || value[i + n] - value[i + n - 1] < -128 || value[i + n] - value[i + n - 1] > 127))
+			n += 1;
+		target[pos++] = 0xe0 | (n - 1);
+		for (int k = 0; k < n; ++k) {
+			target[pos++] = value[i + k] & 0xff;
+			target[pos++] = (value[i + k] >> 8) & 0xff;
+		}
+		i += n;
+	}
+	return pos;
+} // }}}
+
+#endif
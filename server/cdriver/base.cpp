@@ -66,8 +66,9 @@ int main(int argc, char **argv) { // {{{
 	zero.it_value.tv_sec = 0;
 	zero.it_value.tv_nsec = 0;
 	int delay = 0;
+	refill_pending = false;
 	while (true) {
-		for (int i = 0; i < 2 + arch_fds(); ++i)
+		for (int i = 0; i < BASE_FDS + arch_fds(); ++i)
 			pollfds[i].revents = 0;
 		while (true) {
 			bool action = false;
@@ -78,8 +79,12 @@ int main(int argc, char **argv) { // {{{
 			if (!action)
 				break;
 		}
+		// Nothing should be left in the output buffers, but make sure it isn't kept there while waiting.
+		serialdev[0]->flush();
+		if (arch_fds() && serialdev[1])
+			serialdev[1]->flush();
 		//debug("polling %d %d %d", host_block, arch_fds(), delay);
-		poll(host_block ? &pollfds[2] : pollfds, arch_fds() + (host_block ? 0 : 2), delay);
+		poll(host_block ? &pollfds[BASE_FDS] : pollfds, arch_fds() + (host_block ? 0 : BASE_FDS), delay);
 		//debug("return %d %d %d", pollfds[0].revents, pollfds[1].revents, pollfds[2].revents);
 		if (pollfds[0].revents) {
 			timerfd_settime(pollfds[0].fd, 0, &zero, NULL);
@@ -90,6 +95,17 @@ int main(int argc, char **argv) { // {{{
 		}
 		if (pollfds[1].revents)
 			serial(0);
+		if (pollfds[3].revents)
+			run_system_output();
+		if (pollfds[2].revents)
+			run_system_exit();
 		delay = arch_tick();
+		if (refill_pending) {
+			// Continue filling the buffer, but don't wait in poll while there is work to do.
+			refill_pending = false;
+			buffer_refill();
+			if (refill_pending)
+				delay = 0;
+		}
 	}
 } // }}}
@@ -63,14 +63,14 @@ skip1:
 	; wait for enough time to allow next tick.
 	wait_for_tick
 	qbne mainloop, r5, 0
-	mov r5, TICK_US - 5
+	; r5 is reloaded with the sample period below.
 
 	; data is at buffer[fragment][sample][which] with sample array 256 elements, which array 2 elements and 2 bytes per element.
 	; So that's buffer_start + fragment * 256 * 2 * 2 + sample * 2 * 2 + which * 2; I want both which values.
 	lsl r6, r4.b1, 10
 	lsl r7, r4.b0, 2
 	add r6, r6, r7
-	add r6, r6, 8	; buffer start.
+	add r6, r6, 24	; buffer start.
 	lbco r7, CONST_OWN_DATA, r6, 4
 	xor r3.w2, r3.w2, r3.w0	; Apply base to dirs
 	xor r7.w0, r7.w0, r3.w0	; Apply base to neg
@@ -98,6 +98,10 @@ skip1:
 	qbne skip2, r4.b1, r4.b2
 	mov r4.b3, 1
 skip2:
+	; load the sample period of the current fragment; it is at 8 + fragment * 2.
+	lsl r6, r4.b1, 1
+	add r6, r6, 8
+	lbco r5, CONST_OWN_DATA, r6, 2
 	sbco r4, CONST_OWN_DATA, 4, 4
 	; if state == 2: state = 0
 	qbne mainloop, r4.b3, 2
@@ -21,6 +21,7 @@
 #define _CDRIVER_H
 
 #include "configuration.h"
+#include "runfile.h"
 #include <stdio.h>
 #include <math.h>
 #include <stdarg.h>
@@ -28,11 +29,13 @@
 #include <poll.h>
 #include <sys/types.h>
 #include <sys/timerfd.h>
+#include <sys/uio.h>
 
-#define PROTOCOL_VERSION ((uint32_t)3)	// Required version response in BEGIN.
+#define PROTOCOL_VERSION ((uint32_t)4)	// Newest supported version response in BEGIN.
+#define MIN_PROTOCOL_VERSION ((uint32_t)3)	// Oldest supported version response in BEGIN.
 #define ID_SIZE 8
 #define UUID_SIZE 16
-#define BASE_FDS 2
+#define BASE_FDS 4	// Timer, host, exited system commands, system command output.
 
 #define MAXLONG (int32_t((uint32_t(1) << 31) - 1))
 #define MAXINT MAXLONG
@@ -99,6 +102,18 @@ enum SingleByteCommands {	// See serial.cpp for computation of command values. {
 	CMD_STALLACK = 0x8f     // Clear stall.
 }; // }}}
 
+enum SerialFrame {	// Protocol version 4 frames; see serial.cpp. {{{
+	FRAME_END = 0xc0,
+	FRAME_ESC = 0xdb,
+	FRAME_ESC_END = 0xdc,
+	FRAME_ESC_ESC = 0xdd,
+	FRAME_DATA = 0x00,
+	FRAME_ACK = 0x40,
+	FRAME_NACK = 0x80,
+	FRAME_STALL = 0xc0,
+	FRAME_SEQ_MASK = 0x3f
+}; // }}}
+
 extern const SingleByteCommands cmd_ack[4];
 extern const SingleByteCommands cmd_nack[4];
 extern const SingleByteCommands cmd_stall[4];
@@ -239,12 +254,16 @@ struct History {
 	double t0, tp;
 	double f0, f1, f2, fp, fq, fmain;
 	int32_t hwtime, start_time, last_time, last_current_time;
+	int sample_step;	// Sample period of the current fragment [μs].
 	int cbs;
 	int queue_start, queue_end;
 	bool queue_full;
-	int run_file_current;
+	int run_file_current;	// Next record to decode.
+	int run_file_record;	// First record of the current move, or -1.
+	int run_file_events;	// First in-band event record that is not attached to a move yet, or -1.
 	bool probing, single;
 	double run_time, run_dist;
+	double end_v;	// Planned speed at end of current segment, from lookahead [mm/s].
 };
 
 struct Space_History {
@@ -260,9 +279,11 @@ struct Space_History {
 
 struct Motor_History {
 	double last_v;		// v during last iteration, for using limit_a [m/s].
+	double last_a;		// a during last iteration, for using limit_j [m/s^2].
 	double target_v, target_dist;	// Internal values for moving.
 	double current_pos;	// Current position of motor (in steps), and (cast to int) what the hardware currently thinks.
 	double endpos;
+	double end_v;		// Planned speed when reaching endpos, from lookahead [units/s].
 };
 
 struct Axis_History {
@@ -270,11 +291,13 @@ struct Axis_History {
 	double source, current;	// Source position of current movement of axis (in μm), or current position if there is no movement.
 	double target;
 	double endpos[2];
+	double run_offset;	// Position minus run file position; changed by SETPOS records during motion.
 };
 
 struct Axis {
-	Axis_History *history;
+	int history_offset;	// Position of this axis' record in a history snapshot, or -1 if it has none yet.
 	Axis_History settings;
+	inline Axis_History &history(int fragment);
 	double park;		// Park position; not used by the firmware, but stored for use by the host.
 	uint8_t park_order;
 	double min_pos, max_pos;
@@ -282,8 +305,9 @@ struct Axis {
 };
 
 struct Motor {
-	Motor_History *history;
+	int history_offset;	// Position of this motor's record in a history snapshot, or -1 if it has none yet.
 	Motor_History settings;
+	inline Motor_History &history(int fragment);
 	Pin_t step_pin;
 	Pin_t dir_pin;
 	Pin_t enable_pin;
@@ -293,6 +317,7 @@ struct Motor {
 	double home_pos;	// Position of motor (in μm) when the home switch is triggered.
 	bool active;
 	double limit_v, limit_a;		// maximum value for f [m/s], [m/s^2].
+	double limit_j;		// maximum jerk [m/s^3]; INFINITY for trapezoidal profiles.
 	uint8_t home_order;
 	ARCH_MOTOR
 };
@@ -301,6 +326,8 @@ struct Space;
 
 struct SpaceType {
 	void (*xyz2motors)(Space *s, double *motors);
+	// Same for n samples at once.  target has a row of n values per axis, motors gets a row per motor; they must not overlap.  Returns false if it cannot be used for these targets; xyz2motors must be used instead.
+	bool (*xyz2motors_n)(Space *s, int n, double const *__restrict target, double *__restrict motors);
 	void (*reset_pos)(Space *s);
 	void (*check_position)(Space *s, double *data);
 	void (*load)(Space *s, uint8_t old_type, int32_t &addr);
@@ -315,8 +342,8 @@ struct SpaceType {
 };
 
 struct Space {
-	Space_History *history;
 	Space_History settings;
+	inline Space_History &history(int fragment);
 	void *type_data;
 	Motor **motor;
 	Axis **axis;
@@ -375,10 +402,14 @@ struct MoveCommand {
 	bool arc;
 	double center[3];
 	double normal[3];
+	int record;	// First run file record of this move, or -1.
+	int events;	// First record of the in-band events before this move, or -1.
 };
 
+// Writes are buffered; flush() must be called when a message is complete.
 struct Serial_t {
 	virtual void write(char c) = 0;
+	virtual void write(char const *data, int len) = 0;
 	virtual int read() = 0;
 	virtual int readBytes (char *target, int len) = 0;
 	virtual void flush() = 0;
@@ -388,8 +419,11 @@ struct Serial_t {
 struct HostSerial : public Serial_t {
 	char buffer[256];
 	int start, end;
+	char outbuffer[256];
+	int outlen;
 	void begin();
 	void write(char c);
+	void write(char const *data, int len);
 	void refill();
 	int read();
 	int readBytes (char *target, int len) {
@@ -397,13 +431,18 @@ struct HostSerial : public Serial_t {
 			*target++ = read();
 		return len;
 	}
-	void flush() {}
+	void flush();
 	int available();
 };
 EXTERN HostSerial host_serial;
 
 #define COMMAND_SIZE 256
 #define FULL_SERIAL_COMMAND_SIZE (COMMAND_SIZE + (COMMAND_SIZE + 2) / 3)
+#define SERIAL_TIMEOUT 100	// Time in ms without data from the firmware after which unacked packets are resent.
+#define SERIAL_FRAME_SIZE (2 * (COMMAND_SIZE + 3) + 2)	// Protocol version 4 frame, if every byte is escaped.
+#if SERIAL_WINDOW < 4 || SERIAL_WINDOW > 32 || (SERIAL_WINDOW & (SERIAL_WINDOW - 1)) != 0
+#error "SERIAL_WINDOW must be a power of two between 4 and 32"
+#endif
 #define HOST_COMMAND_SIZE 0x4000
 static int const FULL_COMMAND_SIZE[2] = {HOST_COMMAND_SIZE, FULL_SERIAL_COMMAND_SIZE};
 
@@ -440,17 +479,23 @@ EXTERN int cbs_after_current_move;
 EXTERN bool motors_busy;
 EXTERN int out_busy;
 EXTERN int32_t out_time;
-EXTERN char pending_packet[4][FULL_SERIAL_COMMAND_SIZE];
-EXTERN int pending_len[4];
-EXTERN void (*serial_cb[4])();
+EXTERN char pending_packet[SERIAL_WINDOW][SERIAL_FRAME_SIZE];
+EXTERN int pending_len[SERIAL_WINDOW];
+EXTERN void (*serial_cb[SERIAL_WINDOW])();
 EXTERN char datastore[HOST_COMMAND_SIZE];
 EXTERN int32_t last_active;
 EXTERN int32_t last_micros;
 EXTERN int16_t led_phase;
-EXTERN History *history;
+// Planner state at the start of every fragment.  Each snapshot is one contiguous block: History, then Space_History for all spaces, then the Axis_History and Motor_History records at their history_offset.
+// Every fragment's snapshot is followed by checkpoints_per_fragment more, taken every CHECKPOINT_INTERVAL samples.
+EXTERN char *history_ring;
+EXTERN int snapshot_size;
+EXTERN int checkpoints_per_fragment;
+EXTERN int *num_checkpoints;	// Number of valid checkpoints for each fragment.
+EXTERN int (*fragment_events)[2];	// Run file records [first, end) with in-band events that fire when each fragment has been played; first is -1 if there are none.
 EXTERN History settings;
 EXTERN bool computing_move;	// True as long as steps are sent to firmware.
-EXTERN bool aborting, prepared, preparing;
+EXTERN bool aborting, prepared;
 EXTERN int first_fragment;
 EXTERN int stopping;		// From limit.
 EXTERN int sending_fragment;
@@ -489,7 +534,7 @@ void buffered_debug(char const *fmt, ...);
 void packet();	// A command packet has arrived; handle it.
 void settemp(int which, double target);
 void waittemp(int which, double mintemp, double maxtemp);
-void setpos(int which, int t, double f);
+void setpos(int which, int t, double f, bool keep_offset = false);
 
 // serial.cpp
 bool serial(uint8_t which);	// Handle commands from serial.
@@ -498,8 +543,12 @@ void send_packet();
 void write_ack();
 void write_nack();
 void send_host(char cmd, int s = 0, int m = 0, double f = 0, int e = 0, unsigned len = 0);
+ssize_t write_some(int fd, struct iovec *iov, int iovcnt);
 EXTERN uint8_t ff_in;	// Index of next in-packet that is expected.
 EXTERN uint8_t ff_out;	// Index of next out-packet that will be sent.
+EXTERN int serial_protocol;	// Protocol version that is used on the serial port.
+EXTERN int serial_window;	// Number of packets that may be waiting for an ack.
+EXTERN bool serial_upgrade;	// Version 4 was requested, but no frame was received yet.
 
 // move.cpp
 int next_move();
@@ -512,6 +561,34 @@ struct Run_Record {
 	double X, Y, Z, E, f, F;
 	double time, dist;
 } __attribute__((__packed__));
+struct RunFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_records;
+	uint32_t block_records;
+	uint32_t num_sections;
+} __attribute__((__packed__));
+struct RunFileSection {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t offset, size;
+} __attribute__((__packed__));
+enum RunSection {
+	RUN_SECTION_RECORDS,
+	RUN_SECTION_INDEX,
+	RUN_SECTION_STRINGS,
+	RUN_SECTION_BBOX,
+	RUN_SECTION_STATE,	// Optional.
+	NUM_RUN_SECTIONS
+};
+struct RunStateEntry {
+	int32_t type;
+	int32_t tool;
+	double X;
+} __attribute__((__packed__));
+// While a run file is being written, it has no sections and the records start here.
+#define RUN_FILE_STREAM_RECORDS off_t(sizeof(RunFileHeader) + NUM_RUN_SECTIONS * sizeof(RunFileSection))
+#define RUN_FILE_STRINGS_EXT ".strings"
 struct ProbeFile {
 	double x, y, w, h, sina, cosa;
 	unsigned long nx, ny;
@@ -520,19 +597,28 @@ struct ProbeFile {
 void run_file(int name_len, char const *name, int probe_name_len, char const *probe_name, bool start, double sina, double cosa, int audio);
 void abort_run_file();
 void run_file_fill_queue();
+void run_file_fire_events(int fragment);
+void run_file_rewind();
+void run_file_done();
+void run_system_output();
+void run_system_exit();
 void run_adjust_probe(double x, double y, double z);
+void run_restore_state(int record);
 double run_find_pos(double pos[3]);
+Run_Record run_record(int i);
 EXTERN char probe_file_name[256];
 EXTERN off_t probe_file_size;
 EXTERN ProbeFile *probe_file_map;
 EXTERN char run_file_name[256];
 EXTERN off_t run_file_size;
-EXTERN Run_Record *run_file_map;
+EXTERN char *run_file_map;
 EXTERN int run_file_num_strings;
 EXTERN off_t run_file_first_string;
 EXTERN int run_file_num_records;
 EXTERN int run_file_wait_temp;
 EXTERN int run_file_wait;
+EXTERN pid_t run_file_wait_system;	// System command that the run file is waiting for, or 0.
+EXTERN int run_system_fd;	// Output of system commands is written here.
 EXTERN struct itimerspec run_file_timer;
 EXTERN double run_file_refx;
 EXTERN double run_file_refy;
@@ -541,16 +627,36 @@ EXTERN double run_file_sina;
 EXTERN double run_file_cosa;
 EXTERN bool run_file_finishing;
 EXTERN int run_file_audio;
+EXTERN int run_file_prefetch;	// Number of moves that are decoded ahead of the motion.
 
 // setup.cpp
 void setup();
 void connect(char const *port, char const *run_id);
 void connect_end();
-Axis_History *setup_axis_history();
-Motor_History *setup_motor_history();
+void setup_history();
 EXTERN bool host_block;
 EXTERN bool sent_names;
 
+static inline char *history_snapshot(int fragment, int checkpoint) {
+	return &history_ring[(fragment * (1 + checkpoints_per_fragment) + checkpoint) * snapshot_size];
+}
+
+static inline History &history(int fragment) {
+	return *reinterpret_cast <History *>(history_snapshot(fragment, 0));
+}
+
+inline Space_History &Space::history(int fragment) {
+	return *reinterpret_cast <Space_History *>(history_snapshot(fragment, 0) + sizeof(History) + id * sizeof(Space_History));
+}
+
+inline Axis_History &Axis::history(int fragment) {
+	return *reinterpret_cast <Axis_History *>(history_snapshot(fragment, 0) + history_offset);
+}
+
+inline Motor_History &Motor::history(int fragment) {
+	return *reinterpret_cast <Motor_History *>(history_snapshot(fragment, 0) + history_offset);
+}
+
 // storage.cpp
 uint8_t read_8(int32_t &address);
 void write_8(int32_t &address, uint8_t data);
@@ -566,10 +672,13 @@ void handle_temp(int id, int temp);
 void buffer_refill();
 void store_settings();
 void restore_settings();
+int restore_checkpoint(int pos);
+void clear_checkpoints();
 void apply_tick();
 void send_fragment();
 void move_to_current();
 EXTERN int moving_to_current;
+EXTERN bool refill_pending;	// buffer_refill stopped early to let the main loop handle I/O; it must be called again.
 
 // globals.cpp
 bool globals_load(int32_t &address);
@@ -605,6 +714,8 @@ void arch_stop(bool fake = false);
 void arch_home();
 bool arch_running();
 double arch_round_pos(int s, int m, double pos);
+int arch_sample_factor(double rate);
+int arch_max_sample_steps(int period);
 void arch_stop_audio();
 //void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin = ~0, bool heater_invert = false, int heater_adctemp = 0, int heater_limit_l = ~0, int heater_limit_h = ~0, int fan_pin = ~0, bool fan_invert = false, int fan_adctemp = 0, int fan_limit_l = ~0, int fan_limit_h = ~0, double hold_time = 0);
 void arch_start_move(int extra);
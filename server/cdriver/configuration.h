@@ -28,6 +28,68 @@
 // Maximum number of move commands in the queue.
 #define QUEUE_LENGTH 200
 
+// Maximum number of queued move commands that are taken into account when
+// computing the speed at the end of a segment.  Higher numbers allow higher
+// speeds on paths made of many short segments, at the cost of more work per
+// segment.  Must be at least 2.
+#define LOOKAHEAD_LENGTH 16
+
+// Number of samples between checkpoints of the planner state within a
+// fragment.  When a move is aborted, the state is recomputed from the last
+// checkpoint before the abort position, so this bounds the work done while
+// the machine is stopped, at the cost of memory for the snapshots.
+#define CHECKPOINT_INTERVAL 32
+
+// Maximum number of fragments that are computed in one go.  After that, the
+// main loop handles host and firmware traffic before computing more.  Lower
+// numbers make the host more responsive while the buffer is being filled.
+#define REFILL_FRAGMENTS 2
+
+// Number of messages to the host that are preallocated.  Messages with a
+// large data part, or more messages than this, are allocated on the heap.
+#define HOST_QUEUE_POOL 32
+
+// Number of messages that are sent to the host before waiting for an OK.
+// Messages that are queued at the same time are sent in one write.
+#define HOST_WINDOW 4
+
+// Maximum number of packets that are sent to the firmware before waiting for
+// an ack, if it supports protocol version 4.  The firmware may lower it.
+// This must be a power of two, at most 32.
+#define SERIAL_WINDOW 16
+
+// Default number of moves from a run file that are decoded into the queue
+// ahead of the motion; the host can change it in the globals.  The queue is
+// not topped up until it has drained to RUN_FILE_REFILL moves, so the file is
+// decoded in large blocks.  With a prefetch depth of at most RUN_FILE_REFILL,
+// the queue is topped up on every pass.  RUN_FILE_REFILL should be at least
+// LOOKAHEAD_LENGTH.
+#define RUN_FILE_PREFETCH 64
+#define RUN_FILE_REFILL 24
+
+// Time in ms between checks for new records when running a file that is still
+// being written, and the run has caught up with the writer.
+#define RUN_FILE_STREAM_POLL 20
+
+// Maximum number of grid cells a toolpath segment may cover in the index that
+// is used for finding a position in the run file.  Larger segments (usually
+// travel moves) are checked for every search instead.
+#define FIND_POS_MAX_CELLS 64
+
+// The index stores the start position of every FIND_POS_START_INTERVAL'th
+// segment.  The start of other segments is found in the records before them,
+// going back at most this many segments.
+#define FIND_POS_START_INTERVAL 64
+
+// Longest sample period, as a multiple of hwtime_step.  Fragments of slow
+// moves use a longer period, so they need fewer samples.  1 disables this.
+#define MAX_SAMPLE_FACTOR 6
+
+// A longer sample period is only used while no motor can do more steps per
+// sample than this during the fragment.  At full speed, motors usually do
+// more steps than this in a normal sample.
+#define SLOW_SAMPLE_STEPS 64
+
 // Number of buffers to fill before sending START_MOVE.  Lower number makes it
 // start faster, but may cause buffer underruns.
 #define MIN_BUFFER_FILL 1
@@ -0,0 +1,107 @@
+/* gcode-main.cpp - G-Code compiler for Franklin, command line interface
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Usage: franklin-gcode [--no-arc] [--temps N] [--extruders N]
+//		[--park X,Y,Z,A,B,C] [--allow-system REGEX] [--stream STRINGS]
+//		< gcode > runfile
+// Output must be a regular file, because the header is written last.  With
+// --stream, the output can be run while it is written; strings are then also
+// written to the file STRINGS.
+// Errors are written to stderr, one per line; the last line is "bbox"
+// followed by 8 numbers, or "bbox none".
+// Usage: franklin-gcode --preview < runfile > preview
+// Writes the toolpath preview of a complete run file; see preview.h.
+
+#include "gcode.h"
+#include "preview.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+static void usage(char const *name) {
+	fprintf(stderr, "usage: %s [--no-arc] [--temps N] [--extruders N] [--park X,Y,Z,A,B,C] [--allow-system REGEX] [--stream STRINGS] < gcode > runfile\n       %s --preview < runfile > preview\n", name, name);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	if (argc == 2 && strcmp(argv[1], "--preview") == 0) {
+		std::string error;
+		if (!export_preview(0, 1, error)) {
+			fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		return 0;
+	}
+	GcodeSettings settings;
+	settings.arc = true;
+	settings.num_temps = 0;
+	settings.num_extruders = 0;
+	int strings_fd = -1;
+	for (int i = 0; i < 6; ++i)
+		settings.park[i] = NAN;
+	for (int a = 1; a < argc; ++a) {
+		if (strcmp(argv[a], "--no-arc") == 0)
+			settings.arc = false;
+		else if (a + 1 >= argc)
+			usage(argv[0]);
+		else if (strcmp(argv[a], "--temps") == 0)
+			settings.num_temps = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--extruders") == 0)
+			settings.num_extruders = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--allow-system") == 0)
+			settings.allow_system = argv[++a];
+		else if (strcmp(argv[a], "--stream") == 0) {
+			strings_fd = open(argv[++a], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			if (strings_fd < 0) {
+				fprintf(stderr, "unable to open %s: %s\n", argv[a], strerror(errno));
+				return 1;
+			}
+		}
+		else if (strcmp(argv[a], "--park") == 0) {
+			char *p = argv[++a];
+			for (int i = 0; i < 6 && *p; ++i) {
+				char *end;
+				double value = strtod(p, &end);
+				settings.park[i] = end == p ? NAN : value;
+				p = *end == ',' ? end + 1 : end;
+			}
+		}
+		else
+			usage(argv[0]);
+	}
+	double bbox[8];
+	bool have_bbox;
+	std::vector <std::string> errors;
+	bool ok = compile_gcode(0, 1, strings_fd, settings, bbox, &have_bbox, errors);
+	for (size_t i = 0; i < errors.size(); ++i) {
+		// Errors that quote a line end in its newline; don't print it twice.
+		std::string const &e = errors[i];
+		fprintf(stderr, "%.*s\n", int(e.size() && e[e.size() - 1] == '\n' ? e.size() - 1 : e.size()), e.c_str());
+	}
+	if (!ok)
+		return 1;
+	if (have_bbox)
+		fprintf(stderr, "bbox %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g\n", bbox[0], bbox[1], bbox[2], bbox[3], bbox[4], bbox[5], bbox[6], bbox[7]);
+	else
+		fprintf(stderr, "bbox none\n");
+	return 0;
+}
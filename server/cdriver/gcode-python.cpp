@@ -0,0 +1,99 @@
+/* gcode-python.cpp - G-Code compiler for Franklin, Python module
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// franklin_gcode.compile(src_fd, dst_fd, arc, num_temps, num_extruders, park, allow_system)
+// returns (bbox, errors); bbox is a list of 8 floats, or None.  park is a
+// sequence of up to 6 floats or None.
+// franklin_gcode.preview(src_fd, dst_fd) writes the preview of a run file;
+// see preview.h.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "gcode.h"
+#include "preview.h"
+#include <math.h>
+
+static PyObject *compile(PyObject *self, PyObject *args) {
+	(void)&self;
+	GcodeSettings settings;
+	int src, dst, arc;
+	PyObject *park;
+	char const *allow_system;
+	if (!PyArg_ParseTuple(args, "iipiiOz", &src, &dst, &arc, &settings.num_temps, &settings.num_extruders, &park, &allow_system))
+		return NULL;
+	settings.arc = arc;
+	settings.allow_system = allow_system ? allow_system : "";
+	PyObject *seq = PySequence_Fast(park, "park must be a sequence");
+	if (!seq)
+		return NULL;
+	for (int i = 0; i < 6; ++i) {
+		PyObject *item = i < PySequence_Fast_GET_SIZE(seq) ? PySequence_Fast_GET_ITEM(seq, i) : Py_None;
+		settings.park[i] = item == Py_None ? NAN : PyFloat_AsDouble(item);
+	}
+	Py_DECREF(seq);
+	if (PyErr_Occurred())
+		return NULL;
+	double bbox[8];
+	bool have_bbox, ok;
+	std::vector <std::string> errors;
+	Py_BEGIN_ALLOW_THREADS
+	ok = compile_gcode(src, dst, -1, settings, bbox, &have_bbox, errors);
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		PyErr_SetString(PyExc_IOError, errors.back().c_str());
+		return NULL;
+	}
+	PyObject *error_list = PyList_New(errors.size());
+	for (size_t i = 0; i < errors.size(); ++i)
+		PyList_SET_ITEM(error_list, i, PyUnicode_DecodeUTF8(errors[i].data(), errors[i].size(), "replace"));
+	if (!have_bbox)
+		return Py_BuildValue("(ON)", Py_None, error_list);
+	return Py_BuildValue("([dddddddd]N)", bbox[0], bbox[1], bbox[2], bbox[3], bbox[4], bbox[5], bbox[6], bbox[7], error_list);
+}
+
+static PyObject *preview(PyObject *self, PyObject *args) {
+	(void)&self;
+	int src, dst;
+	if (!PyArg_ParseTuple(args, "ii", &src, &dst))
+		return NULL;
+	bool ok;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	ok = export_preview(src, dst, error);
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		PyErr_SetString(PyExc_IOError, error.c_str());
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef methods[] = {
+	{"compile", compile, METH_VARARGS, "Compile G-Code into a run file."},
+	{"preview", preview, METH_VARARGS, "Write the toolpath preview of a run file."},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyModuleDef module = {
+	PyModuleDef_HEAD_INIT, "franklin_gcode", "G-Code compiler for Franklin.", -1, methods, NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit_franklin_gcode() {
+	return PyModule_Create(&module);
+}
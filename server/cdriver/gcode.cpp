@@ -0,0 +1,1114 @@
+/* gcode.cpp - G-Code compiler for Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// This is a port of Printer._gcode_parse in driver.py; the output must be
+// identical, so keep them in sync.
+
+#include "gcode.h"
+#include "runfile.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <regex.h>
+
+// Record types; these are the values of protocol.parsed.
+enum {
+	RUN_SYSTEM,
+	RUN_PRE_LINE,
+	RUN_LINE,
+	RUN_PRE_ARC,
+	RUN_ARC,
+	RUN_GPIO,
+	RUN_SETTEMP,
+	RUN_WAITTEMP,
+	RUN_SETPOS,
+	RUN_WAIT,
+	RUN_CONFIRM,
+	RUN_PARK,
+};
+
+#define C0 273.15
+#define RUN_FILE_BLOCK 256
+// Sections, in the order in which they are written; the bounding box must be last.
+enum {
+	SECTION_RECORDS,
+	SECTION_INDEX,
+	SECTION_STRINGS,
+	SECTION_BBOX,
+	SECTION_STATE,
+	NUM_SECTIONS
+};
+
+// Helpers that behave like their Python counterparts. {{{
+static bool same(double a, double b) {
+	return a == b || (isnan(a) && isnan(b));
+}
+
+static double pymod(double x, double y) {
+	double mod = fmod(x, y);
+	if (mod) {
+		if ((y < 0) != (mod < 0))
+			mod += y;
+	}
+	else
+		mod = copysign(0., y);
+	return mod;
+}
+
+static bool is_space(char c) {
+	return c == ' ' || (c >= '\t' && c <= '\r') || (c >= '\x1c' && c <= '\x1f');
+}
+
+static std::string strip(std::string const &s) {
+	size_t b = 0, e = s.size();
+	while (b < e && is_space(s[b]))
+		++b;
+	while (e > b && is_space(s[e - 1]))
+		--e;
+	return s.substr(b, e - b);
+}
+
+static std::vector <std::string> split(std::string const &s) {
+	std::vector <std::string> ret;
+	size_t p = 0;
+	while (true) {
+		while (p < s.size() && is_space(s[p]))
+			++p;
+		if (p >= s.size())
+			return ret;
+		size_t b = p;
+		while (p < s.size() && !is_space(s[p]))
+			++p;
+		ret.push_back(s.substr(b, p - b));
+	}
+}
+
+static bool starts_with(std::string const &s, char const *prefix) {
+	return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+static bool parse_int(std::string const &s, long long *value) {
+	size_t p = 0;
+	bool negative = false;
+	if (p < s.size() && (s[p] == '+' || s[p] == '-'))
+		negative = s[p++] == '-';
+	if (p >= s.size())
+		return false;
+	long long ret = 0;
+	for (; p < s.size(); ++p) {
+		if (s[p] < '0' || s[p] > '9')
+			return false;
+		if (ret < 100000000000000000LL)
+			ret = ret * 10 + (s[p] - '0');
+	}
+	*value = negative ? -ret : ret;
+	return true;
+}
+
+static bool parse_float(std::string const &s, double *value) {
+	// strtod accepts more than float() does; reject the extras.
+	if (s.empty() || s.find_first_of("xX(") != std::string::npos || is_space(s[0]))
+		return false;
+	char *end;
+	errno = 0;
+	*value = strtod(s.c_str(), &end);
+	return *end == '\0' && errno != EINVAL;
+}
+
+static std::string repr(double x) {
+	// Shortest representation that reads back as x, formatted like Python does.
+	if (isnan(x))
+		return "nan";
+	if (isinf(x))
+		return x > 0 ? "inf" : "-inf";
+	char buffer[40];
+	for (int precision = 1; precision <= 17; ++precision) {
+		snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, x);
+		if (strtod(buffer, NULL) == x)
+			break;
+	}
+	char *e = strchr(buffer, 'e');
+	int exponent = atoi(e + 1);
+	std::string digits;
+	for (char *p = buffer; p < e; ++p) {
+		if (*p >= '0' && *p <= '9')
+			digits += *p;
+	}
+	while (digits.size() > 1 && digits[digits.size() - 1] == '0')
+		digits.erase(digits.size() - 1);
+	std::string ret = signbit(x) ? "-" : "";
+	if (exponent < -4 || exponent >= 16) {
+		ret += digits.substr(0, 1);
+		if (digits.size() > 1)
+			ret += "." + digits.substr(1);
+		snprintf(buffer, sizeof(buffer), "e%c%02d", exponent < 0 ? '-' : '+', abs(exponent));
+		return ret + buffer;
+	}
+	if (exponent < 0)
+		return ret + "0." + std::string(-exponent - 1, '0') + digits;
+	if (int(digits.size()) <= exponent + 1)
+		return ret + digits + std::string(exponent + 1 - digits.size(), '0') + ".0";
+	return ret + digits.substr(0, exponent + 1) + "." + digits.substr(exponent + 1);
+}
+
+static std::string format(char const *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	char *buffer;
+	int len = vasprintf(&buffer, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return fmt;
+	std::string ret(buffer, len);
+	free(buffer);
+	return ret;
+}
+
+static double to_float(double value, bool *overflow) {
+	// Like struct.pack('=f', value).
+	float ret = value;
+	*overflow = isinf(ret) && !isinf(value);
+	return ret;
+}
+// }}}
+
+namespace {
+
+class RunWriter { // {{{
+	// Port of protocol.RunFileWriter.  If strings_fd is valid, the file is
+	// written so it can be run while it grows (see protocol.py).
+	int fd;
+	int strings_fd;
+	bool failed;
+	std::string buffer;
+	uint64_t size;
+	int num_records;
+	std::vector <uint64_t> index;
+	struct StateEntry {
+		int32_t type;
+		int32_t tool;
+		double value;
+	};
+	std::vector <StateEntry> state;
+	std::vector <uint64_t> states_index;
+	std::string states;
+	int64_t prev_tool;
+	double prev[8];
+	double orig[2];
+	int64_t base[4];
+	void write(std::string const &data) {
+		buffer += data;
+		if (buffer.size() >= 1 << 16)
+			flush();
+	}
+	void flush() {
+		size_t done = 0;
+		while (!failed && done < buffer.size()) {
+			ssize_t ret = ::write(fd, &buffer[done], buffer.size() - done);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				failed = true;
+				break;
+			}
+			done += ret;
+		}
+		buffer.clear();
+	}
+	static std::string varint(int64_t value) {
+		uint64_t v = value >= 0 ? uint64_t(value) << 1 : ((uint64_t(-(value + 1))) << 1) + 1;
+		std::string ret;
+		while (v >= 0x80) {
+			ret += char((v & 0x7f) | 0x80);
+			v >>= 7;
+		}
+		return ret + char(v);
+	}
+	template <typename T> static std::string raw(T value) {
+		return std::string(reinterpret_cast <char const *>(&value), sizeof(T));
+	}
+	static int header_size() {
+		return 8 + 4 * 4 + NUM_SECTIONS * (4 + 4 + 8 + 8);
+	}
+	std::string file_header(int num_sections) {
+		return RUN_FILE_MAGIC + raw(uint32_t(2)) + raw(uint32_t(num_records)) + raw(uint32_t(RUN_FILE_BLOCK)) + raw(uint32_t(num_sections));
+	}
+	void put(int target, std::string const &data, off_t offset) {
+		if (!failed && pwrite(target, data.data(), data.size(), offset) != ssize_t(data.size()))
+			failed = true;
+	}
+	void set_state(int type, int32_t tool, double value) {
+		for (size_t i = 0; i < state.size(); ++i) {
+			if (state[i].type == type && state[i].tool == tool) {
+				state[i].value = value;
+				return;
+			}
+		}
+		StateEntry e = {type, tool, value};
+		state.push_back(e);
+	}
+public:
+	RunWriter(int fd_, int strings_fd_) : fd(fd_), strings_fd(strings_fd_), failed(false), size(0), num_records(0) {
+		if (strings_fd < 0)
+			write(std::string(header_size(), '\0'));
+		else
+			write(file_header(0) + std::string(header_size() - file_header(0).size(), '\0'));
+	}
+	void add_string(std::string const &string) {
+		if (strings_fd < 0)
+			return;
+		std::string data = raw(uint32_t(string.size())) + string;
+		if (!failed && ::write(strings_fd, data.data(), data.size()) != ssize_t(data.size()))
+			failed = true;
+	}
+	void add(int type, double const nums[9]) {
+		if (num_records % RUN_FILE_BLOCK == 0) {
+			index.push_back(size);
+			states_index.push_back(states.size());
+			states += raw(uint32_t(state.size())) + raw(uint32_t(0));
+			for (size_t i = 0; i < state.size(); ++i)
+				states += raw(state[i].type) + raw(state[i].tool) + raw(state[i].value);
+			prev_tool = 0;
+			for (int k = 0; k < 8; ++k)
+				prev[k] = 0;
+			orig[0] = 0;
+			orig[1] = 0;
+			for (int k = 0; k < 4; ++k)
+				base[k] = 0;
+		}
+		uint32_t header = type;
+		std::string data;
+		int64_t tool = int64_t(nums[0]);
+		if (tool != prev_tool) {
+			header |= 1 << 4;
+			data += varint(tool - prev_tool);
+			prev_tool = tool;
+		}
+		for (int k = 0; k < 8; ++k) {
+			double value = nums[k + 1];
+			double decoded;
+			int code = 0;
+			if (k < 4) {
+				// Coordinate.
+				if (isfinite(value) && fabs(value) < 1e12) {
+					int64_t q = int64_t(nearbyint(value * RUN_FILE_SCALE));
+					decoded = q / RUN_FILE_SCALE;
+					if (!same(decoded, prev[k])) {
+						code = 1;
+						data += varint(q - base[k]);
+						base[k] = q;
+					}
+				}
+				else {
+					decoded = value;
+					if (!same(decoded, prev[k]))
+						code = 3;
+				}
+			}
+			else if (k < 6) {
+				// Feedrate.
+				bool overflow;
+				decoded = to_float(value, &overflow);
+				if (overflow) {
+					decoded = value;
+					code = 3;
+				}
+				else if (same(decoded, prev[k]))
+					code = 0;
+				else if (k == 5 && same(decoded, prev[4]))
+					code = 1;
+				else {
+					code = 2;
+					data += raw(float(value));
+				}
+			}
+			else {
+				// Time or distance.
+				if (same(value, orig[k - 6]))
+					decoded = prev[k];
+				else {
+					orig[k - 6] = value;
+					bool overflow;
+					double delta = to_float(value - prev[k], &overflow);
+					if (!overflow && isfinite(delta)) {
+						code = 2;
+						data += raw(float(delta));
+						decoded = prev[k] + delta;
+					}
+					else {
+						code = 3;
+						decoded = value;
+					}
+				}
+			}
+			if (code == 3)
+				data += raw(decoded);
+			header |= code << (6 + 2 * k);
+			prev[k] = decoded;
+		}
+		std::string record = std::string(reinterpret_cast <char const *>(&header), 3) + data;
+		write(record);
+		size += record.size();
+		num_records += 1;
+		// Track the state; use the values as they are decoded.
+		if (type == RUN_SETTEMP || type == RUN_GPIO || type == RUN_SETPOS)
+			set_state(type, prev_tool, prev[0]);
+		else if ((type == RUN_PRE_LINE || type == RUN_LINE || type == RUN_ARC) && prev_tool >= 0 && !isnan(prev[3]))
+			set_state(RUN_SETPOS, prev_tool, prev[3]);
+		if (strings_fd >= 0 && num_records % RUN_FILE_BLOCK == 0) {
+			// Publish the finished block.
+			flush();
+			put(fd, file_header(0), 0);
+		}
+	}
+	bool finish(std::vector <std::string> const &strings, double const bbox[8]) {
+		static int const order[NUM_SECTIONS - 1] = {SECTION_INDEX, SECTION_STRINGS, SECTION_STATE, SECTION_BBOX};
+		std::string sections[NUM_SECTIONS];
+		for (size_t i = 0; i < index.size(); ++i)
+			sections[SECTION_INDEX] += raw(index[i]);
+		sections[SECTION_STRINGS] = raw(uint32_t(strings.size()));
+		for (size_t i = 0; i < strings.size(); ++i)
+			sections[SECTION_STRINGS] += raw(uint32_t(strings[i].size()));
+		for (size_t i = 0; i < strings.size(); ++i)
+			sections[SECTION_STRINGS] += strings[i];
+		for (size_t i = 0; i < states_index.size(); ++i)
+			sections[SECTION_STATE] += raw(uint64_t(8 * states_index.size() + states_index[i]));
+		sections[SECTION_STATE] += states;
+		for (int i = 0; i < 8; ++i)
+			sections[SECTION_BBOX] += raw(bbox[i]);
+		for (int i = 0; i < NUM_SECTIONS - 1; ++i)
+			write(sections[order[i]]);
+		flush();
+		uint64_t offset = header_size();
+		std::string table = raw(uint32_t(SECTION_RECORDS)) + raw(uint32_t(0)) + raw(offset) + raw(size);
+		offset += size;
+		for (int i = 0; i < NUM_SECTIONS - 1; ++i) {
+			table += raw(uint32_t(order[i])) + raw(uint32_t(0)) + raw(offset) + raw(uint64_t(sections[order[i]].size()));
+			offset += sections[order[i]].size();
+		}
+		// A reader of a growing file may be watching the header, so write it last.
+		std::string h = file_header(NUM_SECTIONS);
+		put(fd, table, h.size());
+		put(fd, h, 0);
+		return !failed;
+	}
+}; // }}}
+
+struct Nums {
+	// tool, X, Y, Z, E, f, F.
+	double n[7];
+	Nums(double t = 0, double x = 0, double y = 0, double z = 0, double e = 0, double f = 0, double F = 0) {
+		n[0] = t;
+		n[1] = x;
+		n[2] = y;
+		n[3] = z;
+		n[4] = e;
+		n[5] = f;
+		n[6] = F;
+	}
+};
+
+struct Center {
+	bool valid;
+	double ctr[3];
+	double r;
+	double angles[3];
+	double diff;
+};
+
+struct Command {
+	char code;
+	long long num;
+	bool is(char c, long long n) const {
+		return code == c && num == n;
+	}
+};
+
+struct Args {
+	// Python dict of G-Code arguments; keeps insertion order.
+	std::vector <std::pair <char, double> > items;
+	bool has(char c) const {
+		for (size_t i = 0; i < items.size(); ++i) {
+			if (items[i].first == c)
+				return true;
+		}
+		return false;
+	}
+	double &operator[](char c) {
+		for (size_t i = 0; i < items.size(); ++i) {
+			if (items[i].first == c)
+				return items[i].second;
+		}
+		items.push_back(std::pair <char, double>(c, 0));
+		return items.back().second;
+	}
+	double get(char c) const {
+		for (size_t i = 0; i < items.size(); ++i) {
+			if (items[i].first == c)
+				return items[i].second;
+		}
+		return NAN;
+	}
+};
+
+class Compiler { // {{{
+	GcodeSettings const &settings;
+	std::vector <std::string> &errors;
+	RunWriter out;
+	regex_t allow_system;
+	bool have_regex;
+	double bbox[6];
+	bool have_bbox[6];
+	std::vector <std::string> strings;
+	double unit;
+	int arc_normal[3];
+	bool rel, erel;
+	double pos0[6];
+	std::vector <double> pos1;
+	double feedrate;
+	double time_dist[2];
+	std::vector <Nums> pending;
+	double arc_ctr[3], arc_r, arc_diff, arc_start, arc_step;
+	bool tool_changed;
+	int current_extruder;
+	bool have_mode;
+	Command mode;
+	bool have_message;
+	std::string message;
+	double drill_r, drill_z;
+	double const epsilon, aepsilon, rlimit;
+	void add_timedist(int type, Nums const &nums, double ret[9]) { // {{{
+		if (type == RUN_LINE) {
+			if (nums.n[5] == INFINITY) {
+				double extra = pow((nums.n[1] - nums.n[2]) * (nums.n[1] - nums.n[2]) + (nums.n[3] - nums.n[4]) * (nums.n[3] - nums.n[4]) + (nums.n[5] - nums.n[6]) * (nums.n[5] - nums.n[6]), .5);
+				if (!isnan(extra))
+					time_dist[1] += extra;
+			}
+			else {
+				double extra = 2 / (nums.n[5] + nums.n[6]);
+				if (!isnan(extra))
+					time_dist[0] += extra;
+			}
+		}
+		else if (type == RUN_WAIT)
+			time_dist[0] += nums.n[1];
+		for (int i = 0; i < 7; ++i)
+			ret[i] = nums.n[i];
+		ret[7] = time_dist[0];
+		ret[8] = time_dist[1];
+	} // }}}
+	void write(int type, Nums const &nums) {
+		double record[9];
+		add_timedist(type, nums, record);
+		out.add(type, record);
+	}
+	Center center(double const *a, double const *b, double const *c) { // {{{
+		// Given 3 points, determine center, radius, angles of points on circle, deviation of polygon from circle.
+		Center ret;
+		double x0 = a[0], y0 = a[1], z0 = a[2];
+		double x1 = b[0], y1 = b[1];
+		double x2 = c[0], y2 = c[1];
+		double dx = 2 * (-x0 * y1 - x2 * y0 + x2 * y1 + x1 * y0 + x0 * y2 - x1 * y2);
+		double dy = 2 * (-y0 * x1 - y2 * x0 + y2 * x1 + y1 * x0 + y0 * x2 - y1 * x2);
+		if (dx == 0 || dy == 0) {
+			ret.valid = false;
+			ret.diff = INFINITY;
+			return ret;
+		}
+		double xc = ((y0 - y1) * (y0 * y0 - y2 * y2 + x0 * x0 - x2 * x2) - (y0 - y2) * (x0 * x0 - x1 * x1 + y0 * y0 - y1 * y1)) / dx;
+		double yc = ((x0 - x1) * (x0 * x0 - x2 * x2 + y0 * y0 - y2 * y2) - (x0 - x2) * (y0 * y0 - y1 * y1 + x0 * x0 - x1 * x1)) / dy;
+		ret.valid = true;
+		ret.r = pow((xc - x0) * (xc - x0) + (yc - y0) * (yc - y0), .5);
+		double ref = atan2(b[1] - yc, b[0] - xc);
+		double const *p[3] = {a, b, c};
+		for (int i = 0; i < 3; ++i) {
+			double angle = atan2(p[i][1] - yc, p[i][0] - xc);
+			ret.angles[i] = pymod(angle - ref + M_PI, 2 * M_PI) + ref - M_PI;
+		}
+		double amid = (ret.angles[0] + ret.angles[2]) / 2;
+		double cmid[2] = {cos(amid) * ret.r + xc, sin(amid) * ret.r + yc};
+		ret.diff = 0;
+		for (int i = 0; i < 2; ++i) {
+			double mid = (c[i] + a[i]) / 2;
+			ret.diff += (cmid[i] - mid) * (cmid[i] - mid);
+		}
+		ret.ctr[0] = xc;
+		ret.ctr[1] = yc;
+		ret.ctr[2] = z0;
+		return ret;
+	} // }}}
+	void add_record(int type, Nums const &nums = Nums(), bool force = false) { // {{{
+		if (!force && type == RUN_LINE) {
+			// Update bounding box.
+			for (int i = 0; i < 3; ++i) {
+				double value = nums.n[i + 1];
+				if (isnan(value))
+					continue;
+				if (!have_bbox[2 * i] || value < bbox[2 * i]) {
+					bbox[2 * i] = value;
+					have_bbox[2 * i] = true;
+				}
+				if (!have_bbox[2 * i + 1] || value > bbox[2 * i + 1]) {
+					bbox[2 * i + 1] = value;
+					have_bbox[2 * i + 1] = true;
+				}
+			}
+			// Analyze this move in combination with pending moves.
+			if (pending.empty())
+				pending.push_back(Nums(0, pos0[0], pos0[1], pos0[2], pos1[int(nums.n[0])], feedrate, feedrate));
+			pending.push_back(nums);
+			if (pending.size() == 2) {
+				if (!settings.arc || pending[0].n[3] != pending[1].n[3])
+					flush_pending();
+				return;
+			}
+			if (pending.size() == 3) {
+				// If the points are not on a circle with equal angles, or the angle is too large, or the radius is too large, push pending[1] through to output.
+				// Otherwise, record settings.
+				Center c = center(&pending[0].n[1], &pending[1].n[1], &pending[2].n[1]);
+				if (c.diff > epsilon || fabs(c.angles[1] - c.angles[0] - c.angles[2] + c.angles[1]) > aepsilon || c.r > rlimit) {
+					write(RUN_LINE, pending[1]);
+					pending.erase(pending.begin());
+					return;
+				}
+				for (int i = 0; i < 3; ++i)
+					arc_ctr[i] = c.ctr[i];
+				arc_r = c.r;
+				arc_diff = c.diff;
+				arc_start = c.angles[0];
+				arc_step = (c.angles[2] - c.angles[0]) / 2;
+				return;
+			}
+			double current_angle = arc_step * (pending.size() - 1);
+			double a = arc_start + current_angle;
+			double p[2] = {arc_ctr[0] + cos(a) * arc_r, arc_ctr[1] + sin(a) * arc_r};
+			// If new point doesn't fit on circle, push pending as circle to output.
+			// It should allow up to 360, but be safe and break those in two; also makes generating svgs easier.
+			if (current_angle >= 180 * (M_PI / 180))
+				flush_pending();
+			else if ((p[0] - pending.back().n[1]) * (p[0] - pending.back().n[1]) + (p[1] - pending.back().n[2]) * (p[1] - pending.back().n[2]) > epsilon * epsilon)
+				flush_pending();
+			else if (pending[0].n[3] != pending.back().n[3])
+				flush_pending();
+			return;
+		}
+		flush_pending();
+		write(type, nums);
+	} // }}}
+	void flush_pending() { // {{{
+		if (pending.size() >= 6)
+			flush_arc();
+		std::vector <Nums> tmp;
+		if (!pending.empty())
+			tmp.assign(pending.begin() + 1, pending.end());
+		pending.clear();
+		for (size_t i = 0; i < tmp.size(); ++i)
+			add_record(RUN_LINE, tmp[i], true);
+	} // }}}
+	void flush_arc() { // {{{
+		Nums start = pending[0];
+		Nums end = pending[pending.size() - 2];
+		Nums tmp = pending.back();
+		Center c = center(&start.n[1], &pending[pending.size() / 2].n[1], &end.n[1]);
+		if (c.diff < 2 * epsilon || !c.valid) {
+			// This is really a line, or it is not detected as an arc; don't turn it into an arc.
+			return;
+		}
+		pending.clear();
+		add_record(RUN_PRE_ARC, Nums(0, c.ctr[0], c.ctr[1], start.n[3], 0, 0, arc_step > 0 ? 1 : -1), true);
+		add_record(RUN_ARC, Nums(current_extruder, end.n[1], end.n[2], end.n[3], pos1[current_extruder], -feedrate, -feedrate), true);
+		pending.push_back(end);
+		pending.push_back(tmp);
+	} // }}}
+	int add_string(bool valid, std::string const &string) {
+		if (!valid)
+			return 0;
+		for (size_t i = 0; i < strings.size(); ++i) {
+			if (strings[i] == string)
+				return i;
+		}
+		strings.push_back(string);
+		out.add_string(string);
+		return strings.size() - 1;
+	}
+	bool system_allowed(std::string const &command) {
+		regmatch_t match;
+		return have_regex && regexec(&allow_system, command.c_str(), 1, &match, 0) == 0 && match.rm_so == 0;
+	}
+	Nums line_nums(double f, double F) {
+		return Nums(current_extruder, pos0[0], pos0[1], pos0[2], pos1[current_extruder], f, F);
+	}
+	bool command(long long lineno, Command cmd, Args &args);
+public:
+	Compiler(GcodeSettings const &settings_, std::vector <std::string> &errors_, int dst_fd, int strings_fd) : settings(settings_), errors(errors_), out(dst_fd, strings_fd), strings(1), unit(1), rel(false), erel(false), pos1(2, 0.), feedrate(INFINITY), tool_changed(false), current_extruder(0), have_mode(false), have_message(false), drill_r(NAN), drill_z(NAN), epsilon(.5), aepsilon(36 * (M_PI / 180)), rlimit(500) {
+		for (int i = 0; i < 6; ++i) {
+			have_bbox[i] = false;
+			pos0[i] = NAN;
+		}
+		out.add_string(strings[0]);
+		arc_normal[0] = 0;
+		arc_normal[1] = 0;
+		arc_normal[2] = 1;
+		time_dist[0] = 0;
+		time_dist[1] = 0;
+		have_regex = regcomp(&allow_system, settings.allow_system.empty() ? "^$" : settings.allow_system.c_str(), REG_EXTENDED) == 0;
+		if (!have_regex)
+			errors.push_back("Warning: invalid regular expression for allowed system commands; no commands are allowed");
+	}
+	~Compiler() {
+		if (have_regex)
+			regfree(&allow_system);
+	}
+	void parse_line(long long lineno, std::string const &origline);
+	bool finish(double ret[8], bool *valid);
+}; // }}}
+
+void Compiler::parse_line(long long lineno, std::string const &origline) { // {{{
+	std::string line = strip(origline);
+	// Get rid of line numbers and checksums.
+	if (!line.empty() && line[0] == 'N') {
+		size_t p = 1;
+		while (p < line.size() && line[p] >= '0' && line[p] <= '9')
+			++p;
+		size_t ws = p;
+		while (ws < line.size() && is_space(line[ws]))
+			++ws;
+		if (p == 1 || ws == p) {
+			// Invalid line; ignore it.
+			errors.push_back(format("%lld:ignoring invalid gcode: %s", lineno, origline.c_str()));
+			return;
+		}
+		lineno = atoll(line.substr(1, p - 1).c_str());
+		line = line.substr(ws);
+		// Remove checksum.
+		size_t star = line.rfind('*');
+		if (star != std::string::npos) {
+			size_t q = star + 1;
+			while (q < line.size() && line[q] >= '0' && line[q] <= '9')
+				++q;
+			if (q > star + 1 && strip(line.substr(q)).empty())
+				line = line.substr(0, star);
+		}
+		size_t e = line.size();
+		while (e > 0 && is_space(line[e - 1]))
+			--e;
+		line = line.substr(0, e);
+	}
+	else
+		lineno += 1;
+	std::string comment;
+	while (line.find('(') != std::string::npos) {
+		size_t b = line.find('(');
+		size_t e = line.find(')', b);
+		if (e == std::string::npos) {
+			errors.push_back(format("%lld:ignoring line with unterminated comment: %s", lineno, origline.c_str()));
+			return;
+		}
+		comment = strip(line.substr(b + 1, e - b - 1));
+		line = line.substr(0, b) + " " + strip(line.substr(e + 1));
+	}
+	if (line.find(';') != std::string::npos) {
+		size_t p = line.find(';');
+		comment = strip(line.substr(p + 1));
+		line = strip(line.substr(0, p));
+	}
+	std::string upper = comment.substr(0, 4);
+	for (size_t i = 0; i < upper.size(); ++i)
+		upper[i] = toupper(upper[i]);
+	if (upper == "MSG,") {
+		message = strip(comment.substr(4));
+		have_message = true;
+	}
+	else if (starts_with(comment, "SYSTEM:") || starts_with(comment, "SYSTEM&:")) {
+		// SYSTEM& commands run in the background; the file continues without waiting for them.
+		bool background = comment[6] == '&';
+		std::string cmd = comment.substr(background ? 8 : 7);
+		if (!system_allowed(cmd))
+			errors.push_back(format("Warning: system command %s is forbidden and will not be run", cmd.c_str()));
+		add_record(RUN_SYSTEM, Nums(add_string(true, cmd), background ? 1 : 0));
+		return;
+	}
+	std::vector <std::string> words = split(line);
+	size_t w = 0;
+	while (w < words.size()) {
+		Command cmd;
+		if (!have_mode || strchr("GMTDS", words[w][0])) {
+			if (words[w].size() < 2) {
+				errors.push_back(format("%lld:ignoring unparsable line: %s", lineno, origline.c_str()));
+				break;
+			}
+			cmd.code = words[w][0];
+			if (!parse_int(words[w].substr(1), &cmd.num)) {
+				errors.push_back(format("%lld:parse error in line: %s", lineno, origline.c_str()));
+				break;
+			}
+			w += 1;
+		}
+		else
+			cmd = mode;
+		Args args;
+		bool success = true;
+		size_t next = words.size();
+		for (size_t i = w; i < words.size(); ++i) {
+			if (strchr("GMD", words[i][0])) {
+				next = i;
+				break;
+			}
+			double value;
+			if (!parse_float(words[i].substr(1), &value)) {
+				errors.push_back(format("%lld:ignoring invalid gcode: %s", lineno, origline.c_str()));
+				success = false;
+				break;
+			}
+			args[words[i][0]] = value;
+		}
+		w = next;
+		if (!success || cmd.is('M', 2))
+			break;
+		if (command(lineno, cmd, args))
+			have_message = false;
+	}
+} // }}}
+
+bool Compiler::command(long long lineno, Command cmd, Args &args) { // {{{
+	// Handle one command; return false if the message should be kept.
+	if (cmd.code == 'T') {
+		if (cmd.num < 0) {
+			errors.push_back(format("%lld:ignoring invalid tool %lld", lineno, cmd.num));
+			return false;
+		}
+		if (cmd.num >= (long long)pos1.size())
+			pos1.resize(cmd.num + 1, 0.);
+		current_extruder = cmd.num;
+		// Force update of extruder.
+		add_record(RUN_LINE, line_nums(INFINITY, INFINITY));
+		return false;
+	}
+	else if (cmd.is('G', 17) || cmd.is('G', 18) || cmd.is('G', 19)) {
+		for (int i = 0; i < 3; ++i)
+			arc_normal[i] = i == 19 - cmd.num ? 1 : 0;
+		return false;
+	}
+	else if (cmd.is('G', 20)) {
+		unit = 25.4;
+		return false;
+	}
+	else if (cmd.is('G', 21)) {
+		unit = 1;
+		return false;
+	}
+	else if (cmd.is('G', 90) || cmd.is('G', 91)) {
+		rel = cmd.num == 91;
+		erel = rel;
+		return false;
+	}
+	else if (cmd.is('M', 82) || cmd.is('M', 83)) {
+		erel = cmd.num == 83;
+		return false;
+	}
+	else if (cmd.is('M', 84)) {
+		for (size_t e = 0; e < pos1.size(); ++e)
+			pos1[e] = 0;
+	}
+	else if (cmd.is('G', 92)) {
+		if (!args.has('E'))
+			return false;
+		args['E'] *= unit;
+		pos1[current_extruder] = args['E'];
+	}
+	else if (cmd.is('M', 104) || cmd.is('M', 109) || cmd.is('M', 116))
+		args['E'] = args.has('T') ? trunc(args['T']) : current_extruder;
+	if (cmd.is('M', 140)) {
+		cmd.num = 104;
+		args['E'] = -2;
+	}
+	else if (cmd.is('M', 190)) {
+		cmd.num = 109;
+		args['E'] = -2;
+	}
+	else if (cmd.is('M', 6)) {
+		// Tool change: park and remember to probe.
+		cmd.code = 'G';
+		cmd.num = 28;
+		tool_changed = true;
+	}
+	if (cmd.is('G', 28)) {
+		if (settings.num_extruders > current_extruder)
+			pos1[current_extruder] = 0;
+		add_record(RUN_PARK);
+		for (int a = 0; a < 6; ++a) {
+			if (!isnan(settings.park[a]))
+				pos0[a] = NAN;
+		}
+	}
+	else if (cmd.is('G', 0) || cmd.is('G', 1) || cmd.is('G', 81)) {
+		if (cmd.num != 0) {
+			mode = cmd;
+			have_mode = true;
+		}
+		static char const components[] = "XYZABCEFR";
+		double value[9];
+		for (int i = 0; i < 9; ++i)
+			value[i] = NAN;
+		bool present[9] = {false, false, false, false, false, false, false, false, false};
+		for (size_t i = 0; i < args.items.size(); ++i) {
+			char const *c = strchr(components, args.items[i].first);
+			if (!c) {
+				errors.push_back(format("%lld:invalid component %c", lineno, args.items[i].first));
+				continue;
+			}
+			value[c - components] = args.items[i].second;
+			present[c - components] = true;
+		}
+		double f0 = feedrate;
+		if (present[7])
+			feedrate = value[7] * unit / 60;
+		double oldpos0[6];
+		for (int i = 0; i < 6; ++i)
+			oldpos0[i] = pos0[i];
+		if (cmd.num != 81) {
+			if (present[6]) {
+				double estep = erel ? value[6] * unit : value[6] * unit - pos1[current_extruder];
+				pos1[current_extruder] += estep;
+			}
+		}
+		else if (present[8])
+			drill_r = rel ? pos0[2] + value[8] * unit : value[8] * unit;
+		for (int axis = 0; axis < 6; ++axis) {
+			if (!present[axis])
+				continue;
+			if (rel)
+				pos0[axis] += value[axis] * unit;
+			else
+				pos0[axis] = value[axis] * unit;
+			if (axis == 2)
+				drill_z = pos0[2];
+		}
+		if (cmd.num != 81) {
+			double dist = 0;
+			for (int x = 0; x < 3; ++x) {
+				double d = pos0[x] - oldpos0[x];
+				if (!isnan(d))
+					dist += d * d;
+			}
+			dist = pow(dist, .5);
+			if (dist > 0) {
+				f0 = feedrate;	// Always use new value.
+				if (f0 == 0)
+					f0 = INFINITY;
+			}
+			if (isnan(dist))
+				dist = 0;
+			bool moves = dist > 0 && cmd.num == 1;
+			bool same_abc = true;
+			for (int i = 3; i < 6; ++i) {
+				if (!same(pos0[i], oldpos0[i]))
+					same_abc = false;
+			}
+			if (!same_abc)
+				add_record(RUN_PRE_LINE, Nums(current_extruder, pos0[3], pos0[4], pos0[5], NAN, NAN, NAN));
+			add_record(RUN_LINE, line_nums(moves ? f0 / dist : INFINITY, moves ? feedrate / dist : INFINITY));
+		}
+		else {
+			// If old pos is unknown, use safe distance.
+			if (isnan(oldpos0[2]))
+				oldpos0[2] = drill_r;
+			// Drill cycle.
+			// Only support OLD_Z (G90) retract mode; don't support repeats(L).
+			// goto x,y
+			add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], oldpos0[2], 0, INFINITY, INFINITY));
+			// goto r
+			add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], drill_r, 0, INFINITY, INFINITY));
+			// goto z; this is always straight down, because the move before and after it are also vertical.
+			if (drill_z != drill_r) {
+				f0 = feedrate / fabs(drill_z - drill_r);
+				if (isnan(f0))
+					f0 = INFINITY;
+				add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], drill_z, 0, f0, f0));
+			}
+			// retract; this is always straight up, because the move before and after it are also non-horizontal.
+			add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], oldpos0[2], 0, INFINITY, INFINITY));
+			// empty move; this makes sure the previous move is entirely vertical.
+			add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], oldpos0[2], 0, INFINITY, INFINITY));
+			// Set up current z position so next G81 will work.
+			pos0[2] = oldpos0[2];
+		}
+	}
+	else if (cmd.is('G', 2) || cmd.is('G', 3)) {
+		// Arc.
+		mode = cmd;
+		have_mode = true;
+		static char const components[] = "XYZEFIJK";
+		double value[8];
+		bool present[8] = {false, false, false, false, false, false, false, false};
+		for (size_t i = 0; i < args.items.size(); ++i) {
+			char const *c = strchr(components, args.items[i].first);
+			if (!c) {
+				errors.push_back(format("%lld:invalid arc component %c", lineno, args.items[i].first));
+				continue;
+			}
+			value[c - components] = args.items[i].second;
+			present[c - components] = true;
+		}
+		double f0 = feedrate;
+		if (present[4])
+			feedrate = value[4] * unit / 60;
+		double oldpos0[6];
+		for (int i = 0; i < 6; ++i)
+			oldpos0[i] = pos0[i];
+		if (present[3]) {
+			double estep = erel ? value[3] * unit - pos1[current_extruder] : value[3] * unit;
+			pos1[current_extruder] += estep;
+		}
+		double center[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			if (present[axis]) {
+				if (rel)
+					pos0[axis] += value[axis] * unit;
+				else
+					pos0[axis] = value[axis] * unit;
+				if (axis == 2)
+					drill_z = pos0[2];
+			}
+			center[axis] = present[5 + axis] ? oldpos0[axis] + value[5 + axis] : oldpos0[axis];
+		}
+		int s = cmd.num == 2 ? -1 : 1;
+		add_record(RUN_PRE_ARC, Nums(0, center[0], center[1], center[2], s * arc_normal[0], s * arc_normal[1], s * arc_normal[2]));
+		add_record(RUN_ARC, Nums(current_extruder, pos0[0], pos0[1], pos0[2], pos1[current_extruder], -f0, -feedrate));
+	}
+	else if (cmd.is('G', 4))
+		add_record(RUN_WAIT, Nums(0, args.has('P') ? args['P'] / 1000 : 0));
+	else if (cmd.is('G', 92))
+		add_record(RUN_SETPOS, Nums(current_extruder, args['E']));
+	else if (cmd.is('G', 94)) {
+		// Set feedrate to units per minute; this is always used, and it shouldn't raise an error.
+	}
+	else if (cmd.is('M', 0)) {
+		add_record(RUN_CONFIRM, Nums(add_string(have_message, message), tool_changed ? 1 : 0));
+		tool_changed = false;
+	}
+	else if (cmd.is('M', 3) || cmd.is('M', 4)) {
+		// Spindle on; direction is not supported.
+		add_record(RUN_GPIO, Nums(-3, 1));
+	}
+	else if (cmd.is('M', 5))
+		add_record(RUN_GPIO, Nums(-3, 0));
+	else if (cmd.is('M', 9)) {
+		// Coolant off: ignore.
+	}
+	else if (cmd.is('M', 42)) {
+		if (args.has('P') && args.has('S'))
+			add_record(RUN_GPIO, Nums(trunc(args['P']), args['S']));
+		else
+			errors.push_back(format("%lld:invalid M42 request (needs P and S)", lineno));
+	}
+	else if (cmd.is('M', 84)) {
+		// Don't sleep, but set all extruder positions to 0.
+		for (size_t e = 0; e < pos1.size(); ++e)
+			add_record(RUN_SETPOS, Nums(e, 0));
+	}
+	else if (cmd.is('M', 104)) {
+		if (args['E'] >= settings.num_temps)
+			errors.push_back(format("ignoring M104 for invalid temp %.0f", args['E']));
+		else if (!args.has('S'))
+			errors.push_back("ignoring M104 without S");
+		else
+			add_record(RUN_SETTEMP, Nums(args['E'], args['S'] + C0));
+	}
+	else if (cmd.is('M', 106))
+		add_record(RUN_GPIO, Nums(-2, 1));
+	else if (cmd.is('M', 107))
+		add_record(RUN_GPIO, Nums(-2, 0));
+	else if (cmd.is('M', 109)) {
+		if (args.has('S'))
+			add_record(RUN_SETTEMP, Nums(args['E'], args['S'] + C0));
+		add_record(RUN_WAITTEMP, Nums(args['E']));
+	}
+	else if (cmd.is('M', 116))
+		add_record(RUN_WAITTEMP, Nums(-2));
+	else if (cmd.code == 'S') {
+		// Spindle speed; not supported, but shouldn't error.
+	}
+	else {
+		std::string a;
+		for (size_t i = 0; i < args.items.size(); ++i)
+			a += format("%s'%c': %s", i == 0 ? "" : ", ", args.items[i].first, repr(args.items[i].second).c_str());
+		errors.push_back(format("%lld:invalid gcode command (('%c', %lld), {%s})", lineno, cmd.code, cmd.num, a.c_str()));
+	}
+	return true;
+} // }}}
+
+bool Compiler::finish(double ret[8], bool *valid) { // {{{
+	flush_pending();
+	*valid = have_bbox[0] && have_bbox[1] && have_bbox[2] && have_bbox[3];
+	for (int i = 0; i < 6; ++i)
+		ret[i] = *valid && have_bbox[i] ? bbox[i] : 0;
+	ret[6] = time_dist[0];
+	ret[7] = time_dist[1];
+	return out.finish(strings, ret);
+} // }}}
+
+}
+
+bool compile_gcode(int src_fd, int dst_fd, int strings_fd, GcodeSettings const &settings, double bbox[8], bool *have_bbox, std::vector <std::string> &errors) { // {{{
+	Compiler compiler(settings, errors, dst_fd, strings_fd);
+	// Split input into lines like Python does in text mode: \n, \r\n and \r all end a line.
+	char buffer[1 << 16];
+	std::string line;
+	long long lineno = 0;
+	bool cr = false;
+	while (true) {
+		ssize_t len = read(src_fd, buffer, sizeof(buffer));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			errors.push_back(format("error reading G-Code: %s", strerror(errno)));
+			return false;
+		}
+		if (len == 0)
+			break;
+		for (ssize_t i = 0; i < len; ++i) {
+			char c = buffer[i];
+			if (cr && c == '\n') {
+				cr = false;
+				continue;
+			}
+			cr = c == '\r';
+			if (c == '\r' || c == '\n') {
+				line += '\n';
+				compiler.parse_line(lineno++, line);
+				line.clear();
+				continue;
+			}
+			line += c;
+		}
+	}
+	if (!line.empty())
+		compiler.parse_line(lineno++, line);
+	if (!compiler.finish(bbox, have_bbox)) {
+		errors.push_back(format("error writing run file: %s", strerror(errno)));
+		return false;
+	}
+	return true;
+} // }}}
@@ -0,0 +1,45 @@
+/* gcode.h - G-Code compiler for Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GCODE_H
+#define _GCODE_H
+
+#include <string>
+#include <vector>
+
+// Printer settings that influence the compiled file.
+struct GcodeSettings {
+	bool arc;			// Replace sequences of short lines with arcs.
+	int num_temps;
+	int num_extruders;		// Number of axes in the extruder space.
+	double park[6];			// Park position of axes in space 0; NaN if the axis doesn't exist or doesn't park.
+	std::string allow_system;	// Extended regular expression for allowed SYSTEM: commands.
+};
+
+// Compile G-Code from src_fd into a run file (see protocol.py) at dst_fd,
+// which must be at the start of an empty file.  This does the same as
+// Printer._gcode_parse in driver.py.  If strings_fd is not -1, the file can
+// be run while it is written and strings are also written to strings_fd.
+// bbox is set to the bounding box, total time and total distance; have_bbox
+// is false if the file contains no moves.
+// Warnings and errors are added to errors.  Returns false if reading or
+// writing failed.
+bool compile_gcode(int src_fd, int dst_fd, int strings_fd, GcodeSettings const &settings, double bbox[8], bool *have_bbox, std::vector <std::string> &errors);
+
+#endif
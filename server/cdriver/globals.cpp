@@ -92,6 +92,8 @@ bool globals_load(int32_t &addr)
 	if (motors_busy && (current_extruder != ce || zoffset != zo) && settings.queue_start == settings.queue_end && !settings.queue_full && !computing_move) {
 		queue[settings.queue_end].probe = false;
 		queue[settings.queue_end].cb = false;
+		queue[settings.queue_end].record = -1;
+		queue[settings.queue_end].events = -1;
 		queue[settings.queue_end].f[0] = INFINITY;
 		queue[settings.queue_end].f[1] = INFINITY;
 		for (int i = 0; i < spaces[0].num_axes; ++i) {
@@ -123,6 +125,11 @@ bool globals_load(int32_t &addr)
 		fclose(store_adc);
 		store_adc = NULL;
 	}
+	run_file_prefetch = read_16(addr);
+	if (run_file_prefetch < 1)
+		run_file_prefetch = 1;
+	else if (run_file_prefetch > QUEUE_LENGTH - 1)
+		run_file_prefetch = QUEUE_LENGTH - 1;
 	ldebug("all done");
 	if (change_hw)
 		arch_motors_change();
@@ -151,4 +158,5 @@ void globals_save(int32_t &addr)
 	write_float(addr, targety);
 	write_float(addr, zoffset);
 	write_8(addr, store_adc != NULL);
+	write_16(addr, run_file_prefetch);
 }
@@ -25,21 +25,49 @@ void HostSerial::begin() {
 	pollfds[1].revents = 0;
 	start = 0;
 	end = 0;
+	outlen = 0;
 	fcntl(0, F_SETFL, O_NONBLOCK);
 }
 
 void HostSerial::write(char c) {
 	//debug("Firmware write byte: %x", c);
-	while (true) {
-		errno = 0;
-		int ret = ::write(1, &c, 1);
-		if (ret == 1)
-			break;
-		if (errno != EAGAIN && errno != EWOULDBLOCK) {
-			debug("write to host failed: %d %s", ret, strerror(errno));
-			abort();
-		}
+	if (outlen >= int(sizeof(outbuffer)))
+		flush();
+	outbuffer[outlen++] = c;
+}
+
+void HostSerial::write(char const *data, int len) {
+	if (outlen + len <= int(sizeof(outbuffer))) {
+		memcpy(&outbuffer[outlen], data, len);
+		outlen += len;
+		return;
+	}
+	// Send buffered and new data in one call.
+	struct iovec iov[2];
+	iov[0].iov_base = outbuffer;
+	iov[0].iov_len = outlen;
+	iov[1].iov_base = const_cast <char *>(data);
+	iov[1].iov_len = len;
+	ssize_t size = outlen + len;
+	outlen = 0;
+	// Standard output is blocking, so a short write means an error.
+	if (write_some(1, iov, 2) != size) {
+		debug("write to host failed: %s", strerror(errno));
+		abort();
+	}
+}
+
+void HostSerial::flush() {
+	if (outlen == 0)
+		return;
+	struct iovec iov;
+	iov.iov_base = outbuffer;
+	iov.iov_len = outlen;
+	if (write_some(1, &iov, 1) != outlen) {
+		debug("write to host failed: %s", strerror(errno));
+		abort();
 	}
+	outlen = 0;
 }
 
 void HostSerial::refill() {
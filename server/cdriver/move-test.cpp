@@ -0,0 +1,92 @@
+/* move-test.cpp - Test for the lookahead at segment corners in Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Plan the first segment of a path and check the speed at which each motor
+// may reach its corner.  A motor that turns around must arrive at rest.
+
+// Use the driver's globals and time functions, but not its main loop.
+#define main cdriver_main
+#include "base.cpp"
+#undef main
+
+static void queue_line(double x, double y, double f) { // {{{
+	MoveCommand &mc = queue[settings.queue_end];
+	mc.cb = false;
+	mc.probe = false;
+	mc.single = false;
+	mc.f[0] = f;
+	mc.f[1] = f;
+	for (int i = 0; i < 10; ++i)
+		mc.data[i] = NAN;
+	mc.data[0] = x;
+	mc.data[1] = y;
+	mc.time = 0;
+	mc.dist = 0;
+	mc.arc = false;
+	mc.record = -1;
+	mc.events = -1;
+	settings.queue_end = (settings.queue_end + 1) % QUEUE_LENGTH;
+} // }}}
+
+static bool corner(double x0, double y0, double x1, double y1, bool reverse_x, bool reverse_y) { // {{{
+	// Plan the move from the origin to (x0, y0), continuing to (x1, y1).
+	Space &sp = spaces[0];
+	for (int a = 0; a < 2; ++a) {
+		sp.axis[a]->settings.source = 0;
+		sp.axis[a]->settings.current = 0;
+		sp.motor[a]->settings.current_pos = 0;
+	}
+	prepared = false;
+	computing_move = false;
+	settings.queue_start = 0;
+	settings.queue_end = 0;
+	settings.queue_full = false;
+	settings.end_v = 0;
+	queue_line(x0, y0, -50);
+	queue_line(x1, y1, -50);
+	queue_line(x1, y1 + 10, -50);
+	next_move();
+	bool reverse[2] = {reverse_x, reverse_y};
+	bool ok = settings.end_v > 0;
+	for (int m = 0; m < 2; ++m) {
+		if (reverse[m] ? sp.motor[m]->settings.end_v != 0 : !(sp.motor[m]->settings.end_v > 0))
+			ok = false;
+	}
+	fprintf(stderr, "(%g, %g) -> (%g, %g): end speed %f, motors %f %f%s\n", x0, y0, x1, y1, settings.end_v, sp.motor[0]->settings.end_v, sp.motor[1]->settings.end_v, ok ? "" : " FAIL");
+	return ok;
+} // }}}
+
+int main() {
+	setup();
+	Space &sp = spaces[0];
+	sp.setup_nums(2, 2);
+	for (int m = 0; m < 2; ++m) {
+		sp.motor[m]->limit_v = 200;
+		sp.motor[m]->limit_a = 1000;
+	}
+	max_deviation = .1;
+	bool ok = true;
+	ok &= corner(10, 10, 20, 30, false, false);
+	ok &= corner(10, 10, 0, 20, true, false);
+	ok &= corner(10, 10, 20, 0, false, true);
+	if (!ok)
+		return 1;
+	fprintf(stderr, "ok\n");
+	return 0;
+}
@@ -42,6 +42,22 @@ static void change0(int qpos) { // {{{
 	}
 } // }}}
 
+static void attach_events(int first, int end) { // {{{
+	// In-band events of a run file fire when the fragment in which the move after them starts has been played.
+	if (first < 0 || FRAGMENTS_PER_BUFFER == 0)
+		return;
+	int *events = fragment_events[current_fragment];
+	if (events[0] < 0) {
+		events[0] = first;
+		events[1] = end;
+	}
+	else {
+		// The same move may be started again when the fragment is regenerated.
+		events[0] = min(events[0], first);
+		events[1] = max(events[1], end);
+	}
+} // }}}
+
 static void set_from_queue(int s, int qpos, int a0, bool next, bool allow_arc) { // {{{
 	Space &sp = spaces[s];
 	for (int a = 0; a < sp.num_axes; ++a) {
@@ -167,9 +183,120 @@ static void copy_next(int s) { // {{{
 	}
 } // }}}
 
-// Used from previous segment (if prepared): tp, vq.
+static double junction_v(double const *u0, double const *u1, double a) { // {{{
+	// Maximum speed at the corner between two segments with unit directions u0 and u1 [mm/s].
+	double c = 0;
+	for (int i = 0; i < 3; ++i)
+		c += u0[i] * u1[i];
+	if (c > 1 - 1e-6)
+		return INFINITY;
+	double sinhalf = sqrt((1 - c) / 2);
+	if (sinhalf > 1 - 1e-6)
+		return 0;
+	// Speed at which a circle with centripetal acceleration a, tangent to both segments, stays within max_deviation of the corner.
+	return sqrt(a * max_deviation * sinhalf / (1 - sinhalf));
+} // }}}
+
+static double unit(double *u, double const *d) { // {{{
+	// Normalize d into u and return its length.
+	double len = 0;
+	for (int i = 0; i < 3; ++i)
+		len += d[i] * d[i];
+	len = sqrt(len);
+	for (int i = 0; i < 3; ++i)
+		u[i] = len > 0 ? d[i] / len : 0;
+	return len;
+} // }}}
+
+static double lookahead(double v_in, double v_cur, double v_next) { // {{{
+	// Find the highest speed at which the current segment can end, such that
+	// all following segments in the window can be followed at their requested
+	// speed, while still being able to stop at the end of the window.
+	// v_in is the speed at the start of the current segment; v_cur and v_next
+	// are the requested speeds of the current and next segment.  All speeds
+	// are in mm/s.  Arcs in the window are approximated by their chords.
+	// This is called after queue_start has been moved to the next segment.
+	// Returns NAN if there is no acceleration limit to work with.
+	Space &sp = spaces[0];
+	int na = min(3, sp.num_axes);
+	double a = INFINITY;
+	for (int m = 0; m < sp.num_motors; ++m) {
+		double la = sp.motor[m]->limit_a;
+		if (!isnan(la) && la > 0 && la < a)
+			a = la;
+	}
+	if (na == 0 || isinf(a))
+		return NAN;
+	double len[LOOKAHEAD_LENGTH], vmax[LOOKAHEAD_LENGTH], vj[LOOKAHEAD_LENGTH];
+	double u[2][3], d[3], pos[3];
+	// The current and next segment are already set up.
+	for (int i = 0; i < 3; ++i)
+		d[i] = i < na ? sp.axis[i]->settings.dist[0] : 0;
+	unit(u[0], d);
+	for (int i = 0; i < 3; ++i) {
+		d[i] = i < na ? sp.axis[i]->settings.dist[1] : 0;
+		pos[i] = i < na ? sp.axis[i]->settings.endpos[1] : 0;
+	}
+	unit(u[1], d);
+	len[0] = sp.settings.dist[0];
+	len[1] = sp.settings.dist[1];
+	vmax[0] = v_cur;
+	vmax[1] = v_next;
+	int num = 2;
+	for (int q = (settings.queue_start + 1) % QUEUE_LENGTH; num < LOOKAHEAD_LENGTH && q != settings.queue_end; q = (q + 1) % QUEUE_LENGTH) {
+		vj[num - 2] = junction_v(u[(num - 2) & 1], u[(num - 1) & 1], a);
+		for (int i = 0; i < na; ++i) {
+			double target = queue[q].data[i];
+			if (isnan(target)) {
+				d[i] = 0;
+				continue;
+			}
+			target += (i == 2 ? zoffset : 0);
+			d[i] = target - pos[i];
+			pos[i] = target;
+		}
+		len[num] = unit(u[num & 1], d);
+		double f = queue[q].f[0] * feedrate;
+		vmax[num] = len[num] == 0 ? 0 : f < 0 ? -f : f * len[num];
+		if (!queue[q].probe && !isnan(max_v) && !isinf(max_v) && max_v > 0 && vmax[num] > max_v)
+			vmax[num] = max_v;
+		num += 1;
+	}
+	vj[num - 2] = junction_v(u[(num - 2) & 1], u[(num - 1) & 1], a);
+	// Backward pass: the machine must be able to stop at the end of the window.
+	double v = 0;
+	for (int k = num - 2; k >= 0; --k) {
+		double limit = vj[k];
+		if (vmax[k] < limit)
+			limit = vmax[k];
+		if (vmax[k + 1] < limit)
+			limit = vmax[k + 1];
+		v = sqrt(v * v + 2 * a * len[k + 1]);
+		if (limit < v)
+			v = limit;
+	}
+	// Forward pass: the end speed must be reachable from the start speed.
+	double reachable = sqrt(v_in * v_in + 2 * a * len[0]);
+	return v < reachable ? v : reachable;
+} // }}}
+
+static void corner_motors(Space &sp, double f, double *motors) { // {{{
+	// Motor positions at fraction f of the next segment, measured from the end of this segment.
+	double target[sp.num_axes];
+	for (int a = 0; a < sp.num_axes; ++a) {
+		Axis &ax = *sp.axis[a];
+		target[a] = ax.settings.target;
+		ax.settings.target = ax.settings.source + (isnan(ax.settings.dist[0]) ? 0 : ax.settings.dist[0]) + (isnan(ax.settings.dist[1]) ? 0 : ax.settings.dist[1] * f);
+	}
+	space_types[sp.type].xyz2motors(&sp, motors);
+	for (int a = 0; a < sp.num_axes; ++a)
+		sp.axis[a]->settings.target = target[a];
+} // }}}
+
+// Used from previous segment (if prepared): tp, vq, end_v.
 int next_move() { // {{{
 	bool allow_arc = true;
+	bool was_prepared = prepared;
 	settings.probing = false;
 	settings.single = false;
 	moving_to_current = 0;
@@ -318,6 +445,8 @@ int next_move() { // {{{
 	settings.single = queue[settings.queue_start].single;
 	settings.run_time = queue[settings.queue_start].time;
 	settings.run_dist = queue[settings.queue_start].dist;
+	settings.run_file_record = queue[settings.queue_start].record;
+	int events = queue[settings.queue_start].events;
 
 	if (queue[settings.queue_start].cb) {
 		cbs_after_current_move += 1;
@@ -343,6 +472,14 @@ int next_move() { // {{{
 				sp.axis[a]->settings.dist[0] = NAN;
 		}
 		settings.fq = 0;
+		settings.end_v = 0;
+		if (events >= 0) {
+			// Pass the events on to the next move, or fire them after the current fragment.
+			if (settings.queue_start != settings.queue_end || settings.queue_full)
+				queue[settings.queue_start].events = events;
+			else
+				attach_events(events, settings.run_file_record);
+		}
 		return num_cbs + next_move();
 	} // }}}
 
@@ -395,6 +532,21 @@ int next_move() { // {{{
 	}
 #ifdef DEBUG_MOVE
 	debug("After limiting, v0 = %f /s, vp = %f /s and vq = %f /s", v0, vp, vq);
+#endif
+	// }}}
+	// Use lookahead to limit the speed at the end of this segment. {{{
+	double end_v = 0;
+	if (prepared && !settings.probing && spaces[0].settings.dist[0] > 0 && spaces[0].settings.dist[1] > 0) {
+		double v_cur = fabs(v0) > fabs(vp) ? fabs(v0) : fabs(vp);
+		end_v = lookahead(was_prepared ? settings.end_v : 0, v_cur * spaces[0].settings.dist[0], fabs(vq) * spaces[0].settings.dist[1]);
+		if (isnan(end_v))
+			end_v = 0;
+		else if (vq > end_v / spaces[0].settings.dist[1])
+			vq = end_v / spaces[0].settings.dist[1];
+	}
+	settings.end_v = end_v;
+#ifdef DEBUG_MOVE
+	debug("After lookahead, end_v = %f mm/s and vq = %f /s", end_v, vq);
 #endif
 	// }}}
 	// Already set up: f0, v0, vp, vq, dist[0], dist[1], mtr->dist[0], mtr->dist[1].
@@ -468,6 +620,23 @@ int next_move() { // {{{
 		}
 		// Using NULL as target fills endpos.
 		space_types[sp.type].xyz2motors(&sp, NULL);
+		// Allow motors to reach endpos at the planned speed, in proportion to their part of the move.
+		// Motors that stop or turn around at the corner must reach it at zero speed.
+		double end_f = spaces[0].settings.dist[0] > 0 ? settings.end_v / spaces[0].settings.dist[0] : 0;
+		double corner[sp.num_motors], next[sp.num_motors];
+		if (end_f > 0) {
+			corner_motors(sp, 0, corner);
+			// Only the direction at the corner matters, so look a short way into the next segment.
+			corner_motors(sp, 1e-3, next);
+		}
+		for (int m = 0; m < sp.num_motors; ++m) {
+			Motor &mtr = *sp.motor[m];
+			double pos = mtr.settings.current_pos / mtr.steps_per_unit;
+			if (end_f > 0 && !isnan(mtr.settings.endpos) && (corner[m] - pos) * (next[m] - corner[m]) > 0)
+				mtr.settings.end_v = end_f * fabs(mtr.settings.endpos - pos);
+			else
+				mtr.settings.end_v = 0;
+		}
 	}
 	// }}}
 
@@ -506,6 +675,7 @@ int next_move() { // {{{
 #endif
 	} // }}}
 
+	attach_events(events, settings.run_file_record);
 	first_fragment = current_fragment;	// Do this every time, because otherwise the queue must be regenerated.	TODO: send partial fragment to make sure this hack actually works, or fix it properly.
 	computing_move = true;
 	return num_cbs;
@@ -535,7 +705,7 @@ void abort_move(int pos) { // {{{
 	debug("move no longer prepared");
 #endif
 	//debug("free abort reset");
-	current_fragment_pos = 0;
+	restore_checkpoint(pos);
 	computing_move = true;
 	while (computing_move && current_fragment_pos < unsigned(pos)) {
 		//debug("abort reconstruct %d %d", current_fragment_pos, pos);
@@ -547,6 +717,7 @@ void abort_move(int pos) { // {{{
 	store_settings();
 	computing_move = false;
 	prepared = false;
+	settings.end_v = 0;
 	current_fragment_pos = 0;
 	for (int s = 0; s < NUM_SPACES; ++s) {
 		Space &sp = spaces[s];
@@ -560,6 +731,8 @@ void abort_move(int pos) { // {{{
 		}
 		for (int m = 0; m < sp.num_motors; ++m) {
 			sp.motor[m]->settings.last_v = 0;
+			sp.motor[m]->settings.last_a = 0;
+			sp.motor[m]->settings.end_v = 0;
 			//debug("setting motor %d pos to %f", m, sp.motor[m]->settings.current_pos);
 		}
 	}
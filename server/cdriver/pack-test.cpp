@@ -0,0 +1,126 @@
+/* pack-test.cpp - Round-trip test for the avr sample packing in Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Pack random fragments with avr_pack_samples, decode them with the firmware's
+// unpack_samples and check that the samples are unchanged.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
+#include "avr-pack.h"
+
+// As in cdriver.h and arch-avr.h.
+#define COMMAND_SIZE 256
+#define AVR_PACKED_SAMPLES 124
+
+static uint8_t packet[COMMAND_SIZE];
+
+static uint8_t command(int pos) {
+	return packet[pos];
+}
+
+static uint16_t read_16(int pos) {
+	return command(pos) | (command(pos + 1) << 8);
+}
+
+static uint32_t read_32(int pos) {
+	uint32_t ret = 0;
+	for (uint8_t b = 0; b < 4; ++b)
+		ret |= uint32_t(command(pos + b)) << (8 * b);
+	return ret;
+}
+
+#include "../../firmware/unpack.h"
+
+static void make_samples(int *value, int num, int mode) { // {{{
+	int x = 0;
+	double p = rand() / double(RAND_MAX);
+	double v = (rand() % 4000 - 2000) / 100.;
+	double a = (rand() % 2000 - 1000) / 1000.;
+	double last = floor(p);
+	for (int i = 0; i < num; ++i) {
+		switch (mode) {
+		case 0:
+			// Noise.
+			value[i] = rand() % 65535 - 32767;
+			break;
+		case 1:
+			// Mostly standing still.
+			value[i] = rand() % 4 == 0 ? rand() % 7 - 3 : 0;
+			break;
+		case 2:
+			// Small changes.
+			x += rand() % 3 - 1;
+			value[i] = x;
+			break;
+		case 3:
+			// Long runs of the same speed.
+			value[i] = rand() % 10 == 0 ? rand() % 600 - 300 : i > 0 ? value[i - 1] : 0;
+			break;
+		default:
+			// Constant acceleration; mode 5 reverses it halfway.
+			if (mode == 5 && i == num / 2)
+				a = -a;
+			p += v + a / 2;
+			v += a;
+			value[i] = int(floor(p) - last);
+			last = floor(p);
+			break;
+		}
+	}
+} // }}}
+
+int main() {
+	srand(1);
+	long raw = 0, packed = 0;
+	for (int t = 0; t < 100000; ++t) {
+		int num = 1 + rand() % AVR_PACKED_SAMPLES;
+		int mode = rand() % 6;
+		int value[AVR_PACKED_SAMPLES];
+		make_samples(value, num, mode);
+		// Pack it like arch_send_fragment does.
+		char data[4 * AVR_PACKED_SAMPLES];
+		int len = avr_pack_samples(data, value, 0, num, false, true);
+		if (len > 2 * num + (num + 31) / 32)
+			len = avr_pack_samples(data, value, 0, num, true, false);
+		if (3 + len >= COMMAND_SIZE) {
+			printf("fragment %d (mode %d): %d samples packed into %d bytes\n", t, mode, num, len);
+			return 1;
+		}
+		packet[2] = len;
+		for (int i = 0; i < len; ++i)
+			packet[3 + i] = data[i];
+		int16_t target[AVR_PACKED_SAMPLES];
+		if (!unpack_samples(target, num)) {
+			printf("fragment %d (mode %d): decoding failed\n", t, mode);
+			return 1;
+		}
+		for (int i = 0; i < num; ++i) {
+			if (target[i] != value[i]) {
+				printf("fragment %d (mode %d): sample %d is %d instead of %d\n", t, mode, i, target[i], value[i]);
+				return 1;
+			}
+		}
+		raw += 2 * num;
+		packed += len;
+	}
+	printf("ok: %ld bytes of samples packed into %ld (%.2f)\n", raw, packed, double(packed) / raw);
+	return 0;
+}
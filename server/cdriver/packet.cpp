@@ -88,7 +88,7 @@ void waittemp(int which, double mintemp, double maxtemp) {
 	temps[which].adcmax_alarm = temps[which].toadc(temps[which].max_alarm, MAXINT);
 }
 
-void setpos(int which, int t, double f) {
+void setpos(int which, int t, double f, bool keep_offset) {
 	if (!motors_busy)
 	{
 		debug("Error: Setting position while motors are not busy!");
@@ -119,12 +119,18 @@ void setpos(int which, int t, double f) {
 		spaces[which].motor[t]->settings.current_pos = diff;
 		//debug("setpos nan %d %d %f", which, t, diff);
 	}
+	// The position is now known, so run files use it directly.
+	if (!keep_offset)
+		spaces[which].axis[t]->settings.run_offset = 0;
 	for (int fragment = 0; fragment < FRAGMENTS_PER_BUFFER; ++fragment) {
-		if (!isnan(spaces[which].motor[t]->history[fragment].current_pos))
-			spaces[which].motor[t]->history[fragment].current_pos += diff;
+		if (!isnan(spaces[which].motor[t]->history(fragment).current_pos))
+			spaces[which].motor[t]->history(fragment).current_pos += diff;
 		else
-			spaces[which].motor[t]->history[fragment].current_pos = diff;
+			spaces[which].motor[t]->history(fragment).current_pos = diff;
+		if (!keep_offset)
+			spaces[which].axis[t]->history(fragment).run_offset = 0;
 	}
+	clear_checkpoints();
 	if (isnan(spaces[which].axis[t]->settings.current)) {
 		space_types[spaces[which].type].reset_pos(&spaces[which]);
 		for (int a = 0; a < spaces[which].num_axes; ++a)
@@ -195,6 +201,8 @@ void packet()
 			num += spaces[t].num_axes;
 		queue[settings.queue_end].probe = command[0][2] == CMD_PROBE;
 		queue[settings.queue_end].single = command[0][2] == CMD_SINGLE;
+		queue[settings.queue_end].record = -1;
+		queue[settings.queue_end].events = -1;
 		int const offset = 3 + ((num - 1) >> 3) + 1;	// Bytes from start of command where values are.
 		int t = 0;
 		for (int ch = 0; ch < num; ++ch)
@@ -242,6 +250,7 @@ void packet()
 		}
 		else
 			serialdev[0]->write(OK);
+		serialdev[0]->flush();
 		if (!computing_move) {
 			//debug("starting move");
 			int num_movecbs = next_move();
@@ -255,7 +264,7 @@ void packet()
 					//debug("sent immediate %d cbs", num_movecbs);
 				}
 			}
-			//debug("no movecbs to add (prev %d)", history[(current_fragment - 1 + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER].cbs);
+			//debug("no movecbs to add (prev %d)", history((current_fragment - 1 + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER).cbs);
 			buffer_refill();
 		}
 		//else
@@ -406,7 +415,9 @@ void packet()
 			return;
 		}
 		double f = get_float(5);
-		setpos(which, t, f);
+		// When resuming a paused run file, the host restores the position
+		// where it stopped; the file continues with the same offset.
+		setpos(which, t, f, run_file_map != NULL);
 		return;
 	}
 	case CMD_GETPOS:	// Get current position
@@ -652,6 +663,9 @@ void packet()
 				cbs_after_current_move = 0;
 			}
 			arch_stop();
+			// When the stop has not completed yet, the arch restores the queue when it does.
+			if (!host_block)
+				run_file_rewind();
 			settings.queue_start = 0;
 			settings.queue_end = 0;
 			settings.queue_full = false;
@@ -732,7 +746,7 @@ void packet()
 #ifdef DEBUG_CMD
 		debug("CMD_GETTIME");
 #endif
-		send_host(CMD_TIME, 0, 0, (history[running_fragment].run_time + history[running_fragment].run_dist / max_v) / feedrate + settings.hwtime / 1e6);
+		send_host(CMD_TIME, 0, 0, (history(running_fragment).run_time + history(running_fragment).run_dist / max_v) / feedrate + settings.hwtime / 1e6);
 		return;
 	}
 	case CMD_SPI:
@@ -760,8 +774,11 @@ void packet()
 #ifdef DEBUG_CMD
 		debug("CMD_TP_GETPOS");
 #endif
-		// TODO: Send actual current position, not next queued.  Include fraction.
-		send_host(CMD_TP_POS, 0, 0, history[running_fragment].run_file_current);
+		// TODO: Include fraction.
+		if (history(running_fragment).run_file_record >= 0)
+			send_host(CMD_TP_POS, 0, 0, history(running_fragment).run_file_record);
+		else
+			send_host(CMD_TP_POS, 0, 0, history(running_fragment).run_file_current);
 		return;
 	}
 	case CMD_TP_SETPOS:
@@ -771,18 +788,23 @@ void packet()
 #endif
 		double pos = get_float(3);
 		int ipos = int(pos);
-		if (ipos > 0 && ipos < run_file_num_records && (run_file_map[ipos - 1].type == RUN_PRE_ARC || run_file_map[ipos - 1].type == RUN_PRE_LINE))
+		if (ipos > 0 && ipos < run_file_num_records && (run_record(ipos - 1).type == RUN_PRE_ARC || run_record(ipos - 1).type == RUN_PRE_LINE))
 			ipos -= 1;
 		discarding = true;
 		arch_discard();
-		settings.run_file_current = int(pos);
+		settings.run_file_current = ipos;
+		settings.run_file_events = -1;
 		// Hack to force TP_GETPOS to return the same value; this is only called when paused, so it does no harm.
-		history[running_fragment].run_file_current = int(pos);
+		history(running_fragment).run_file_current = int(pos);
+		history(running_fragment).run_file_record = -1;
+		clear_checkpoints();
 		for (int s = 0; s < NUM_SPACES; ++s) {
 			Space &sp = spaces[s];
 			for (int a = 0; a < sp.num_axes; ++a)
 				sp.axis[a]->settings.source = NAN;
 		}
+		// Temperatures, gpios and extruder positions are set as if the file was run up to here.
+		run_restore_state(ipos);
 		// TODO: Use fraction.
 		discarding = false;
 		buffer_refill();
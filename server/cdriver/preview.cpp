@@ -0,0 +1,483 @@
+/* preview.cpp - Toolpath preview export for Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "preview.h"
+#include "runfile.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <map>
+#include <vector>
+
+// Record types; these are the values of protocol.parsed.
+enum {
+	RUN_SYSTEM,
+	RUN_PRE_LINE,
+	RUN_LINE,
+	RUN_PRE_ARC,
+	RUN_ARC,
+	RUN_GPIO,
+	RUN_SETTEMP,
+	RUN_WAITTEMP,
+	RUN_SETPOS,
+	RUN_WAIT,
+	RUN_CONFIRM,
+	RUN_PARK,
+};
+
+// Sections that are used here; see gcode.cpp.
+enum {
+	SECTION_RECORDS,
+	SECTION_INDEX,
+};
+
+// Maximum deviation from the toolpath for each level of detail, in mm.  Level
+// 0 is also the maximum deviation of arcs from their line segments.
+static float const tolerance[] = {.01, .05, .2, 1};
+#define NUM_LEVELS int(sizeof(tolerance) / sizeof(*tolerance))
+// Height difference that starts a new layer, in mm.
+#define LAYER_EPSILON 1e-3
+
+namespace {
+
+struct Record {
+	int type;
+	int64_t tool;
+	double X, Y, Z, E, f, F;
+};
+
+class RunReader { // {{{
+	// Minimal decoder of format 2 run files; see protocol.py.
+	char const *map;
+	off_t size;
+	uint32_t block_records;
+	uint64_t records, records_size;
+	uint64_t index, num_blocks;
+	template <typename T> T get(uint64_t pos) const {
+		T ret;
+		memcpy(&ret, &map[pos], sizeof(T));
+		return ret;
+	}
+public:
+	uint32_t num_records;
+	RunReader() : map(NULL), size(0), block_records(0), records(0), records_size(0), index(0), num_blocks(0), num_records(0) {}
+	~RunReader() {
+		if (map)
+			munmap(const_cast <char *>(map), size);
+	}
+	bool open(int fd, std::string &error) {
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			error = std::string("unable to read run file: ") + strerror(errno);
+			return false;
+		}
+		size = st.st_size;
+		if (size < 24) {
+			error = "run file is too short";
+			return false;
+		}
+		void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (m == MAP_FAILED) {
+			error = std::string("unable to map run file: ") + strerror(errno);
+			return false;
+		}
+		map = reinterpret_cast <char const *>(m);
+		uint32_t num_sections = get <uint32_t>(20);
+		if (memcmp(map, RUN_FILE_MAGIC, 8) != 0 || get <uint32_t>(8) != 2 || num_sections == 0 || uint64_t(24) + num_sections * 24 > uint64_t(size)) {
+			error = "run file is not complete or not in format 2";
+			return false;
+		}
+		num_records = get <uint32_t>(12);
+		block_records = get <uint32_t>(16);
+		if (block_records == 0) {
+			error = "invalid run file header";
+			return false;
+		}
+		bool found[2] = {false, false};
+		for (uint32_t s = 0; s < num_sections; ++s) {
+			uint32_t type = get <uint32_t>(24 + s * 24);
+			uint64_t offset = get <uint64_t>(24 + s * 24 + 8);
+			uint64_t length = get <uint64_t>(24 + s * 24 + 16);
+			if (offset > uint64_t(size) || length > uint64_t(size) - offset) {
+				error = "run file section is out of range";
+				return false;
+			}
+			if (type == SECTION_RECORDS) {
+				records = offset;
+				records_size = length;
+				found[0] = true;
+			}
+			else if (type == SECTION_INDEX) {
+				index = offset;
+				num_blocks = length / sizeof(uint64_t);
+				found[1] = true;
+			}
+		}
+		if (!found[0] || !found[1] || num_blocks != (uint64_t(num_records) + block_records - 1) / block_records) {
+			error = "run file has no valid records or index";
+			return false;
+		}
+		return true;
+	}
+	bool decode(uint64_t block, std::vector <Record> &out) {
+		// Returns false if the block runs past the end of the records.
+		out.clear();
+		uint64_t pos = get <uint64_t>(index + block * sizeof(uint64_t));
+		uint64_t end = records_size;
+		double values[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+		int64_t tool = 0;
+		int64_t base[4] = {0, 0, 0, 0};
+		uint32_t n = block_records;
+		if ((block + 1) * block_records > num_records)
+			n = num_records - block * block_records;
+		for (uint32_t r = 0; r < n; ++r) {
+			if (pos + 3 > end)
+				return false;
+			uint32_t header = uint8_t(map[records + pos]) | uint8_t(map[records + pos + 1]) << 8 | uint8_t(map[records + pos + 2]) << 16;
+			pos += 3;
+			for (int k = -1; k < 8; ++k) {
+				int code = (header >> (6 + 2 * k)) & 3;
+				if (k < 0 ? code != 1 : code == 0)
+					continue;
+				if (k < 0 || (code == 1 && k < 4)) {
+					// Zigzag varint.
+					uint64_t v = 0;
+					for (int shift = 0; ; shift += 7) {
+						if (pos >= end || shift > 63)
+							return false;
+						uint8_t b = map[records + pos++];
+						v |= uint64_t(b & 0x7f) << shift;
+						if (!(b & 0x80))
+							break;
+					}
+					int64_t delta = v & 1 ? -int64_t(v >> 1) - 1 : int64_t(v >> 1);
+					if (k < 0)
+						tool += delta;
+					else {
+						base[k] += delta;
+						values[k] = base[k] / RUN_FILE_SCALE;
+					}
+				}
+				else if (code == 1)
+					values[k] = values[k - 1];
+				else if (code == 2) {
+					if (pos + 4 > end)
+						return false;
+					float value;
+					memcpy(&value, &map[records + pos], 4);
+					pos += 4;
+					values[k] = k >= 6 ? values[k] + value : value;
+				}
+				else {
+					if (pos + 8 > end)
+						return false;
+					memcpy(&values[k], &map[records + pos], 8);
+					pos += 8;
+				}
+			}
+			Record rec = {int(header & 0xf), tool, values[0], values[1], values[2], values[3], values[4], values[5]};
+			out.push_back(rec);
+		}
+		return true;
+	}
+	uint64_t blocks() const { return num_blocks; }
+}; // }}}
+
+struct Polyline {
+	bool travel;
+	std::vector <double> points;	// x, y pairs.
+};
+
+struct Layer {
+	double z;
+	std::vector <Polyline> lines;
+};
+
+class Builder { // {{{
+	// Turn the records into polylines per layer.
+	bool extrude_all;
+	double current[3];
+	double center[3], normal[3];
+	std::map <int64_t, double> e;
+	bool pre_extrude;
+public:
+	bool extruded;	// Whether anything was extruded.
+	std::vector <Layer> layers;
+	Builder(bool extrude_all_) : extrude_all(extrude_all_), pre_extrude(false), extruded(false) {
+		for (int k = 0; k < 3; ++k) {
+			current[k] = NAN;
+			center[k] = NAN;
+			normal[k] = NAN;
+		}
+	}
+	bool moves_e(int64_t tool, double E) {
+		// Update the extruder position; return true if it moves forward.
+		if (tool < 0 || isnan(E))
+			return false;
+		double &pos = e[tool];	// Extruders start at 0.
+		bool ret = E > pos + 1e-9;
+		pos = E;
+		return ret;
+	}
+	void add(Record const &r) {
+		switch (r.type) {
+			case RUN_PRE_ARC:
+				center[0] = r.X;
+				center[1] = r.Y;
+				center[2] = r.Z;
+				normal[0] = r.E;
+				normal[1] = r.f;
+				normal[2] = r.F;
+				return;
+			case RUN_PRE_LINE:
+				pre_extrude = moves_e(r.tool, r.E);
+				return;
+			case RUN_SETPOS:
+				if (r.tool >= 0)
+					e[r.tool] = r.X;
+				return;
+			case RUN_LINE:
+			case RUN_ARC:
+				break;
+			default:
+				return;
+		}
+		bool extrude = moves_e(r.tool, r.E) || pre_extrude;
+		pre_extrude = false;
+		extruded = extruded || extrude;
+		if (extrude_all)
+			extrude = true;
+		double start[3], end[3] = {r.X, r.Y, r.Z};
+		for (int k = 0; k < 3; ++k) {
+			start[k] = current[k];
+			if (isnan(end[k]))
+				end[k] = current[k];
+			current[k] = end[k];
+		}
+		if (isnan(start[0]) || isnan(start[1]) || isnan(end[0]) || isnan(end[1]))
+			return;
+		if (layers.empty() || (extrude && !isnan(end[2]) && !(fabs(end[2] - layers.back().z) <= LAYER_EPSILON))) {
+			layers.push_back(Layer());
+			layers.back().z = isnan(end[2]) ? 0 : end[2];
+		}
+		std::vector <Polyline> &lines = layers.back().lines;
+		if (lines.empty() || lines.back().travel == extrude || lines.back().points[lines.back().points.size() - 2] != start[0] || lines.back().points.back() != start[1]) {
+			lines.push_back(Polyline());
+			lines.back().travel = !extrude;
+			lines.back().points.push_back(start[0]);
+			lines.back().points.push_back(start[1]);
+		}
+		std::vector <double> &points = lines.back().points;
+		if (r.type == RUN_ARC)
+			add_arc(points, start, end);
+		points.push_back(end[0]);
+		points.push_back(end[1]);
+	}
+	void add_arc(std::vector <double> &points, double const start[3], double const end[3]) {
+		// Add the points of an arc, except the end point.  This
+		// computes arcs the same way as set_from_queue does.
+		double n = 0;
+		for (int k = 0; k < 3; ++k) {
+			if (isnan(start[k]) || isnan(end[k]) || isnan(center[k]) || isnan(normal[k]))
+				return;
+			n += normal[k] * normal[k];
+		}
+		n = sqrt(n);
+		if (n == 0)
+			return;
+		double unit[3], c[3], target[3], e1[3], e2[3];
+		double sn = 0, cn = 0, tn = 0;
+		for (int k = 0; k < 3; ++k) {
+			unit[k] = normal[k] / n;
+			sn += start[k] * unit[k];
+			cn += center[k] * unit[k];
+			tn += end[k] * unit[k];
+		}
+		double helix = tn - sn;
+		double src = 0, dst = 0;
+		for (int k = 0; k < 3; ++k) {
+			c[k] = center[k] - unit[k] * (cn - sn);
+			target[k] = end[k] - unit[k] * helix;
+			e1[k] = start[k] - c[k];
+			src += e1[k] * e1[k];
+			dst += (target[k] - c[k]) * (target[k] - c[k]);
+		}
+		src = sqrt(src);
+		dst = sqrt(dst);
+		if (src == 0 || dst == 0)
+			return;
+		double cosa = 0, sina = 0;
+		for (int k = 0; k < 3; ++k)
+			e1[k] /= src;
+		for (int k = 0; k < 3; ++k) {
+			e2[k] = unit[(k + 1) % 3] * e1[(k + 2) % 3] - unit[(k + 2) % 3] * e1[(k + 1) % 3];
+			cosa += e1[k] * (target[k] - c[k]) / dst;
+			sina += e2[k] * (target[k] - c[k]) / dst;
+		}
+		double angle = atan2(sina, cosa);
+		if (angle <= 0)
+			angle += 2 * M_PI;
+		// Use enough points to stay within the finest tolerance.
+		double radius = src > dst ? src : dst;
+		int steps = 1;
+		if (radius > tolerance[0])
+			steps = int(ceil(angle / (2 * acos(1 - tolerance[0] / radius))));
+		if (steps > 1000)
+			steps = 1000;
+		for (int i = 1; i < steps; ++i) {
+			double u = double(i) / steps;
+			double a = angle * u;
+			double rad = src + (dst - src) * u;
+			points.push_back(c[0] + rad * (cos(a) * e1[0] + sin(a) * e2[0]) + helix * u * unit[0]);
+			points.push_back(c[1] + rad * (cos(a) * e1[1] + sin(a) * e2[1]) + helix * u * unit[1]);
+		}
+	}
+}; // }}}
+
+void simplify(std::vector <double> const &p, double tol, std::string &out) { // {{{
+	// Douglas-Peucker; write the kept points as floats.
+	size_t n = p.size() / 2;
+	std::vector <bool> keep(n, n <= 2);
+	keep[0] = true;
+	keep[n - 1] = true;
+	std::vector <std::pair <size_t, size_t> > todo;
+	if (n > 2)
+		todo.push_back(std::make_pair(size_t(0), n - 1));
+	while (!todo.empty()) {
+		size_t a = todo.back().first, b = todo.back().second;
+		todo.pop_back();
+		double ax = p[2 * a], ay = p[2 * a + 1];
+		double dx = p[2 * b] - ax, dy = p[2 * b + 1] - ay;
+		double len2 = dx * dx + dy * dy;
+		double worst = -1;
+		size_t worst_i = a;
+		for (size_t i = a + 1; i < b; ++i) {
+			// Distance to the segment, so closed loops work.
+			double px = p[2 * i] - ax, py = p[2 * i + 1] - ay;
+			double u = len2 > 0 ? (px * dx + py * dy) / len2 : 0;
+			u = u < 0 ? 0 : u > 1 ? 1 : u;
+			double ex = px - u * dx, ey = py - u * dy;
+			double d = ex * ex + ey * ey;
+			if (d > worst) {
+				worst = d;
+				worst_i = i;
+			}
+		}
+		if (worst > tol * tol) {
+			keep[worst_i] = true;
+			if (worst_i - a > 1)
+				todo.push_back(std::make_pair(a, worst_i));
+			if (b - worst_i > 1)
+				todo.push_back(std::make_pair(worst_i, b));
+		}
+	}
+	uint32_t count = 0;
+	size_t count_pos = out.size();
+	out.append(4, '\0');
+	for (size_t i = 0; i < n; ++i) {
+		if (!keep[i])
+			continue;
+		float xy[2] = {float(p[2 * i]), float(p[2 * i + 1])};
+		out.append(reinterpret_cast <char const *>(xy), sizeof(xy));
+		count += 1;
+	}
+	memcpy(&out[count_pos], &count, 4);
+} // }}}
+
+template <typename T> void put(std::string &out, T value) {
+	out.append(reinterpret_cast <char const *>(&value), sizeof(T));
+}
+
+}
+
+bool export_preview(int src_fd, int dst_fd, std::string &error) { // {{{
+	RunReader reader;
+	if (!reader.open(src_fd, error))
+		return false;
+	std::vector <Record> records;
+	Builder builder(false);
+	for (int pass = 0; pass < 2; ++pass) {
+		for (uint64_t b = 0; b < reader.blocks(); ++b) {
+			if (!reader.decode(b, records)) {
+				error = "invalid records in run file";
+				return false;
+			}
+			for (size_t i = 0; i < records.size(); ++i)
+				builder.add(records[i]);
+		}
+		if (builder.extruded)
+			break;
+		// Without extrusion, show all moves.
+		builder = Builder(true);
+	}
+	std::vector <Layer> const &layers = builder.layers;
+	std::string data;
+	std::vector <uint32_t> table;
+	uint64_t data_start = 8 + 4 * 4 + NUM_LEVELS * 4 + layers.size() * (8 + NUM_LEVELS * 8);
+	for (size_t l = 0; l < layers.size(); ++l) {
+		for (int level = 0; level < NUM_LEVELS; ++level) {
+			uint64_t start = data.size();
+			for (size_t i = 0; i < layers[l].lines.size(); ++i) {
+				Polyline const &line = layers[l].lines[i];
+				size_t pos = data.size();
+				simplify(line.points, tolerance[level], data);
+				if (line.travel)
+					data[pos + 3] |= char(PREVIEW_TRAVEL >> 24);
+			}
+			if (data_start + data.size() > 0xffffffff) {
+				error = "preview is too large";
+				return false;
+			}
+			table.push_back(data_start + start);
+			table.push_back(data.size() - start);
+		}
+	}
+	std::string out = PREVIEW_MAGIC;
+	put(out, uint32_t(1));
+	put(out, uint32_t(NUM_LEVELS));
+	put(out, uint32_t(layers.size()));
+	put(out, uint32_t(0));
+	for (int level = 0; level < NUM_LEVELS; ++level)
+		put(out, tolerance[level]);
+	for (size_t l = 0; l < layers.size(); ++l) {
+		put(out, float(layers[l].z));
+		put(out, uint32_t(0));
+		for (int level = 0; level < NUM_LEVELS; ++level) {
+			put(out, table[2 * (l * NUM_LEVELS + level)]);
+			put(out, table[2 * (l * NUM_LEVELS + level) + 1]);
+		}
+	}
+	out += data;
+	size_t done = 0;
+	while (done < out.size()) {
+		ssize_t ret = write(dst_fd, &out[done], out.size() - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			error = std::string("unable to write preview: ") + strerror(errno);
+			return false;
+		}
+		done += ret;
+	}
+	return true;
+} // }}}
@@ -0,0 +1,45 @@
+/* preview.h - Toolpath preview export for Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PREVIEW_H
+#define _PREVIEW_H
+
+#include <string>
+
+// A preview holds the moves of a run file as polylines in the XY plane, per
+// layer, at several levels of detail.  All values are little endian.
+// header: char magic[8] = "FRANKPRV", uint32_t version = 1,
+//	uint32_t num_levels, uint32_t num_layers, uint32_t reserved,
+//	float tolerance[num_levels] (the maximum deviation in each level).
+// layer table: for every layer: float z, uint32_t reserved, and for every
+//	level uint32_t offset and size of its data in the file.
+// layer data: polylines, each a uint32_t number of points, with the high
+//	bit set for moves that don't extrude, followed by float x, y for every
+//	point.
+// Layers are started by extruding moves at a new height; other moves are
+// part of the current layer.  If nothing is extruded, all moves count as
+// extruding.
+#define PREVIEW_MAGIC "FRANKPRV"
+#define PREVIEW_TRAVEL 0x80000000
+
+// Write the preview of the run file at src_fd, which must be complete and
+// in format 2, to dst_fd.  On failure, error is set and false is returned.
+bool export_preview(int src_fd, int dst_fd, std::string &error);
+
+#endif
@@ -20,6 +20,10 @@
 #include "cdriver.h"
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <spawn.h>
+#include <fcntl.h>
 
 #if 0
 #define rundebug debug
@@ -44,8 +48,434 @@ static String *strings;
 
 static Run_Record run_preline;
 
+// Format 2 files are decoded a block at a time; the last two blocks are kept.
+static bool run_file_v2;
+static int run_file_block;	// Records per block.
+static int run_file_num_blocks;
+static char const *run_file_records;
+static off_t run_file_records_size;
+static char const *run_file_index;	// Offset of each block in run_file_records.
+static off_t run_file_state = -1;	// Offset of the state section in run_file_map, or -1.
+static off_t run_file_state_size;
+static Run_Record *run_block[2];
+static int run_block_num[2];
+static int run_block_size[2];	// Number of decoded records; blocks of a growing file may be incomplete.
+static int run_block_last;
+
+// A file that is still being written is followed while it grows.  Its block
+// index is built while decoding and its strings come from a side file.
+static bool run_file_stream;
+static int run_file_fd = -1;
+static uint64_t *run_stream_index;
+static int run_stream_index_size;
+static int run_stream_strings_fd = -1;
+static char *run_stream_string_data;
+static off_t run_stream_string_size;
+static off_t run_stream_string_parsed;
+
 static double probe_adjust;
 
+// Index of the toolpath for run_find_pos; built on the first search.  Only
+// the bounding boxes are stored; the geometry of a candidate is computed
+// from the records when it is checked.
+struct FindSegment {
+	int record;
+	int seen;
+	// Bounding box in X and Y.
+	double min[2], max[2];
+};
+
+// Line or arc for run_find_pos.
+struct FindGeometry {
+	bool arc;
+	double start[3], end[3];
+	// Only used for arcs.
+	double center[3], e1[3], e2[3], normal[3];
+	double angle, radius[2], helix;
+};
+
+static bool find_built;
+static FindSegment *find_segments;	// NULL if the index could not be allocated.
+static int find_num_segments;
+static double (*find_start)[3];	// Start position of every FIND_POS_START_INTERVAL'th segment.
+static int *find_cell;	// Start of each cell in find_items; find_cell[find_nx * find_ny] is the end.
+static int *find_items;
+static int *find_loose;	// Segments that are not in the grid.
+static int find_num_loose;
+static int find_nx, find_ny;
+static double find_x0, find_y0, find_size;
+static int find_stamp;
+
+static void free_find_index() {
+	free(find_segments);
+	free(find_start);
+	free(find_cell);
+	free(find_items);
+	free(find_loose);
+	find_built = false;
+	find_segments = NULL;
+	find_start = NULL;
+	find_cell = NULL;
+	find_items = NULL;
+	find_loose = NULL;
+	find_num_segments = 0;
+	find_num_loose = 0;
+	find_nx = 0;
+	find_ny = 0;
+}
+
+static off_t run_block_offset(int b) {
+	if (b >= run_file_num_blocks)
+		return run_file_records_size;
+	uint64_t ret;
+	memcpy(&ret, &run_file_index[b * sizeof(uint64_t)], sizeof(uint64_t));
+	return ret < uint64_t(run_file_records_size) ? off_t(ret) : run_file_records_size;
+}
+
+static bool run_read(uint8_t const *&p, uint8_t const *end, void *target, int len) {
+	if (end - p < len)
+		return false;
+	memcpy(target, p, len);
+	p += len;
+	return true;
+}
+
+static bool run_read_varint(uint8_t const *&p, uint8_t const *end, int64_t *value) {
+	uint64_t ret = 0;
+	for (int shift = 0; shift < 64 && p < end; shift += 7) {
+		uint8_t b = *p++;
+		ret |= uint64_t(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*value = int64_t(ret >> 1) ^ -int64_t(ret & 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void run_stream_add_block(off_t offset) {
+	if (run_file_num_blocks >= run_stream_index_size) {
+		run_stream_index_size *= 2;
+		run_stream_index = reinterpret_cast<uint64_t *>(realloc(run_stream_index, run_stream_index_size * sizeof(uint64_t)));
+		run_file_index = reinterpret_cast<char const *>(run_stream_index);
+	}
+	run_stream_index[run_file_num_blocks++] = offset;
+}
+
+static int run_decode_block(int b, Run_Record *record) {
+	uint8_t const *p = reinterpret_cast<uint8_t const *>(run_file_records) + run_block_offset(b);
+	uint8_t const *end = reinterpret_cast<uint8_t const *>(run_file_records) + run_block_offset(b + 1);
+	int num = min(run_file_block, run_file_num_records - b * run_file_block);
+	int32_t tool = 0;
+	double value[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	int64_t base[4] = {0, 0, 0, 0};
+	for (int i = 0; i < num; ++i) {
+		uint8_t h[3];
+		bool ok = run_read(p, end, h, 3);
+		uint32_t header = h[0] | h[1] << 8 | h[2] << 16;
+		int64_t delta = 0;
+		if (ok && ((header >> 4) & 3) == 1) {
+			ok = run_read_varint(p, end, &delta);
+			tool += delta;
+		}
+		for (int k = 0; ok && k < 8; ++k) {
+			switch ((header >> (6 + 2 * k)) & 3) {
+			case 0:
+				break;
+			case 1:
+				if (k < 4) {
+					ok = run_read_varint(p, end, &delta);
+					base[k] += delta;
+					value[k] = base[k] / RUN_FILE_SCALE;
+				}
+				else
+					value[k] = value[k - 1];
+				break;
+			case 2:
+			{
+				float f;
+				ok = run_read(p, end, &f, sizeof(float));
+				value[k] = k >= 6 ? value[k] + f : f;
+				break;
+			}
+			case 3:
+				ok = run_read(p, end, &value[k], sizeof(double));
+				break;
+			}
+		}
+		if (!ok) {
+			debug("Run file block %d is corrupt; ignoring records from %d", b, b * run_file_block + i);
+			for (; i < num; ++i) {
+				record[i].type = RUN_PRE_LINE;
+				record[i].tool = 0;
+				record[i].X = NAN;
+				record[i].Y = NAN;
+				record[i].Z = NAN;
+				record[i].E = NAN;
+			}
+			return num;
+		}
+		record[i].type = header & 0xf;
+		record[i].tool = tool;
+		record[i].X = value[0];
+		record[i].Y = value[1];
+		record[i].Z = value[2];
+		record[i].E = value[3];
+		record[i].f = value[4];
+		record[i].F = value[5];
+		record[i].time = value[6];
+		record[i].dist = value[7];
+	}
+	if (run_file_stream && num == run_file_block && b + 1 == run_file_num_blocks)
+		run_stream_add_block(p - reinterpret_cast<uint8_t const *>(run_file_records));
+	return num;
+}
+
+static Run_Record *run_load_block(int b, int need) {
+	// Return block b from the cache, decoding it if it isn't there with at least need + 1 records.
+	if (run_block_num[run_block_last] != b || run_block_size[run_block_last] <= need) {
+		run_block_last = !run_block_last;
+		if (run_block_num[run_block_last] != b || run_block_size[run_block_last] <= need) {
+			run_block_size[run_block_last] = run_decode_block(b, run_block[run_block_last]);
+			run_block_num[run_block_last] = b;
+		}
+	}
+	return run_block[run_block_last];
+}
+
+Run_Record run_record(int i) {
+	Run_Record ret;
+	if (!run_file_v2) {
+		memcpy(&ret, &run_file_map[i * sizeof(Run_Record)], sizeof(Run_Record));
+		return ret;
+	}
+	int b = i / run_file_block;
+	// The start of a block in a growing file is found by decoding the block before it.
+	while (run_file_stream && b >= run_file_num_blocks) {
+		int n = run_file_num_blocks;
+		run_load_block(n - 1, run_file_block - 1);
+		if (run_file_num_blocks == n)
+			break;
+	}
+	return run_load_block(b, i % run_file_block)[i % run_file_block];
+}
+
+static void run_stream_read_strings() {
+	// Read new strings from the side file of a growing run file.
+	if (run_stream_strings_fd < 0) {
+		char name[sizeof(run_file_name) + sizeof(RUN_FILE_STRINGS_EXT)];
+		snprintf(name, sizeof(name), "%s" RUN_FILE_STRINGS_EXT, run_file_name);
+		run_stream_strings_fd = open(name, O_RDONLY | O_CLOEXEC);
+		if (run_stream_strings_fd < 0)
+			return;
+	}
+	struct stat stat;
+	if (fstat(run_stream_strings_fd, &stat) < 0 || stat.st_size <= run_stream_string_size)
+		return;
+	run_stream_string_data = reinterpret_cast<char *>(realloc(run_stream_string_data, stat.st_size));
+	ssize_t got = pread(run_stream_strings_fd, &run_stream_string_data[run_stream_string_size], stat.st_size - run_stream_string_size, run_stream_string_size);
+	if (got <= 0)
+		return;
+	run_stream_string_size += got;
+	while (run_stream_string_size - run_stream_string_parsed >= off_t(sizeof(uint32_t))) {
+		uint32_t len;
+		memcpy(&len, &run_stream_string_data[run_stream_string_parsed], sizeof(uint32_t));
+		if (run_stream_string_size - run_stream_string_parsed - off_t(sizeof(uint32_t)) < off_t(len))
+			break;
+		strings = reinterpret_cast<String *>(realloc(strings, (run_file_num_strings + 1) * sizeof(String)));
+		strings[run_file_num_strings].start = run_stream_string_parsed + sizeof(uint32_t);
+		strings[run_file_num_strings].len = len;
+		run_file_num_strings += 1;
+		run_stream_string_parsed += sizeof(uint32_t) + len;
+	}
+}
+
+static char const *run_string(int i, int *len) {
+	if (run_file_stream && i >= run_file_num_strings)
+		run_stream_read_strings();
+	if (i < 0 || i >= run_file_num_strings) {
+		debug("Invalid string %d in run file", i);
+		*len = 0;
+		return "";
+	}
+	*len = strings[i].len;
+	if (run_file_stream)
+		return &run_stream_string_data[strings[i].start];
+	return &run_file_map[run_file_first_string + strings[i].start];
+}
+
+static bool run_open_v2() {
+	RunFileHeader header;
+	memcpy(&header, run_file_map, sizeof(RunFileHeader));
+	if (header.version != 2) {
+		debug("Unsupported run file version %d", header.version);
+		return false;
+	}
+	if (header.block_records == 0 || header.block_records > 0x10000 || header.num_records > 0x7fffffff || header.num_sections > 0x100 || sizeof(RunFileHeader) + header.num_sections * sizeof(RunFileSection) > unsigned(run_file_size)) {
+		debug("Invalid run file header");
+		return false;
+	}
+	RunFileSection section[NUM_RUN_SECTIONS];
+	bool found[NUM_RUN_SECTIONS] = {};
+	for (unsigned i = 0; i < header.num_sections; ++i) {
+		RunFileSection s;
+		memcpy(&s, &run_file_map[sizeof(RunFileHeader) + i * sizeof(RunFileSection)], sizeof(RunFileSection));
+		if (s.offset > uint64_t(run_file_size) || s.size > uint64_t(run_file_size) - s.offset) {
+			debug("Run file section %d is out of range", s.type);
+			return false;
+		}
+		if (s.type < NUM_RUN_SECTIONS) {
+			section[s.type] = s;
+			found[s.type] = true;
+		}
+	}
+	for (int i = 0; i < NUM_RUN_SECTIONS; ++i) {
+		if (!found[i] && i != RUN_SECTION_STATE) {
+			debug("Run file section %d is missing", i);
+			return false;
+		}
+	}
+	run_file_num_records = header.num_records;
+	run_file_block = header.block_records;
+	run_file_num_blocks = (run_file_num_records + run_file_block - 1) / run_file_block;
+	if (section[RUN_SECTION_INDEX].size != uint64_t(run_file_num_blocks) * sizeof(uint64_t)) {
+		debug("Invalid run file index");
+		return false;
+	}
+	// Strings: int32_t numstrings, int32_t stringlengths[], strings.
+	off_t pos = section[RUN_SECTION_STRINGS].offset;
+	off_t size = section[RUN_SECTION_STRINGS].size;
+	run_file_num_strings = size < off_t(sizeof(int32_t)) ? -1 : read_num(pos);
+	if (run_file_num_strings < 0 || run_file_num_strings >= size / off_t(sizeof(int32_t))) {
+		debug("Invalid run file strings");
+		return false;
+	}
+	strings = reinterpret_cast<String *>(malloc(run_file_num_strings * sizeof(String)));
+	off_t current = 0;
+	for (int i = 0; i < run_file_num_strings; ++i) {
+		strings[i].start = current;
+		strings[i].len = read_num(pos + sizeof(int32_t) * (i + 1));
+		current += unsigned(strings[i].len);
+	}
+	run_file_first_string = pos + sizeof(int32_t) * (run_file_num_strings + 1);
+	if (run_file_first_string + current > pos + size) {
+		debug("Invalid run file strings");
+		return false;
+	}
+	run_file_records = &run_file_map[section[RUN_SECTION_RECORDS].offset];
+	run_file_records_size = section[RUN_SECTION_RECORDS].size;
+	run_file_index = &run_file_map[section[RUN_SECTION_INDEX].offset];
+	run_file_state = -1;
+	if (found[RUN_SECTION_STATE]) {
+		if (section[RUN_SECTION_STATE].size < uint64_t(run_file_num_blocks) * sizeof(uint64_t))
+			debug("Invalid run file state; ignoring it");
+		else {
+			run_file_state = section[RUN_SECTION_STATE].offset;
+			run_file_state_size = section[RUN_SECTION_STATE].size;
+		}
+	}
+	for (int b = 0; b < 2; ++b) {
+		run_block[b] = reinterpret_cast<Run_Record *>(malloc(run_file_block * sizeof(Run_Record)));
+		run_block_num[b] = -1;
+	}
+	run_file_v2 = true;
+	return true;
+}
+
+static void run_stream_close() {
+	run_file_stream = false;
+	close(run_file_fd);
+	run_file_fd = -1;
+	if (run_stream_strings_fd >= 0)
+		close(run_stream_strings_fd);
+	run_stream_strings_fd = -1;
+	free(run_stream_index);
+	run_stream_index = NULL;
+	free(run_stream_string_data);
+	run_stream_string_data = NULL;
+	run_stream_string_size = 0;
+	run_stream_string_parsed = 0;
+	free(strings);
+	strings = NULL;
+	for (int b = 0; b < 2; ++b) {
+		free(run_block[b]);
+		run_block[b] = NULL;
+	}
+}
+
+static void run_stream_update() {
+	// Check a growing file for new records.
+	RunFileHeader header;
+	struct stat stat;
+	if (pread(run_file_fd, &header, sizeof(header), 0) != sizeof(header) || fstat(run_file_fd, &stat) < 0) {
+		debug("Failed to check run file for new records: %s", strerror(errno));
+		return;
+	}
+	if (stat.st_size > run_file_size) {
+		void *map = mremap(run_file_map, run_file_size, stat.st_size, MREMAP_MAYMOVE);
+		if (map == MAP_FAILED) {
+			debug("Failed to map new part of run file: %s", strerror(errno));
+			return;
+		}
+		run_file_map = reinterpret_cast<char *>(map);
+		run_file_size = stat.st_size;
+	}
+	if (header.num_sections != 0) {
+		// The file is complete; read it like any other file from now on.
+		run_stream_close();
+		free_find_index();
+		if (!run_open_v2()) {
+			debug("Completed run file is invalid");
+			abort_run_file();
+		}
+		return;
+	}
+	run_file_records = &run_file_map[RUN_FILE_STREAM_RECORDS];
+	run_file_records_size = run_file_size - RUN_FILE_STREAM_RECORDS;
+	if (int(header.num_records) > run_file_num_records) {
+		run_file_num_records = header.num_records;
+		// The index for run_find_pos doesn't include the new records.
+		free_find_index();
+	}
+}
+
+static bool run_open_stream(int fd) {
+	RunFileHeader header;
+	memcpy(&header, run_file_map, sizeof(RunFileHeader));
+	if (header.version != 2 || header.block_records == 0 || header.block_records > 0x10000 || run_file_size < RUN_FILE_STREAM_RECORDS) {
+		debug("Invalid header in growing run file");
+		return false;
+	}
+	run_file_fd = fd;
+	run_file_block = header.block_records;
+	run_file_num_records = 0;
+	run_stream_index_size = 16;
+	run_stream_index = reinterpret_cast<uint64_t *>(malloc(run_stream_index_size * sizeof(uint64_t)));
+	run_stream_index[0] = 0;
+	run_file_index = reinterpret_cast<char const *>(run_stream_index);
+	run_file_num_blocks = 1;
+	run_file_num_strings = 0;
+	run_file_state = -1;
+	for (int b = 0; b < 2; ++b) {
+		run_block[b] = reinterpret_cast<Run_Record *>(malloc(run_file_block * sizeof(Run_Record)));
+		run_block_num[b] = -1;
+	}
+	run_file_v2 = true;
+	run_file_stream = true;
+	run_stream_update();
+	return true;
+}
+
+static bool run_file_available() {
+	// Check if there is a record to run; a growing file is checked for new records.
+	if (settings.run_file_current < run_file_num_records)
+		return true;
+	if (!run_file_stream)
+		return false;
+	run_stream_update();
+	return run_file_map && settings.run_file_current < run_file_num_records;
+}
+
 void run_file(int name_len, char const *name, int probe_name_len, char const *probename, bool start, double sina, double cosa, int audio) {
 	rundebug("run file %d %f %f", start, sina, cosa);
 	abort_run_file();
@@ -58,6 +488,16 @@ void run_file(int name_len, char const *name, int probe_name_len, char const *pr
 	settings.run_time = 0;
 	settings.run_dist = 0;
 	settings.run_file_current = 0;
+	settings.run_file_record = -1;
+	settings.run_file_events = -1;
+	// History of the previous run must not be used for rewinding this one.
+	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f)
+		history(f).run_file_record = -1;
+	for (int e = 0; e < spaces[1].num_axes; ++e) {
+		spaces[1].axis[e]->settings.run_offset = 0;
+		for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f)
+			spaces[1].axis[e]->history(f).run_offset = 0;
+	}
 	int probe_fd;
 	if (probe_name_len > 0) {
 		probe_fd = open(probe_file_name, O_RDONLY);
@@ -94,8 +534,8 @@ void run_file(int name_len, char const *name, int probe_name_len, char const *pr
 		return;
 	}
 	run_file_size = stat.st_size;
-	run_file_map = reinterpret_cast<Run_Record *>(mmap(NULL, run_file_size, PROT_READ, MAP_SHARED, fd, 0));
-	close(fd);
+	run_file_map = reinterpret_cast<char *>(mmap(NULL, run_file_size, PROT_READ, MAP_SHARED, fd, 0));
+	madvise(run_file_map, run_file_size, MADV_SEQUENTIAL);
 	if (probe_name_len > 0) {
 		probe_file_map = reinterpret_cast<ProbeFile *>(mmap(NULL, probe_file_size, PROT_READ, MAP_SHARED, probe_fd, 0));
 		close(probe_fd);
@@ -105,13 +545,32 @@ void run_file(int name_len, char const *name, int probe_name_len, char const *pr
 			munmap(run_file_map, run_file_size);
 			probe_file_map = NULL;
 			run_file_map = NULL;
+			close(fd);
 			return;
 		}
 	}
 	else
 		probe_file_map = NULL;
-	if (audio < 0) {
-		// File format:
+	if (audio < 0 && run_file_size >= off_t(sizeof(RunFileHeader)) && memcmp(run_file_map, RUN_FILE_MAGIC, 8) == 0) {
+		if (reinterpret_cast<RunFileHeader *>(run_file_map)->num_sections == 0) {
+			// The file is still being written; keep fd to check for new records.
+			if (!run_open_stream(fd)) {
+				close(fd);
+				abort_run_file();
+				return;
+			}
+		}
+		else {
+			close(fd);
+			if (!run_open_v2()) {
+				abort_run_file();
+				return;
+			}
+		}
+	}
+	else if (audio < 0) {
+		close(fd);
+		// File format 1:
 		// records
 		// strings
 		// int32_t stringlengths[]
@@ -130,6 +589,7 @@ void run_file(int name_len, char const *name, int probe_name_len, char const *pr
 		run_file_num_records = run_file_first_string / sizeof(Run_Record);
 	}
 	else {
+		close(fd);
 		audio_hwtime_step = 1000000. / *reinterpret_cast <double *>(run_file_map);
 		run_file_num_records = run_file_size - sizeof(double);
 	}
@@ -155,14 +615,28 @@ void abort_run_file() {
 	run_file_finishing = false;
 	if (!run_file_map)
 		return;
+	// A running system command is not waited for anymore.
+	run_file_wait_system = 0;
+	// Events that have not fired refer to this file.
+	settings.run_file_events = -1;
+	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f)
+		fragment_events[f][0] = -1;
 	munmap(run_file_map, run_file_size);
 	run_file_map = NULL;
 	if (probe_file_map) {
 		munmap(probe_file_map, probe_file_size);
 		probe_file_map = NULL;
 	}
+	if (run_file_stream)
+		run_stream_close();
 	free(strings);
 	strings = NULL;
+	run_file_v2 = false;
+	for (int b = 0; b < 2; ++b) {
+		free(run_block[b]);
+		run_block[b] = NULL;
+	}
+	free_find_index();
 	arch_stop_audio();
 }
 
@@ -212,6 +686,231 @@ static double handle_probe(double ox, double oy, double z) {
 	return z + l * (1 - fx) + r * fx + probe_adjust;
 }
 
+static void prefetch_records(int first, int num) {
+	// Ask the kernel to read the pages of the upcoming records.
+	if (first >= run_file_num_records)
+		return;
+	if (first + num > run_file_num_records)
+		num = run_file_num_records - first;
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t start, end;
+	if (run_file_v2) {
+		start = reinterpret_cast <uintptr_t>(&run_file_records[run_block_offset(first / run_file_block)]);
+		end = reinterpret_cast <uintptr_t>(&run_file_records[run_block_offset((first + num - 1) / run_file_block + 1)]);
+	}
+	else {
+		start = reinterpret_cast <uintptr_t>(&run_file_map[first * sizeof(Run_Record)]);
+		end = reinterpret_cast <uintptr_t>(&run_file_map[(first + num) * sizeof(Run_Record)]);
+	}
+	start -= start % page;
+	madvise(reinterpret_cast <void *>(start), end - start, MADV_WILLNEED);
+}
+
+static void run_set_gpio(int tool, bool state) {
+	if (tool == -2)
+		tool = fan_id != 255 ? fan_id : -1;
+	else if (tool == -3)
+		tool = spindle_id != 255 ? spindle_id : -1;
+	if (tool < 0 || tool >= num_gpios) {
+		if (tool != -1)
+			debug("cannot set invalid gpio %d", tool);
+		return;
+	}
+	if (state) {
+		gpios[tool].state = 1;
+		SET(gpios[tool].pin);
+	}
+	else {
+		gpios[tool].state = 0;
+		RESET(gpios[tool].pin);
+	}
+	send_host(CMD_UPDATE_PIN, tool, gpios[tool].state);
+}
+
+static void run_set_temp(int tool, double value) {
+	if (tool == -1)
+		tool = bed_id != 255 ? bed_id : -1;
+	rundebug("settemp %d %f", tool, value);
+	settemp(tool, value);
+	send_host(CMD_UPDATE_TEMP, tool, 0, value);
+}
+
+static pid_t run_system(int string) {
+	// Start a system command without waiting for it.  Its output goes to the debug stream.
+	int len;
+	char const *str = run_string(string, &len);
+	char const *cmd = strndupa(str, len);
+	debug("Running system command: %d %s", len, cmd);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+	if (run_system_fd >= 0) {
+		posix_spawn_file_actions_adddup2(&actions, run_system_fd, 1);
+		posix_spawn_file_actions_adddup2(&actions, run_system_fd, 2);
+	}
+	// SIGCHLD is blocked for the signalfd; don't pass that on.
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t mask;
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	char const *argv[] = {"sh", "-c", cmd, NULL};
+	pid_t pid;
+	int ret = posix_spawn(&pid, "/bin/sh", &actions, &attr, const_cast <char *const *>(argv), environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if (ret != 0) {
+		debug("Unable to run system command: %s", strerror(ret));
+		return 0;
+	}
+	return pid;
+}
+
+void run_system_output() {
+	// Pass output of system commands to the debug stream, one line at a time.
+	static char buffer[256];
+	static int used = 0;
+	while (true) {
+		ssize_t got = read(pollfds[3].fd, &buffer[used], sizeof(buffer) - 1 - used);
+		if (got <= 0)
+			break;
+		used += got;
+		int start = 0;
+		for (int i = start; i < used; ++i) {
+			if (buffer[i] != '\n')
+				continue;
+			buffer[i] = '\0';
+			debug("system: %s", &buffer[start]);
+			start = i + 1;
+		}
+		if (start == 0 && used == sizeof(buffer) - 1) {
+			// Line is too long; split it.
+			buffer[used] = '\0';
+			debug("system: %s", buffer);
+			start = used;
+		}
+		memmove(buffer, &buffer[start], used - start);
+		used -= start;
+	}
+}
+
+void run_system_exit() {
+	// Reap finished system commands; continue the run file if it was waiting for one.
+	struct signalfd_siginfo info;
+	while (read(pollfds[2].fd, &info, sizeof(info)) == sizeof(info)) {}
+	run_system_output();
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		debug("Done running system command, return = %d", status);
+		if (pid == run_file_wait_system) {
+			run_file_wait_system = 0;
+			run_file_fill_queue();
+		}
+	}
+}
+
+static void run_fire_events(int first, int end) {
+	// Fire the in-band events in a range of records.  Extruder positions
+	// are not set here; they were handled when the records were decoded.
+	for (int i = first; i < end && i < run_file_num_records; ++i) {
+		Run_Record r = run_record(i);
+		if (r.type == RUN_GPIO)
+			run_set_gpio(r.tool, r.X);
+		else if (r.type == RUN_SETTEMP)
+			run_set_temp(r.tool, r.X);
+		else if (r.type == RUN_SYSTEM)
+			run_system(r.tool);
+	}
+}
+
+void run_file_fire_events(int fragment) {
+	// Called by the arch code when a fragment has been played.
+	int first = fragment_events[fragment][0];
+	fragment_events[fragment][0] = -1;
+	if (first < 0 || !run_file_map)
+		return;
+	run_fire_events(first, fragment_events[fragment][1]);
+}
+
+static void run_fire_all() {
+	// All motion has finished; fire events that are still waiting for it, in order.
+	for (int f = running_fragment; FRAGMENTS_PER_BUFFER > 0; f = (f + 1) % FRAGMENTS_PER_BUFFER) {
+		run_file_fire_events(f);
+		if (f == current_fragment)
+			break;
+	}
+	if (settings.run_file_events >= 0)
+		run_fire_events(settings.run_file_events, settings.run_file_current);
+	settings.run_file_events = -1;
+}
+
+void run_file_rewind() {
+	// Called when the queue is cleared after a stop.  Decoding continues
+	// from the move that was interrupted, so the moves that were in the
+	// queue are not skipped.  Events that have not fired are dropped; they
+	// are decoded again.
+	if (!run_file_map || run_file_audio >= 0)
+		return;
+	int record = FRAGMENTS_PER_BUFFER > 0 ? history(running_fragment).run_file_record : -1;
+	if (record < 0 && (settings.queue_start != settings.queue_end || settings.queue_full))
+		record = queue[settings.queue_start].record;
+	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f) {
+		if (fragment_events[f][0] >= 0 && (record < 0 || fragment_events[f][0] < record))
+			record = fragment_events[f][0];
+		fragment_events[f][0] = -1;
+	}
+	if (settings.run_file_events >= 0 && (record < 0 || settings.run_file_events < record))
+		record = settings.run_file_events;
+	settings.run_file_events = -1;
+	if (record < 0 || record >= settings.run_file_current)
+		return;
+	// Undo the offsets of in-band extruder positions that are decoded again.
+	// Each one changed the offset by the difference between the previous
+	// position of that extruder in the file and the new one.
+	for (int i = settings.run_file_current - 1; i >= record; --i) {
+		Run_Record r = run_record(i);
+		if (r.type != RUN_SETPOS || r.tool < 0 || r.tool >= spaces[1].num_axes)
+			continue;
+		for (int p = i - 1; p >= 0; --p) {
+			Run_Record prev = run_record(p);
+			if ((prev.type == RUN_PRE_LINE || prev.type == RUN_LINE || prev.type == RUN_ARC) && prev.tool == r.tool && !isnan(prev.E)) {
+				spaces[1].axis[r.tool]->settings.run_offset -= prev.E - r.X;
+				break;
+			}
+		}
+	}
+	rundebug("rewinding run file from %d to %d", settings.run_file_current, record);
+	settings.run_file_current = record;
+	run_preline.X = NAN;
+	run_preline.Y = NAN;
+	run_preline.Z = NAN;
+	run_preline.E = NAN;
+}
+
+void run_file_done() {
+	run_fire_all();
+	send_host(CMD_FILE_DONE);
+	abort_run_file();
+}
+
+static bool run_setpos_inband(int tool, double pos) {
+	// Change the offset between run file and extruder positions, so the
+	// extruder does not need to stop.  This needs the position at the end of
+	// the queue; returns false if it is not known.
+	int num0 = spaces[0].num_axes;
+	int n = settings.queue_full ? QUEUE_LENGTH : (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH;
+	for (int i = 1; i <= n; ++i) {
+		double e = queue[(settings.queue_end - i + QUEUE_LENGTH) % QUEUE_LENGTH].data[num0 + tool];
+		if (!isnan(e)) {
+			spaces[1].axis[tool]->settings.run_offset = e - pos;
+			return true;
+		}
+	}
+	return false;
+}
+
 void run_file_fill_queue() {
 	static bool lock = false;
 	if (lock)
@@ -242,27 +941,48 @@ void run_file_fill_queue() {
 	}
 	int cbs = 0;
 	bool must_move = true;
+	// Don't decode while the queue is still well filled.
+	int fill = settings.queue_full ? QUEUE_LENGTH : (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH;
+	if (run_file_map && fill > RUN_FILE_REFILL && computing_move)
+		must_move = false;
+	else if (run_file_map)
+		prefetch_records(settings.run_file_current + run_file_prefetch, 2 * run_file_prefetch);
 	while (must_move) {
 		must_move = false;
 		while (run_file_map	// There is a file to run.
-				&& (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH < 4	// There is space in the queue.
+				&& (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH < run_file_prefetch	// There is space in the queue.
 				&& !settings.queue_full	// Really, there is space in the queue.
-				&& settings.run_file_current < run_file_num_records	// There are records to send.
+				&& run_file_available()	// There are records to send.
 				&& !run_file_wait_temp	// We are not waiting for a temp alarm.
 				&& !run_file_wait	// We are not waiting for something else (pause or confirm).
+				&& !run_file_wait_system	// We are not waiting for a system command.
 				&& !run_file_finishing) {	// We are not waiting for underflow (should be impossible anyway, if there are commands in the queue).
-			int t = run_file_map[settings.run_file_current].type;
-			if (t != RUN_LINE && t != RUN_PRE_LINE && t != RUN_PRE_ARC && t != RUN_ARC && (arch_running() || settings.queue_end != settings.queue_start || computing_move || sending_fragment || transmitting_fragment))
-				break;
-			Run_Record &r = run_file_map[settings.run_file_current];
+			Run_Record r = run_record(settings.run_file_current);
+			int t = r.type;
+			bool busy = arch_running() || settings.queue_end != settings.queue_start || computing_move || sending_fragment || transmitting_fragment;
+			// Motion has stopped before the events were attached to a move.
+			if (!busy && settings.run_file_events >= 0)
+				run_fire_all();
+			if (busy) {
+				// GPIO and temperature changes and background commands fire when the motion before them has been played; extruder positions are handled as an offset.
+				bool inband = t == RUN_GPIO || t == RUN_SETTEMP || (t == RUN_SYSTEM && r.X != 0) || (t == RUN_SETPOS && r.tool >= 0 && r.tool < spaces[1].num_axes && run_setpos_inband(r.tool, r.X));
+				if (inband) {
+					if (settings.run_file_events < 0)
+						settings.run_file_events = settings.run_file_current;
+					settings.run_file_current += 1;
+					continue;
+				}
+				if (t != RUN_LINE && t != RUN_PRE_LINE && t != RUN_PRE_ARC && t != RUN_ARC)
+					break;
+			}
 			rundebug("running %d: %d %d", settings.run_file_current, r.type, r.tool);
 			switch (r.type) {
 				case RUN_SYSTEM:
 				{
-					char const *cmd = strndupa(&reinterpret_cast<char const *>(run_file_map)[run_file_first_string + strings[r.tool].start], strings[r.tool].len);
-					debug("Running system command: %ld %d %s", strings[r.tool].start, strings[r.tool].len, cmd);
-					int ret = system(cmd);
-					debug("Done running system command, return = %d", ret);
+					// X is nonzero for commands that run in the background.
+					pid_t pid = run_system(r.tool);
+					if (r.X == 0)
+						run_file_wait_system = pid;
 					break;
 				}
 				case RUN_PRE_ARC:
@@ -325,7 +1045,7 @@ void run_file_fill_queue() {
 					for (int i = 6; i < num0; ++i)
 						queue[settings.queue_end].data[i] = NAN;
 					for (int i = 0; i < spaces[1].num_axes; ++i) {
-						queue[settings.queue_end].data[num0 + i] = (i == r.tool ? r.E : i == run_preline.tool ? run_preline.E : NAN);
+						queue[settings.queue_end].data[num0 + i] = (i == r.tool ? r.E : i == run_preline.tool ? run_preline.E : NAN) + spaces[1].axis[i]->settings.run_offset;
 						//debug("queue %d + %d = %f", num0, i, queue[settings.queue_end].data[num0 + i]);
 					}
 					run_preline.E = NAN;
@@ -338,42 +1058,21 @@ void run_file_fill_queue() {
 					queue[settings.queue_end].time = r.time;
 					queue[settings.queue_end].dist = r.dist;
 					queue[settings.queue_end].cb = false;
+					int first = settings.run_file_current;
+					while (first > 0 && (run_record(first - 1).type == RUN_PRE_LINE || run_record(first - 1).type == RUN_PRE_ARC))
+						first -= 1;
+					queue[settings.queue_end].record = first;
+					queue[settings.queue_end].events = settings.run_file_events;
+					settings.run_file_events = -1;
 					settings.queue_end = (settings.queue_end + 1) % QUEUE_LENGTH;
 					break;
 				}
 				case RUN_GPIO:
-				{
-					int tool = r.tool;
-					if (tool == -2)
-						tool = fan_id != 255 ? fan_id : -1;
-					else if (tool == -3)
-						tool = spindle_id != 255 ? spindle_id : -1;
-					if (tool < 0 || tool >= num_gpios) {
-						if (tool != -1)
-							debug("cannot set invalid gpio %d", tool);
-						break;
-					}
-					if (r.X) {
-						gpios[tool].state = 1;
-						SET(gpios[tool].pin);
-					}
-					else {
-						gpios[tool].state = 0;
-						RESET(gpios[tool].pin);
-					}
-					send_host(CMD_UPDATE_PIN, tool, gpios[tool].state);
+					run_set_gpio(r.tool, r.X);
 					break;
-				}
 				case RUN_SETTEMP:
-				{
-					int tool = r.tool;
-					if (tool == -1)
-						tool = bed_id != 255 ? bed_id : -1;
-					rundebug("settemp %d %f", tool, r.X);
-					settemp(tool, r.X);
-					send_host(CMD_UPDATE_TEMP, tool, 0, r.X);
+					run_set_temp(r.tool, r.X);
 					break;
-				}
 				case RUN_WAITTEMP:
 				{
 					int tool = r.tool;
@@ -421,8 +1120,10 @@ void run_file_fill_queue() {
 					break;
 				case RUN_CONFIRM:
 				{
-					int len = min(strings[r.tool].len, 250);
-					memcpy(datastore, &reinterpret_cast<char const *>(run_file_map)[run_file_first_string + strings[r.tool].start], len);
+					int len;
+					char const *str = run_string(r.tool, &len);
+					len = min(len, 250);
+					memcpy(datastore, str, len);
 					run_file_wait += 1;
 					send_host(CMD_CONFIRM, r.X ? 1 : 0, 0, 0, 0, len);
 					break;
@@ -448,13 +1149,18 @@ void run_file_fill_queue() {
 		send_host(CMD_MOVECB, cbs);
 	buffer_refill();
 	rundebug("run queue done");
-	if (run_file_map && settings.run_file_current >= run_file_num_records && !run_file_wait_temp && !run_file_wait && !run_file_finishing) {
+	if (run_file_map && run_file_stream && settings.run_file_current >= run_file_num_records && !run_file_wait_temp && !run_file_wait && !run_file_wait_system && !run_file_finishing) {
+		// Caught up with the writer of the file; check again later.
+		run_file_timer.it_value.tv_sec = 0;
+		run_file_timer.it_value.tv_nsec = RUN_FILE_STREAM_POLL * 1000000;
+		run_file_wait += 1;
+		timerfd_settime(pollfds[0].fd, 0, &run_file_timer, NULL);
+	}
+	else if (run_file_map && settings.run_file_current >= run_file_num_records && !run_file_wait_temp && !run_file_wait && !run_file_wait_system && !run_file_finishing) {
 		// Done.
 		//debug("done running file");
-		if (!computing_move && !sending_fragment && !arch_running()) {
-			send_host(CMD_FILE_DONE);
-			abort_run_file();
-		}
+		if (!computing_move && !sending_fragment && !arch_running())
+			run_file_done();
 		else
 			run_file_finishing = true;
 	}
@@ -468,81 +1174,524 @@ void run_adjust_probe(double x, double y, double z) {
 	probe_adjust = z - probe_z;
 }
 
+static void run_state_set(RunStateEntry *&state, int &num, int &size, int type, int tool, double X) {
+	// Same as RunFileWriter._set_state in protocol.py.
+	for (int i = 0; i < num; ++i) {
+		if (state[i].type == type && state[i].tool == tool) {
+			state[i].X = X;
+			return;
+		}
+	}
+	if (num >= size) {
+		size = size * 2 + 16;
+		state = reinterpret_cast<RunStateEntry *>(realloc(state, size * sizeof(RunStateEntry)));
+	}
+	state[num].type = type;
+	state[num].tool = tool;
+	state[num].X = X;
+	num += 1;
+}
+
+void run_restore_state(int record) {
+	// Set temperatures, gpios and extruder positions to what they are
+	// before record.  The state section holds them for the start of every
+	// block, so at most one block is scanned.  Without it, all records
+	// before this one are scanned.
+	if (!run_file_map || run_file_audio >= 0 || record <= 0)
+		return;
+	if (record > run_file_num_records)
+		record = run_file_num_records;
+	RunStateEntry *state = NULL;
+	int num = 0, size = 0;
+	int first = 0;
+	if (run_file_state >= 0) {
+		int block = min(record / run_file_block, run_file_num_blocks - 1);
+		uint64_t offset;
+		uint32_t count = 0;
+		memcpy(&offset, &run_file_map[run_file_state + block * sizeof(uint64_t)], sizeof(offset));
+		if (offset <= uint64_t(run_file_state_size) - 2 * sizeof(uint32_t))
+			memcpy(&count, &run_file_map[run_file_state + offset], sizeof(count));
+		if (offset > uint64_t(run_file_state_size) - 2 * sizeof(uint32_t) || count > (run_file_state_size - offset - 2 * sizeof(uint32_t)) / sizeof(RunStateEntry))
+			debug("Invalid state for block %d in run file; scanning from the start", block);
+		else {
+			num = count;
+			size = count + 16;
+			state = reinterpret_cast<RunStateEntry *>(malloc(size * sizeof(RunStateEntry)));
+			memcpy(state, &run_file_map[run_file_state + offset + 2 * sizeof(uint32_t)], count * sizeof(RunStateEntry));
+			first = block * run_file_block;
+		}
+	}
+	for (int i = first; i < record; ++i) {
+		Run_Record r = run_record(i);
+		if (r.type == RUN_SETTEMP || r.type == RUN_GPIO || r.type == RUN_SETPOS)
+			run_state_set(state, num, size, r.type, r.tool, r.X);
+		else if ((r.type == RUN_PRE_LINE || r.type == RUN_LINE || r.type == RUN_ARC) && r.tool >= 0 && !isnan(r.E))
+			run_state_set(state, num, size, RUN_SETPOS, r.tool, r.E);
+	}
+	for (int i = 0; i < num; ++i) {
+		switch (state[i].type) {
+			case RUN_GPIO:
+				run_set_gpio(state[i].tool, state[i].X);
+				break;
+			case RUN_SETTEMP:
+				run_set_temp(state[i].tool, state[i].X);
+				break;
+			case RUN_SETPOS:
+				if (state[i].tool < spaces[1].num_axes)
+					setpos(1, state[i].tool, state[i].X);
+				break;
+			default:
+				debug("Invalid state type %d in run file", state[i].type);
+				break;
+		}
+	}
+	free(state);
+}
+
+static bool find_arc(FindGeometry &seg, double const center[3], double const n[3]) { // {{{
+	// Compute arc parameters the same way as set_from_queue does.
+	double normal = 0;
+	for (int k = 0; k < 3; ++k) {
+		if (isnan(seg.start[k]) || isnan(seg.end[k]) || isnan(center[k]) || isnan(n[k]))
+			return false;
+		normal += n[k] * n[k];
+	}
+	normal = sqrt(normal);
+	if (normal == 0)
+		return false;
+	double sn = 0, cn = 0, tn = 0;
+	for (int k = 0; k < 3; ++k) {
+		seg.normal[k] = n[k] / normal;
+		sn += seg.start[k] * seg.normal[k];
+		cn += center[k] * seg.normal[k];
+		tn += seg.end[k] * seg.normal[k];
+	}
+	seg.helix = tn - sn;
+	double target[3];
+	double src = 0, dst = 0;
+	for (int k = 0; k < 3; ++k) {
+		seg.center[k] = center[k] - seg.normal[k] * (cn - sn);
+		target[k] = seg.end[k] - seg.normal[k] * seg.helix;
+		seg.e1[k] = seg.start[k] - seg.center[k];
+		src += seg.e1[k] * seg.e1[k];
+		dst += (target[k] - seg.center[k]) * (target[k] - seg.center[k]);
+	}
+	src = sqrt(src);
+	dst = sqrt(dst);
+	if (src == 0 || dst == 0)
+		return false;
+	for (int k = 0; k < 3; ++k)
+		seg.e1[k] /= src;
+	double cosa = 0, sina = 0;
+	for (int k = 0; k < 3; ++k) {
+		int c1 = (k + 1) % 3;
+		int c2 = (k + 2) % 3;
+		seg.e2[k] = seg.normal[c1] * seg.e1[c2] - seg.normal[c2] * seg.e1[c1];
+		cosa += seg.e1[k] * (target[k] - seg.center[k]) / dst;
+		sina += seg.e2[k] * (target[k] - seg.center[k]) / dst;
+	}
+	seg.angle = atan2(sina, cosa);
+	if (seg.angle <= 0)
+		seg.angle += 2 * M_PI;
+	seg.radius[0] = src;
+	seg.radius[1] = dst;
+	return true;
+} // }}}
+
+static void find_point(FindGeometry const &seg, double u, double p[3]) { // {{{
+	if (!seg.arc) {
+		for (int k = 0; k < 3; ++k)
+			p[k] = seg.start[k] + (seg.end[k] - seg.start[k]) * u;
+		return;
+	}
+	double angle = seg.angle * u;
+	double radius = seg.radius[0] + (seg.radius[1] - seg.radius[0]) * u;
+	double cosa = cos(angle);
+	double sina = sin(angle);
+	for (int k = 0; k < 3; ++k)
+		p[k] = seg.center[k] + radius * (cosa * seg.e1[k] + sina * seg.e2[k]) + seg.helix * u * seg.normal[k];
+} // }}}
+
+static double find_dist(FindGeometry const &seg, double u, double pos[3]) { // {{{
+	// Squared distance from pos to the point at fraction u of the segment.  NaN components of pos are ignored.
+	double p[3];
+	find_point(seg, u, p);
+	double d = 0;
+	for (int k = 0; k < 3; ++k) {
+		if (isnan(pos[k]))
+			continue;
+		if (isnan(p[k]))
+			return INFINITY;
+		d += (pos[k] - p[k]) * (pos[k] - p[k]);
+	}
+	return d;
+} // }}}
+
+static double find_closest(FindGeometry const &seg, double pos[3], double *fraction) { // {{{
+	// Return squared distance from pos to the segment; store the fraction of the closest point.
+	if (!seg.arc) {
+		/* ((pos-O).(target-O))/((target-O).(target-O))*(target-O) = projection-O
+		   */
+		double pt = 0, tt = 0;
+		for (int k = 0; k < 3; ++k) {
+			if (isnan(pos[k]))
+				continue;
+			if (isnan(seg.start[k]) || isnan(seg.end[k]))
+				return INFINITY;
+			pt += (pos[k] - seg.start[k]) * (seg.end[k] - seg.start[k]);
+			tt += (seg.end[k] - seg.start[k]) * (seg.end[k] - seg.start[k]);
+		}
+		*fraction = tt > 0 ? pt / tt : 0;
+		if (*fraction < 0)
+			*fraction = 0;
+		if (*fraction > 1)
+			*fraction = 1;
+		return find_dist(seg, *fraction, pos);
+	}
+	// Find the closest of a number of samples, then refine it with a golden section search between its neighbours.
+	int n = int(ceil(seg.angle / (M_PI / 8))) + 1;
+	int best = 0;
+	double dist = INFINITY;
+	for (int j = 0; j < n; ++j) {
+		double d = find_dist(seg, double(j) / (n - 1), pos);
+		if (d < dist) {
+			dist = d;
+			best = j;
+		}
+	}
+	double const g = (sqrt(5.) - 1) / 2;
+	double a = max(best - 1, 0) / double(n - 1);
+	double b = min(best + 1, n - 1) / double(n - 1);
+	double c = b - g * (b - a);
+	double d = a + g * (b - a);
+	double fc = find_dist(seg, c, pos);
+	double fd = find_dist(seg, d, pos);
+	for (int i = 0; i < 40; ++i) {
+		if (fc < fd) {
+			b = d;
+			d = c;
+			fd = fc;
+			c = b - g * (b - a);
+			fc = find_dist(seg, c, pos);
+		}
+		else {
+			a = c;
+			c = d;
+			fc = fd;
+			d = a + g * (b - a);
+			fd = find_dist(seg, d, pos);
+		}
+	}
+	double u = (a + b) / 2;
+	double du = find_dist(seg, u, pos);
+	if (du < dist) {
+		*fraction = u;
+		return du;
+	}
+	*fraction = double(best) / (n - 1);
+	return dist;
+} // }}}
+
+static void find_segment(Run_Record const &r, double current[3], double const center[3], double const normal[3], FindGeometry &seg, double lo[2], double hi[2]) { // {{{
+	// Compute the geometry and bounding box of a line or arc that starts at current; current is moved to its end.
+	double target[3] = {r.X, r.Y, r.Z};
+	for (int k = 0; k < 3; ++k) {
+		seg.start[k] = current[k];
+		seg.end[k] = isnan(target[k]) ? current[k] : target[k];
+		current[k] = seg.end[k];
+	}
+	// Arcs that cannot be computed are handled as lines.
+	seg.arc = r.type == RUN_ARC && find_arc(seg, center, normal);
+	for (int k = 0; k < 2; ++k) {
+		if (seg.arc) {
+			double rmax = seg.radius[0] > seg.radius[1] ? seg.radius[0] : seg.radius[1];
+			double h = seg.helix * seg.normal[k];
+			lo[k] = seg.center[k] - rmax + (h < 0 ? h : 0);
+			hi[k] = seg.center[k] + rmax + (h > 0 ? h : 0);
+		}
+		else {
+			lo[k] = seg.start[k] < seg.end[k] ? seg.start[k] : seg.end[k];
+			hi[k] = seg.start[k] < seg.end[k] ? seg.end[k] : seg.start[k];
+		}
+	}
+} // }}}
+
+static void find_geometry(int s, FindGeometry &seg) { // {{{
+	// Recompute the geometry of an indexed segment.  It starts at the last
+	// value of each coordinate before it, or at the stored start position;
+	// the center of an arc is in a record after the previous segment.
+	int record = find_segments[s].record;
+	int first = find_segments[s - s % FIND_POS_START_INTERVAL].record;
+	double current[3] = {NAN, NAN, NAN};
+	double center[3] = {NAN, NAN, NAN};
+	double normal[3] = {NAN, NAN, NAN};
+	int missing = 3;
+	Run_Record r = run_record(record);
+	bool need_center = r.type == RUN_ARC;
+	for (int i = record - 1; i >= 0 && ((i >= first && missing > 0) || need_center); --i) {
+		Run_Record p = run_record(i);
+		if (p.type == RUN_PRE_ARC && need_center) {
+			center[0] = p.X;
+			center[1] = p.Y;
+			center[2] = p.Z;
+			normal[0] = p.E;
+			normal[1] = p.f;
+			normal[2] = p.F;
+			need_center = false;
+		}
+		if (p.type != RUN_LINE && p.type != RUN_ARC)
+			continue;
+		need_center = false;
+		if (i < first)
+			break;
+		double target[3] = {p.X, p.Y, p.Z};
+		for (int k = 0; k < 3; ++k) {
+			if (isnan(current[k]) && !isnan(target[k])) {
+				current[k] = target[k];
+				missing -= 1;
+			}
+		}
+	}
+	for (int k = 0; k < 3; ++k) {
+		if (isnan(current[k]))
+			current[k] = find_start[s / FIND_POS_START_INTERVAL][k];
+	}
+	double lo[2], hi[2];
+	find_segment(r, current, center, normal, seg, lo, hi);
+} // }}}
+
+static bool find_cells(FindSegment const &seg, int range[4]) { // {{{
+	// Compute the range of grid cells that the segment covers; return false if it should not be in the grid.
+	if (find_nx == 0 || isnan(seg.min[0]) || isnan(seg.min[1]) || isnan(seg.max[0]) || isnan(seg.max[1]))
+		return false;
+	range[0] = min(int((seg.min[0] - find_x0) / find_size), find_nx - 1);
+	range[1] = min(int((seg.min[1] - find_y0) / find_size), find_ny - 1);
+	range[2] = min(int((seg.max[0] - find_x0) / find_size), find_nx - 1);
+	range[3] = min(int((seg.max[1] - find_y0) / find_size), find_ny - 1);
+	return (range[2] - range[0] + 1) * (range[3] - range[1] + 1) <= FIND_POS_MAX_CELLS;
+} // }}}
+
+static void build_find_index() { // {{{
+	find_built = true;
+	find_segments = reinterpret_cast<FindSegment *>(malloc(sizeof(FindSegment) * max(run_file_num_records, 1)));
+	find_start = reinterpret_cast<double (*)[3]>(malloc(sizeof(double[3]) * (run_file_num_records / FIND_POS_START_INTERVAL + 1)));
+	if (!find_segments || !find_start) {
+		debug("Not enough memory for position index; searching all records");
+		free_find_index();
+		find_built = true;
+		return;
+	}
+	find_num_segments = 0;
+	double current[3] = {NAN, NAN, NAN};
+	double center[3] = {NAN, NAN, NAN};
+	double normal[3] = {NAN, NAN, NAN};
+	double lo[2] = {INFINITY, INFINITY};
+	double hi[2] = {-INFINITY, -INFINITY};
+	for (int i = 0; i < run_file_num_records; ++i) {
+		Run_Record r = run_record(i);
+		if (r.type == RUN_PRE_ARC) {
+			center[0] = r.X;
+			center[1] = r.Y;
+			center[2] = r.Z;
+			normal[0] = r.E;
+			normal[1] = r.f;
+			normal[2] = r.F;
+			continue;
+		}
+		if (r.type != RUN_LINE && r.type != RUN_ARC)
+			continue;
+		if (find_num_segments % FIND_POS_START_INTERVAL == 0) {
+			for (int k = 0; k < 3; ++k)
+				find_start[find_num_segments / FIND_POS_START_INTERVAL][k] = current[k];
+		}
+		FindSegment &seg = find_segments[find_num_segments++];
+		seg.record = i;
+		seg.seen = 0;
+		FindGeometry g;
+		find_segment(r, current, center, normal, g, seg.min, seg.max);
+		// The center only applies to the arc that follows it; find_geometry relies on that.
+		for (int k = 0; k < 3; ++k)
+			center[k] = NAN;
+		for (int k = 0; k < 2; ++k) {
+			if (seg.min[k] < lo[k])
+				lo[k] = seg.min[k];
+			if (seg.max[k] > hi[k])
+				hi[k] = seg.max[k];
+		}
+	}
+	// Use a uniform grid with about one cell per segment.
+	find_nx = 0;
+	find_ny = 0;
+	if (lo[0] <= hi[0] && lo[1] <= hi[1]) {
+		double w = hi[0] - lo[0];
+		double h = hi[1] - lo[1];
+		find_x0 = lo[0];
+		find_y0 = lo[1];
+		find_size = sqrt(w * h / find_num_segments);
+		if (find_size < (w > h ? w : h) / find_num_segments)
+			find_size = (w > h ? w : h) / find_num_segments;
+		if (!(find_size > 0))
+			find_size = 1;
+		while (true) {
+			find_nx = int(w / find_size) + 1;
+			find_ny = int(h / find_size) + 1;
+			if (double(find_nx) * find_ny <= 1 << 22)
+				break;
+			find_size *= 2;
+		}
+	}
+	int num_cells = find_nx * find_ny;
+	find_cell = reinterpret_cast<int *>(calloc(num_cells + 1, sizeof(int)));
+	if (!find_cell) {
+		debug("Not enough memory for position grid; checking all segments");
+		find_nx = 0;
+		find_ny = 0;
+		return;
+	}
+	find_num_loose = 0;
+	int range[4];
+	for (int i = 0; i < find_num_segments; ++i) {
+		if (!find_cells(find_segments[i], range)) {
+			find_num_loose += 1;
+			continue;
+		}
+		for (int y = range[1]; y <= range[3]; ++y) {
+			for (int x = range[0]; x <= range[2]; ++x)
+				find_cell[y * find_nx + x + 1] += 1;
+		}
+	}
+	for (int c = 0; c < num_cells; ++c)
+		find_cell[c + 1] += find_cell[c];
+	find_items = reinterpret_cast<int *>(malloc(sizeof(int) * max(find_cell[num_cells], 1)));
+	find_loose = reinterpret_cast<int *>(malloc(sizeof(int) * max(find_num_loose, 1)));
+	if (!find_items || !find_loose) {
+		debug("Not enough memory for position grid; checking all segments");
+		find_nx = 0;
+		find_ny = 0;
+		return;
+	}
+	find_num_loose = 0;
+	for (int i = 0; i < find_num_segments; ++i) {
+		if (!find_cells(find_segments[i], range)) {
+			find_loose[find_num_loose++] = i;
+			continue;
+		}
+		for (int y = range[1]; y <= range[3]; ++y) {
+			for (int x = range[0]; x <= range[2]; ++x)
+				find_items[find_cell[y * find_nx + x]++] = i;
+		}
+	}
+	// Filling moved every start to the start of the next cell; move them back.
+	for (int c = num_cells; c > 0; --c)
+		find_cell[c] = find_cell[c - 1];
+	find_cell[0] = 0;
+	debug("position index: %d segments, %dx%d cells, %d entries, %d unindexed", find_num_segments, find_nx, find_ny, find_cell[num_cells], find_num_loose);
+} // }}}
+
+static bool find_far(double const lo[2], double const hi[2], double pos[3], double dist) { // {{{
+	// Check if a bounding box is further away than dist (which is squared).
+	double bd = 0;
+	for (int k = 0; k < 2; ++k) {
+		if (isnan(pos[k]))
+			continue;
+		double dd = pos[k] < lo[k] ? lo[k] - pos[k] : pos[k] > hi[k] ? pos[k] - hi[k] : 0;
+		bd += dd * dd;
+	}
+	return bd > dist;
+} // }}}
+
+static void find_test(FindGeometry const &g, int r, double pos[3], double *dist, double *record) { // {{{
+	double fraction = 0;
+	double d = find_closest(g, pos, &fraction);
+	if (d < *dist || (d == *dist && r + fraction < *record)) {
+		*dist = d;
+		*record = r + fraction;
+	}
+} // }}}
+
+static void find_check(int s, double pos[3], double *dist, double *record) { // {{{
+	FindSegment &seg = find_segments[s];
+	if (seg.seen == find_stamp)
+		return;
+	seg.seen = find_stamp;
+	// Skip segments whose bounding box is too far away.
+	if (find_far(seg.min, seg.max, pos, *dist))
+		return;
+	FindGeometry g;
+	find_geometry(s, g);
+	find_test(g, seg.record, pos, dist, record);
+} // }}}
+
+static double find_scan(double pos[3]) { // {{{
+	// Check all records in order; used when there is no index.
+	double dist = INFINITY;
+	double record = NAN;
+	double current[3] = {NAN, NAN, NAN};
+	double center[3] = {NAN, NAN, NAN};
+	double normal[3] = {NAN, NAN, NAN};
+	for (int i = 0; i < run_file_num_records; ++i) {
+		Run_Record r = run_record(i);
+		if (r.type == RUN_PRE_ARC) {
+			center[0] = r.X;
+			center[1] = r.Y;
+			center[2] = r.Z;
+			normal[0] = r.E;
+			normal[1] = r.f;
+			normal[2] = r.F;
+			continue;
+		}
+		if (r.type != RUN_LINE && r.type != RUN_ARC)
+			continue;
+		FindGeometry g;
+		double lo[2], hi[2];
+		find_segment(r, current, center, normal, g, lo, hi);
+		for (int k = 0; k < 3; ++k)
+			center[k] = NAN;
+		if (!find_far(lo, hi, pos, dist))
+			find_test(g, i, pos, &dist, &record);
+	}
+	return record;
+} // }}}
+
 double run_find_pos(double pos[3]) {
 	// Find position in toolpath that is closest to requested position.
 	if (!run_file_map)
 		return NAN;
+	if (!find_built)
+		build_find_index();
+	if (!find_segments)
+		return find_scan(pos);
+	find_stamp += 1;
 	double dist = INFINITY;
-	double current[3] = {NAN, NAN, NAN};
-	double center[3];
-	double normal[3];
-	double record;
-	// These are not used yet.
-	(void)&center;
-	(void)&normal;
-	for (int i = 0; i < run_file_num_records; ++i) {
-		switch (run_file_map[i].type) {
-			case RUN_SYSTEM:
-			case RUN_PRE_LINE:
-			case RUN_GPIO:
-			case RUN_SETTEMP:
-			case RUN_WAITTEMP:
-			case RUN_SETPOS:
-			case RUN_WAIT:
-			case RUN_CONFIRM:
-			case RUN_PARK:
-				continue;
-			case RUN_PRE_ARC:
-				center[0] = run_file_map[i].X;
-				center[1] = run_file_map[i].Y;
-				center[2] = run_file_map[i].Z;
-				normal[0] = run_file_map[i].E;
-				normal[1] = run_file_map[i].f;
-				normal[2] = run_file_map[i].F;
+	double record = NAN;
+	if (isnan(pos[0]) || isnan(pos[1]) || find_nx == 0) {
+		// The grid cannot be used; check all segments.
+		for (int s = 0; s < find_num_segments; ++s)
+			find_check(s, pos, &dist, &record);
+		return record;
+	}
+	for (int i = 0; i < find_num_loose; ++i)
+		find_check(find_loose[i], pos, &dist, &record);
+	// Search rings of cells around the requested position, until the rings are further away than the closest segment.
+	double fx = floor((pos[0] - find_x0) / find_size);
+	double fy = floor((pos[1] - find_y0) / find_size);
+	int cx = fx < 0 ? 0 : fx >= find_nx ? find_nx - 1 : int(fx);
+	int cy = fy < 0 ? 0 : fy >= find_ny ? find_ny - 1 : int(fy);
+	for (int r = 0; r < max(find_nx, find_ny); ++r) {
+		double bound = (r - 1) * find_size;
+		if (r > 1 && bound * bound > dist)
+			break;
+		for (int y = cy - r; y <= cy + r; ++y) {
+			if (y < 0 || y >= find_ny)
 				continue;
-			case RUN_ARC:
-				// TODO: handle arc; workaround: fall through, handle as line.
-			case RUN_LINE:
-				double target[3] = {run_file_map[i].X, run_file_map[i].Y, run_file_map[i].Z};
-				int k;
-				double pt = 0, tt = 0;
-				for (k = 0; k < 3; ++k) {
-					if (isnan(pos[k]))
-						continue;
-					if (isnan(target[k])) {
-						target[k] = current[k];
-						if (isnan(target[k]))
-							break;
-					}
-					/* ((pos-O).(target-O))/((target-O).(target-O))*(target-O) = projection-O
-					   */
-					pt += (pos[k] - current[k]) * (target[k] - current[k]);
-					tt += (target[k] - current[k]) * (target[k] - current[k]);
-				}
-				if (k < 3) {
-					// Target position was NaN, pos was not.
+			int step = (r == 0 || y == cy - r || y == cy + r) ? 1 : 2 * r;
+			for (int x = cx - r; x <= cx + r; x += step) {
+				if (x < 0 || x >= find_nx)
 					continue;
-				}
-				double fraction = pt / tt;
-				if (fraction < 0)
-					fraction = 0;
-				if (fraction > 1)
-					fraction = 1;
-				double d = 0;
-				for (k = 0; k < 3; ++k) {
-					if (isnan(pos[k]))
-						continue;
-					double dd = pos[k] - ((target[k] - current[k]) * fraction + current[k]);
-					d += dd * dd;
-				}
-				if (d < dist) {
-					dist = d;
-					record = i + fraction;
-				}
-				for (k = 0; k < 3; ++k) {
-					if (!isnan(target[k]))
-						current[k] = target[k];
-				}
+				int c = y * find_nx + x;
+				for (int i = find_cell[c]; i < find_cell[c + 1]; ++i)
+					find_check(find_items[i], pos, &dist, &record);
+			}
 		}
 	}
 	return record;
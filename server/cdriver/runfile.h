@@ -0,0 +1,29 @@
+/* runfile.h - Run file format constants for Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RUNFILE_H
+#define _RUNFILE_H
+
+// Run file format 2; see protocol.py for the record encoding.  This is
+// shared by the compiler (gcode.cpp), the preview exporter (preview.cpp)
+// and the driver (run.cpp).
+#define RUN_FILE_MAGIC "FRANKRUN"
+#define RUN_FILE_SCALE 1e6
+
+#endif
@@ -39,24 +39,49 @@
 // Codes (low nybble is data): 80 (e1 d2) b3 b4 (d5 e6) 87 (f8) 99 aa (cb cc) ad 9e (ff)
 // Codes which have duplicates in printer id codes are not used.
 // These are defined in cdriver.h.
+
+// With protocol version 4, packets are sent in frames instead:
+// FRAME_END, data, header, crc16 (low byte first), FRAME_END, with
+// FRAME_END and FRAME_ESC escaped as FRAME_ESC, FRAME_ESC_END/FRAME_ESC_ESC.
+// The crc is CRC-CCITT (0x8408 reflected, start 0xffff) over data and header.
+// The header is the frame type and a 6 bit sequence number.  Acks are
+// cumulative, nacks request everything from their sequence number to be
+// resent.  Up to serial_window packets can be waiting for an ack.  The
+// firmware switches to version 4 when it receives a BEGIN that requests it;
+// the ack for that BEGIN is the last version 3 message.
 // }}}
 
 struct Queuerecord { // {{{
 	Queuerecord *next;
 	unsigned len;
 	char cmd;
+	bool pooled;
 	int32_t s, m, e;
 	double f;
 }; // }}}
 
+#define HOST_POOL_DATA (COMMAND_SIZE - 22)
+struct Poolrecord { // {{{
+	Queuerecord record;
+	char data[HOST_POOL_DATA];	// Directly follows record, like the data of heap allocated records.
+}; // }}}
+
 // Globals. {{{
-static bool sending_to_host = false;
+static int host_in_flight = 0;	// Messages sent to host that were not acknowledged yet.
+static int host_limit_oks = 0;	// Number of OKs until the host has received CMD_LIMIT, or 0.
 static Queuerecord *hostqueue_head = NULL;
 static Queuerecord *hostqueue_tail = NULL;
+static Poolrecord host_pool[HOST_QUEUE_POOL];
+static int host_pool_used = 0;
+static Queuerecord *host_pool_free = NULL;
 #ifdef SERIAL
 static bool had_data = false;
 static bool doing_debug = false;
 static uint8_t need_id = 0;
+static char frame[COMMAND_SIZE + 3];	// Unescaped frame that is being received.
+static int frame_len = -1;	// Number of bytes in frame, or -1 between frames.
+static bool frame_escape = false;
+static bool frame_nack_sent = false;
 #endif
 // }}}
 
@@ -75,8 +100,35 @@ const SingleByteCommands cmd_nack[4] = { CMD_NACK0, CMD_NACK1, CMD_NACK2, CMD_NA
 const SingleByteCommands cmd_stall[4] = { CMD_STALL0, CMD_STALL1, CMD_STALL2, CMD_STALL3 };
 // }}}
 
-static void send_to_host() { // {{{
-	sending_to_host = true;
+static Queuerecord *alloc_record(unsigned len) { // {{{
+	if (len <= HOST_POOL_DATA) {
+		if (host_pool_free) {
+			Queuerecord *ret = host_pool_free;
+			host_pool_free = ret->next;
+			return ret;
+		}
+		if (host_pool_used < HOST_QUEUE_POOL) {
+			Queuerecord *ret = &host_pool[host_pool_used++].record;
+			ret->pooled = true;
+			return ret;
+		}
+	}
+	// Use malloc, not mem_alloc, because there are multiple pointers to the same memory and mem_alloc cannot handle that.
+	Queuerecord *ret = reinterpret_cast <Queuerecord *>(malloc(sizeof(Queuerecord) + len));
+	ret->pooled = false;
+	return ret;
+} // }}}
+
+static void free_record(Queuerecord *r) { // {{{
+	if (r->pooled) {
+		r->next = host_pool_free;
+		host_pool_free = r;
+	}
+	else
+		free(r);
+} // }}}
+
+static void send_one_to_host() { // {{{
 	//debug("sending");
 	Queuerecord *r = hostqueue_head;
 	hostqueue_head = r->next;
@@ -95,19 +147,24 @@ static void send_to_host() { // {{{
 #endif
 	serialdev[0]->write(22 + r->len);
 	serialdev[0]->write(r->cmd);
-	for (unsigned i = 0; i < sizeof(int32_t); ++i)
-		serialdev[0]->write(reinterpret_cast <char *>(&r->s)[i]);
-	for (unsigned i = 0; i < sizeof(int32_t); ++i)
-		serialdev[0]->write(reinterpret_cast <char *>(&r->m)[i]);
-	for (unsigned i = 0; i < sizeof(int32_t); ++i)
-		serialdev[0]->write(reinterpret_cast <char *>(&r->e)[i]);
-	for (unsigned i = 0; i < sizeof(double); ++i)
-		serialdev[0]->write(reinterpret_cast <char *>(&r->f)[i]);
-	for (unsigned i = 0; i < r->len; ++i)
-		serialdev[0]->write(reinterpret_cast <char *>(r)[sizeof(Queuerecord) + i]);
-	if (r->cmd == CMD_LIMIT)
+	serialdev[0]->write(reinterpret_cast <char *>(&r->s), sizeof(int32_t));
+	serialdev[0]->write(reinterpret_cast <char *>(&r->m), sizeof(int32_t));
+	serialdev[0]->write(reinterpret_cast <char *>(&r->e), sizeof(int32_t));
+	serialdev[0]->write(reinterpret_cast <char *>(&r->f), sizeof(double));
+	serialdev[0]->write(&reinterpret_cast <char *>(r)[sizeof(Queuerecord)], r->len);
+	host_in_flight += 1;
+	if (r->cmd == CMD_LIMIT) {
 		stopping = 1;
-	free(r);
+		host_limit_oks = host_in_flight;
+	}
+	free_record(r);
+} // }}}
+
+static void send_to_host() { // {{{
+	// Send all queued messages that fit in the window, in one write.
+	while (hostqueue_head && host_in_flight < HOST_WINDOW)
+		send_one_to_host();
+	serialdev[0]->flush();
 } // }}}
 
 #ifdef SERIAL
@@ -123,18 +180,205 @@ static void command_cancel() { // {{{
 	}
 } // }}}
 
+static inline int seq_mask() { // {{{
+	return serial_protocol >= 4 ? FRAME_SEQ_MASK : 3;
+} // }}}
+
 static void resend(int amount) { // {{{
 	// Unless the last packet was already received; in that case ignore the NACK.
 	//debug("nack%d ff %d busy %d", which, ff_out, out_busy);
 	if (out_busy >= amount) {
-		ff_out = (ff_out - amount) & 3;
+		ff_out = (ff_out - amount) & seq_mask();
 		out_busy -= amount;
 		while (amount--) {
-			ff_out = (ff_out + 1) & 3;
+			ff_out = (ff_out + 1) & seq_mask();
 			send_packet();
 		}
 	}
 } // }}}
+
+static void serial_acked(int amount) { // {{{
+	// The oldest amount packets have been acked; call their callbacks and send pending commands.
+	while (amount--) {
+		out_busy -= 1;
+		void (*cb)() = serial_cb[0];
+		for (int i = 0; i < out_busy; ++i)
+			serial_cb[i] = serial_cb[i + 1];
+		serial_cb[out_busy] = NULL;
+		if (cb)
+			cb();
+	}
+	if (out_busy < serial_window && change_pending)
+		arch_motors_change();
+	if (out_busy < serial_window && start_pending) {
+		arch_start_move(0);
+	}
+	if (out_busy < serial_window && stop_pending) {
+		//debug("do pending stop");
+		arch_stop();
+	}
+	if (out_busy < serial_window && discard_pending)
+		arch_do_discard();
+	if (!sending_fragment && !stopping && arch_running()) {
+		run_file_fill_queue();
+		buffer_refill();
+	}
+	arch_had_ack();
+} // }}}
+
+static uint16_t crc_update(uint16_t crc, uint8_t data) { // {{{
+	crc ^= data;
+	for (int bit = 0; bit < 8; ++bit)
+		crc = crc & 1 ? (crc >> 1) ^ 0x8408 : crc >> 1;
+	return crc;
+} // }}}
+
+static int frame_write(char *target, uint8_t header, char const *data = NULL, int len = 0) { // {{{
+	// Fill target with a frame; return its length.
+	uint16_t crc = 0xffff;
+	int pos = 0;
+	target[pos++] = FRAME_END;
+	for (int i = 0; i < len + 3; ++i) {
+		uint8_t c;
+		if (i < len) {
+			c = data[i];
+			crc = crc_update(crc, c);
+		}
+		else if (i == len) {
+			c = header;
+			crc = crc_update(crc, c);
+		}
+		else
+			c = i == len + 1 ? crc & 0xff : crc >> 8;
+		if (c == FRAME_END || c == FRAME_ESC) {
+			target[pos++] = FRAME_ESC;
+			c = c == FRAME_END ? FRAME_ESC_END : FRAME_ESC_ESC;
+		}
+		target[pos++] = c;
+	}
+	target[pos++] = FRAME_END;
+	return pos;
+} // }}}
+
+static void write_frame(uint8_t header) { // {{{
+	char buffer[10];
+	int len = frame_write(buffer, header);
+	serialdev[1]->write(buffer, len);
+	serialdev[1]->flush();
+} // }}}
+
+static bool frame_handle() { // {{{
+	// A complete frame was received.  Return true if it was a reply that was handled.
+	int len = frame_len;
+	frame_len = -1;
+	uint16_t crc = 0xffff;
+	for (int i = 0; i < len - 2; ++i)
+		crc = crc_update(crc, frame[i]);
+	if (len < 3 || uint8_t(frame[len - 2]) != (crc & 0xff) || uint8_t(frame[len - 1]) != (crc >> 8)) {
+		debug("invalid frame of %d bytes", len);
+		if (serial_protocol >= 4 && !frame_nack_sent) {
+			write_nack();
+			frame_nack_sent = true;
+		}
+		return false;
+	}
+	uint8_t header = frame[len - 3];
+	int seq = header & FRAME_SEQ_MASK;
+	len -= 3;
+	if (serial_protocol < 4) {
+		if (!serial_upgrade || (header & ~FRAME_SEQ_MASK) != FRAME_DATA) {
+			debug("ignoring frame while using protocol version %d", serial_protocol);
+			return false;
+		}
+		// This is the reply to BEGIN; everything that follows uses version 4.
+		serial_protocol = 4;
+		serial_upgrade = false;
+		ff_in = seq;
+		ff_out = 0;
+		out_busy = 0;
+	}
+	switch (header & ~FRAME_SEQ_MASK) {
+	case FRAME_ACK:
+	{
+		// Acks are cumulative.
+		int amount = ((seq - ff_out + out_busy) & FRAME_SEQ_MASK) + 1;
+		serial_acked(amount <= out_busy ? amount : 0);
+		return false;
+	}
+	case FRAME_NACK:
+	{
+		int amount = (ff_out - seq) & FRAME_SEQ_MASK;
+		if (amount > 0)
+			resend(amount);
+		return false;
+	}
+	case FRAME_STALL:
+		debug("received stall!");
+		ff_out = seq;
+		out_busy = 0;
+		serialdev[1]->write(CMD_STALLACK);
+		serialdev[1]->flush();
+		serial_acked(0);
+		return false;
+	}
+	int diff = (seq - ff_in) & FRAME_SEQ_MASK;
+	if (diff != 0) {
+		if (diff > FRAME_SEQ_MASK / 2) {
+			// Retry of a packet that was already handled, so our ack was lost.
+			write_frame(FRAME_ACK | seq);
+		}
+		else if (!frame_nack_sent) {
+			// A packet was lost; request it and everything after it.
+			write_nack();
+			frame_nack_sent = true;
+		}
+		return false;
+	}
+	frame_nack_sent = false;
+	memcpy(command[1], frame, len);
+	int available = 0;
+	if (len < 2 || hwpacketsize(len, &available) != len) {
+		debug("invalid packet length %d for %02x", len, command[1][0]);
+		write_ack();
+		return false;
+	}
+	if (!hwpacket(len))
+		return false;
+	void (*cb)() = wait_for_reply[0];
+	expected_replies -= 1;
+	for (int i = 0; i < expected_replies; ++i)
+		wait_for_reply[i] = wait_for_reply[i + 1];
+	wait_for_reply[expected_replies] = NULL;
+	cb();
+	return true;
+} // }}}
+
+static bool frame_byte(uint8_t c) { // {{{
+	// Handle a byte of a frame.  Return true if a reply was handled.
+	if (c == FRAME_END) {
+		if (frame_len > 0)
+			return frame_handle();
+		// Start of a frame, or the end of a lost one.
+		frame_len = 0;
+		frame_escape = false;
+		return false;
+	}
+	if (c == FRAME_ESC) {
+		frame_escape = true;
+		return false;
+	}
+	if (frame_escape) {
+		c = c == FRAME_ESC_END ? FRAME_END : FRAME_ESC;
+		frame_escape = false;
+	}
+	if (frame_len >= int(sizeof(frame))) {
+		debug("frame too long");
+		frame_len = -1;
+		return false;
+	}
+	frame[frame_len++] = c;
+	return false;
+} // }}}
 #endif
 
 // There may be serial data available.
@@ -143,9 +387,14 @@ bool serial(uint8_t channel) { // {{{
 #ifdef SERIAL // Handle timeouts on serial line. {{{
 		if (channel == 1) {
 			int32_t utm = utime();
-			if (int32_t(utm - last_micros) >= 100000)
+			if (int32_t(utm - last_micros) >= SERIAL_TIMEOUT * 1000)
 			{
-				if (command_end[channel] > 0) {
+				if (frame_len >= 0 && !had_data) {
+					debug("Ignoring unfinished frame");
+					frame_len = -1;
+					last_micros = utm;
+				}
+				else if (command_end[channel] > 0) {
 					if (!had_data) {
 						// Command not finished; ignore it and wait for next.
 						debug("Ignoring unfinished command");
@@ -182,6 +431,13 @@ bool serial(uint8_t channel) { // {{{
 #ifdef SERIAL // {{{
 			if (channel == 1) {
 				had_data = true;
+				if (frame_len >= 0) {
+					if (!expected_replies)
+						last_micros = utime();
+					if (frame_byte(command[channel][0]))
+						return true;
+					continue;
+				}
 				if (doing_debug) {
 					if (command[channel][0] == 0) {
 						END_DEBUG();
@@ -204,6 +460,10 @@ bool serial(uint8_t channel) { // {{{
 				}
 				// If this is a 1-byte command, handle it.
 				int which = 0;
+				if (command[channel][0] == FRAME_END && (serial_protocol >= 4 || serial_upgrade)) {
+					frame_byte(FRAME_END);
+					continue;
+				}
 				switch (command[channel][0])
 				{
 				case CMD_DEBUG:
@@ -221,10 +481,13 @@ bool serial(uint8_t channel) { // {{{
 				case CMD_STALL1:
 					which += 1;
 				case CMD_STALL0:
+					if (serial_protocol >= 4)
+						continue;
 					debug("received stall!");
 					ff_out = which;
 					out_busy = 0;
 					serialdev[1]->write(CMD_STALLACK);
+					serialdev[1]->flush();
 					which += 1;
 					// Fall through.
 				case CMD_ACK3:
@@ -236,33 +499,11 @@ bool serial(uint8_t channel) { // {{{
 				case CMD_ACK0:
 					//debug("ack%d ff %d busy %d", which, ff_out, out_busy);
 					which &= 3;
+					if (serial_protocol >= 4)
+						continue;	// Sent before the firmware switched to version 4; ignore it.
 					// Ack: flip the flipflop.
-					if (out_busy > 0 && ((ff_out - out_busy) & 3) == which) { // Only if we expected it and it is the right type.
-						out_busy -= 1;
-						void (*cb)() = serial_cb[0];
-						for (int i = 0; i < out_busy; ++i)
-							serial_cb[i] = serial_cb[i + 1];
-						serial_cb[out_busy] = NULL;
-						if (cb)
-							cb();
-					}
-					if (out_busy < 3 && change_pending)
-						arch_motors_change();
-					if (out_busy < 3 && start_pending) {
-						arch_start_move(0);
-					}
-					if (out_busy < 3 && stop_pending) {
-						//debug("do pending stop");
-						arch_stop();
-					}
-					if (out_busy < 3 && discard_pending)
-						arch_do_discard();
-					if (!sending_fragment && !stopping && arch_running()) {
-						run_file_fill_queue();
-						buffer_refill();
-					}
-					if (!preparing)
-						arch_had_ack();
+					// Only if we expected it and it is the right type.
+					serial_acked(out_busy > 0 && ((ff_out - out_busy) & 3) == which ? 1 : 0);
 					continue;
 				case CMD_NACK3:
 					which += 1;
@@ -272,6 +513,8 @@ bool serial(uint8_t channel) { // {{{
 					which += 1;
 				case CMD_NACK0:
 				{
+					if (serial_protocol >= 4)
+						continue;
 					// Nack: the host didn't properly receive the packet: resend.
 					int amount = ((ff_out - which - 1) & 3) + 1;
 					resend(amount);
@@ -294,6 +537,10 @@ bool serial(uint8_t channel) { // {{{
 						last_micros = utime();
 					break;
 				}
+				if (serial_protocol >= 4) {
+					// Not in a frame; this is garbage from a frame that lost its start.
+					continue;
+				}
 				if ((command[1][0] & 0x90) != 0x10) {
 					// These lengths are not allowed; this cannot be a good packet.
 					debug("invalid firmware command code %02x", command[1][0]);
@@ -306,11 +553,11 @@ bool serial(uint8_t channel) { // {{{
 #endif // }}}
 				// Message received.
 				if (command[channel][0] == OK) {
-					if (sending_to_host) {
+					if (host_in_flight > 0) {
 						//debug("no longer sending");
-						sending_to_host = false;
+						host_in_flight -= 1;
 						//debug("received OK; sending next to host (if any)");
-						if (stopping == 1) {
+						if (host_limit_oks > 0 && --host_limit_oks == 0 && stopping == 1) {
 							//debug("done stopping");
 							stopping = 0;
 							sending_fragment = 0;
@@ -493,6 +740,7 @@ bool serial(uint8_t channel) { // {{{
 				debug("old ff_in: %d", ff_in);
 #endif
 				serialdev[channel]->write(cmd_ack[which]);
+				serialdev[channel]->flush();
 				command_end[channel] = 0;
 				continue;
 			}
@@ -544,19 +792,19 @@ bool prepare_packet(char *the_packet, int size) { // {{{
 		debug("packet is too large: %d > %d", size, COMMAND_SIZE);
 		return false;
 	}
-	if (preparing) {
-		debug("Prepare_packet is called recursively.  Aborting.");
+	// The caller must make sure there is room in the window; packets that do not fit are queued by the arch code.
+	if (out_busy >= serial_window) {
+		debug("BUG: prepare_packet called with a full window");
 		abort();
 	}
-	// Wait for room in the queue.  This is required to avoid a stall being received in between prepare and send.
-	preparing = true;
-	while (out_busy >= 3) {
-		poll(&pollfds[2], 1, -1);
-		serial(1);
-	}
-	preparing = false;	// Not yet, but there are no further interruptions.
 	if (stopping)
 		return false;
+	int slot = ff_out & (SERIAL_WINDOW - 1);
+	if (serial_protocol >= 4) {
+		pending_len[slot] = frame_write(pending_packet[slot], FRAME_DATA | ff_out, the_packet, size);
+		ff_out = (ff_out + 1) & FRAME_SEQ_MASK;
+		return true;
+	}
 	// Set flipflop bit.
 	the_packet[0] &= 0x1f;
 	the_packet[0] |= ff_out << 5;
@@ -595,14 +843,14 @@ bool prepare_packet(char *the_packet, int size) { // {{{
 		}
 		the_packet[size + t] = sum;
 	}
-	pending_len[ff_out] = size + (size + 2) / 3;
+	pending_len[slot] = size + (size + 2) / 3;
 #ifdef DEBUG_SERIAL
 	fprintf(stderr, "prepare %p:", the_packet);
 #endif
-	for (uint8_t i = 0; i < pending_len[ff_out]; ++i) {
-		pending_packet[ff_out][i] = the_packet[i];
+	for (int i = 0; i < pending_len[slot]; ++i) {
+		pending_packet[slot][i] = the_packet[i];
 #ifdef DEBUG_SERIAL
-		fprintf(stderr, " %02x", int(uint8_t(pending_packet[ff_out][i])));
+		fprintf(stderr, " %02x", int(uint8_t(pending_packet[slot][i])));
 #endif
 	}
 #ifdef DEBUG_SERIAL
@@ -614,15 +862,15 @@ bool prepare_packet(char *the_packet, int size) { // {{{
 
 // Send packet to firmware.
 void send_packet() { // {{{
-	int which = (ff_out - 1) & 3;
+	int which = ((ff_out - 1) & seq_mask()) & (SERIAL_WINDOW - 1);
 #ifdef DEBUG_DATA
 	fprintf(stderr, "send (%d): ", out_busy);
-	for (uint8_t i = 0; i < pending_len[which]; ++i)
+	for (int i = 0; i < pending_len[which]; ++i)
 		fprintf(stderr, " %02x", int(uint8_t(pending_packet[which][i])));
 	fprintf(stderr, "\n");
 #endif
-	for (uint8_t t = 0; t < pending_len[which]; ++t)
-		serialdev[1]->write(pending_packet[which][t]);
+	serialdev[1]->write(pending_packet[which], pending_len[which]);
+	serialdev[1]->flush();
 	out_busy += 1;
 	out_time = utime();
 } // }}}
@@ -631,7 +879,13 @@ void write_ack() { // {{{
 //#ifdef DEBUG_DATA
 	//debug("wack %d", ff_in);
 //#endif
+	if (serial_protocol >= 4) {
+		write_frame(FRAME_ACK | ff_in);
+		ff_in = (ff_in + 1) & FRAME_SEQ_MASK;
+		return;
+	}
 	serialdev[1]->write(cmd_ack[ff_in]);
+	serialdev[1]->flush();
 	ff_in = (ff_in + 1) & 3;
 } // }}}
 
@@ -639,14 +893,33 @@ void write_nack() { // {{{
 //#ifdef DEBUG_DATA
 	//debug("wnack %d", ff_in);
 //#endif
+	if (serial_protocol >= 4) {
+		write_frame(FRAME_NACK | ff_in);
+		return;
+	}
 	serialdev[1]->write(cmd_nack[ff_in]);
+	serialdev[1]->flush();
 } // }}}
 #endif
 
 void send_host(char cmd, int s, int m, double f, int e, unsigned len) { // {{{
 	//debug("queueing for host cmd %x", cmd);
-	// Use malloc, not mem_alloc, because there are multiple pointers to the same memory and mem_alloc cannot handle that.
-	Queuerecord *record = reinterpret_cast <Queuerecord *>(malloc(sizeof(Queuerecord) + len));
+	// Merge with events that are still waiting in the queue.
+	if (cmd == CMD_MOVECB && hostqueue_tail && hostqueue_tail->cmd == CMD_MOVECB) {
+		// Only the last one, so the order of events is not changed.
+		hostqueue_tail->s += s;
+		return;
+	}
+	if (cmd == CMD_UPDATE_TEMP) {
+		// Only the latest value is relevant.
+		for (Queuerecord *r = hostqueue_head; r; r = r->next) {
+			if (r->cmd == CMD_UPDATE_TEMP && r->s == s) {
+				r->f = f;
+				return;
+			}
+		}
+	}
+	Queuerecord *record = alloc_record(len);
 	if (hostqueue_head)
 		hostqueue_tail->next = record;
 	else
@@ -661,10 +934,37 @@ void send_host(char cmd, int s, int m, double f, int e, unsigned len) { // {{{
 	record->next = NULL;
 	for (unsigned i = 0; i < len; ++i)
 		reinterpret_cast <char *>(record)[sizeof(Queuerecord) + i] = datastore[i];
-	if (!sending_to_host) {
+	if (host_in_flight < HOST_WINDOW) {
 		//debug("immediately sending");
 		send_to_host();
 	}
 	//else
 	//	debug("queueing host cmd");
 } // }}}
+
+ssize_t write_some(int fd, struct iovec *iov, int iovcnt) { // {{{
+	// Write as much data as the fd accepts without waiting, using as few system calls as possible.  Return the number of bytes written, or -1 on error.
+	ssize_t total = 0;
+	while (iovcnt > 0) {
+		ssize_t ret = ::writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			break;
+		}
+		total += ret;
+		// Skip the data that was written.
+		while (iovcnt > 0 && size_t(ret) >= iov->iov_len) {
+			ret -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = reinterpret_cast <char *>(iov->iov_base) + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return total;
+} // }}}
@@ -18,6 +18,11 @@
  */
 
 #include "cdriver.h"
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/signalfd.h>
+#include <string.h>
+#include <errno.h>
 
 static unsigned char host_command[HOST_COMMAND_SIZE];
 #ifdef SERIAL
@@ -30,7 +35,6 @@ void setup()
 #ifdef SERIAL
 	command[1] = serial_command;
 #endif
-	preparing = false;
 	host_block = false;
 	sent_names = false;
 	last_active = millis();
@@ -50,17 +54,42 @@ void setup()
 	pollfds[0].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 	pollfds[0].events = POLLIN | POLLPRI;
 	pollfds[0].revents = 0;
+	// System commands from run files are spawned in the background; their exit is noticed through SIGCHLD and their output goes to a pipe.
+	sigset_t sigchld;
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigchld, NULL);
+	pollfds[2].fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+	pollfds[2].events = POLLIN;
+	pollfds[2].revents = 0;
+	int output[2];
+	if (pipe2(output, O_CLOEXEC) < 0) {
+		debug("unable to create pipe for system commands: %s", strerror(errno));
+		output[0] = -1;
+		output[1] = -1;
+	}
+	else
+		fcntl(output[0], F_SETFL, O_NONBLOCK);
+	pollfds[3].fd = output[0];
+	pollfds[3].events = POLLIN;
+	pollfds[3].revents = 0;
+	run_system_fd = output[1];
+	run_file_wait_system = 0;
 	command_end[0] = 0;
 	motors_busy = false;
 	current_extruder = 0;
 	continue_cb = 0;
 	ping = 0;
-	for (int i = 0; i < 4; ++i) {
-		pending_len[i] = 0;
+	for (int i = 0; i < 4; ++i)
 		wait_for_reply[i] = NULL;
+	for (int i = 0; i < SERIAL_WINDOW; ++i) {
+		pending_len[i] = 0;
 		serial_cb[i] = NULL;
 	}
 	out_busy = 0;
+	serial_protocol = 3;
+	serial_window = 3;
+	serial_upgrade = false;
 	led_pin.init();
 	stop_pin.init();
 	probe_pin.init();
@@ -74,7 +103,7 @@ void setup()
 	//debug("current_fragment = running_fragment; %d %p", current_fragment, &current_fragment);
 	current_fragment_pos = 0;
 	num_active_motors = 0;
-	hwtime_step = 10000; // Note: When changing this, also change max in cdriver/space.cpp
+	hwtime_step = 10000;
 	audio_hwtime_step = 1;	// This is set by audio file.
 	feedrate = 1;
 	max_deviation = 0;
@@ -102,6 +131,7 @@ void setup()
 	spindle_id = 255;
 	run_file_map = NULL;
 	run_file_finishing = false;
+	run_file_prefetch = RUN_FILE_PREFETCH;
 	expected_replies = 0;
 	num_temps = 0;
 	temps = NULL;
@@ -113,8 +143,8 @@ void setup()
 }
 
 void connect_end() {
-	if (protocol_version < PROTOCOL_VERSION) {
-		debug("Printer has older Franklin version %d than host which has %d; please flash newer firmware.", protocol_version, PROTOCOL_VERSION);
+	if (protocol_version < MIN_PROTOCOL_VERSION) {
+		debug("Printer has older Franklin version %d than host which needs at least %d; please flash newer firmware.", protocol_version, MIN_PROTOCOL_VERSION);
 		exit(1);
 	}
 	else if (protocol_version > PROTOCOL_VERSION) {
@@ -122,38 +152,11 @@ void connect_end() {
 		exit(1);
 	}
 	// Now set things up that need information from the firmware.
-	history = new History[FRAGMENTS_PER_BUFFER];
-	for (int i = 0; i < 2; ++i) {
-		int f = (current_fragment - i + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
-		history[f].t0 = 0;
-		history[f].f0 = 0;
-		history[f].hwtime = 0;
-		history[f].last_current_time = 0;
-		history[f].cbs = 0;
-		history[f].tp = 0;
-		history[f].f1 = 1;
-		history[f].f2 = 0;
-		history[f].fp = 0;
-		history[f].fq = 0;
-		history[f].fmain = 1;
-		history[f].start_time = 0;
-		history[f].last_time = 0;
-		history[f].queue_start = 0;
-		history[f].queue_end = 0;
-		history[f].queue_full = false;
-	}
-	for (int s = 0; s < NUM_SPACES; ++s) {
-		Space &sp = spaces[s];
-		sp.history = new Space_History[FRAGMENTS_PER_BUFFER];
-		for (int a = 0; a < sp.num_axes; ++a) {
-			delete[] sp.axis[a]->history;
-			sp.axis[a]->history = setup_axis_history();
-		}
-		for (int m = 0; m < sp.num_motors; ++m) {
-			delete[] sp.motor[m]->history;
-			sp.motor[m]->history = setup_motor_history();
-		}
-	}
+	delete[] history_ring;
+	history_ring = NULL;
+	setup_history();
+	if (FRAGMENTS_PER_BUFFER > 0)
+		debug("history: %d bytes per fragment snapshot, %d checkpoints per fragment, %d bytes for %d fragments", snapshot_size, checkpoints_per_fragment, snapshot_size * (1 + checkpoints_per_fragment) * FRAGMENTS_PER_BUFFER, FRAGMENTS_PER_BUFFER);
 	// Update current position.
 	first_fragment = current_fragment;
 	//debug("not blocking host");
@@ -165,28 +168,94 @@ void connect_end() {
 		send_host(CMD_CONNECTED);
 }
 
-Axis_History *setup_axis_history() {
-	Axis_History *ret = new Axis_History[FRAGMENTS_PER_BUFFER];
-	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f) {
-		ret[f].dist[0] = NAN;
-		ret[f].dist[1] = NAN;
-		ret[f].main_dist = NAN;
-		ret[f].target = NAN;
-		ret[f].source = NAN;
-		ret[f].current = NAN;
+void setup_history() {
+	// Rebuild the history ring for the current set of axes and motors.  Records of existing objects are kept; new ones get defaults.
+	int size = sizeof(History) + NUM_SPACES * sizeof(Space_History);
+	for (int s = 0; s < NUM_SPACES; ++s)
+		size += spaces[s].num_axes * sizeof(Axis_History) + spaces[s].num_motors * sizeof(Motor_History);
+	int checkpoints = SAMPLES_PER_FRAGMENT > 0 ? (int(SAMPLES_PER_FRAGMENT) - 1) / CHECKPOINT_INTERVAL : 0;
+	char *ring = new char[FRAGMENTS_PER_BUFFER * (1 + checkpoints) * size];
+	// The number of fragments only changes on connect, which clears the ring.
+	bool keep_checkpoints = history_ring && checkpoints == checkpoints_per_fragment;
+	for (int i = 0; i < FRAGMENTS_PER_BUFFER * (1 + checkpoints); ++i) {
+		char *snapshot = &ring[i * size];
+		int f = i / (1 + checkpoints);
+		int k = i % (1 + checkpoints);
+		char const *old = history_ring && (k == 0 || keep_checkpoints) ? history_snapshot(f, k) : NULL;
+		int pos = sizeof(History) + NUM_SPACES * sizeof(Space_History);
+		if (old)
+			memcpy(snapshot, old, pos);
+		else {
+			memset(snapshot, 0, pos);
+			History &h = *reinterpret_cast <History *>(snapshot);
+			h.f1 = 1;
+			h.fmain = 1;
+			h.run_file_record = -1;
+		}
+		for (int s = 0; s < NUM_SPACES; ++s) {
+			Space &sp = spaces[s];
+			for (int a = 0; a < sp.num_axes; ++a) {
+				Axis_History &ah = *reinterpret_cast <Axis_History *>(&snapshot[pos]);
+				if (old && sp.axis[a]->history_offset >= 0)
+					memcpy(&ah, &old[sp.axis[a]->history_offset], sizeof(Axis_History));
+				else {
+					ah.dist[0] = NAN;
+					ah.dist[1] = NAN;
+					ah.main_dist = NAN;
+					ah.target = NAN;
+					ah.source = NAN;
+					ah.current = NAN;
+					ah.endpos[0] = NAN;
+					ah.endpos[1] = NAN;
+					ah.run_offset = 0;
+				}
+				pos += sizeof(Axis_History);
+			}
+			for (int m = 0; m < sp.num_motors; ++m) {
+				Motor_History &mh = *reinterpret_cast <Motor_History *>(&snapshot[pos]);
+				if (old && sp.motor[m]->history_offset >= 0)
+					memcpy(&mh, &old[sp.motor[m]->history_offset], sizeof(Motor_History));
+				else {
+					mh.last_v = 0;
+					mh.last_a = 0;
+					mh.current_pos = 0;
+					mh.target_v = NAN;
+					mh.target_dist = NAN;
+					mh.endpos = NAN;
+					mh.end_v = 0;
+				}
+				pos += sizeof(Motor_History);
+			}
+		}
 	}
-	return ret;
-}
-
-Motor_History *setup_motor_history() {
-	Motor_History *ret = new Motor_History[FRAGMENTS_PER_BUFFER];
-	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f) {
-		ret[f].last_v = 0;
-		ret[f].current_pos = 0;
-		ret[f].last_v = 0;
-		ret[f].target_v = NAN;
-		ret[f].target_dist = NAN;
-		ret[f].endpos = NAN;
+	// Offsets are the same in every snapshot.
+	int pos = sizeof(History) + NUM_SPACES * sizeof(Space_History);
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		for (int a = 0; a < sp.num_axes; ++a) {
+			sp.axis[a]->history_offset = pos;
+			pos += sizeof(Axis_History);
+		}
+		for (int m = 0; m < sp.num_motors; ++m) {
+			sp.motor[m]->history_offset = pos;
+			pos += sizeof(Motor_History);
+		}
+	}
+	// Events of fragments that are still in the buffer must fire when they have been played.
+	if (!history_ring) {
+		delete[] num_checkpoints;
+		num_checkpoints = new int[FRAGMENTS_PER_BUFFER];
+		delete[] fragment_events;
+		fragment_events = new int[FRAGMENTS_PER_BUFFER][2];
+		for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f)
+			fragment_events[f][0] = -1;
+	}
+	if (!keep_checkpoints) {
+		for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f)
+			num_checkpoints[f] = 0;
 	}
-	return ret;
+	delete[] history_ring;
+	history_ring = ring;
+	snapshot_size = size;
+	checkpoints_per_fragment = checkpoints;
 }
@@ -61,11 +61,11 @@ bool Space::setup_nums(int na, int nm) { // {{{
 			new_axes[a]->settings.target = NAN;
 			new_axes[a]->settings.source = NAN;
 			new_axes[a]->settings.current = NAN;
-			new_axes[a]->history = setup_axis_history();
+			new_axes[a]->settings.run_offset = 0;
+			new_axes[a]->history_offset = -1;
 		}
 		for (int a = na; a < old_na; ++a) {
 			space_types[type].afree(this, a);
-			delete[] axis[a]->history;
 			delete axis[a];
 		}
 		delete[] axis;
@@ -90,24 +90,27 @@ bool Space::setup_nums(int na, int nm) { // {{{
 			new_motors[m]->home_order = 0;
 			new_motors[m]->limit_v = INFINITY;
 			new_motors[m]->limit_a = INFINITY;
+			new_motors[m]->limit_j = INFINITY;
 			new_motors[m]->active = false;
 			new_motors[m]->settings.last_v = 0;
+			new_motors[m]->settings.last_a = 0;
 			new_motors[m]->settings.current_pos = 0;
 			new_motors[m]->settings.target_v = NAN;
 			new_motors[m]->settings.target_dist = NAN;
 			new_motors[m]->settings.endpos = NAN;
-			new_motors[m]->history = setup_motor_history();
+			new_motors[m]->settings.end_v = 0;
+			new_motors[m]->history_offset = -1;
 			ARCH_NEW_MOTOR(id, m, new_motors);
 		}
 		for (int m = nm; m < old_nm; ++m) {
 			DATA_DELETE(id, m);
-			delete[] motor[m]->history;
 			delete motor[m];
 		}
 		delete[] motor;
 		motor = new_motors;
 		arch_motors_change();
 	}
+	setup_history();
 	return true;
 } // }}}
 
@@ -125,6 +128,7 @@ void move_to_current() { // {{{
 	settings.fq = 0;
 	settings.t0 = 0;
 	settings.tp = 0;
+	settings.end_v = 0;
 	//debug("clearing %d cbs after current move for move to current", cbs_after_current_move);
 	cbs_after_current_move = 0;
 	current_fragment_pos = 0;
@@ -147,8 +151,11 @@ void move_to_current() { // {{{
 			sp.axis[a]->settings.dist[1] = 0;
 			sp.axis[a]->settings.main_dist = 0;
 		}
-		for (int m = 0; m < sp.num_motors; ++m)
+		for (int m = 0; m < sp.num_motors; ++m) {
 			sp.motor[m]->settings.last_v = 0;
+			sp.motor[m]->settings.last_a = 0;
+			sp.motor[m]->settings.end_v = 0;
+		}
 	}
 	buffer_refill();
 } // }}}
@@ -220,6 +227,7 @@ void Space::load_motor(int m, int32_t &addr) { // {{{
 	motor[m]->home_pos = read_float(addr);
 	motor[m]->limit_v = read_float(addr);
 	motor[m]->limit_a = read_float(addr);
+	motor[m]->limit_j = read_float(addr);
 	motor[m]->home_order = read_8(addr);
 	arch_motors_change();
 	SET_OUTPUT(motor[m]->enable_pin);
@@ -256,10 +264,11 @@ void Space::load_motor(int m, int32_t &addr) { // {{{
 			arch_addpos(id, m, motor[m]->settings.current_pos - oldpos);
 			// Adjust current_pos in all history.
 			for (int h = 0; h < FRAGMENTS_PER_BUFFER; ++h) {
-				oldpos = motor[m]->history[h].current_pos;
+				oldpos = motor[m]->history(h).current_pos;
 				pos = oldpos / old_steps_per_unit;
-				motor[m]->history[h].current_pos = pos * motor[m]->steps_per_unit;
+				motor[m]->history(h).current_pos = pos * motor[m]->steps_per_unit;
 			}
+			clear_checkpoints();
 		}
 	}
 	if (must_move)
@@ -288,6 +297,7 @@ void Space::save_motor(int m, int32_t &addr) { // {{{
 	write_float(addr, motor[m]->home_pos);
 	write_float(addr, motor[m]->limit_v);
 	write_float(addr, motor[m]->limit_a);
+	write_float(addr, motor[m]->limit_j);
 	write_8(addr, motor[m]->home_order);
 } // }}}
 
@@ -299,7 +309,6 @@ void Space::init(int space_id) { // {{{
 	num_motors = 0;
 	motor = NULL;
 	axis = NULL;
-	history = NULL;
 	space_types[type].init(this);
 } // }}}
 
@@ -316,6 +325,41 @@ void Space::cancel_update() { // {{{
 // }}}
 
 // Movement handling. {{{
+static double brake_dist(Motor *mtr, double v, double end_v, double a = 0) { // {{{
+	// Distance needed to slow down from v to end_v with an S-curve, limited by limit_a and limit_j.
+	// a is the acceleration at the start, in the direction of motion.
+	double j = mtr->limit_j;
+	if (fabs(a) > mtr->limit_a)
+		a = a > 0 ? mtr->limit_a : -mtr->limit_a;
+	if (a > 0) {
+		// Reduce a to 0 first; v still rises meanwhile.
+		double t = a / j;
+		return v * t + a * a * a / (3 * j * j) + brake_dist(mtr, v + a * a / (2 * j), end_v);
+	}
+	if (a < 0) {
+		double t = -a / j;
+		if (v - end_v < a * a / (2 * j)) {
+			// Reducing the deceleration to 0 already passes end_v.
+			return v * t + a * t * t / 2 + j * t * t * t / 6;
+		}
+		// Already braking: this is the rest of the S-curve that starts with a = 0 at a higher speed.
+		double v0 = v + a * a / (2 * j);
+		double ramp = v0 * t - j * t * t * t / 6;
+		double rest = brake_dist(mtr, v0, end_v) - ramp;
+		return rest > 0 ? rest : 0;
+	}
+	double dv = v - end_v;
+	if (dv <= 0)
+		return 0;
+	double t;
+	if (dv * mtr->limit_j < mtr->limit_a * mtr->limit_a)
+		t = 2 * sqrt(dv / mtr->limit_j);	// limit_a is never reached.
+	else
+		t = dv / mtr->limit_a + mtr->limit_a / mtr->limit_j;
+	// The profile is symmetric, so the average speed is halfway.
+	return (v + end_v) / 2 * t;
+} // }}}
+
 static void check_distance(int sp, int mt, Motor *mtr, double distance, double dt, double &factor) { // {{{
 	if (dt == 0) {
 		factor = 0;
@@ -335,7 +379,9 @@ static void check_distance(int sp, int mt, Motor *mtr, double distance, double d
 	if (mtr->settings.last_v * s < 0) {
 		//debug("!");
 		mtr->settings.last_v = 0;
+		mtr->settings.last_a = 0;
 	}
+	bool use_j = mtr->limit_j > 0 && !isinf(mtr->limit_j);
 	// Limit v.
 	if (v > mtr->limit_v) {
 		//debug("v %f limit %f", v, mtr->limit_v);
@@ -350,21 +396,60 @@ static void check_distance(int sp, int mt, Motor *mtr, double distance, double d
 		distance = (limit_dv * s + mtr->settings.last_v) * dt;
 		v = fabs(distance / dt);
 	}
+	// Limit j+.
+	if (use_j) {
+		double last_v = mtr->settings.last_v * s;
+		double a = mtr->settings.last_a * s + mtr->limit_j * dt;
+		// Start reducing a in time to reach the target speed without overshooting it.
+		double target_dv = (fabs(mtr->settings.target_v) < mtr->limit_v ? fabs(mtr->settings.target_v) : mtr->limit_v) - last_v;
+		double approach = target_dv > 0 ? sqrt(2 * mtr->limit_j * target_dv) : 0;
+		if (approach < a)
+			a = approach;
+		if (v - last_v > a * dt) {
+			v = last_v + a * dt;
+			if (v < 0)
+				v = 0;
+			distance = s * v * dt;
+		}
+	}
 	//debug("cd3 %f %f", distance, dt);
 	// Limit a-.
 	// Distance to travel until end of segment or connection.
 	double max_dist = (mtr->settings.endpos - mtr->settings.current_pos / mtr->steps_per_unit) * s;
-	// Find distance traveled when slowing down at maximum a.
+	// Find distance traveled when slowing down at maximum a to end_v.
 	// x = 1/2 at²
 	// t = sqrt(2x/a)
 	// v = at
 	// v² = 2a²x/a = 2ax
 	// x = v²/2a
-	double limit_dist = v * v / 2 / mtr->limit_a;
+	// The lookahead in next_move allows the segment to end at end_v instead of 0; subtract the part of the slowdown that is not needed.
+	double end_v = mtr->settings.end_v;
+	double limit_dist = use_j ? brake_dist(mtr, v, end_v, (v - mtr->settings.last_v * s) / dt) : (v * v - end_v * end_v) / 2 / mtr->limit_a;
 	//debug("max %f limit %f v %f a %f", max_dist, limit_dist, v, mtr->limit_a);
 	if (max_dist > 0 && limit_dist > max_dist) {
 		//debug("a- endpos %f limit a %f limit dist %f max dist %f v %f distance %f current pos %f s %d dt %f", mtr->settings.endpos, mtr->limit_a, limit_dist, max_dist, v, distance, mtr->settings.current_pos, s, dt);
-		v = sqrt(max_dist * 2 * mtr->limit_a);
+		if (use_j) {
+			// Find the highest speed that can still brake in time; brake_dist is monotonic in v, also with the acceleration that v implies.
+			// The acceleration may not drop faster than limit_j allows, so braking starts with a ramp.
+			double min_a = mtr->settings.last_a * s - mtr->limit_j * dt;
+			if (min_a < -mtr->limit_a)
+				min_a = -mtr->limit_a;
+			double low = mtr->settings.last_v * s + min_a * dt, high = v;
+			if (low < end_v)
+				low = end_v;
+			if (low > high)
+				low = high;
+			for (int i = 0; i < 20; ++i) {
+				double mid = (low + high) / 2;
+				if (brake_dist(mtr, mid, end_v, (mid - mtr->settings.last_v * s) / dt) > max_dist)
+					high = mid;
+				else
+					low = mid;
+			}
+			v = low;
+		}
+		else
+			v = sqrt(end_v * end_v + max_dist * 2 * mtr->limit_a);
 		distance = s * v * dt;
 	}
 	//debug("cd4 %f %f", distance, dt); */
@@ -374,9 +459,8 @@ static void check_distance(int sp, int mt, Motor *mtr, double distance, double d
 	if (settings.probing && steps)
 		steps = s;
 	else {
-		// Maximum depends on number of subfragments.  Be conservative and use 0x7e per subfragment; assume 128 subfragments (largest power of 2 smaller than 10000/75)
-		// TODO: 10000 and 75 should follow the actual values for step_time in cdriver and TIME_PER_ISR in firmware.
-		int max = 0x1e << 7;
+		// choose_sample_step keeps the period short enough for this; only moves that are too fast for the firmware are limited here.
+		int max = arch_max_sample_steps(settings.sample_step);
 		if (abs(steps) > max) {
 			debug("overflow %d from cp %f dist %f steps/mm %f dt %f s %d max %d", steps, mtr->settings.current_pos, distance, mtr->steps_per_unit, dt, s, max);
 			steps = max * s;
@@ -393,6 +477,15 @@ static void check_distance(int sp, int mt, Motor *mtr, double distance, double d
 		factor = f;
 } // }}}
 
+static void check_motors(Space *s, double const *motors_target, int32_t current_time, double &factor) { // {{{
+	for (int m = 0; m < s->num_motors; ++m) {
+		//if (s->id == 0 && m == 0)
+			//debug("check move %d %d target %f current %f", s->id, m, motors_target[m], s->motor[m]->settings.current_pos / s->motor[m]->steps_per_unit);
+		double distance = motors_target[m] - s->motor[m]->settings.current_pos / s->motor[m]->steps_per_unit;
+		check_distance(s->id, m, s->motor[m], distance, (current_time - settings.last_time) / 1e6, factor);
+	}
+} // }}}
+
 static void move_axes(Space *s, int32_t current_time, double &factor) { // {{{
 	double motors_target[s->num_motors];
 	bool ok = true;
@@ -403,12 +496,7 @@ static void move_axes(Space *s, int32_t current_time, double &factor) { // {{{
 		movedebug("retried move");
 	}
 	//movedebug("ok %d", ok);
-	for (int m = 0; m < s->num_motors; ++m) {
-		//if (s->id == 0 && m == 0)
-			//debug("check move %d %d target %f current %f", s->id, m, motors_target[m], s->motor[m]->settings.current_pos / s->motor[m]->steps_per_unit);
-		double distance = motors_target[m] - s->motor[m]->settings.current_pos / s->motor[m]->steps_per_unit;
-		check_distance(s->id, m, s->motor[m], distance, (current_time - settings.last_time) / 1e6, factor);
-	}
+	check_motors(s, motors_target, current_time, factor);
 } // }}}
 
 static bool do_steps(double &factor, int32_t current_time) { // {{{
@@ -481,6 +569,7 @@ static bool do_steps(double &factor, int32_t current_time) { // {{{
 	}
 	else
 		movedebug("no correct: %f %d", factor, int(settings.start_time));
+	double dt = (current_time - settings.last_time) / 1e6;
 	settings.last_time = current_time;
 #ifdef DEBUG_PATH
 	fprintf(stderr, "%d", current_time);
@@ -536,7 +625,9 @@ static bool do_steps(double &factor, int32_t current_time) { // {{{
 			}
 			mtr.settings.current_pos = new_cp;
 			//cpdebug(s, m, "cp three %f", target);
-			mtr.settings.last_v = mtr.settings.target_v * factor;
+			double v = mtr.settings.target_v * factor;
+			mtr.settings.last_a = dt > 0 ? (v - mtr.settings.last_v) / dt : 0;
+			mtr.settings.last_v = v;
 		}
 	}
 	current_fragment_pos += 1;
@@ -566,6 +657,10 @@ void make_target(Space &sp, double f, bool next) { // {{{
 	}
 } // }}}
 
+static double tick_time(unsigned long long current_time) { // {{{
+	return (current_time - settings.start_time) / 1e6;
+} // }}}
+
 static void handle_motors(unsigned long long current_time) { // {{{
 	// Check for move.
 	if (!computing_move) {
@@ -574,7 +669,7 @@ static void handle_motors(unsigned long long current_time) { // {{{
 	}
 	movedebug("handling %d %d", computing_move, cbs_after_current_move);
 	double factor = 1;
-	double t = (current_time - settings.start_time) / 1e6;
+	double t = tick_time(current_time);
 	if (t >= settings.t0 + settings.tp) {	// Finish this move and prepare next. {{{
 		movedebug("finishing %f %f %f %ld %ld", t, settings.t0, settings.tp, long(current_time), long(settings.start_time));
 		//debug("finish steps");
@@ -601,7 +696,7 @@ static void handle_motors(unsigned long long current_time) { // {{{
 		bool did_steps = do_steps(factor, current_time);
 		//debug("f3 %f", factor);
 		// Start time may have changed; recalculate t.
-		t = (current_time - settings.start_time) / 1e6;
+		t = tick_time(current_time);
 		if (t / (settings.t0 + settings.tp) >= done_factor) {
 			movedebug("Done with this move");
 			int had_cbs = cbs_after_current_move;
@@ -618,7 +713,7 @@ static void handle_motors(unsigned long long current_time) { // {{{
 					else
 						fragment = current_fragment;
 					//debug("adding %d cbs to fragment %d", had_cbs, fragment);
-					history[fragment].cbs += had_cbs;
+					history(fragment).cbs += had_cbs;
 				}
 				return;
 			}
@@ -636,8 +731,10 @@ static void handle_motors(unsigned long long current_time) { // {{{
 				}
 				for (int s = 0; s < NUM_SPACES; ++s) {
 					Space &sp = spaces[s];
-					for (int m = 0; m < sp.num_motors; ++m)
+					for (int m = 0; m < sp.num_motors; ++m) {
 						sp.motor[m]->settings.last_v = 0;
+						sp.motor[m]->settings.last_a = 0;
+					}
 				}
 				if (cbs_after_current_move > 0) {
 					if (!aborting) {
@@ -654,7 +751,7 @@ static void handle_motors(unsigned long long current_time) { // {{{
 						else
 							fragment = current_fragment;
 						//debug("adding %d cbs to final fragment %d", cbs_after_current_move, fragment);
-						history[fragment].cbs += cbs_after_current_move;
+						history(fragment).cbs += cbs_after_current_move;
 					}
 					//debug("clearing %d cbs after current move in final", cbs_after_current_move);
 					cbs_after_current_move = 0;
@@ -711,67 +808,47 @@ static void handle_motors(unsigned long long current_time) { // {{{
 	do_steps(factor, current_time);
 } // }}}
 
+static void save_snapshot(char *snapshot) { // {{{
+	memcpy(snapshot, &settings, sizeof(History));
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		memcpy(snapshot + sizeof(History) + s * sizeof(Space_History), &sp.settings, sizeof(Space_History));
+		for (int m = 0; m < sp.num_motors; ++m)
+			memcpy(&snapshot[sp.motor[m]->history_offset], &sp.motor[m]->settings, sizeof(Motor_History));
+		for (int a = 0; a < sp.num_axes; ++a)
+			memcpy(&snapshot[sp.axis[a]->history_offset], &sp.axis[a]->settings, sizeof(Axis_History));
+	}
+} // }}}
+
+static void load_snapshot(char const *snapshot) { // {{{
+	int cbs = settings.cbs;
+	memcpy(&settings, snapshot, sizeof(History));
+	settings.cbs = cbs;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		memcpy(&sp.settings, snapshot + sizeof(History) + s * sizeof(Space_History), sizeof(Space_History));
+		for (int m = 0; m < sp.num_motors; ++m)
+			memcpy(&sp.motor[m]->settings, &snapshot[sp.motor[m]->history_offset], sizeof(Motor_History));
+		for (int a = 0; a < sp.num_axes; ++a)
+			memcpy(&sp.axis[a]->settings, &snapshot[sp.axis[a]->history_offset], sizeof(Axis_History));
+	}
+} // }}}
+
 void store_settings() { // {{{
 	current_fragment_pos = 0;
 	num_active_motors = 0;
 	if (FRAGMENTS_PER_BUFFER == 0)
 		return;
-	history[current_fragment].t0 = settings.t0;
-	history[current_fragment].tp = settings.tp;
-	history[current_fragment].f0 = settings.f0;
-	history[current_fragment].f1 = settings.f1;
-	history[current_fragment].f2 = settings.f2;
-	history[current_fragment].fp = settings.fp;
-	history[current_fragment].fq = settings.fq;
-	history[current_fragment].fmain = settings.fmain;
-	history[current_fragment].cbs = 0;
-	history[current_fragment].hwtime = settings.hwtime;
-	history[current_fragment].start_time = settings.start_time;
-	history[current_fragment].last_time = settings.last_time;
-	history[current_fragment].last_current_time = settings.last_current_time;
-	history[current_fragment].queue_start = settings.queue_start;
-	history[current_fragment].queue_end = settings.queue_end;
-	history[current_fragment].queue_full = settings.queue_full;
-	history[current_fragment].run_file_current = settings.run_file_current;
-	history[current_fragment].run_time = settings.run_time;
-	history[current_fragment].run_dist = settings.run_dist;
+	save_snapshot(history_snapshot(current_fragment, 0));
+	history(current_fragment).cbs = 0;
+	num_checkpoints[current_fragment] = 0;
 	for (int s = 0; s < NUM_SPACES; ++s) {
 		Space &sp = spaces[s];
-		sp.history[current_fragment].dist[0] = sp.settings.dist[0];
-		sp.history[current_fragment].dist[1] = sp.settings.dist[1];
-		for (int i = 0; i < 2; ++i) {
-			sp.history[current_fragment].arc[i] = sp.settings.arc[i];
-			sp.history[current_fragment].angle[i] = sp.settings.angle[i];
-			sp.history[current_fragment].helix[i] = sp.settings.helix[i];
-			for (int t = 0; t < 2; ++t)
-				sp.history[current_fragment].radius[i][t] = sp.settings.radius[i][t];
-			for (int t = 0; t < 3; ++t) {
-				sp.history[current_fragment].offset[i][t] = sp.settings.offset[i][t];
-				sp.history[current_fragment].e1[i][t] = sp.settings.e1[i][t];
-				sp.history[current_fragment].e2[i][t] = sp.settings.e2[i][t];
-				sp.history[current_fragment].normal[i][t] = sp.settings.normal[i][t];
-			}
-		}
 		for (int m = 0; m < sp.num_motors; ++m) {
 			sp.motor[m]->active = false;
 			DATA_CLEAR(s, m);
-			sp.motor[m]->history[current_fragment].last_v = sp.motor[m]->settings.last_v;
-			sp.motor[m]->history[current_fragment].target_v = sp.motor[m]->settings.target_v;
-			sp.motor[m]->history[current_fragment].target_dist = sp.motor[m]->settings.target_dist;
-			sp.motor[m]->history[current_fragment].current_pos = sp.motor[m]->settings.current_pos;
-			sp.motor[m]->history[current_fragment].endpos = sp.motor[m]->settings.endpos;
 			cpdebug(s, m, "store");
 		}
-		for (int a = 0; a < sp.num_axes; ++a) {
-			sp.axis[a]->history[current_fragment].dist[0] = sp.axis[a]->settings.dist[0];
-			sp.axis[a]->history[current_fragment].dist[1] = sp.axis[a]->settings.dist[1];
-			sp.axis[a]->history[current_fragment].main_dist = sp.axis[a]->settings.main_dist;
-			sp.axis[a]->history[current_fragment].target = sp.axis[a]->settings.target;
-			sp.axis[a]->history[current_fragment].source = sp.axis[a]->settings.source;
-			sp.axis[a]->history[current_fragment].current = sp.axis[a]->settings.current;
-			sp.axis[a]->history[current_fragment].endpos[0] = sp.axis[a]->settings.endpos[0];
-			sp.axis[a]->history[current_fragment].endpos[1] = sp.axis[a]->settings.endpos[1];
-		}
 	}
 } // }}}
 
@@ -780,62 +857,49 @@ void restore_settings() { // {{{
 	num_active_motors = 0;
 	if (FRAGMENTS_PER_BUFFER == 0)
 		return;
-	settings.t0 = history[current_fragment].t0;
-	settings.tp = history[current_fragment].tp;
-	settings.f0 = history[current_fragment].f0;
-	settings.f1 = history[current_fragment].f1;
-	settings.f2 = history[current_fragment].f2;
-	settings.fp = history[current_fragment].fp;
-	settings.fq = history[current_fragment].fq;
-	settings.fmain = history[current_fragment].fmain;
-	history[current_fragment].cbs = 0;
-	settings.hwtime = history[current_fragment].hwtime;
-	settings.start_time = history[current_fragment].start_time;
-	settings.last_time = history[current_fragment].last_time;
-	settings.last_current_time = history[current_fragment].last_current_time;
-	settings.queue_start = history[current_fragment].queue_start;
-	settings.queue_end = history[current_fragment].queue_end;
-	settings.queue_full = history[current_fragment].queue_full;
-	settings.run_file_current = history[current_fragment].run_file_current;
-	settings.run_time = history[current_fragment].run_time;
-	settings.run_dist = history[current_fragment].run_dist;
+	load_snapshot(history_snapshot(current_fragment, 0));
+	history(current_fragment).cbs = 0;
+	// Events are attached again when the fragment is regenerated.
+	fragment_events[current_fragment][0] = -1;
 	for (int s = 0; s < NUM_SPACES; ++s) {
 		Space &sp = spaces[s];
-		sp.settings.dist[0] = sp.history[current_fragment].dist[0];
-		sp.settings.dist[1] = sp.history[current_fragment].dist[1];
-		for (int i = 0; i < 2; ++i) {
-			sp.settings.arc[i] = sp.history[current_fragment].arc[i];
-			sp.settings.angle[i] = sp.history[current_fragment].angle[i];
-			sp.settings.helix[i] = sp.history[current_fragment].helix[i];
-			for (int t = 0; t < 2; ++t)
-				sp.settings.radius[i][t] = sp.history[current_fragment].radius[i][t];
-			for (int t = 0; t < 3; ++t) {
-				sp.settings.offset[i][t] = sp.history[current_fragment].offset[i][t];
-				sp.settings.e1[i][t] = sp.history[current_fragment].e1[i][t];
-				sp.settings.e2[i][t] = sp.history[current_fragment].e2[i][t];
-				sp.settings.normal[i][t] = sp.history[current_fragment].normal[i][t];
-			}
-		}
 		for (int m = 0; m < sp.num_motors; ++m) {
 			sp.motor[m]->active = false;
 			DATA_CLEAR(s, m);
-			sp.motor[m]->settings.last_v = sp.motor[m]->history[current_fragment].last_v;
-			sp.motor[m]->settings.target_v = sp.motor[m]->history[current_fragment].target_v;
-			sp.motor[m]->settings.target_dist = sp.motor[m]->history[current_fragment].target_dist;
-			sp.motor[m]->settings.current_pos = sp.motor[m]->history[current_fragment].current_pos;
-			sp.motor[m]->settings.endpos = sp.motor[m]->history[current_fragment].endpos;
 			cpdebug(s, m, "restore");
 		}
-		for (int a = 0; a < sp.num_axes; ++a) {
-			sp.axis[a]->settings.dist[0] = sp.axis[a]->history[current_fragment].dist[0];
-			sp.axis[a]->settings.dist[1] = sp.axis[a]->history[current_fragment].dist[1];
-			sp.axis[a]->settings.main_dist = sp.axis[a]->history[current_fragment].main_dist;
-			sp.axis[a]->settings.target = sp.axis[a]->history[current_fragment].target;
-			sp.axis[a]->settings.source = sp.axis[a]->history[current_fragment].source;
-			sp.axis[a]->settings.current = sp.axis[a]->history[current_fragment].current;
-			sp.axis[a]->settings.endpos[0] = sp.axis[a]->history[current_fragment].endpos[0];
-			sp.axis[a]->settings.endpos[1] = sp.axis[a]->history[current_fragment].endpos[1];
-		}
+	}
+} // }}}
+
+int restore_checkpoint(int pos) { // {{{
+	// Restore the state of the last checkpoint of the current fragment at or before sample pos.  Returns the position of that checkpoint.
+	// Must be called after restore_settings.  Samples before the returned position are not regenerated.
+	if (FRAGMENTS_PER_BUFFER == 0)
+		return 0;
+	int k = min(pos / CHECKPOINT_INTERVAL, num_checkpoints[current_fragment]);
+	if (k == 0)
+		return 0;
+	load_snapshot(history_snapshot(current_fragment, k));
+	current_fragment_pos = k * CHECKPOINT_INTERVAL;
+	return current_fragment_pos;
+} // }}}
+
+void clear_checkpoints() { // {{{
+	// Call this when state is changed in the fragment snapshots; checkpoints are not updated.
+	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f)
+		num_checkpoints[f] = 0;
+} // }}}
+
+static void checkpoint() { // {{{
+	// Record a checkpoint if a tick has just ended on a checkpoint position.
+	int k = current_fragment_pos / CHECKPOINT_INTERVAL;
+	if (current_fragment_pos % CHECKPOINT_INTERVAL == 0 && k > 0 && k <= checkpoints_per_fragment) {
+		save_snapshot(history_snapshot(current_fragment, k));
+		num_checkpoints[current_fragment] = k;
+	}
+	else if (k < num_checkpoints[current_fragment]) {
+		// The fragment is being regenerated; later checkpoints are no longer valid.
+		num_checkpoints[current_fragment] = k;
 	}
 } // }}}
 
@@ -852,12 +916,12 @@ void send_fragment() { // {{{
 		if (current_fragment_pos < 2) {
 			// TODO: find out why this is attempted and avoid it.
 			debug("not sending short fragment for 0 motors; %d %d", current_fragment, running_fragment);
-			if (history[current_fragment].cbs) {
+			if (history(current_fragment).cbs) {
 				if (settings.queue_start == settings.queue_end && !settings.queue_full) {
 					// Send cbs immediately.
 					if (!host_block) {
-						send_host(CMD_MOVECB, history[current_fragment].cbs);  
-						history[current_fragment].cbs = 0;
+						send_host(CMD_MOVECB, history(current_fragment).cbs);  
+						history(current_fragment).cbs = 0;
 					}
 				}
 			}
@@ -868,11 +932,12 @@ void send_fragment() { // {{{
 			debug("sending fragment for 0 motors at position %d", current_fragment_pos);
 		//abort();
 	}
-	//debug("sending %d prevcbs %d", current_fragment, history[(current_fragment + FRAGMENTS_PER_BUFFER - 1) % FRAGMENTS_PER_BUFFER].cbs);
+	//debug("sending %d prevcbs %d", current_fragment, history((current_fragment + FRAGMENTS_PER_BUFFER - 1) % FRAGMENTS_PER_BUFFER).cbs);
 	if (arch_send_fragment()) {
 		current_fragment = (current_fragment + 1) % FRAGMENTS_PER_BUFFER;
 		//debug("current_fragment = (current_fragment + 1) %% FRAGMENTS_PER_BUFFER; %d", current_fragment);
 		//debug("current send -> %x", current_fragment);
+		fragment_events[current_fragment][0] = -1;
 		store_settings();
 		if ((current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER >= MIN_BUFFER_FILL && !stopping) {
 			arch_start_move(0);
@@ -880,20 +945,176 @@ void send_fragment() { // {{{
 	}
 } // }}}
 
+static double peak_step_rate(double duration) { // {{{
+	// Highest step rate any motor can reach within duration [s], given its current speed and limits.
+	// Motors that don't take part in the current segment stay idle; a fragment with a long period ends when the next segment starts.
+	double rate = 0;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		if (!settings.single && s == 2)
+			continue;
+		Space &sp = spaces[s];
+		for (int m = 0; m < sp.num_motors; ++m) {
+			Motor &mtr = *sp.motor[m];
+			if (mtr.settings.last_v == 0 && (isnan(mtr.settings.endpos) || fabs(mtr.settings.endpos * mtr.steps_per_unit - mtr.settings.current_pos) < .5))
+				continue;
+			double v = fabs(mtr.settings.last_v) + mtr.limit_a * duration;
+			if (v > mtr.limit_v)
+				v = mtr.limit_v;
+			v *= fabs(mtr.steps_per_unit);
+			if (!(v <= rate))
+				rate = v;
+		}
+	}
+	return isnan(rate) ? INFINITY : rate;
+} // }}}
+
+static void choose_sample_step() { // {{{
+	// Choose the sample period for a new fragment: the longest one that the arch allows for the step rates the motors can reach during it.
+	// Probing does one step per sample, so it keeps the normal period.
+	// Samples that would need more steps than the firmware can do in them are split by using a shorter period.
+	int factor = settings.probing ? 1 : MAX_SAMPLE_FACTOR;
+	while (factor > 1) {
+		double rate = peak_step_rate(SAMPLES_PER_FRAGMENT * factor * hwtime_step / 1e6);
+		if (arch_sample_factor(rate) >= factor && rate * factor * hwtime_step / 1e6 <= arch_max_sample_steps(hwtime_step * factor))
+			break;
+		factor -= 1;
+	}
+	settings.sample_step = hwtime_step * factor;
+} // }}}
+
 void apply_tick() { // {{{
-	settings.hwtime += hwtime_step;
+	if (current_fragment_pos == 0)
+		choose_sample_step();
+	settings.hwtime += settings.sample_step;
 	if (current_fragment_pos < SAMPLES_PER_FRAGMENT)
 		handle_motors(settings.hwtime);
 	//if (spaces[0].num_axes >= 2)
 		//debug("move z %d %d %f %f %f", current_fragment, current_fragment_pos, spaces[0].axis[2]->settings.current, spaces[0].motor[0]->settings.current_pos, spaces[0].motor[0]->settings.current_pos + avr_pos_offset[0]);
 } // }}}
 
+// Batched computation of ticks. {{{
+// During the main part of a segment, the targets are a smooth function of
+// time, so they can be computed for many ticks at once, into one contiguous
+// row per axis.  Motor positions are then computed from those rows with the
+// batched kinematics of the space type.  This stays valid until a limit is hit: then start_time is
+// adjusted and the rest of the batch must be recomputed.  The batch size
+// adapts to how often that happens.
+#define MAX_BATCH 64
+static int batch_size = MAX_BATCH;
+
+static int main_ticks(int max_ticks) { // {{{
+	// Number of upcoming ticks that are in the main part of the segment.
+	int n = 0;
+	while (n < max_ticks && tick_time(settings.hwtime + (n + 1) * settings.sample_step) < settings.t0)
+		n += 1;
+	return n;
+} // }}}
+
+static int batch_ticks(int n) { // {{{
+	// Do n ticks in the main part; return the number of ticks that were done.
+	int32_t start_time = settings.start_time;
+	double f[n];
+	for (int k = 0; k < n; ++k) {
+		double t_fraction = tick_time(settings.hwtime + (k + 1) * settings.sample_step) / settings.t0;
+		f[k] = (settings.f1 * (2 - t_fraction) + settings.f2 * t_fraction) * t_fraction;
+	}
+	int total_axes = 0, total_motors = 0;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		total_axes += spaces[s].num_axes;
+		total_motors += spaces[s].num_motors;
+	}
+	double target[total_axes][n];
+	double motors[total_motors][n];
+	bool batched[NUM_SPACES];
+	int a0 = 0, m0 = 0;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		batched[s] = false;
+		if ((settings.single || s != 2) && !sp.settings.arc[0]) {
+			for (int a = 0; a < sp.num_axes; ++a) {
+				double *row = target[a0 + a];
+				double source = sp.axis[a]->settings.source;
+				double dist = sp.axis[a]->settings.dist[0];
+				for (int k = 0; k < n; ++k)
+					row[k] = source + dist * f[k];
+			}
+			batched[s] = space_types[sp.type].xyz2motors_n(&sp, n, target[a0], motors[m0]);
+		}
+		a0 += sp.num_axes;
+		m0 += sp.num_motors;
+	}
+	for (int k = 0; k < n; ++k) {
+		settings.hwtime += settings.sample_step;
+		double factor = 1;
+		a0 = 0;
+		m0 = 0;
+		for (int s = 0; s < NUM_SPACES; ++s) {
+			Space &sp = spaces[s];
+			if (!settings.single && s == 2) {
+				a0 += sp.num_axes;
+				m0 += sp.num_motors;
+				continue;
+			}
+			if (sp.settings.arc[0]) {
+				for (int a = 0; a < sp.num_axes; ++a)
+					sp.axis[a]->settings.target = isnan(sp.axis[a]->settings.dist[0]) ? NAN : sp.axis[a]->settings.source;
+				make_target(sp, f[k], false);
+			}
+			else {
+				for (int a = 0; a < sp.num_axes; ++a)
+					sp.axis[a]->settings.target = target[a0 + a][k];
+			}
+			if (batched[s]) {
+				double motors_target[sp.num_motors];
+				for (int m = 0; m < sp.num_motors; ++m)
+					motors_target[m] = motors[m0 + m][k];
+				check_motors(&sp, motors_target, settings.hwtime, factor);
+			}
+			else
+				move_axes(&sp, settings.hwtime, factor);
+			a0 += sp.num_axes;
+			m0 += sp.num_motors;
+		}
+		do_steps(factor, settings.hwtime);
+		if (settings.start_time != start_time)
+			return k + 1;
+	}
+	return n;
+} // }}}
+
+static bool fill_fragment() { // {{{
+	// Compute ticks until the fragment is full or the move is done.  Return true if the fragment should be sent.
+	while (computing_move && !stopping && !discard_pending && !discarding && current_fragment_pos < SAMPLES_PER_FRAGMENT) {
+		if (current_fragment_pos == 0)
+			choose_sample_step();
+		// Batches don't cross checkpoints.
+		int next_checkpoint = (current_fragment_pos / CHECKPOINT_INTERVAL + 1) * CHECKPOINT_INTERVAL;
+		int n = main_ticks(min(batch_size, min(int(SAMPLES_PER_FRAGMENT), next_checkpoint) - int(current_fragment_pos)));
+		if (n < 2) {
+			// Connector part, end of segment, or start of the next one.
+			int queue_start = settings.queue_start;
+			apply_tick();
+			checkpoint();
+			// A long sample period was only chosen for the motors of the old segment.
+			if (settings.sample_step > hwtime_step && settings.queue_start != queue_start && current_fragment_pos > 0)
+				return true;
+			continue;
+		}
+		int done = batch_ticks(n);
+		checkpoint();
+		if (done == n)
+			batch_size = min(batch_size * 2, MAX_BATCH);
+		else
+			batch_size = max(done, 2);
+	}
+	return current_fragment_pos >= SAMPLES_PER_FRAGMENT;
+} // }}}
+// }}}
+
 void buffer_refill() { // {{{
 	//debug("refill");
-	if (preparing || FRAGMENTS_PER_BUFFER == 0) {
-		//debug("no refill because prepare");
+	if (FRAGMENTS_PER_BUFFER == 0)
 		return;
-	}
 	if (moving_to_current == 2)
 		move_to_current();
 	if (!computing_move || refilling || stopping || discard_pending || discarding) {
@@ -906,17 +1127,20 @@ void buffer_refill() { // {{{
 		send_fragment();
 	//debug("refill start %d %d %d", running_fragment, current_fragment, sending_fragment);
 	// Keep one free fragment, because we want to be able to rewind and use the buffer before the one currently active.
+	int fragments = 0;
 	while (computing_move && !stopping && !discard_pending && !discarding && (running_fragment - 1 - current_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER > 4 && !sending_fragment) {
+		if (fragments >= REFILL_FRAGMENTS) {
+			// Let the main loop check for commands from host and firmware before continuing.
+			refill_pending = true;
+			break;
+		}
 		//debug("refill %d %d %f", current_fragment, current_fragment_pos, spaces[0].motor[0]->settings.current_pos);
 		// fill fragment until full.
-		apply_tick();
-		//debug("refill2 %d %f", current_fragment, spaces[0].motor[0]->settings.current_pos);
-		if (current_fragment_pos >= SAMPLES_PER_FRAGMENT) {
+		if (fill_fragment()) {
 			//debug("fragment full %d %d %d", computing_move, current_fragment_pos, BYTES_PER_FRAGMENT);
 			send_fragment();
+			fragments += 1;
 		}
-		// Check for commands from host; in case of many short buffers, this loop may not end in a reasonable time.
-		//serial(0);
 	}
 	if (stopping || discard_pending) {
 		//debug("aborting refill for stopping");
@@ -29,6 +29,12 @@ static void xyz2motors(Space *s, double *motors) { // {{{
 	}
 } // }}}
 
+static bool xyz2motors_n(Space *s, int n, double const *__restrict target, double *__restrict motors) { // {{{
+	for (int i = 0; i < s->num_axes * n; ++i)
+		motors[i] = target[i];
+	return true;
+} // }}}
+
 static void reset_pos(Space *s) { // {{{
 	// If positions are unknown, pretend that they are 0.
 	// This is mostly useful for extruders.
@@ -96,6 +102,7 @@ static int follow(Space *s, int axis) { // {{{
 
 void Cartesian_init(int num) { // {{{
 	space_types[num].xyz2motors = xyz2motors;
+	space_types[num].xyz2motors_n = xyz2motors_n;
 	space_types[num].reset_pos = reset_pos;
 	space_types[num].check_position = check_position;
 	space_types[num].load = load;
@@ -145,6 +152,8 @@ static void eload(Space *s, uint8_t old_type, int32_t &addr) { // {{{
 		move = true;
 		queue[settings.queue_end].probe = false;
 		queue[settings.queue_end].cb = false;
+		queue[settings.queue_end].record = -1;
+		queue[settings.queue_end].events = -1;
 		queue[settings.queue_end].f[0] = INFINITY;
 		queue[settings.queue_end].f[1] = INFINITY;
 		for (int i = 0; i < spaces[0].num_axes; ++i) {
@@ -211,6 +220,7 @@ static double eunchange0(Space *s, int axis, double value) { // {{{
 
 void Extruder_init(int num) { // {{{
 	space_types[num].xyz2motors = xyz2motors;
+	space_types[num].xyz2motors_n = xyz2motors_n;
 	space_types[num].reset_pos = reset_pos;
 	space_types[num].check_position = check_position;
 	space_types[num].load = eload;
@@ -297,6 +307,7 @@ static int ffollow(Space *s, int axis) { // {{{
 
 void Follower_init(int num) { // {{{
 	space_types[num].xyz2motors = xyz2motors;
+	space_types[num].xyz2motors_n = xyz2motors_n;
 	space_types[num].reset_pos = reset_pos;
 	space_types[num].check_position = check_position;
 	space_types[num].load = fload;
@@ -89,6 +89,29 @@ static void xyz2motors(Space *s, double *motors) {
 	}
 }
 
+static bool xyz2motors_n(Space *s, int n, double const *__restrict target, double *__restrict motors) {
+	double const *__restrict x = target, *__restrict y = target + n, *__restrict z = target + 2 * n;
+	// Missing targets are filled from the current position, which changes every tick.
+	for (int k = 0; k < n; ++k) {
+		if (isnan(x[k]) || isnan(y[k]) || isnan(z[k]))
+			return false;
+	}
+	// One tower at a time, so the inner loop has no dependencies between samples and no branches; it is vectorized.
+	for (uint8_t a = 0; a < 3; ++a) {
+		double ax = APEX(s, a).x;
+		double ay = APEX(s, a).y;
+		double az = APEX(s, a).z;
+		double l2 = APEX(s, a).rodlength * APEX(s, a).rodlength;
+		double *__restrict m = motors + a * n;
+		for (int k = 0; k < n; ++k) {
+			double dx = x[k] - ax;
+			double dy = y[k] - ay;
+			m[k] = sqrt(l2 - dx * dx - dy * dy) + z[k] - az;
+		}
+	}
+	return true;
+}
+
 static void reset_pos (Space *s) {
 	// All axes' current_pos must be valid and equal, in other words, x=y=0.
 	double p[3];
@@ -220,6 +243,7 @@ static int follow(Space *s, int axis) {
 
 void Delta_init(int num) {
 	space_types[num].xyz2motors = xyz2motors;
+	space_types[num].xyz2motors_n = xyz2motors_n;
 	space_types[num].reset_pos = reset_pos;
 	space_types[num].check_position = check_position;
 	space_types[num].load = load;
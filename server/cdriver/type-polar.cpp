@@ -38,9 +38,9 @@ static void xyz2motors(Space *s, double *motors) {
 	double z = s->axis[2]->settings.target;
 	double r = sqrt(x * x + y * y);
 	double theta = atan2(y, x);
-	while (theta - s->motor[1]->settings.current_pos / s->motor[1]->steps_per_unit > 2 * M_PI)
+	while (theta - s->motor[1]->settings.current_pos / s->motor[1]->steps_per_unit > M_PI)
 		theta -= 2 * M_PI;
-	while (theta - s->motor[1]->settings.current_pos / s->motor[1]->steps_per_unit < -2 * M_PI)
+	while (theta - s->motor[1]->settings.current_pos / s->motor[1]->steps_per_unit < -M_PI)
 		theta += 2 * M_PI;
 	if (motors) {
 		motors[0] = r;
@@ -54,6 +54,32 @@ static void xyz2motors(Space *s, double *motors) {
 	}
 }
 
+static bool xyz2motors_n(Space *s, int n, double const *__restrict target, double *__restrict motors) {
+	double const *__restrict x = target, *__restrict y = target + n, *__restrict z = target + 2 * n;
+	for (int k = 0; k < n; ++k) {
+		if (isnan(x[k]) || isnan(y[k]))
+			return false;
+	}
+	double *__restrict r = motors, *__restrict theta = motors + n, *__restrict mz = motors + 2 * n;
+	// This loop is vectorized; atan2 and the wrapping below are not.
+	for (int k = 0; k < n; ++k) {
+		r[k] = sqrt(x[k] * x[k] + y[k] * y[k]);
+		mz[k] = z[k];
+	}
+	for (int k = 0; k < n; ++k)
+		theta[k] = atan2(y[k], x[k]);
+	// Wrap each sample against the previous one, like the per-tick path does against current_pos.
+	double current = s->motor[1]->settings.current_pos / s->motor[1]->steps_per_unit;
+	for (int k = 0; k < n; ++k) {
+		while (theta[k] - current > M_PI)
+			theta[k] -= 2 * M_PI;
+		while (theta[k] - current < -M_PI)
+			theta[k] += 2 * M_PI;
+		current = theta[k];
+	}
+	return true;
+}
+
 static void reset_pos (Space *s) {
 	double r = s->motor[0]->settings.current_pos / s->motor[0]->steps_per_unit;
 	double theta = s->motor[1]->settings.current_pos / s->motor[1]->steps_per_unit;
@@ -125,6 +151,7 @@ static int follow(Space *s, int axis) {
 
 void Polar_init(int num) {
 	space_types[num].xyz2motors = xyz2motors;
+	space_types[num].xyz2motors_n = xyz2motors_n;
 	space_types[num].reset_pos = reset_pos;
 	space_types[num].check_position = check_position;
 	space_types[num].load = load;
@@ -31,7 +31,6 @@ TYPE_DELTA = 1
 TYPE_POLAR = 2
 TYPE_EXTRUDER = 3
 TYPE_FOLLOWER = 4
-record_format = '=Bidddddddd' # type, tool, X, Y, Z, E, f, F, time, dist
 # }}}
 
 # Imports.  {{{
@@ -59,6 +58,7 @@ import mmap
 import random
 import errno
 import shutil
+import hashlib
 # }}}
 
 config = fhs.init(packagename = 'franklin', config = { # {{{
@@ -66,7 +66,8 @@ config = fhs.init(packagename = 'franklin', config = { # {{{
 	'allow-system': None,
 	'uuid': None,
 	'local': False,
-	'arc': True
+	'arc': True,
+	'gcode-cache': '1000'
 	})
 # }}}
 
@@ -79,6 +80,17 @@ if False:
 	sys.settrace(trace)
 # }}}
 
+# Native G-Code compiler; it is installed next to cdriver. {{{
+# If neither the module nor the program is available, _gcode_parse is used.
+cdriver_dir = os.path.dirname(config['cdriver'] or '')
+sys.path.insert(0, cdriver_dir)
+try:
+	import franklin_gcode
+except ImportError:
+	franklin_gcode = None
+gcode_compiler = os.path.join(cdriver_dir, 'franklin-gcode')
+# }}}
+
 fcntl.fcntl(sys.stdin.fileno(), fcntl.F_SETFL, os.O_NONBLOCK)
 
 def dprint(x, data): # {{{
@@ -212,6 +224,11 @@ class Printer: # {{{
 		self.probe_speed = 3.
 		self.gcode_file = False
 		self.gcode_map = None
+		self.gcode_run_file = None
+		self.gcode_compiler = None
+		self.gcode_previews = {}	# Preview exporters that are running, by job name: [process, filename, stderr output].
+		self.gcode_stream_strings = None
+		self.gcode_stream_key = None
 		self.gcode_id = None
 		self.gcode_waiting = 0
 		self.audio_id = None
@@ -287,6 +304,7 @@ class Printer: # {{{
 		self.feedrate = 1
 		self.max_deviation = 0
 		self.max_v = float('inf')
+		self.run_prefetch = 64
 		self.current_extruder = 0
 		self.targetx = 0
 		self.targety = 0
@@ -679,7 +697,7 @@ class Printer: # {{{
 		if data is None:
 			return False
 		self.queue_length, self.num_pins, num_temps, num_gpios = struct.unpack('=BBBB', data[:4])
-		self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, self.timeout, self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.current_extruder, self.targetx, self.targety, self.zoffset, self.store_adc = struct.unpack('=HHHHHhhhdddBddd?', data[4:])
+		self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, self.timeout, self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.current_extruder, self.targetx, self.targety, self.zoffset, self.store_adc, self.run_prefetch = struct.unpack('=HHHHHhhhdddBddd?H', data[4:])
 		while len(self.temps) < num_temps:
 			self.temps.append(self.Temp(len(self.temps)))
 			if update:
@@ -701,7 +719,7 @@ class Printer: # {{{
 			ng = len(self.gpios)
 		dt = nt - len(self.temps)
 		dg = ng - len(self.gpios)
-		data = struct.pack('=BBHHHHHhhhdddBddd?', nt, ng, self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, int(self.timeout), self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.current_extruder, self.targetx, self.targety, self.zoffset, self.store_adc)
+		data = struct.pack('=BBHHHHHhhhdddBddd?H', nt, ng, self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, int(self.timeout), self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.current_extruder, self.targetx, self.targety, self.zoffset, self.store_adc, self.run_prefetch)
 		self._send_packet(struct.pack('=B', protocol.command['WRITE_GLOBALS']) + data)
 		self._read_globals(update = True)
 		if update:
@@ -731,7 +749,7 @@ class Printer: # {{{
 	def _globals_update(self, target = None): # {{{
 		if not self.initialized:
 			return
-		self._broadcast(target, 'globals_update', [self.name, self.profile, len(self.temps), len(self.gpios), self.pin_names, self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, self.probe_dist, self.probe_safe_dist, self.bed_id, self.fan_id, self.spindle_id, self.unit_name, self.timeout, self.feedrate, self.max_deviation, self.max_v, self.targetx, self.targety, self.zoffset, self.store_adc, self.park_after_print, self.sleep_after_print, self.cool_after_print, self._mangle_spi(), self.temp_scale_min, self.temp_scale_max, self.connected, not self.paused and (None if self.gcode_map is None and not self.gcode_file else True)])
+		self._broadcast(target, 'globals_update', [self.name, self.profile, len(self.temps), len(self.gpios), self.pin_names, self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, self.probe_dist, self.probe_safe_dist, self.bed_id, self.fan_id, self.spindle_id, self.unit_name, self.timeout, self.feedrate, self.max_deviation, self.max_v, self.targetx, self.targety, self.zoffset, self.store_adc, self.park_after_print, self.sleep_after_print, self.cool_after_print, self._mangle_spi(), self.temp_scale_min, self.temp_scale_max, self.run_prefetch, self.connected, not self.paused and (None if self.gcode_map is None and not self.gcode_file else True)])
 	# }}}
 	def _space_update(self, which, target = None): # {{{
 		if not self.initialized:
@@ -786,7 +804,21 @@ class Printer: # {{{
 		return z + l * (1 - fx) + r * fx
 	# }}}
 	def _gcode_close(self): # {{{
+		if self.gcode_compiler is not None:
+			self.gcode_compiler.kill()
+			self.gcode_compiler.wait()
+			self.gcode_compiler.stderr.close()
+			self.gcode_compiler = None
+		if self.gcode_stream_strings is not None:
+			# A complete file has been linked into the cache.
+			for filename in (self.gcode_stream_strings, self.gcode_filename):
+				try:
+					os.unlink(filename)
+				except FileNotFoundError:
+					pass
+			self.gcode_stream_strings = None
 		self.gcode_strings = []
+		self.gcode_run_file = None
 		self.gcode_map.close()
 		os.close(self.gcode_fd)
 		self.gcode_map = None
@@ -883,11 +915,12 @@ class Printer: # {{{
 		while name == '' or name in self.jobqueue:
 			name = '%s-%d' % (origname, i)
 			i += 1
-		bbox, errors = self._gcode_parse(f, name)
+		bbox, errors = self._gcode_cached(f, name)
 		for e in errors:
 			log(e)
 		if bbox is None:
 			return errors
+		self._gcode_preview(os.path.splitext(name)[0])
 		self.jobqueue[os.path.splitext(name)[0]] = bbox
 		self._broadcast(None, 'queue', [(q, self.jobqueue[q]) for q in self.jobqueue])
 		return errors
@@ -1439,7 +1472,7 @@ class Printer: # {{{
 			cb()
 		self.gcode_id = None
 	# }}}
-	def _gcode_run(self, src, angle = 0, abort = True): # {{{
+	def _gcode_run(self, src, angle = 0, abort = True, filename = None): # {{{
 		if self.parking:
 			return
 		angle = math.radians(angle)
@@ -1461,23 +1494,18 @@ class Printer: # {{{
 		if len(self.spaces) > 1:
 			for e in range(len(self.spaces[1].axis)):
 				self.set_axis_pos(1, e, 0)
-		filename = fhs.read_spool(os.path.join(self.uuid, 'gcode', src + os.extsep + 'bin'), text = False, opened = False)
-		self.total_time = self.jobqueue[src][-2:]
+		if filename is None:
+			filename = fhs.read_spool(os.path.join(self.uuid, 'gcode', src + os.extsep + 'bin'), text = False, opened = False)
+			self.total_time = self.jobqueue[src][-2:]
+		self.gcode_filename = filename
 		self.gcode_fd = os.open(filename, os.O_RDONLY)
 		self.gcode_map = mmap.mmap(self.gcode_fd, 0, prot = mmap.PROT_READ)
-		filesize = os.fstat(self.gcode_fd).st_size
-		bboxsize = 8 * struct.calcsize('=d')
-		def unpack(format, pos):
-			return struct.unpack(format, self.gcode_map[pos:pos + struct.calcsize(format)])
-		num_strings = unpack('=I', filesize - bboxsize - struct.calcsize('=I'))[0]
-		self.gcode_strings = []
-		sizes = [unpack('=I', filesize - bboxsize - struct.calcsize('=I') * (num_strings + 1 - x))[0] for x in range(num_strings)]
-		first_string = filesize - bboxsize - struct.calcsize('=I') * (num_strings + 1) - sum(sizes)
-		pos = 0
-		for x in range(num_strings):
-			self.gcode_strings.append(self.gcode_map[first_string + pos:first_string + pos + sizes[x]].decode('utf-8', 'replace'))
-			pos += sizes[x]
-		self.gcode_num_records = first_string / struct.calcsize(record_format)
+		self.gcode_run_file = protocol.RunFile(self.gcode_map)
+		if src is None:
+			# The bounding box is not known while the file is being compiled.
+			self.total_time = self.gcode_run_file.bbox[-2:] if self.gcode_run_file.bbox is not None else [float('nan'), float('nan')]
+		self.gcode_strings = self.gcode_run_file.strings
+		self.gcode_num_records = self.gcode_run_file.num_records
 		if self.probemap is not None:
 			self.gcode_file = True
 			self._globals_update()
@@ -1503,6 +1531,266 @@ class Printer: # {{{
 			self._globals_update()
 			self._send_packet(struct.pack('=BBddBB', protocol.command['RUN_FILE'], 1 if self.confirmer is None else 0, self.gcode_angle[0], self.gcode_angle[1], 0xff, 0) + filename.encode('utf8'))
 	# }}}
+	def _gcode_compile(self, src, name): # {{{
+		'''Compile G-Code with the native compiler, which produces the same result as _gcode_parse.'''
+		if franklin_gcode is None and not os.access(gcode_compiler, os.X_OK):
+			return self._gcode_parse(src, name)
+		assert len(self.spaces) > 0
+		self._broadcast(None, 'blocked', 'parsing g-code')
+		with fhs.write_spool(os.path.join(self.uuid, 'gcode', os.path.splitext(name)[0] + os.path.extsep + 'bin'), text = False) as dst:
+			if franklin_gcode is not None:
+				num_extruders, park = self._gcode_compiler_settings()
+				bbox, errors = franklin_gcode.compile(src.fileno(), dst.fileno(), config['arc'], len(self.temps), num_extruders, park, self.allow_system)
+			else:
+				process = subprocess.run(self._gcode_compiler_command(), stdin = src, stdout = dst, stderr = subprocess.PIPE, close_fds = True)
+				bbox, errors = self._gcode_compiler_result(process.returncode, process.stderr)
+		self._broadcast(None, 'blocked', None)
+		return bbox, errors
+	# }}}
+	def _gcode_preview(self, name): # {{{
+		'''Write the toolpath preview of a queued job, for the web interface.
+		The compiler program writes it in the background; a preview broadcast is sent when it is done.'''
+		self._gcode_preview_stop(name)
+		src = fhs.read_spool(os.path.join(self.uuid, 'gcode', name + os.extsep + 'bin'), text = False, opened = False)
+		filename = fhs.write_spool(os.path.join(self.uuid, 'preview', name + os.extsep + 'bin'), text = False, opened = False)
+		try:
+			if os.access(gcode_compiler, os.X_OK):
+				# Write to a temporary file, so the web interface never sees a partial preview.
+				with open(src, 'rb') as f, open(filename + os.extsep + 'part', 'wb') as dst:
+					self.gcode_previews[name] = [subprocess.Popen([gcode_compiler, '--preview'], stdin = f, stdout = dst, stderr = subprocess.PIPE, close_fds = True), filename, b'']
+				return
+			if franklin_gcode is None:
+				return
+			with open(src, 'rb') as f, open(filename, 'wb') as dst:
+				franklin_gcode.preview(f.fileno(), dst.fileno())
+		except (IOError, OSError) as e:
+			log('unable to write preview for %s: %s' % (name, e))
+			return
+		self._broadcast(None, 'preview', name)
+	# }}}
+	def _gcode_preview_input(self, name): # {{{
+		process, filename, output = self.gcode_previews[name]
+		data = os.read(process.stderr.fileno(), 4096)
+		if len(data) > 0:
+			self.gcode_previews[name][2] += data
+			return
+		process.wait()
+		process.stderr.close()
+		del self.gcode_previews[name]
+		try:
+			if process.returncode != 0:
+				os.unlink(filename + os.extsep + 'part')
+				log('unable to write preview for %s: %s' % (name, output.decode('utf-8', 'replace').strip()))
+				return
+			os.rename(filename + os.extsep + 'part', filename)
+		except OSError as e:
+			log('unable to write preview for %s: %s' % (name, e))
+			return
+		self._broadcast(None, 'preview', name)
+	# }}}
+	def _gcode_preview_stop(self, name): # {{{
+		if name not in self.gcode_previews:
+			return
+		process, filename, output = self.gcode_previews.pop(name)
+		process.kill()
+		process.wait()
+		process.stderr.close()
+		try:
+			os.unlink(filename + os.extsep + 'part')
+		except OSError:
+			pass
+	# }}}
+	def _gcode_cached(self, src, name): # {{{
+		'''Compile G-Code into the job queue, or reuse an earlier result for the same code and settings.'''
+		key = self._gcode_cache_key(src)
+		filename = fhs.write_spool(os.path.join(self.uuid, 'gcode', os.path.splitext(name)[0] + os.extsep + 'bin'), text = False, opened = False)
+		cached = self._gcode_cache_get(key)
+		if cached is not None:
+			try:
+				os.unlink(filename)
+			except FileNotFoundError:
+				pass
+			self._gcode_cache_link(cached[0], filename)
+			with open(filename, 'rb') as f:
+				f.seek(-8 * 8, os.SEEK_END)
+				return struct.unpack('=' + 'd' * 8, f.read()), cached[1]
+		bbox, errors = self._gcode_compile(src, name)
+		if bbox is not None:
+			self._gcode_cache_add(key, filename, errors)
+		return bbox, errors
+	# }}}
+	def _gcode_cache_key(self, src): # {{{
+		'''Hash the source and the settings that influence the compiled file.
+		The position of src is not changed.'''
+		if int(config['gcode-cache']) <= 0:
+			return None
+		num_extruders, park = self._gcode_compiler_settings()
+		h = hashlib.sha256(json.dumps([protocol.run_file_version, config['arc'], len(self.temps), num_extruders, park, self.allow_system]).encode('utf-8'))
+		fd = src.fileno()
+		try:
+			pos = os.lseek(fd, 0, os.SEEK_CUR)
+		except OSError:
+			# Not a regular file; it can only be read once.
+			return None
+		while True:
+			data = os.read(fd, 1 << 20)
+			if len(data) == 0:
+				break
+			h.update(data)
+		os.lseek(fd, pos, os.SEEK_SET)
+		return h.hexdigest()
+	# }}}
+	def _gcode_cache_get(self, key): # {{{
+		'''Find a cached run file; return its filename and the messages of its compilation, or None.'''
+		if key is None:
+			return None
+		filename = fhs.read_spool(os.path.join(self.uuid, 'cache', key + os.extsep + 'bin'), text = False, opened = False)
+		if filename is None or not os.path.exists(filename):
+			return None
+		# Mark as recently used.
+		os.utime(filename)
+		try:
+			with open(os.path.splitext(filename)[0] + os.extsep + 'errors', encoding = 'utf-8', errors = 'replace') as f:
+				errors = f.read().splitlines()
+		except FileNotFoundError:
+			errors = []
+		log('using cached compilation of G-Code')
+		return filename, errors
+	# }}}
+	def _gcode_cache_link(self, src, dst): # {{{
+		try:
+			os.link(src, dst)
+		except OSError:
+			shutil.copyfile(src, dst)
+	# }}}
+	def _gcode_cache_add(self, key, filename, errors): # {{{
+		'''Add a compiled file to the cache and remove the least recently used entries when it is too large.'''
+		if key is None:
+			return
+		cache = fhs.write_spool(os.path.join(self.uuid, 'cache'), dir = True, opened = False)
+		entry = os.path.join(cache, key)
+		try:
+			with open(entry + os.extsep + 'errors', 'w', encoding = 'utf-8') as f:
+				f.write(''.join(e + '\n' for e in errors))
+			self._gcode_cache_link(filename, entry + os.extsep + 'tmp')
+			os.replace(entry + os.extsep + 'tmp', entry + os.extsep + 'bin')
+		except OSError:
+			traceback.print_exc()
+			log('unable to add %s to G-Code cache' % filename)
+			return
+		entries = []
+		for name in os.listdir(cache):
+			base, ext = os.path.splitext(name)
+			if ext != os.extsep + 'bin' or base == key:
+				continue
+			st = os.stat(os.path.join(cache, name))
+			entries.append((st.st_mtime, st.st_size, base))
+		entries.sort()
+		size = os.stat(entry + os.extsep + 'bin').st_size + sum(e[1] for e in entries)
+		limit = int(config['gcode-cache']) * 1000000
+		while size > limit and len(entries) > 0:
+			mtime, esize, base = entries.pop(0)
+			for ext in ('bin', 'errors'):
+				try:
+					os.unlink(os.path.join(cache, base + os.extsep + ext))
+				except FileNotFoundError:
+					pass
+			size -= esize
+	# }}}
+	def _gcode_compiler_settings(self): # {{{
+		num_extruders = len(self.spaces[1].axis) if len(self.spaces) > 1 else 0
+		park = [axis['park'] for axis in self.spaces[0].axis[:6]]
+		return num_extruders, park
+	# }}}
+	def _gcode_compiler_command(self): # {{{
+		num_extruders, park = self._gcode_compiler_settings()
+		cmd = [gcode_compiler, '--temps', str(len(self.temps)), '--extruders', str(num_extruders), '--park', ','.join(repr(p) for p in park), '--allow-system', self.allow_system or '^$']
+		if not config['arc']:
+			cmd.append('--no-arc')
+		return cmd
+	# }}}
+	def _gcode_compiler_result(self, returncode, output): # {{{
+		'''Parse the output of the compiler program; the last line is the bounding box.'''
+		errors = output.decode('utf-8', 'replace').splitlines()
+		bbox = None
+		if returncode != 0 or len(errors) == 0 or not errors[-1].startswith('bbox '):
+			errors.append('G-Code compiler failed')
+		else:
+			result = errors.pop().split()[1:]
+			if result != ['none']:
+				bbox = [float(x) for x in result]
+		return bbox, errors
+	# }}}
+	def _gcode_stream(self, src, angle): # {{{
+		'''Compile G-Code and run it while it is being compiled.
+		The compiler program publishes complete blocks in the file header; cdriver and _gcode_update follow them.'''
+		assert len(self.spaces) > 0
+		if self.parking:
+			return
+		key = self._gcode_cache_key(src)
+		cached = self._gcode_cache_get(key)
+		if cached is not None:
+			for e in cached[1]:
+				log(e)
+			self._gcode_run(None, angle, abort = False, filename = cached[0])
+			return
+		self.gcode_stream_key = key
+		with fhs.write_spool(os.path.join(self.uuid, 'run', key + os.extsep + 'bin'), text = False) as dst:
+			filename = dst.name
+			self.gcode_compiler = subprocess.Popen(self._gcode_compiler_command() + ['--stream', filename + protocol.run_file_strings_ext], stdin = src, stdout = dst, stderr = subprocess.PIPE, close_fds = True)
+		self.gcode_compiler_output = b''
+		# The header is written before any input is read.
+		while os.path.getsize(filename) < protocol.run_file_records_start:
+			if self.gcode_compiler.poll() is not None:
+				for e in self._gcode_compiler_result(self.gcode_compiler.returncode, self.gcode_compiler.stderr.read())[1]:
+					log(e)
+				self.gcode_compiler.stderr.close()
+				self.gcode_compiler = None
+				self._print_done(False, 'G-Code compiler failed')
+				return
+			time.sleep(.01)
+		self.gcode_stream_strings = filename + protocol.run_file_strings_ext
+		self._gcode_run(None, angle, abort = False, filename = filename)
+	# }}}
+	def _gcode_compiler_input(self): # {{{
+		data = os.read(self.gcode_compiler.stderr.fileno(), 4096)
+		if len(data) > 0:
+			self.gcode_compiler_output += data
+			return
+		self.gcode_compiler.wait()
+		self.gcode_compiler.stderr.close()
+		returncode = self.gcode_compiler.returncode
+		bbox, errors = self._gcode_compiler_result(returncode, self.gcode_compiler_output)
+		self.gcode_compiler = None
+		self.gcode_compiler_output = b''
+		for e in errors:
+			log(e)
+		if self.gcode_map is None:
+			return
+		if returncode != 0:
+			self._print_done(False, 'G-Code compiler failed')
+			return
+		if bbox is not None:
+			self.total_time = bbox[-2:]
+			self._gcode_cache_add(self.gcode_stream_key, self.gcode_filename, errors)
+		self._gcode_update()
+	# }}}
+	def _gcode_update(self): # {{{
+		'''Follow a run file that is still being written.'''
+		if self.gcode_map is None or not self.gcode_run_file.growing:
+			return
+		if os.fstat(self.gcode_fd).st_size > len(self.gcode_map):
+			self.gcode_map.close()
+			self.gcode_map = mmap.mmap(self.gcode_fd, 0, prot = mmap.PROT_READ)
+		try:
+			with open(self.gcode_stream_strings, 'rb') as f:
+				strings = f.read()
+		except FileNotFoundError:
+			strings = b''
+		self.gcode_run_file.update(self.gcode_map, strings)
+		self.gcode_strings = self.gcode_run_file.strings
+		self.gcode_num_records = self.gcode_run_file.num_records
+	# }}}
 	def _gcode_parse(self, src, name): # {{{
 		assert len(self.spaces) > 0
 		self._broadcast(None, 'blocked', 'parsing g-code')
@@ -1537,6 +1825,7 @@ class Printer: # {{{
 				time_dist[0] += nums[1]
 			return nums + time_dist
 		with fhs.write_spool(os.path.join(self.uuid, 'gcode', os.path.splitext(name)[0] + os.path.extsep + 'bin'), text = False) as dst:
+			out = protocol.RunFileWriter(dst)
 			epsilon = .5	# TODO: check if this should be configurable
 			aepsilon = math.radians(36)	# TODO: check if this should be configurable
 			rlimit = 500	# TODO: check if this should be configurable
@@ -1599,7 +1888,7 @@ class Printer: # {{{
 						arc_ctr, arc_r, angles, arc_diff = center(pending[0][1:4], pending[1][1:4], pending[2][1:4])
 						if arc_diff > epsilon or abs(angles[1] - angles[0] - angles[2] + angles[1]) > aepsilon or arc_r > rlimit:
 							#log('not arc: %s' % repr((arc_ctr, arc_r, angles, arc_diff)))
-							dst.write(struct.pack('=Bl' + 'd' * 8, protocol.parsed['LINE'], *add_timedist(type, pending[1])))
+							out.add(protocol.parsed['LINE'], add_timedist(type, pending[1]))
 							pending.pop(0)
 							return
 						arc[:] = [arc_ctr, arc_r, arc_diff, angles[0], (angles[2] - angles[0]) / 2]
@@ -1623,7 +1912,7 @@ class Printer: # {{{
 					#log('non-line %s' % type)
 				flush_pending()
 				#log('force or other ' + repr((type, nums, add_timedist(type, nums))))
-				dst.write(struct.pack('=Bl' + 'd' * 8, type, *add_timedist(type, nums)))
+				out.add(type, add_timedist(type, nums))
 			def flush_pending():
 				if len(pending) >= 6:
 					#log('arc')
@@ -1687,10 +1976,13 @@ class Printer: # {{{
 					line = line[:p].strip()
 				if comment.upper().startswith('MSG,'):
 					message = comment[4:].strip()
-				elif comment.startswith('SYSTEM:'):
-					if not re.match(self.allow_system, comment[7:]):
-						errors.append('Warning: system command %s is forbidden and will not be run' % comment[7:])
-					add_record(protocol.parsed['SYSTEM'], [add_string(comment[7:])])
+				elif comment.startswith('SYSTEM:') or comment.startswith('SYSTEM&:'):
+					# SYSTEM& commands run in the background; the file continues without waiting for them.
+					background = comment[6] == '&'
+					cmd = comment[8 if background else 7:]
+					if not re.match(self.allow_system, cmd):
+						errors.append('Warning: system command %s is forbidden and will not be run' % cmd)
+					add_record(protocol.parsed['SYSTEM'], [add_string(cmd), 1 if background else 0])
 					continue
 				if line == '':
 					continue
@@ -1891,7 +2183,7 @@ class Printer: # {{{
 							pos[1][current_extruder] += estep
 						else:
 							estep = 0
-						center = [None] * 3
+						arc_center = [None] * 3
 						for axis in range(3):
 							value = components[chr(b'X'[0] + axis)]
 							if value is not None:
@@ -1903,11 +2195,11 @@ class Printer: # {{{
 									z = pos[0][2]
 							value = components[chr(b'I'[0] + axis)]
 							if value is not None:
-								center[axis] = oldpos[0][axis] + value
+								arc_center[axis] = oldpos[0][axis] + value
 							else:
-								center[axis] = oldpos[0][axis]
+								arc_center[axis] = oldpos[0][axis]
 						s = -1 if cmd[1] == 2 else 1
-						add_record(protocol.parsed['PRE_ARC'], {'X': center[0], 'Y': center[1], 'Z': center[2], 'E': s * arc_normal[0], 'f': s * arc_normal[1], 'F': s * arc_normal[2], 'T': 0})
+						add_record(protocol.parsed['PRE_ARC'], {'X': arc_center[0], 'Y': arc_center[1], 'Z': arc_center[2], 'E': s * arc_normal[0], 'f': s * arc_normal[1], 'F': s * arc_normal[2], 'T': 0})
 						add_record(protocol.parsed['ARC'], {'X': pos[0][0], 'Y': pos[0][1], 'Z': pos[0][2], 'E': pos[1][current_extruder], 'f': -f0, 'F': -pos[2], 'T': current_extruder})
 					elif cmd == ('G', 4):
 						add_record(protocol.parsed['WAIT'], [0, float(args['P']) / 1000 if 'P' in args else 0])
@@ -1963,15 +2255,6 @@ class Printer: # {{{
 						errors.append('%d:invalid gcode command %s' % (lineno, repr((cmd, args))))
 					message = None
 			flush_pending()
-			stringmap = []
-			size = 0
-			for s in strings:
-				us = s.encode('utf-8')
-				stringmap.append(len(us))
-				dst.write(us)
-				size += len(us)
-			for s in stringmap:
-				dst.write(struct.pack('=L', s))
 			ret = bbox
 			if any(x is None for x in bbox[:4]):
 				bbox = bbox_last
@@ -1983,7 +2266,7 @@ class Printer: # {{{
 				for t, b in enumerate(bbox):
 					if b is None:
 						bbox[t] = 0;
-			dst.write(struct.pack('=L' + 'd' * 8, len(strings), *(bbox + time_dist)))
+			out.finish(strings, bbox + time_dist)
 		self._broadcast(None, 'blocked', None)
 		return ret and ret + time_dist, errors
 	# }}}
@@ -2052,7 +2335,7 @@ class Printer: # {{{
 			else:
 				self.motor[len(motors):] = []
 			for m in range(len(motors)):
-				self.motor[m]['step_pin'], self.motor[m]['dir_pin'], self.motor[m]['enable_pin'], self.motor[m]['limit_min_pin'], self.motor[m]['limit_max_pin'], self.motor[m]['steps_per_unit'], self.motor[m]['home_pos'], self.motor[m]['limit_v'], self.motor[m]['limit_a'], self.motor[m]['home_order'] = struct.unpack('=HHHHHddddB', motors[m])
+				self.motor[m]['step_pin'], self.motor[m]['dir_pin'], self.motor[m]['enable_pin'], self.motor[m]['limit_min_pin'], self.motor[m]['limit_max_pin'], self.motor[m]['steps_per_unit'], self.motor[m]['home_pos'], self.motor[m]['limit_v'], self.motor[m]['limit_a'], self.motor[m]['limit_j'], self.motor[m]['home_order'] = struct.unpack('=HHHHHdddddB', motors[m])
 				if self.id == 1 and m < len(self.printer.multipliers):
 					self.motor[m]['steps_per_unit'] /= self.printer.multipliers[m]
 		def write_info(self, num_axes = None):
@@ -2094,13 +2377,13 @@ class Printer: # {{{
 			if self.id == 2:
 				if self.follower[motor]['space'] >= len(self.printer.spaces) or self.follower[motor]['motor'] >= len(self.printer.spaces[self.follower[motor]['space']].motor):
 					#log('write motor for follower %d with fake base' % motor)
-					base = {'steps_per_unit': 1, 'limit_v': float('inf'), 'limit_a': float('inf')}
+					base = {'steps_per_unit': 1, 'limit_v': float('inf'), 'limit_a': float('inf'), 'limit_j': float('inf')}
 				else:
 					#log('write motor for follower %d with base %s' % (motor, self.printer.spaces[0].motor))
 					base = self.printer.spaces[self.follower[motor]['space']].motor[self.follower[motor]['motor']]
 			else:
 				base = self.motor[motor]
-			return struct.pack('=HHHHHddddB', self.motor[motor]['step_pin'], self.motor[motor]['dir_pin'], self.motor[motor]['enable_pin'], self.motor[motor]['limit_min_pin'], self.motor[motor]['limit_max_pin'], base['steps_per_unit'] * (1. if self.id != 1 or motor >= len(self.printer.multipliers) else self.printer.multipliers[motor]), self.motor[motor]['home_pos'], base['limit_v'], base['limit_a'], int(self.motor[motor]['home_order']))
+			return struct.pack('=HHHHHdddddB', self.motor[motor]['step_pin'], self.motor[motor]['dir_pin'], self.motor[motor]['enable_pin'], self.motor[motor]['limit_min_pin'], self.motor[motor]['limit_max_pin'], base['steps_per_unit'] * (1. if self.id != 1 or motor >= len(self.printer.multipliers) else self.printer.multipliers[motor]), self.motor[motor]['home_pos'], base['limit_v'], base['limit_a'], base['limit_j'], int(self.motor[motor]['home_order']))
 		def set_current_pos(self, axis, pos):
 			#log('setting pos of %d %d to %f' % (self.id, axis, pos))
 			self.printer._send_packet(struct.pack('=BBBd', protocol.command['SETPOS'], self.id, axis, pos))
@@ -2122,7 +2405,7 @@ class Printer: # {{{
 				log('invalid type')
 				raise AssertionError('invalid space type')
 		def export(self):
-			std = [self.name, self.type, [[a['name'], a['park'], a['park_order'], a['min'], a['max'], a['home_pos2']] for a in self.axis], [[self.motor_name(i), m['step_pin'], m['dir_pin'], m['enable_pin'], m['limit_min_pin'], m['limit_max_pin'], m['steps_per_unit'], m['home_pos'], m['limit_v'], m['limit_a'], m['home_order']] for i, m in enumerate(self.motor)], None if self.id != 1 else self.printer.multipliers]
+			std = [self.name, self.type, [[a['name'], a['park'], a['park_order'], a['min'], a['max'], a['home_pos2']] for a in self.axis], [[self.motor_name(i), m['step_pin'], m['dir_pin'], m['enable_pin'], m['limit_min_pin'], m['limit_max_pin'], m['steps_per_unit'], m['home_pos'], m['limit_v'], m['limit_a'], m['home_order'], m['limit_j']] for i, m in enumerate(self.motor)], None if self.id != 1 else self.printer.multipliers]
 			if self.type == TYPE_CARTESIAN:
 				return std
 			elif self.type == TYPE_DELTA:
@@ -2183,7 +2466,7 @@ class Printer: # {{{
 					ret += ''.join(['%s = %f\r\n' % (x, m[x]) for x in ('home_pos',)])
 					ret += ''.join(['%s = %d\r\n' % (x, m[x]) for x in ('home_order',)])
 				if self.id != 2:
-					ret += ''.join(['%s = %f\r\n' % (x, m[x]) for x in ('steps_per_unit', 'limit_v', 'limit_a')])
+					ret += ''.join(['%s = %f\r\n' % (x, m[x]) for x in ('steps_per_unit', 'limit_v', 'limit_a', 'limit_j')])
 			return ret
 	# }}}
 	class Temp: # {{{
@@ -2704,7 +2987,7 @@ class Printer: # {{{
 		message += 'unit_name=%s\r\n' % self.unit_name
 		message += 'spi_setup=%s\r\n' % self._mangle_spi()
 		message += ''.join(['%s = %s\r\n' % (x, write_pin(getattr(self, x))) for x in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin')])
-		message += ''.join(['%s = %d\r\n' % (x, getattr(self, x)) for x in ('bed_id', 'fan_id', 'spindle_id', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'timeout')])
+		message += ''.join(['%s = %d\r\n' % (x, getattr(self, x)) for x in ('bed_id', 'fan_id', 'spindle_id', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'timeout', 'run_prefetch')])
 		message += ''.join(['%s = %f\r\n' % (x, getattr(self, x)) for x in ('probe_dist', 'probe_safe_dist', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v')])
 		for i, s in enumerate(self.spaces):
 			message += s.export_settings()
@@ -2736,12 +3019,12 @@ class Printer: # {{{
 		globals_changed = True
 		changed = {'space': set(), 'temp': set(), 'gpio': set(), 'axis': set(), 'motor': set(), 'extruder': set(), 'delta': set(), 'follower': set()}
 		keys = {
-				'general': {'num_temps', 'num_gpios', 'pin_names', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'temp_scale_min', 'temp_scale_max', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v'},
+				'general': {'num_temps', 'num_gpios', 'pin_names', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'temp_scale_min', 'temp_scale_max', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v', 'run_prefetch'},
 				'space': {'type', 'num_axes', 'delta_angle', 'polar_max_r'},
 				'temp': {'name', 'R0', 'R1', 'Rc', 'Tc', 'beta', 'heater_pin', 'fan_pin', 'thermistor_pin', 'fan_temp', 'fan_duty', 'heater_limit_l', 'heater_limit_h', 'fan_limit_l', 'fan_limit_h', 'hold_time'},
 				'gpio': {'name', 'pin', 'state', 'reset', 'duty'},
 				'axis': {'name', 'park', 'park_order', 'min', 'max', 'home_pos2'},
-				'motor': {'step_pin', 'dir_pin', 'enable_pin', 'limit_min_pin', 'limit_max_pin', 'steps_per_unit', 'home_pos', 'limit_v', 'limit_a', 'home_order'},
+				'motor': {'step_pin', 'dir_pin', 'enable_pin', 'limit_min_pin', 'limit_max_pin', 'steps_per_unit', 'home_pos', 'limit_v', 'limit_a', 'limit_j', 'home_order'},
 				'extruder': {'dx', 'dy', 'dz'},
 				'delta': {'axis_min', 'axis_max', 'rodlength', 'radius'},
 				'follower': {'space', 'motor'}
@@ -2811,7 +3094,7 @@ class Printer: # {{{
 			except ValueError:
 				errors.append((l, 'invalid value for %s' % key))
 				continue
-			if key not in keys[section] or (section == 'motor' and ((key in ('home_pos', 'home_order') and index[0] == 1) or (key in ('steps_per_unit', 'limit_v', 'limit_a') and index[0] == 2))):
+			if key not in keys[section] or (section == 'motor' and ((key in ('home_pos', 'home_order') and index[0] == 1) or (key in ('steps_per_unit', 'limit_v', 'limit_a', 'limit_j') and index[0] == 2))):
 				errors.append((l, 'invalid key for section %s' % section))
 				continue
 			# If something critical is changed, update instantly.
@@ -2877,11 +3160,20 @@ class Printer: # {{{
 	@delayed
 	def gcode_run(self, id, code, angle = 0, probemap = None): # {{{
 		'''Run a string of g-code.
+		If the compiler program is available, the print starts before
+		the code is fully compiled.
 		'''
 		self.probemap = probemap
 		with fhs.write_temp(text = False) as f:
 			f.write(code)
 			f.seek(0)
+			if os.access(gcode_compiler, os.X_OK):
+				# Start printing while the code is being compiled.
+				self._unpause()
+				self._print_done(False, 'aborted by starting new print')
+				self.gcode_id = id
+				self._gcode_stream(f, angle)
+				return
 			self.gcode_id = id
 			# Break this in two, otherwise tail recursion may destroy f before call is done?
 			ret = self._gcode_run(f.filename, angle)
@@ -2981,6 +3273,10 @@ class Printer: # {{{
 			self._broadcast(None, 'audioqueue', tuple(self.audioqueue.keys()))
 		else:
 			filename = fhs.read_spool(os.path.join(self.uuid, 'gcode', name + os.extsep + 'bin'), opened = False)
+			self._gcode_preview_stop(name)
+			preview = fhs.read_spool(os.path.join(self.uuid, 'preview', name + os.extsep + 'bin'), opened = False)
+			if preview is not None and os.path.exists(preview):
+				os.unlink(preview)
 			del self.jobqueue[name]
 			self._broadcast(None, 'queue', [(q, self.jobqueue[q]) for q in self.jobqueue])
 		try:
@@ -3083,6 +3379,7 @@ class Printer: # {{{
 		@return position, total toolpath length.'''
 		if self.gcode_map is None:
 			return 0, 0
+		self._gcode_update()
 		self._send_packet(struct.pack('=B', protocol.command['TP_GETPOS']))
 		cmd, s, m, f, e, data = self._get_reply()
 		assert cmd == protocol.rcommand['TP_POS']
@@ -3094,6 +3391,7 @@ class Printer: # {{{
 		@param position: new toolpath position.
 		@return None.'''
 		assert self.gcode_map is not None
+		self._gcode_update()
 		assert 0 <= position < self.gcode_num_records
 		assert self.paused
 		self.queue_info[1] = []	# Don't restore extruder position on resume.
@@ -3106,14 +3404,14 @@ class Printer: # {{{
 		@return first position of returned region (normally position - num), list of lines+arcs+specials'''
 		if self.gcode_map is None:
 			return 0, []
+		self._gcode_update()
 		if num is None:
 			num = 100;	# TODO: make configurable.
 		if position is None:
 			position = self.tp_get_position()[0]
 		position = int(position)
 		def parse_record(num):
-			s = struct.calcsize(record_format)
-			type, tool, X, Y, Z, E, f, F, time, dist = struct.unpack(record_format, self.gcode_map[num * s:(num + 1) * s])
+			type, tool, X, Y, Z, E, f, F, time, dist = self.gcode_run_file.record(num)
 			return tuple(protocol.parsed.keys())[tuple(protocol.parsed.values()).index(type)], tool, X, Y, Z, E, f, F, time, dist
 		return max(0, position - num), [parse_record(x) for x in range(position - num, position + num + 1) if 0 <= x < self.gcode_num_records]
 	# }}}
@@ -3121,6 +3419,7 @@ class Printer: # {{{
 		'''Get string from toolpath.
 		@param num: index of the string.
 		@return the string.'''
+		self._gcode_update()
 		return self.gcode_strings[num]
 	# }}}
 	def tp_find_position(self, x = None, y = None, z = None): # {{{
@@ -3142,7 +3441,7 @@ class Printer: # {{{
 	def get_globals(self): # {{{
 		#log('getting globals')
 		ret = {'num_temps': len(self.temps), 'num_gpios': len(self.gpios)}
-		for key in ('name', 'pin_names', 'uuid', 'queue_length', 'num_pins', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'feedrate', 'targetx', 'targety', 'zoffset', 'store_adc', 'temp_scale_min', 'temp_scale_max', 'paused', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v'):
+		for key in ('name', 'pin_names', 'uuid', 'queue_length', 'num_pins', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'feedrate', 'targetx', 'targety', 'zoffset', 'store_adc', 'temp_scale_min', 'temp_scale_max', 'paused', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v', 'run_prefetch'):
 			ret[key] = getattr(self, key)
 		return ret
 	# }}}
@@ -3164,7 +3463,7 @@ class Printer: # {{{
 			self.spi_setup = self._unmangle_spi(ka.pop('spi_setup'))
 			if self.spi_setup:
 				self._spi_send(self.spi_setup)
-		for key in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'bed_id', 'fan_id', 'spindle_id', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'timeout'):
+		for key in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'bed_id', 'fan_id', 'spindle_id', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'timeout', 'run_prefetch'):
 			if key in ka:
 				setattr(self, key, int(ka.pop(key)))
 		for key in ('probe_dist', 'probe_safe_dist', 'feedrate', 'targetx', 'targety', 'zoffset', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v'):
@@ -3246,7 +3545,7 @@ class Printer: # {{{
 			for key in ('limit_min_pin', 'limit_max_pin', 'home_pos', 'home_order'):
 				ret[key] = self.spaces[space].motor[motor][key]
 		if space != 2:
-			for key in ('steps_per_unit', 'limit_v', 'limit_a'):
+			for key in ('steps_per_unit', 'limit_v', 'limit_a', 'limit_j'):
 				ret[key] = self.spaces[space].motor[motor][key]
 		return ret
 	# }}}
@@ -3333,7 +3632,7 @@ class Printer: # {{{
 				self.spaces[space].motor[motor][key] = ka.pop(key)
 		if space != 1 and 'home_order' in ka:
 			self.spaces[space].motor[motor]['home_order'] = ka.pop('home_order')
-		for key in ('steps_per_unit', 'limit_v', 'limit_a'):
+		for key in ('steps_per_unit', 'limit_v', 'limit_a', 'limit_j'):
 			if space != 2 and key in ka:
 				self.spaces[space].motor[motor][key] = ka.pop(key)
 		self._send_packet(struct.pack('=BBB', protocol.command['WRITE_SPACE_MOTOR'], space, motor) + self.spaces[space].write_motor(motor))
@@ -3441,8 +3740,17 @@ while True: # {{{
 	if len(call_queue) > 0:
 		continue	# Handle this first.
 	fds = [sys.stdin, printer.printer]
+	if printer.gcode_compiler is not None:
+		fds.append(printer.gcode_compiler.stderr)
+	for name in printer.gcode_previews:
+		fds.append(printer.gcode_previews[name][0].stderr)
 	#log('waiting; movewait = %d' % printer.movewait)
 	found = select.select(fds, [], fds, None)
+	if printer.gcode_compiler is not None and (printer.gcode_compiler.stderr in found[0] or printer.gcode_compiler.stderr in found[2]):
+		printer._gcode_compiler_input()
+	for name in tuple(printer.gcode_previews):
+		if printer.gcode_previews[name][0].stderr in found[0] or printer.gcode_previews[name][0].stderr in found[2]:
+			printer._gcode_preview_input(name)
 	if sys.stdin in found[0] or sys.stdin in found[2]:
 		#log('command')
 		printer._command_input()
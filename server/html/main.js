@@ -857,6 +857,7 @@ function globals_update(printer) { // {{{
 	update_float(p, [null, 'feedrate']);
 	update_float(p, [null, 'max_deviation']);
 	update_float(p, [null, 'max_v']);
+	update_float(p, [null, 'run_prefetch']);
 	update_float(p, [null, 'targetx']);
 	update_float(p, [null, 'targety']);
 	update_float(p, [null, 'zoffset']);
@@ -1022,6 +1023,7 @@ function space_update(printer, index) { // {{{
 			update_float(p, [['motor', [index, m]], 'home_pos']);
 		update_float(p, [['motor', [index, m]], 'limit_v']);
 		update_float(p, [['motor', [index, m]], 'limit_a']);
+		update_float(p, [['motor', [index, m]], 'limit_j']);
 		if (index != 1)
 			update_float(p, [['motor', [index, m]], 'home_order']);
 	}
@@ -1703,6 +1705,7 @@ function redraw_canvas(printer) { // {{{
 		c.scale(canvas.width / factor, -canvas.width / factor);
 		c.lineWidth = 1.5 * factor / canvas.width;
 		c.translate(-center[0], -center[1]);
+		printer.mm_per_pixel = factor / canvas.width;
 		// }}}
 
 		get_pointer_pos_xy = function(printer, e) { // {{{
@@ -1779,6 +1782,24 @@ function redraw_canvas(printer) { // {{{
 		c.rotate(printer.targetangle);
 		// }}}
 
+		// Draw toolpath preview. {{{
+		if (printer.preview) {
+			c.save();
+			c.beginPath();
+			for (var l = 0; l < printer.preview.layers.length; ++l) {
+				var lines = printer.preview.layers[l];
+				for (var i = 0; i < lines.length; ++i) {
+					c.moveTo(lines[i][0], lines[i][1]);
+					for (var p = 2; p < lines[i].length; p += 2)
+						c.lineTo(lines[i][p], lines[i][p + 1]);
+				}
+			}
+			c.strokeStyle = '#ccc';
+			c.stroke();
+			c.restore();
+		}
+		// }}}
+
 		c.beginPath();
 		if (b[0] != b[1] && b[2] != b[3]) {
 			// Draw print bounding box. {{{
@@ -1874,14 +1895,71 @@ function redraw_canvas(printer) { // {{{
 }
 // }}}
 
+function load_preview(printer, name) { // {{{
+	// Fetch the toolpath preview of a job, one layer at a time.  See
+	// cdriver/preview.h for the format.
+	var preview = {name: name, layers: []};
+	printer.preview = preview;
+	var base = document.location.pathname + '?printer=' + encodeURIComponent(printer.printer.uuid) + '&preview=' + encodeURIComponent(name);
+	var get = function(query, cb) {
+		var request = new XMLHttpRequest();
+		request.open('GET', base + query, true);
+		request.responseType = 'arraybuffer';
+		request.AddEvent('load', function() {
+			if (printer.preview !== preview || this.status != 200)
+				return;
+			cb(new DataView(this.response));
+		});
+		request.send();
+	};
+	get('', function(index) {
+		var num_levels = index.getUint32(12, true);
+		var num_layers = index.getUint32(16, true);
+		// Use the coarsest level that is finer than a pixel.
+		var level = 0;
+		while (level + 1 < num_levels && index.getFloat32(24 + 4 * (level + 1), true) <= printer.mm_per_pixel)
+			level += 1;
+		var next = function(layer) {
+			if (layer >= num_layers) {
+				redraw_canvas(printer);
+				return;
+			}
+			get('&layer=' + layer + '&level=' + level, function(data) {
+				var lines = [];
+				var pos = 0;
+				while (pos < data.byteLength) {
+					var count = data.getUint32(pos, true);
+					pos += 4;
+					var travel = count >= 0x80000000;
+					count &= 0x7fffffff;
+					if (!travel) {
+						var line = [];
+						for (var i = 0; i < 2 * count; ++i)
+							line.push(data.getFloat32(pos + 4 * i, true));
+						lines.push(line);
+					}
+					pos += 8 * count;
+				}
+				preview.layers.push(lines);
+				if (layer % 16 == 15)
+					redraw_canvas(printer);
+				next(layer + 1);
+			});
+		};
+		next(0);
+	});
+} // }}}
+
 function start_move(printer) { // {{{
 	// Update bbox.
 	var q = get_element(printer, [null, 'queue']);
 	printer.bbox = [null, null, null, null];
+	var selected = [];
 	for (var e = 0; e < q.options.length; ++e) {
 		if (!q.options[e].selected)
 			continue;
 		var name = q.options[e].value;
+		selected.push(name);
 		var item;
 		for (item = 0; item < printer.printer.queue.length; ++item)
 			if (printer.printer.queue[item][0] == name)
@@ -1897,9 +1975,21 @@ function start_move(printer) { // {{{
 		if (printer.bbox[3] == null || printer.printer.queue[item][1][3] > printer.bbox[3])
 			printer.bbox[3] = printer.printer.queue[item][1][3];
 	}
+	// Show the toolpath if a single job is selected.
+	if (selected.length != 1)
+		printer.preview = null;
+	else if (!printer.preview || printer.preview.name != selected[0])
+		load_preview(printer, selected[0]);
 	update_canvas_and_spans(printer);
 } // }}}
 
+function preview(printer, name) { // {{{
+	// The preview of a job has been written; reload it if it is shown.
+	var p = printers[printer].printer;
+	if (p.preview && p.preview.name == name)
+		load_preview(p, name);
+} // }}}
+
 function reset_position(printer) { // {{{
 	printer.targetangle = 0;
 	update_canvas_and_spans(printer);
@@ -104,6 +104,9 @@ function _setup_updater() {
 			printers[printer].queue = q;
 			trigger_update(printer, 'queue');
 		},
+		preview: function(printer, name) {
+			trigger_update(printer, 'preview', name);
+		},
 		audioqueue: function(printer, q) {
 			printers[printer].audioqueue = q;
 			trigger_update(printer, 'audioqueue');
@@ -148,6 +151,7 @@ function _setup_updater() {
 					store_adc: false,
 					temp_scale_min: 0,
 					temp_scale_max: 0,
+					run_prefetch: 0,
 					message: null,
 					spaces: [{
 							name: null,
@@ -240,8 +244,9 @@ function _setup_updater() {
 			printers[printer].spi_setup = values[26];
 			printers[printer].temp_scale_min = values[27];
 			printers[printer].temp_scale_max = values[28];
-			printers[printer].connected = values[29];
-			printers[printer].status = values[30];
+			printers[printer].run_prefetch = values[29];
+			printers[printer].connected = values[30];
+			printers[printer].status = values[31];
 			for (var i = printers[printer].num_temps; i < new_num_temps; ++i) {
 				printers[printer].temps.push({
 					name: null,
@@ -306,7 +311,8 @@ function _setup_updater() {
 					home_pos: values[3][m][7],
 					limit_v: values[3][m][8],
 					limit_a: values[3][m][9],
-					home_order: values[3][m][10]
+					home_order: values[3][m][10],
+					limit_j: values[3][m][11]
 				});
 			}
 			if (index == 1) {
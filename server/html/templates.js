@@ -248,14 +248,14 @@ function Axis(printer, space, axis) {
 }
 
 function Motor(printer, space, motor) {
-	var e = [['steps_per_unit', 3, 1], ['home_pos', 3, 1], ['home_order', 0, 1], ['limit_v', 0, 1], ['limit_a', 1, 1]];
+	var e = [['steps_per_unit', 3, 1], ['home_pos', 3, 1], ['home_order', 0, 1], ['limit_v', 0, 1], ['limit_a', 1, 1], ['limit_j', 0, 1]];
 	for (var i = 0; i < e.length; ++i) {
 		var div = Create('div');
 		if (space == 0 || (space == 1 && i != 1 && i != 2) || (space == 2 && (i == 1 || i == 2)))
 			div.Add(Float(printer, [['motor', [space, motor]], e[i][0]], e[i][1], e[i][2]));
 		e[i] = div;
 	}
-	return make_tablerow(printer, motor_name(printer, space, motor), e, ['rowtitle5']);
+	return make_tablerow(printer, motor_name(printer, space, motor), e, ['rowtitle6']);
 }
 
 function Pins_space(printer, space, motor) {
@@ -700,6 +700,9 @@ function Printer(printer) {	// {{{
 	e.Add(Float(ret, [null, 'max_v'], 2, 1));
 	e.AddText(' ').Add(add_name(ret, 'unit', 0, 0));
 	e.AddText('/s');
+	e = setup.AddElement('div').AddText('Run File Prefetch:');
+	e.Add(Float(ret, [null, 'run_prefetch'], 0));
+	e.AddText(' moves');
 	// Cartesian. {{{
 	setup.Add([make_table(ret).AddMultipleTitles([
 		'Cartesian/Other',
@@ -746,21 +749,24 @@ function Printer(printer) {	// {{{
 		UnitTitle(ret, 'Switch Pos'),
 		'Home Order',
 		UnitTitle(ret, 'Limit v', '/s'),
-		UnitTitle(ret, 'Limit a', '/s²')
+		UnitTitle(ret, 'Limit a', '/s²'),
+		UnitTitle(ret, 'Limit j', '/s³')
 	], [
-		'htitle5',
-		'title5',
-		'title5',
-		'title5',
-		'title5',
-		'title5'
+		'htitle6',
+		'title6',
+		'title6',
+		'title6',
+		'title6',
+		'title6',
+		'title6'
 	], [
 		null,
 		'Number of (micro)steps that the motor needs to do to move the hardware by one unit.',
 		'Position of the home switch.',
 		'Order when homing.  Equal order homes simultaneously; lower order homes first.',
 		'Maximum speed of the motor.',
-		'Maximum acceleration of the motor.  4000 is a normal value.'
+		'Maximum acceleration of the motor.  4000 is a normal value.',
+		'Maximum jerk (change of acceleration) of the motor.  Infinity disables the jerk limit.'
 	]).AddMultiple(ret, 'motor', Motor)]);
 	// }}} -->
 	// Delta. {{{
@@ -17,6 +17,8 @@
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 import random
+import struct
+import math
 from websocketd import log
 
 single = {
@@ -178,3 +180,300 @@ def check(packet):
 				log('bad checksum')
 				return False
 	return True
+
+# Parsed G-Code files.
+# Format 2 layout:
+# header: magic, version, number of records, records per block, number of sections
+# section table: type, reserved, offset, size for every section
+# sections: records, block index, strings, state, bounding box.  The bounding
+# box (6 doubles) plus total time and distance is always at the end of the
+# file.  The state section is optional for readers.
+#
+# Records are stored in blocks which can be decoded on their own; the index
+# holds the offset of every block from the start of the records section.  A
+# record starts with a 24 bit little endian header: the type in the low 4
+# bits, followed by a 2 bit code for each of tool, X, Y, Z, E, f, F, time,
+# dist.  Code 0 means the value is the same as in the previous record of the
+# block (all values are 0 at the start of a block).  Other codes:
+# tool: 1: zigzag varint delta.
+# X, Y, Z, E: 1: zigzag varint delta of the value in units of
+#	1 / run_file_scale; 3: double.
+# f, F: 1 (F only): same as f; 2: float; 3: double.
+# time, dist: 2: float delta; 3: double.
+#
+# The state section allows starting a run at any record without going through
+# the records before its block.  For every block it holds the records that
+# restore the state at the start of that block: the last SETTEMP and GPIO for
+# every tool, and the position of every extruder that has been used as a
+# SETPOS, in the order in which they first appeared.  The section starts with
+# a 64 bit offset from the start of the section for every block.  Each offset
+# points to a 32 bit count, 32 bits of padding and that many
+# run_file_state_entry.
+#
+# A file can be run while it is still being written.  Until it is complete,
+# the header has 0 sections and the number of records that have been written
+# completely; the records start directly after room for the section table.
+# Strings are then also appended to a side file (the name of the run file
+# plus run_file_strings_ext) as a 32 bit length followed by the string.
+# The section table is written before the header, so the header is the last
+# thing that changes.
+# Format 1 is a plain array of run_file_v1_record, followed by strings,
+# their lengths, the number of strings and the bounding box.
+run_file_magic = b'FRANKRUN'
+run_file_version = 2
+run_file_block = 256
+run_file_scale = 1e6
+run_file_header = '=8sIIII'
+run_file_section_format = '=IIQQ'
+run_file_section = {
+	'RECORDS': 0,
+	'INDEX': 1,
+	'STRINGS': 2,
+	'BBOX': 3,
+	'STATE': 4,
+	}
+run_file_v1_record = '=Bidddddddd' # type, tool, X, Y, Z, E, f, F, time, dist
+run_file_state_entry = '=iid' # type, tool, X
+run_file_strings_ext = '.strings'
+run_file_records_start = struct.calcsize(run_file_header) + len(run_file_section) * struct.calcsize(run_file_section_format)
+
+def _same(a, b):
+	return a == b or (math.isnan(a) and math.isnan(b))
+
+def _float(value):
+	'''Return value rounded to float, or None if it does not fit.'''
+	try:
+		return struct.unpack('=f', struct.pack('=f', value))[0]
+	except OverflowError:
+		return None
+
+def _varint(value):
+	value = value * 2 if value >= 0 else -value * 2 - 1
+	ret = b''
+	while value >= 0x80:
+		ret += bytes((value & 0x7f | 0x80,))
+		value >>= 7
+	return ret + bytes((value,))
+
+class RunFileWriter:
+	'''Write parsed G-Code in format 2 to a binary file object.'''
+	def __init__(self, dst):
+		self.dst = dst
+		self.num_records = 0
+		self.size = 0
+		self.index = []
+		self.state = []
+		self.states = []
+		self.states_size = 0
+		self.dst.write(b'\0' * run_file_records_start)
+		self.start = self.dst.tell()
+	def add(self, type, nums):
+		'''Add a record.  nums is [tool, X, Y, Z, E, f, F, time, dist].'''
+		if self.num_records % run_file_block == 0:
+			self.index.append(self.size)
+			state = struct.pack('=II', len(self.state), 0) + b''.join(struct.pack(run_file_state_entry, *e) for e in self.state)
+			self.states.append((self.states_size, state))
+			self.states_size += len(state)
+			self.prev = [0, 0., 0., 0., 0., 0., 0., 0., 0.]
+			self.orig = [0., 0.]
+			self.base = [0] * 4
+		header = type
+		data = b''
+		tool = int(nums[0])
+		if tool != self.prev[0]:
+			header |= 1 << 4
+			data += _varint(tool - self.prev[0])
+			self.prev[0] = tool
+		for k, value in enumerate(nums[1:]):
+			value = float(value)
+			code = 0
+			if k < 4:
+				# Coordinate.
+				if math.isfinite(value) and abs(value) < 1e12:
+					q = round(value * run_file_scale)
+					decoded = q / run_file_scale
+					if not _same(decoded, self.prev[k + 1]):
+						code = 1
+						data += _varint(q - self.base[k])
+						self.base[k] = q
+				else:
+					decoded = value
+					if not _same(decoded, self.prev[k + 1]):
+						code = 3
+			elif k < 6:
+				# Feedrate.
+				decoded = _float(value)
+				if decoded is None:
+					decoded = value
+					code = 3
+				elif _same(decoded, self.prev[k + 1]):
+					pass
+				elif k == 5 and _same(decoded, self.prev[5]):
+					code = 1
+				else:
+					code = 2
+					data += struct.pack('=f', value)
+			else:
+				# Time or distance; store the difference, so rounding errors don't add up.
+				if _same(value, self.orig[k - 6]):
+					decoded = self.prev[k + 1]
+				else:
+					self.orig[k - 6] = value
+					delta = _float(value - self.prev[k + 1])
+					if delta is not None and math.isfinite(delta):
+						code = 2
+						data += struct.pack('=f', delta)
+						decoded = self.prev[k + 1] + delta
+					else:
+						code = 3
+						decoded = value
+			if code == 3:
+				data += struct.pack('=d', decoded)
+			header |= code << (6 + 2 * k)
+			self.prev[k + 1] = decoded
+		record = struct.pack('<I', header)[:3] + data
+		self.dst.write(record)
+		self.size += len(record)
+		self.num_records += 1
+		# Track the state; use the values as they are decoded.
+		tool, X, E = self.prev[0], self.prev[1], self.prev[4]
+		if type in (parsed['SETTEMP'], parsed['GPIO'], parsed['SETPOS']):
+			self._set_state(type, tool, X)
+		elif type in (parsed['PRE_LINE'], parsed['LINE'], parsed['ARC']) and tool >= 0 and not math.isnan(E):
+			self._set_state(parsed['SETPOS'], tool, E)
+	def _set_state(self, type, tool, value):
+		for e in self.state:
+			if e[0] == type and e[1] == tool:
+				e[2] = value
+				return
+		self.state.append([type, tool, value])
+	def finish(self, strings, bbox):
+		'''Write index, strings and bounding box (8 doubles, including time and distance) and fill in the header.'''
+		sections = [(run_file_section['RECORDS'], self.start, self.size)]
+		encoded = [s.encode('utf-8') for s in strings]
+		for type, data in (
+				('INDEX', b''.join(struct.pack('=Q', x) for x in self.index)),
+				('STRINGS', struct.pack('=I', len(encoded)) + b''.join(struct.pack('=I', len(s)) for s in encoded) + b''.join(encoded)),
+				('STATE', b''.join(struct.pack('=Q', 8 * len(self.states) + x[0]) for x in self.states) + b''.join(x[1] for x in self.states)),
+				('BBOX', struct.pack('=' + 'd' * 8, *bbox))):
+			sections.append((run_file_section[type], sections[-1][1] + sections[-1][2], len(data)))
+			self.dst.write(data)
+		self.dst.seek(0)
+		self.dst.write(struct.pack(run_file_header, run_file_magic, run_file_version, self.num_records, run_file_block, len(sections)))
+		for s in sections:
+			self.dst.write(struct.pack(run_file_section_format, s[0], 0, s[1], s[2]))
+		self.dst.seek(0, 2)
+
+class RunFile:
+	'''Read parsed G-Code in format 1 or 2 from a bytes-like object, usually an mmap.
+	For a file that is still being written, strings is the content of the side file.'''
+	def __init__(self, data, strings = b''):
+		self.update(data, strings)
+	def update(self, data, strings = b''):
+		'''Use new data for a file that is still being written; this keeps the block index that has been found so far.'''
+		self.data = data
+		self.block = None
+		self.cache = []
+		def unpack(format, pos):
+			return struct.unpack(format, data[pos:pos + struct.calcsize(format)])
+		if data[:len(run_file_magic)] == run_file_magic:
+			magic, version, self.num_records, self.block_records, num_sections = unpack(run_file_header, 0)
+			if version != run_file_version:
+				raise ValueError('unsupported run file version %d' % version)
+			self.version = 2
+			if num_sections == 0:
+				# The file is still being written.
+				if not getattr(self, 'growing', False):
+					self.growing = True
+					self.index = [0]
+				self.records = run_file_records_start
+				self.bbox = None
+				self.strings = []
+				pos = 0
+				while pos + 4 <= len(strings):
+					size = struct.unpack('=I', strings[pos:pos + 4])[0]
+					if pos + 4 + size > len(strings):
+						break
+					self.strings.append(bytes(strings[pos + 4:pos + 4 + size]).decode('utf-8', 'replace'))
+					pos += 4 + size
+				return
+			self.growing = False
+			sections = {}
+			for s in range(num_sections):
+				type, reserved, offset, size = unpack(run_file_section_format, struct.calcsize(run_file_header) + s * struct.calcsize(run_file_section_format))
+				sections[type] = (offset, size)
+			self.records = sections[run_file_section['RECORDS']][0]
+			index = sections[run_file_section['INDEX']]
+			self.index = [unpack('=Q', index[0] + 8 * i)[0] for i in range(index[1] // 8)]
+			pos = sections[run_file_section['STRINGS']][0]
+			num_strings = unpack('=I', pos)[0]
+			sizes = [unpack('=I', pos + 4 * (1 + x))[0] for x in range(num_strings)]
+			first_string = pos + 4 * (1 + num_strings)
+		else:
+			self.growing = False
+			bboxsize = 8 * struct.calcsize('=d')
+			num_strings = unpack('=I', len(data) - bboxsize - struct.calcsize('=I'))[0]
+			sizes = [unpack('=I', len(data) - bboxsize - struct.calcsize('=I') * (num_strings + 1 - x))[0] for x in range(num_strings)]
+			first_string = len(data) - bboxsize - struct.calcsize('=I') * (num_strings + 1) - sum(sizes)
+			self.num_records = first_string // struct.calcsize(run_file_v1_record)
+			self.version = 1
+		self.bbox = struct.unpack('=' + 'd' * 8, data[-8 * 8:])
+		self.strings = []
+		pos = first_string
+		for x in range(num_strings):
+			self.strings.append(bytes(data[pos:pos + sizes[x]]).decode('utf-8', 'replace'))
+			pos += sizes[x]
+	def record(self, num):
+		'''Return record num as (type, tool, X, Y, Z, E, f, F, time, dist).'''
+		if self.version == 1:
+			s = struct.calcsize(run_file_v1_record)
+			return struct.unpack(run_file_v1_record, self.data[num * s:(num + 1) * s])
+		block = num // self.block_records
+		# The start of a block in a growing file is only known after decoding the previous block.
+		for b in range(len(self.index) - 1, block):
+			self._decode(b)
+		if block != self.block or len(self.cache) <= num % self.block_records:
+			self._decode(block)
+		return self.cache[num % self.block_records]
+	def _decode(self, block):
+		data = self.data
+		pos = self.records + self.index[block]
+		def varint():
+			nonlocal pos
+			ret = 0
+			shift = 0
+			while True:
+				b = data[pos]
+				pos += 1
+				ret |= (b & 0x7f) << shift
+				shift += 7
+				if not b & 0x80:
+					break
+			return ret >> 1 if ret & 1 == 0 else -(ret >> 1) - 1
+		values = [0, 0., 0., 0., 0., 0., 0., 0., 0.]
+		base = [0] * 4
+		self.cache = []
+		for r in range(min(self.block_records, self.num_records - block * self.block_records)):
+			header = data[pos] | data[pos + 1] << 8 | data[pos + 2] << 16
+			pos += 3
+			if (header >> 4) & 3 == 1:
+				values[0] += varint()
+			for k in range(8):
+				code = (header >> (6 + 2 * k)) & 3
+				if code == 1:
+					if k < 4:
+						base[k] += varint()
+						values[k + 1] = base[k] / run_file_scale
+					else:
+						values[k + 1] = values[k]
+				elif code == 2:
+					value = struct.unpack('=f', data[pos:pos + 4])[0]
+					pos += 4
+					values[k + 1] = values[k + 1] + value if k >= 6 else value
+				elif code == 3:
+					values[k + 1] = struct.unpack('=d', data[pos:pos + 8])[0]
+					pos += 8
+			self.cache.append((header & 0xf,) + tuple(values))
+		self.block = block
+		if self.growing and len(self.cache) == self.block_records and len(self.index) == block + 1:
+			self.index.append(pos - self.records)
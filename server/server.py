@@ -63,6 +63,8 @@ is in a configuration file):
   password, or a username:password pair.  If only a password is supplied, any
   username is accepted with that password.  Default: ''
 * done: system command to run after completing a job.  Default: ''
+* gcode-cache: maximum size in MB of the cache of compiled G-Code, which is
+  used when the same code is added again.  0 disables the cache.  Default: 1000
 * local: Internal use only.  Do not use.
 * log: passed on to the websockets server, which uses it to create a log file
   with websockets traffic.
@@ -91,6 +93,7 @@ import re
 import os
 import sys
 import math
+import struct
 import random
 import websocketd
 from websocketd import log
@@ -121,6 +124,7 @@ config = fhs.init(packagename = 'franklin', config = {
 		'log': '',
 		'tls': 'False',
 		'arc': True,
+		'gcode-cache': '1000',
 	})
 # }}}
 
@@ -158,7 +162,41 @@ class Server(websocketd.RPChttpd): # {{{
 		else:
 			return connection.data['password'] == connection.data['pwd']
 	def page(self, connection):
-		if 'printer' in connection.query:
+		if 'preview' in connection.query and 'printer' in connection.query:
+			# Toolpath preview of a queued job; see cdriver/preview.h.
+			# Without a layer, the header and layer table are returned.
+			printer = connection.query['printer'][0]
+			job = connection.query['preview'][0]
+			filename = None
+			if printer in printers and isinstance(printers[printer], Printer) and '/' not in printer + job and not job.startswith('.'):
+				filename = fhs.read_spool(os.path.join(printer, 'preview', job + os.extsep + 'bin'), text = False, opened = False)
+			if filename is None or not os.path.exists(filename):
+				self.reply(connection, 404)
+				return
+			with open(filename, 'rb') as f:
+				header = f.read(24)
+				if len(header) < 24 or header[:8] != b'FRANKPRV':
+					self.reply(connection, 404)
+					return
+				num_levels, num_layers = struct.unpack('=II', header[12:20])
+				if 'layer' not in connection.query:
+					f.seek(0)
+					message = f.read(24 + 4 * num_levels + num_layers * (8 + 8 * num_levels))
+				else:
+					try:
+						layer = int(connection.query['layer'][0])
+						level = int(connection.query['level'][0]) if 'level' in connection.query else 0
+					except ValueError:
+						layer = -1
+					if not 0 <= layer < num_layers or not 0 <= level < num_levels:
+						self.reply(connection, 400)
+						return
+					f.seek(24 + 4 * num_levels + layer * (8 + 8 * num_levels) + 8 + 8 * level)
+					offset, size = struct.unpack('=II', f.read(8))
+					f.seek(offset)
+					message = f.read(size)
+			self.reply(connection, 200, message, 'application/octet-stream')
+		elif 'printer' in connection.query:
 			# Export request.
 			printer = connection.query['printer'][0]
 			if printer not in printers or not isinstance(printers[printer], Printer):
@@ -712,7 +750,7 @@ def detect(port): # {{{
 	broadcast(None, 'port_state', port, 1)
 	if port == '-' or port.startswith('!'):
 		run_id = nextid()
-		process = subprocess.Popen((fhs.read_data('driver.py', opened = False), '--uuid', '-', '--cdriver', config['local'] or fhs.read_data('franklin-cdriver', opened = False), '--allow-system', config['allow-system']) + (('--system',) if fhs.is_system else ()) + (('--arc', 'False') if not config['arc'] else ()), stdin = subprocess.PIPE, stdout = subprocess.PIPE, close_fds = True)
+		process = subprocess.Popen((fhs.read_data('driver.py', opened = False), '--uuid', '-', '--cdriver', config['local'] or fhs.read_data('franklin-cdriver', opened = False), '--allow-system', config['allow-system']) + (('--system',) if fhs.is_system else ()) + (('--arc', 'False') if not config['arc'] else ()) + ('--gcode-cache', config['gcode-cache']), stdin = subprocess.PIPE, stdout = subprocess.PIPE, close_fds = True)
 		printers[port] = Printer(port, process, None, run_id)
 		ports[port] = port
 		return False
@@ -817,7 +855,7 @@ def detect(port): # {{{
 			else:
 				log('accepting unknown printer on port %s' % port)
 				#log('printers: %s' % repr(tuple(printers.keys())))
-				process = subprocess.Popen((fhs.read_data('driver.py', opened = False), '--cdriver', fhs.read_data('franklin-cdriver', opened = False), '--uuid', uuid if uuid is not None else '', '--allow-system', config['allow-system']) + (('--system',) if fhs.is_system else ()) + (('--arc', 'False') if not config['arc'] else ()), stdin = subprocess.PIPE, stdout = subprocess.PIPE, close_fds = True)
+				process = subprocess.Popen((fhs.read_data('driver.py', opened = False), '--cdriver', fhs.read_data('franklin-cdriver', opened = False), '--uuid', uuid if uuid is not None else '', '--allow-system', config['allow-system']) + (('--system',) if fhs.is_system else ()) + (('--arc', 'False') if not config['arc'] else ()) + ('--gcode-cache', config['gcode-cache']), stdin = subprocess.PIPE, stdout = subprocess.PIPE, close_fds = True)
 				new_printer = Printer(port, process, printer, run_id)
 				def finish(success, uuid):
 					assert success
@@ -916,7 +954,7 @@ if config['local'] != '':
 def create_printer(uuid = None): # {{{
 	if uuid is None:
 		uuid = protocol.new_uuid()
-	process = subprocess.Popen((fhs.read_data('driver.py', opened = False), '--uuid', uuid, '--cdriver', fhs.read_data('franklin-cdriver', opened = False), '--allow-system', config['allow-system']) + (('--system',) if fhs.is_system else ()) + (('--arc', 'False') if not config['arc'] else ()), stdin = subprocess.PIPE, stdout = subprocess.PIPE, close_fds = True)
+	process = subprocess.Popen((fhs.read_data('driver.py', opened = False), '--uuid', uuid, '--cdriver', fhs.read_data('franklin-cdriver', opened = False), '--allow-system', config['allow-system']) + (('--system',) if fhs.is_system else ()) + (('--arc', 'False') if not config['arc'] else ()) + ('--gcode-cache', config['gcode-cache']), stdin = subprocess.PIPE, stdout = subprocess.PIPE, close_fds = True)
 	printers[uuid] = Printer(None, process, None, None)
 	return uuid
 # }}}